@@ -0,0 +1,492 @@
+// Scan-throughput benchmark for regex-plainc and regex-cpp.
+//
+// Generates a set of corpora, runs every engine of both implementations over
+// each of them with every pattern below, the batch engine at a sweep of batch
+// sizes, and prints one line of JSON per
+// measurement: the best of a few runs, in MB/s and matching lines per second,
+// as the programs' own --stats report them. The schema and the order of the
+// lines are fixed, so the output of two builds can be diffed or fed to a
+// script that flags regressions.
+
+#define _GNU_SOURCE
+#include <errno.h>
+#include <fcntl.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#define BENCH_SCHEMA 1
+#define DEFAULT_SIZE (16 << 20)
+#define DEFAULT_RUNS 3
+#define LONG_LINE (1 << 20)
+#define PATHOLOGICAL_SHARE 16 // the pathological corpus is this much smaller, as some engines crawl over it
+#define MAX_CORPORA 64
+
+typedef struct
+{
+    const char *name;
+    const char *pattern;
+} bench_pattern_t;
+
+static const bench_pattern_t patterns[] = {
+    {"trace", "TRACE"},
+    {"ticket", "#[0-9]+"},
+    {"rules", "TRACE|#[0-9]+"},
+    {"anchored", "^[-0-9]+T[0-9:.]+Z (WARN|ERROR) "},
+    {"explosive", "(a|b)*a(a|b){12}c"},
+};
+
+typedef struct
+{
+    const char *implementation;
+    const char *engine;
+    const char *options[2]; // passed to the program, up to the first NULL
+} bench_engine_t;
+
+static const bench_engine_t engines[] = {
+    {"plainc", "auto", {NULL}},
+    {"plainc", "full", {"--engine=full"}},
+    {"plainc", "lazy", {"--engine=lazy"}},
+    {"plainc", "literal", {"--engine=literal"}},
+    // each way of walking the DFA on its own, which fails where the DFA
+    // does not fit it
+    {"plainc", "table", {"--engine=table"}},
+    {"plainc", "shuffle", {"--engine=shuffle"}},
+    {"plainc", "stride2", {"--engine=stride2"}},
+    {"plainc", "teddy", {"--engine=teddy"}},
+    {"plainc", "set", {"--set"}},
+    // lines per call to the batch matcher, from one, where it is a plain walk
+    // with the batching overhead, up to more than a chunk holds
+    {"plainc", "batch-1", {"--engine=batch", "--batch=1"}},
+    {"plainc", "batch-8", {"--engine=batch", "--batch=8"}},
+    {"plainc", "batch-64", {"--engine=batch", "--batch=64"}},
+    {"plainc", "batch-512", {"--engine=batch", "--batch=512"}},
+    {"plainc", "batch-4096", {"--engine=batch", "--batch=4096"}},
+    {"cpp", "nfa", {NULL}},
+};
+
+typedef struct
+{
+    char name[64];
+    char path[4096];
+} corpus_t;
+
+// The result of a run, from the --stats line of either program.
+typedef struct
+{
+    double compile_ms;
+    size_t bytes;
+    double seconds;
+    size_t matches;
+} run_t;
+
+// xorshift64*, seeded the same way every time so the corpora are too
+static uint64_t random_state = 0x9E3779B97F4A7C15ull;
+
+static uint64_t random_next(void)
+{
+    random_state ^= random_state >> 12;
+    random_state ^= random_state << 25;
+    random_state ^= random_state >> 27;
+    return random_state * 0x2545F4914F6CDD1Dull;
+}
+
+static int random_below(int n)
+{
+    return (int)(random_next() % (uint64_t)n);
+}
+
+static const char *const levels[] = {"DEBUG", "INFO", "WARN", "ERROR"};
+static const char *const components[] = {"scheduler", "http", "db.pool", "auth", "cache", "worker"};
+static const char *const words[] = {"request", "completed", "connection", "timeout", "retrying", "user",
+                                    "session", "opened", "closed", "after", "bytes", "queue",
+                                    "latency", "upstream", "failed", "ok", "handler", "flush"};
+
+#define COUNT(a) ((int)(sizeof(a) / sizeof((a)[0])))
+
+// A log line; `hits` makes about half the lines match the TRACE or #N rules,
+// and without it no line does.
+static void write_log_line(FILE *fp, bool hits)
+{
+    fprintf(fp, "2024-%02d-%02dT%02d:%02d:%02d.%03dZ ", 1 + random_below(12), 1 + random_below(28),
+            random_below(24), random_below(60), random_below(60), random_below(1000));
+    int roll = random_below(4);
+    fprintf(fp, "%s %s[%d]:", hits && roll == 0 ? "TRACE" : levels[random_below(COUNT(levels))],
+            components[random_below(COUNT(components))], random_below(32768));
+    int n = 4 + random_below(12);
+    for (int i = 0; i < n; ++i)
+    {
+        fprintf(fp, " %s", words[random_below(COUNT(words))]);
+    }
+    if (hits && roll == 1)
+    {
+        fprintf(fp, " see #%d", random_below(100000));
+    }
+    fputc('\n', fp);
+}
+
+static void generate(const char *name, const char *path, size_t size)
+{
+    FILE *fp = fopen(path, "w");
+    if (!fp)
+    {
+        fprintf(stderr, "regex-bench: %s: %s\n", path, strerror(errno));
+        exit(2);
+    }
+    while ((size_t)ftell(fp) < size)
+    {
+        if (strcmp(name, "log-hits") == 0 || strcmp(name, "log-misses") == 0)
+        {
+            write_log_line(fp, strcmp(name, "log-hits") == 0);
+        }
+        else if (strcmp(name, "random") == 0)
+        {
+            for (int i = 0; i < 4096; ++i)
+            {
+                fputc(random_below(256), fp);
+            }
+        }
+        else if (strcmp(name, "long-lines") == 0)
+        {
+            // words all the way, and a match only at the very end
+            for (int length = 0; length < LONG_LINE;)
+            {
+                const char *w = words[random_below(COUNT(words))];
+                length += fprintf(fp, "%s ", w);
+            }
+            fprintf(fp, "TRACE #%d\n", random_below(100000));
+        }
+        else
+        {
+            // lines of a and b, on which (a|b)*a(a|b){n}c needs 2^n states
+            // and a lazy cache keeps flushing
+            for (int i = 0; i < 4096; ++i)
+            {
+                fputc("ab"[random_below(2)], fp);
+            }
+            fputc('\n', fp);
+        }
+    }
+    fclose(fp);
+}
+
+// Runs argv and reads its standard error into `out`; standard output goes
+// to /dev/null. Returns false if it could not be run or died.
+static bool run_capture(char *const argv[], char *out, size_t size)
+{
+    int pipefd[2];
+    if (pipe(pipefd) < 0)
+    {
+        return false;
+    }
+    pid_t pid = fork();
+    if (pid < 0)
+    {
+        close(pipefd[0]);
+        close(pipefd[1]);
+        return false;
+    }
+    if (pid == 0)
+    {
+        int null = open("/dev/null", O_WRONLY);
+        dup2(null, STDOUT_FILENO);
+        dup2(pipefd[1], STDERR_FILENO);
+        close(pipefd[0]);
+        execv(argv[0], argv);
+        _exit(127);
+    }
+    close(pipefd[1]);
+    size_t length = 0;
+    ssize_t n;
+    while ((n = read(pipefd[0], out + length, size - 1 - length)) > 0)
+    {
+        length += n;
+        if (length == size - 1)
+        {
+            // keep the tail, which has the stats line
+            memmove(out, out + size / 2, length - size / 2);
+            length -= size / 2;
+        }
+    }
+    out[length] = '\0';
+    close(pipefd[0]);
+    int status;
+    waitpid(pid, &status, 0);
+    // grep's exit status: 0 for matches, 1 for none, 2 for trouble
+    return WIFEXITED(status) && WEXITSTATUS(status) < 2;
+}
+
+// Reads "compiled in X ms; scanned B bytes ... in S s (R MB/s), M matching
+// lines" out of the --stats output of either program. S is printed to the
+// nanosecond and taken as it is; R is rounded to 0.1 MB/s and ignored. A scan
+// that took no measurable time cannot be ranked and fails.
+static bool parse_stats(const char *out, run_t *run)
+{
+    const char *compiled = strstr(out, "compiled in ");
+    const char *scanned = compiled ? strstr(compiled, "scanned ") : NULL;
+    const char *rate = scanned ? strstr(scanned, " s (") : NULL;
+    const char *matching = rate ? strstr(rate, "MB/s), ") : NULL;
+    if (!matching)
+    {
+        return false;
+    }
+    // the time is the number before the rate, after the last " in "
+    const char *time = rate;
+    while (time > scanned && strncmp(time, " in ", 4) != 0)
+    {
+        --time;
+    }
+    if (sscanf(compiled, "compiled in %lf", &run->compile_ms) != 1 ||
+        sscanf(scanned, "scanned %zu", &run->bytes) != 1 || sscanf(time, " in %lf", &run->seconds) != 1 ||
+        sscanf(matching, "MB/s), %zu", &run->matches) != 1)
+    {
+        return false;
+    }
+    return run->seconds > 0;
+}
+
+static void print_json_string(FILE *fp, const char *s)
+{
+    fputc('"', fp);
+    for (; *s; ++s)
+    {
+        unsigned char c = *s;
+        if (c == '"' || c == '\\')
+        {
+            fprintf(fp, "\\%c", c);
+        }
+        else if (c < 0x20)
+        {
+            fprintf(fp, "\\u%04x", c);
+        }
+        else
+        {
+            fputc(c, fp);
+        }
+    }
+    fputc('"', fp);
+}
+
+static void print_result(FILE *fp, const bench_engine_t *engine, const corpus_t *corpus,
+                         const bench_pattern_t *pattern, const run_t *best)
+{
+    fprintf(fp, "{\"implementation\": \"%s\", \"engine\": \"%s\", \"corpus\": ", engine->implementation,
+            engine->engine);
+    print_json_string(fp, corpus->name);
+    fprintf(fp, ", \"pattern\": \"%s\", ", pattern->name);
+    if (best)
+    {
+        fprintf(fp,
+                "\"ok\": true, \"bytes\": %zu, \"compile_ms\": %.3f, \"seconds\": %.9f, \"mb_per_s\": %.1f, "
+                "\"matches\": %zu, \"matches_per_s\": %.0f}\n",
+                best->bytes, best->compile_ms, best->seconds, best->bytes / best->seconds / 1e6, best->matches,
+                best->matches / best->seconds);
+    }
+    else
+    {
+        fprintf(fp, "\"ok\": false}\n");
+    }
+    fflush(fp);
+}
+
+// Benchmarks one engine on one corpus with one pattern, keeping the fastest
+// of `runs` scans, and prints it to each of outputs. Returns its throughput,
+// 0 when it failed.
+static double bench_one(FILE *const *outputs, const char *program, const bench_engine_t *engine,
+                        const corpus_t *corpus, const bench_pattern_t *pattern, int runs)
+{
+    char *argv[8];
+    int argc = 0;
+    argv[argc++] = (char *)program;
+    argv[argc++] = "--stats";
+    argv[argc++] = "-c";
+    for (int o = 0; o < COUNT(engine->options) && engine->options[o]; ++o)
+    {
+        argv[argc++] = (char *)engine->options[o];
+    }
+    argv[argc++] = (char *)pattern->pattern;
+    argv[argc++] = (char *)corpus->path;
+    argv[argc] = NULL;
+    static char out[1 << 16];
+    run_t best = {0};
+    bool ok = false;
+    for (int r = 0; r < runs; ++r)
+    {
+        run_t run;
+        if (!run_capture(argv, out, sizeof(out)) || !parse_stats(out, &run))
+        {
+            ok = false;
+            break;
+        }
+        if (!ok || run.seconds < best.seconds)
+        {
+            best = run;
+        }
+        ok = true;
+    }
+    double mb_per_s = ok ? best.bytes / best.seconds / 1e6 : 0;
+    for (; *outputs; ++outputs)
+    {
+        print_result(*outputs, engine, corpus, pattern, ok ? &best : NULL);
+    }
+    return mb_per_s;
+}
+
+static void usage(FILE *fp)
+{
+    fprintf(fp, "usage: regex-bench [--plainc=PATH] [--cpp=PATH] [--corpora=DIR] [--size=BYTES]\n"
+                "                   [--runs=N] [-o FILE] [FILE...]\n"
+                "\n"
+                "Scans generated corpora, and each FILE as a corpus of its own, with\n"
+                "every pattern and engine of regex-plainc and regex-cpp, and prints a\n"
+                "line of JSON per measurement, then one comparing the two programs per\n"
+                "corpus and pattern.\n"
+                "\n"
+                "      --plainc=PATH, --cpp=PATH\n"
+                "                the programs to run; either is skipped when not given\n"
+                "      --corpora=DIR\n"
+                "                where the corpora are generated, once; the current\n"
+                "                directory by default\n"
+                "      --size=BYTES\n"
+                "                the size of each generated corpus, 16 MB by default\n"
+                "      --runs=N  scans per measurement, the fastest kept; 3 by default\n"
+                "  -o FILE       write the results to FILE as well\n");
+}
+
+int main(int argc, char *argv[])
+{
+    const char *plainc = NULL;
+    const char *cpp = NULL;
+    const char *dir = ".";
+    const char *output = NULL;
+    size_t size = DEFAULT_SIZE;
+    int runs = DEFAULT_RUNS;
+    int i = 1;
+    for (; i < argc && argv[i][0] == '-' && argv[i][1]; ++i)
+    {
+        if (strncmp(argv[i], "--plainc=", 9) == 0)
+        {
+            plainc = argv[i] + 9;
+        }
+        else if (strncmp(argv[i], "--cpp=", 6) == 0)
+        {
+            cpp = argv[i] + 6;
+        }
+        else if (strncmp(argv[i], "--corpora=", 10) == 0)
+        {
+            dir = argv[i] + 10;
+        }
+        else if (strncmp(argv[i], "--size=", 7) == 0 && atol(argv[i] + 7) > 0)
+        {
+            size = atol(argv[i] + 7);
+        }
+        else if (strncmp(argv[i], "--runs=", 7) == 0 && atoi(argv[i] + 7) > 0)
+        {
+            runs = atoi(argv[i] + 7);
+        }
+        else if (strcmp(argv[i], "-o") == 0 && i + 1 < argc)
+        {
+            output = argv[++i];
+        }
+        else if (strcmp(argv[i], "-h") == 0 || strcmp(argv[i], "--help") == 0)
+        {
+            usage(stdout);
+            return 0;
+        }
+        else
+        {
+            fprintf(stderr, "regex-bench: unknown option '%s'\n", argv[i]);
+            usage(stderr);
+            return 2;
+        }
+    }
+    if (!plainc && !cpp)
+    {
+        usage(stderr);
+        return 2;
+    }
+    FILE *results = output ? fopen(output, "w") : NULL;
+    if (output && !results)
+    {
+        fprintf(stderr, "regex-bench: %s: %s\n", output, strerror(errno));
+        return 2;
+    }
+
+    static const char *const generated[] = {"log-hits", "log-misses", "random", "long-lines", "pathological"};
+    static corpus_t corpora[MAX_CORPORA];
+    int ncorpora = 0;
+    mkdir(dir, 0777);
+    for (int g = 0; g < COUNT(generated); ++g)
+    {
+        corpus_t *corpus = &corpora[ncorpora++];
+        snprintf(corpus->name, sizeof(corpus->name), "%s", generated[g]);
+        snprintf(corpus->path, sizeof(corpus->path), "%s/%s-%zu.txt", dir, generated[g], size);
+        struct stat st;
+        if (stat(corpus->path, &st) < 0)
+        {
+            bool small = strcmp(generated[g], "pathological") == 0;
+            generate(generated[g], corpus->path, small ? size / PATHOLOGICAL_SHARE : size);
+        }
+    }
+    for (; i < argc && ncorpora < MAX_CORPORA; ++i)
+    {
+        corpus_t *corpus = &corpora[ncorpora++];
+        const char *base = strrchr(argv[i], '/');
+        snprintf(corpus->name, sizeof(corpus->name), "file:%s", base ? base + 1 : argv[i]);
+        snprintf(corpus->path, sizeof(corpus->path), "%s", argv[i]);
+    }
+
+    FILE *outputs[] = {stdout, results, NULL};
+    for (int o = 0; outputs[o]; ++o)
+    {
+        fprintf(outputs[o], "{\"schema\": %d, \"runs\": %d, \"size\": %zu}\n", BENCH_SCHEMA, runs, size);
+    }
+    for (int c = 0; c < ncorpora; ++c)
+    {
+        for (int p = 0; p < COUNT(patterns); ++p)
+        {
+            double best_plainc = 0;
+            double cpp_rate = 0;
+            for (int e = 0; e < COUNT(engines); ++e)
+            {
+                bool is_cpp = strcmp(engines[e].implementation, "cpp") == 0;
+                const char *program = is_cpp ? cpp : plainc;
+                if (!program)
+                {
+                    continue;
+                }
+                double rate = bench_one(outputs, program, &engines[e], &corpora[c], &patterns[p], runs);
+                if (is_cpp)
+                {
+                    cpp_rate = rate;
+                }
+                else if (rate > best_plainc)
+                {
+                    best_plainc = rate;
+                }
+            }
+            if (plainc && cpp)
+            {
+                for (int o = 0; outputs[o]; ++o)
+                {
+                    fprintf(outputs[o], "{\"compare\": ");
+                    print_json_string(outputs[o], corpora[c].name);
+                    fprintf(outputs[o],
+                            ", \"pattern\": \"%s\", \"plainc_mb_per_s\": %.1f, \"cpp_mb_per_s\": %.1f, "
+                            "\"speedup\": %.2f}\n",
+                            patterns[p].name, best_plainc, cpp_rate, cpp_rate > 0 ? best_plainc / cpp_rate : 0.0);
+                }
+            }
+        }
+    }
+    if (results)
+    {
+        fclose(results);
+    }
+    return 0;
+}
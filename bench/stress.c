@@ -0,0 +1,511 @@
+// Compile-scalability stress suite for regex-plainc.
+//
+// Generates families of patterns that grow with N, compiles each with
+// `regex-plainc --metrics --explain --engine=full` in a child process, and
+// prints one line of JSON per compilation: the time every phase took, as the
+// program measures it, the automata it built and the peak RSS of the child.
+// N doubles until a compilation takes longer than --timeout or runs out of
+// memory. Each family then gets a line per phase with the exponent of its
+// growth, the slope of log time over log N, flagged when it is super-linear.
+
+#define _GNU_SOURCE
+#include <errno.h>
+#include <fcntl.h>
+#include <math.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/resource.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+#define STRESS_SCHEMA 1
+#define DEFAULT_TIMEOUT 10    // seconds of CPU per compilation
+#define DEFAULT_MEMORY 4096   // MB of address space per compilation
+#define MAX_POINTS 32         // compilations per family
+#define SUPERLINEAR 1.25      // the growth exponent a phase is flagged at
+#define MIN_FIT_SECONDS 1e-3  // shorter times are left out of the fit as noise
+
+// the phases of --metrics, in its order
+static const char *const phases[] = {"parse", "nfa", "plan", "subset", "closure", "minimize", "trie", "tables"};
+#define PHASES ((int)(sizeof(phases) / sizeof(phases[0])))
+
+typedef struct
+{
+    const char *name;
+    const char *grows; // what N counts
+    int first;
+    int last;
+    bool linear_steps; // N goes up by `first` rather than doubling
+    bool utf8;
+    bool lex; // compile with --lex rather than for a search
+    void (*generate)(FILE *fp, int n);
+} family_t;
+
+typedef struct
+{
+    int n;
+    bool ok;
+    double seconds[PHASES];
+    double wall;
+    long peak_rss_kb;
+    long nfa_states;
+    long dfa_states;
+    long min_dfa_states;
+    long nfa_bytes;
+    long dfa_bytes;
+} point_t;
+
+// xorshift64*, seeded the same way for every pattern so runs compare
+static uint64_t random_state;
+
+static uint64_t random_next(void)
+{
+    random_state ^= random_state >> 12;
+    random_state ^= random_state << 25;
+    random_state ^= random_state >> 27;
+    return random_state * 0x2545F4914F6CDD1Dull;
+}
+
+static int random_below(int n)
+{
+    return (int)(random_next() % (uint64_t)n);
+}
+
+static void write_word(FILE *fp)
+{
+    int length = 4 + random_below(7);
+    for (int i = 0; i < length; ++i)
+    {
+        fputc('a' + random_below(26), fp);
+    }
+}
+
+// word|word|...: N keywords or blocklist entries
+static void generate_literals(FILE *fp, int n)
+{
+    for (int i = 0; i < n; ++i)
+    {
+        if (i > 0)
+        {
+            fputc('|', fp);
+        }
+        write_word(fp);
+    }
+}
+
+// (((a|b)*|c)*|d)*...: closures nested N deep
+static void generate_nested(FILE *fp, int n)
+{
+    for (int i = 0; i < n; ++i)
+    {
+        fputc('(', fp);
+    }
+    fputc('a', fp);
+    for (int i = 0; i < n; ++i)
+    {
+        fprintf(fp, "|%c)*", 'b' + i % 25);
+    }
+}
+
+// (a|b)*a(a|b){N}: the DFA must remember the last N + 1 bytes
+static void generate_explosion(FILE *fp, int n)
+{
+    fprintf(fp, "(a|b)*a(a|b){%d}", n);
+}
+
+// N lex rules, which machine() chains; a stray ')' ends each rule
+static void generate_lex_rules(FILE *fp, int n)
+{
+    static const char *const shapes[] = {"%s", "%s[a-z0-9_]*", "%s=[0-9]+", "\"%s\"[ \\t]*\\(", "#%s[0-9]{2,4}"};
+    for (int i = 0; i < n; ++i)
+    {
+        if (i > 0)
+        {
+            fputc(')', fp);
+        }
+        char word[16];
+        int length = 3 + random_below(6);
+        for (int j = 0; j < length; ++j)
+        {
+            word[j] = 'a' + random_below(26);
+        }
+        word[length] = '\0';
+        fprintf(fp, shapes[i % 5], word);
+    }
+}
+
+// [\x{...}-\x{...}]x|...: N wide code point ranges, each in UTF-8 a tree of
+// byte sequences
+static void generate_wide_classes(FILE *fp, int n)
+{
+    for (int i = 0; i < n; ++i)
+    {
+        int low = 0x80 + random_below(0x10000);
+        if (0xD800 <= low && low <= 0xDFFF)
+        {
+            // surrogates can't be written, only spanned
+            low += 0x800;
+        }
+        int high = low + 1 + random_below(0x10FFFF - low);
+        fprintf(fp, "%s[\\x{%X}-\\x{%X}]%c", i > 0 ? "|" : "", low, high, 'a' + i % 26);
+    }
+}
+
+static const family_t families[] = {
+    {"literals", "alternatives", 64, 1 << 16, false, false, false, generate_literals},
+    {"nested-closures", "depth", 4, 1024, false, false, false, generate_nested},
+    {"explosion", "n in (a|b)*a(a|b){n}", 2, 24, true, false, false, generate_explosion},
+    {"lex-rules", "rules", 8, 1 << 14, false, false, true, generate_lex_rules},
+    {"wide-classes", "classes", 1, 4096, false, true, false, generate_wide_classes},
+};
+#define FAMILIES ((int)(sizeof(families) / sizeof(families[0])))
+
+static double seconds_now(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+// The number after "key": in the JSON text from `from` on, or -1.
+static double json_number(const char *from, const char *key)
+{
+    char quoted[64];
+    snprintf(quoted, sizeof(quoted), "\"%s\": ", key);
+    const char *p = from ? strstr(from, quoted) : NULL;
+    return p ? strtod(p + strlen(quoted), NULL) : -1;
+}
+
+// Compiles the pattern in the file at path in a child held to the limits,
+// and fills in point from its --metrics line and its resource usage.
+static void compile_point(const char *program, const char *path, const family_t *family, int timeout, long memory,
+                          point_t *point)
+{
+    int pipefd[2];
+    point->ok = false;
+    if (pipe(pipefd) < 0)
+    {
+        return;
+    }
+    double start = seconds_now();
+    pid_t pid = fork();
+    if (pid < 0)
+    {
+        close(pipefd[0]);
+        close(pipefd[1]);
+        return;
+    }
+    if (pid == 0)
+    {
+        struct rlimit cpu = {timeout, timeout};
+        struct rlimit as = {(rlim_t)memory << 20, (rlim_t)memory << 20};
+        setrlimit(RLIMIT_CPU, &cpu);
+        setrlimit(RLIMIT_AS, &as);
+        int null = open("/dev/null", O_WRONLY);
+        dup2(null, STDOUT_FILENO);
+        dup2(pipefd[1], STDERR_FILENO);
+        close(pipefd[0]);
+        char *argv[16];
+        int argc = 0;
+        argv[argc++] = (char *)program;
+        argv[argc++] = "--metrics";
+        if (family->lex)
+        {
+            argv[argc++] = "--lex";
+        }
+        else
+        {
+            argv[argc++] = "--explain";
+            argv[argc++] = "--engine=full";
+            argv[argc++] = "--max-states=100000000";
+            argv[argc++] = "--max-dfa-bytes=1099511627776";
+        }
+        if (family->utf8)
+        {
+            argv[argc++] = "-u";
+        }
+        argv[argc++] = "-f";
+        argv[argc++] = (char *)path;
+        argv[argc] = NULL;
+        execv(program, argv);
+        _exit(127);
+    }
+    close(pipefd[1]);
+    // the metrics repeat the pattern, so the output is as long as it is
+    size_t capacity = 1 << 16;
+    size_t length = 0;
+    char *out = malloc(capacity);
+    ssize_t n;
+    while (out && (n = read(pipefd[0], out + length, capacity - 1 - length)) > 0)
+    {
+        length += n;
+        if (length == capacity - 1)
+        {
+            capacity *= 2;
+            char *grown = realloc(out, capacity);
+            if (!grown)
+            {
+                free(out);
+            }
+            out = grown;
+        }
+    }
+    close(pipefd[0]);
+    int status;
+    struct rusage usage;
+    wait4(pid, &status, 0, &usage);
+    point->wall = seconds_now() - start;
+    point->peak_rss_kb = usage.ru_maxrss;
+    if (!out)
+    {
+        return;
+    }
+    out[length] = '\0';
+    const char *line = strstr(out, family->lex ? "{\"compilation\": \"lex\"" : "{\"compilation\": \"search\"");
+    if (!WIFEXITED(status) || WEXITSTATUS(status) != 0 || !line)
+    {
+        free(out);
+        return;
+    }
+    const char *seconds = strstr(line, "\"seconds\": {");
+    const char *bytes = strstr(line, "\"bytes\": {");
+    for (int i = 0; i < PHASES; ++i)
+    {
+        point->seconds[i] = json_number(seconds, phases[i]);
+    }
+    point->nfa_states = json_number(line, "nfa_states");
+    point->dfa_states = json_number(line, "dfa_states");
+    point->min_dfa_states = json_number(line, "min_dfa_states");
+    point->nfa_bytes = json_number(bytes, "nfa");
+    point->dfa_bytes = json_number(bytes, "dfa");
+    point->ok = true;
+    free(out);
+}
+
+static void print_point(FILE *fp, const family_t *family, const point_t *point, long pattern_bytes)
+{
+    fprintf(fp, "{\"family\": \"%s\", \"n\": %d, \"pattern_bytes\": %ld, \"ok\": %s, \"wall_seconds\": %.6f, ",
+            family->name, point->n, pattern_bytes, point->ok ? "true" : "false", point->wall);
+    fprintf(fp, "\"peak_rss_kb\": %ld", point->peak_rss_kb);
+    if (point->ok)
+    {
+        fprintf(fp, ", \"seconds\": {");
+        for (int i = 0; i < PHASES; ++i)
+        {
+            fprintf(fp, "%s\"%s\": %.9f", i > 0 ? ", " : "", phases[i], point->seconds[i]);
+        }
+        fprintf(fp,
+                "}, \"nfa_states\": %ld, \"dfa_states\": %ld, \"min_dfa_states\": %ld, "
+                "\"bytes\": {\"nfa\": %ld, \"dfa\": %ld}",
+                point->nfa_states, point->dfa_states, point->min_dfa_states, point->nfa_bytes, point->dfa_bytes);
+    }
+    fprintf(fp, "}\n");
+    fflush(fp);
+}
+
+// The least-squares slope of log y over log n, for the points where y is at
+// least `floor`, less `base`; NAN when fewer than two are left.
+static double growth_exponent(const point_t *points, int count, const double *y, double floor, double base)
+{
+    double sx = 0, sy = 0, sxx = 0, sxy = 0;
+    int m = 0;
+    for (int i = 0; i < count; ++i)
+    {
+        if (!points[i].ok || y[i] < floor || y[i] - base <= 0)
+        {
+            continue;
+        }
+        double lx = log(points[i].n);
+        double ly = log(y[i] - base);
+        sx += lx;
+        sy += ly;
+        sxx += lx * lx;
+        sxy += lx * ly;
+        ++m;
+    }
+    double d = m * sxx - sx * sx;
+    return m >= 2 && d > 0 ? (m * sxy - sx * sy) / d : NAN;
+}
+
+static void print_growth(FILE *fp, const family_t *family, const char *what, double exponent)
+{
+    fprintf(fp, "{\"family\": \"%s\", \"growth\": \"%s\", ", family->name, what);
+    if (isnan(exponent))
+    {
+        fprintf(fp, "\"exponent\": null, \"superlinear\": false}\n");
+    }
+    else
+    {
+        fprintf(fp, "\"exponent\": %.2f, \"superlinear\": %s}\n", exponent, exponent > SUPERLINEAR ? "true" : "false");
+    }
+}
+
+static void usage(FILE *fp)
+{
+    fprintf(fp, "usage: regex-stress --plainc=PATH [--dir=DIR] [--timeout=SECONDS] [--memory=MB]\n"
+                "                    [--family=NAME] [-o FILE]\n"
+                "\n"
+                "Compiles families of patterns of growing size N with regex-plainc and\n"
+                "prints, as JSON lines, the time each phase took, the automata built and\n"
+                "the peak RSS against N, then per family and phase the exponent of the\n"
+                "growth, flagged when it is over %.2f.\n"
+                "\n"
+                "      --plainc=PATH\n"
+                "                the program to compile with\n"
+                "      --dir=DIR the directory the patterns are written to, the current\n"
+                "                one by default\n"
+                "      --timeout=SECONDS, --memory=MB\n"
+                "                the CPU time and address space each compilation may\n"
+                "                take, %d s and %d MB by default; a family stops growing\n"
+                "                at the first compilation over either\n"
+                "      --family=NAME\n"
+                "                only run one family:",
+            SUPERLINEAR, DEFAULT_TIMEOUT, DEFAULT_MEMORY);
+    for (int f = 0; f < FAMILIES; ++f)
+    {
+        fprintf(fp, " %s", families[f].name);
+    }
+    fprintf(fp, "\n  -o FILE       write the results to FILE as well\n");
+}
+
+int main(int argc, char *argv[])
+{
+    const char *plainc = NULL;
+    const char *dir = ".";
+    const char *only = NULL;
+    const char *output = NULL;
+    int timeout = DEFAULT_TIMEOUT;
+    long memory = DEFAULT_MEMORY;
+    for (int i = 1; i < argc; ++i)
+    {
+        if (strncmp(argv[i], "--plainc=", 9) == 0)
+        {
+            plainc = argv[i] + 9;
+        }
+        else if (strncmp(argv[i], "--dir=", 6) == 0)
+        {
+            dir = argv[i] + 6;
+        }
+        else if (strncmp(argv[i], "--timeout=", 10) == 0 && atoi(argv[i] + 10) > 0)
+        {
+            timeout = atoi(argv[i] + 10);
+        }
+        else if (strncmp(argv[i], "--memory=", 9) == 0 && atol(argv[i] + 9) > 0)
+        {
+            memory = atol(argv[i] + 9);
+        }
+        else if (strncmp(argv[i], "--family=", 9) == 0)
+        {
+            only = argv[i] + 9;
+        }
+        else if (strcmp(argv[i], "-o") == 0 && i + 1 < argc)
+        {
+            output = argv[++i];
+        }
+        else if (strcmp(argv[i], "-h") == 0 || strcmp(argv[i], "--help") == 0)
+        {
+            usage(stdout);
+            return 0;
+        }
+        else
+        {
+            fprintf(stderr, "regex-stress: unknown option '%s'\n", argv[i]);
+            usage(stderr);
+            return 2;
+        }
+    }
+    if (!plainc)
+    {
+        usage(stderr);
+        return 2;
+    }
+    mkdir(dir, 0777);
+    FILE *results = output ? fopen(output, "w") : NULL;
+    if (output && !results)
+    {
+        fprintf(stderr, "regex-stress: %s: %s\n", output, strerror(errno));
+        return 2;
+    }
+    FILE *outputs[] = {stdout, results, NULL};
+    for (int o = 0; outputs[o]; ++o)
+    {
+        fprintf(outputs[o], "{\"schema\": %d, \"timeout\": %d, \"memory_mb\": %ld}\n", STRESS_SCHEMA, timeout,
+                memory);
+    }
+
+    for (int f = 0; f < FAMILIES; ++f)
+    {
+        const family_t *family = &families[f];
+        if (only && strcmp(only, family->name) != 0)
+        {
+            continue;
+        }
+        fprintf(stderr, "regex-stress: %s, N = %s\n", family->name, family->grows);
+        static point_t points[MAX_POINTS];
+        int count = 0;
+        for (int n = family->first; n <= family->last && count < MAX_POINTS;
+             n = family->linear_steps ? n + family->first : n * 2)
+        {
+            char path[4096];
+            snprintf(path, sizeof(path), "%s/%s-%d.pattern", dir, family->name, n);
+            FILE *fp = fopen(path, "w");
+            if (!fp)
+            {
+                fprintf(stderr, "regex-stress: %s: %s\n", path, strerror(errno));
+                return 2;
+            }
+            random_state = 0x9E3779B97F4A7C15ull;
+            family->generate(fp, n);
+            long pattern_bytes = ftell(fp);
+            fclose(fp);
+            point_t *point = &points[count++];
+            memset(point, 0, sizeof(*point));
+            point->n = n;
+            compile_point(plainc, path, family, timeout, memory, point);
+            for (int o = 0; outputs[o]; ++o)
+            {
+                print_point(outputs[o], family, point, pattern_bytes);
+            }
+            if (!point->ok)
+            {
+                break;
+            }
+        }
+
+        double y[MAX_POINTS];
+        for (int p = 0; p < PHASES; ++p)
+        {
+            for (int i = 0; i < count; ++i)
+            {
+                y[i] = points[i].seconds[p];
+            }
+            double exponent = growth_exponent(points, count, y, MIN_FIT_SECONDS, 0);
+            for (int o = 0; outputs[o]; ++o)
+            {
+                print_growth(outputs[o], family, phases[p], exponent);
+            }
+        }
+        // RSS over what the smallest pattern took, once it has at least doubled
+        double base = points[0].peak_rss_kb;
+        for (int i = 0; i < count; ++i)
+        {
+            y[i] = points[i].peak_rss_kb;
+        }
+        double exponent = growth_exponent(points, count, y, 2 * base, base);
+        for (int o = 0; outputs[o]; ++o)
+        {
+            print_growth(outputs[o], family, "peak_rss", exponent);
+        }
+    }
+    if (results)
+    {
+        fclose(results);
+    }
+    return 0;
+}
@@ -1,25 +1,33 @@
+#include <algorithm>
 #include <array>
 #include <boost/dynamic_bitset.hpp>
 #include <boost/variant2/variant.hpp>
+#include <cerrno>
+#include <chrono>
+#include <cstdio>
+#include <cstring>
+#include <fcntl.h>
 #include <fmt/format.h>
 #include <initializer_list>
 #include <iomanip>
 #include <iostream>
 #include <memory>
-#include <stack>
+#include <stdexcept>
+#include <string>
 #include <string_view>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
 #include <vector>
 
-#define DEBUG
-
 template <typename T>
 static constexpr bool in(T value, std::initializer_list<T> values) {
   for (const auto &v : values) {
-    if (value != v) {
-      return false;
+    if (value == v) {
+      return true;
     }
   }
-  return true;
+  return false;
 }
 
 class BitSet {
@@ -46,26 +54,43 @@ public:
     bool at_end() const { return _pos == _set._set.size(); }
   };
 
+  // Character classes are sized for the whole alphabet on first use, so a set
+  // recycled from another node never has to grow.
+  static constexpr std::size_t minimumBits = 256;
+
   void set(std::size_t bit) {
-    _set.resize(std::max(_set.size(), bit), _isComplement);
+    _set.resize(std::max({_set.size(), bit + 1, minimumBits}), _isComplement);
     _set.set(bit);
   }
   void complement() {
-    _set = ~_set;
+    _set.flip();
     _isComplement = !_isComplement;
   }
-  bool get(std::size_t bit) const { return _set[bit]; }
+  bool get(std::size_t bit) const {
+    return bit < _set.size() ? _set[bit] : _isComplement;
+  }
+  // The heap the set takes.
+  std::size_t bytes() const {
+    return _set.num_blocks() * sizeof(_internal_type::block_type);
+  }
   const_iterator begin() { return const_iterator{*this}; }
   const_iterator end() { return const_iterator{*this, _set.size()}; }
-  void clear() { _set.clear(); }
+  // Keeps the underlying storage so a recycled node can be refilled without
+  // allocating.
+  void clear() {
+    _set.clear();
+    _isComplement = false;
+  }
 };
 
 static std::ostream &printccl(std::ostream &os, const BitSet &set) {
   os << "[";
-  for (int i = 0; i <= 0x7F; ++i) {
+  for (int i = 0; i <= 0xFF; ++i) {
     if (set.get(i)) {
       if (i < ' ') {
         os << fmt::format("^{}", static_cast<char>(i + '@'));
+      } else if (i >= 0x7F) {
+        os << fmt::format("\\x{:02X}", i);
       } else {
         os << fmt::format("{}", static_cast<char>(i));
       }
@@ -75,23 +100,134 @@ static std::ostream &printccl(std::ostream &os, const BitSet &set) {
   return os;
 }
 
-static constexpr char edgeEmpty = -3;
-static constexpr char edgeCharacterClass = -2;
-static constexpr char edgeEpsilon = -1;
+// A literal edge is the byte it reads, 0 to 0xFF.
+static constexpr int edgeEmpty = -3;
+static constexpr int edgeCharacterClass = -2;
+static constexpr int edgeEpsilon = -1;
 
 static constexpr int anchorNone = 0;
 static constexpr int anchorLineStart = 1 << 0;
 static constexpr int anchorLineEnd = 1 << 1;
 static constexpr int anchorBoth = anchorLineStart | anchorLineEnd;
 
+// What an assertion sees on either side of a position: a kind of byte, or the
+// edge of the line. Assertions are masks of the kinds they accept.
+static constexpr int kindEdge = 0;
+static constexpr int kindNewline = 1;
+static constexpr int kindReturn = 2;
+static constexpr int kindWord = 3;
+static constexpr int kindOther = 4;
+static constexpr int kindBit(int kind) { return 1 << kind; }
+static constexpr int behindLineStart = kindBit(kindEdge) | kindBit(kindNewline);
+static constexpr int aheadLineEnd = behindLineStart | kindBit(kindReturn);
+static constexpr int notWord = aheadLineEnd | kindBit(kindOther);
+
+static int byteKind(unsigned char c) {
+  if (c == '\n') {
+    return kindNewline;
+  }
+  if (c == '\r') {
+    return kindReturn;
+  }
+  return c == '_' || std::isalnum(c) ? kindWord : kindOther;
+}
+
+static constexpr int utf8Max = 0x10FFFF;
+static constexpr int surrogateFirst = 0xD800;
+static constexpr int surrogateLast = 0xDFFF;
+
+// Encodes code point c into out, returning the number of bytes.
+static int utf8Encode(int c, std::array<unsigned char, 4> &out) {
+  if (c < 0x80) {
+    out[0] = c;
+    return 1;
+  }
+  int length = c < 0x800 ? 2 : c < 0x10000 ? 3 : 4;
+  for (int i = length - 1; i > 0; --i) {
+    out[i] = 0x80 | (c & 0x3F);
+    c >>= 6;
+  }
+  out[0] = (0xF00 >> length) | c;
+  return length;
+}
+
+// Runs of upper case letters, each with its lower case delta above: ASCII,
+// then the letters that fold in UTF-8 mode, Latin-1, Greek and Cyrillic.
+constexpr std::array<std::array<int, 3>, 7> caseRuns{{
+    {'A', 'Z', 0x20},
+    {0xC0, 0xD6, 0x20},
+    {0xD8, 0xDE, 0x20},
+    {0x391, 0x3A1, 0x20},
+    {0x3A3, 0x3AB, 0x20},
+    {0x400, 0x40F, 0x50},
+    {0x410, 0x42F, 0x20},
+}};
+
+// A run of code points that share an encoded length, as the range each of
+// their bytes falls in.
+struct Utf8Sequence {
+  int length;
+  std::array<unsigned char, 4> lo;
+  std::array<unsigned char, 4> hi;
+};
+
+// Splits the code points lo to hi, all beyond ASCII, into byte sequences such
+// that every combination of the bytes in a sequence's ranges encodes one of
+// them, in ascending order.
+static void utf8Split(std::vector<Utf8Sequence> &out, int lo, int hi) {
+  for (int last : {0x7FF, 0xFFFF}) {
+    if (lo <= last && hi > last) {
+      utf8Split(out, lo, last);
+      utf8Split(out, last + 1, hi);
+      return;
+    }
+  }
+  Utf8Sequence sequence;
+  sequence.length = utf8Encode(lo, sequence.lo);
+  for (int i = 1; i < sequence.length; ++i) {
+    // the bytes after a split point must run over their full range
+    int m = (1 << 6 * i) - 1;
+    if ((lo & ~m) != (hi & ~m)) {
+      if ((lo & m) != 0) {
+        utf8Split(out, lo, lo | m);
+        utf8Split(out, (lo | m) + 1, hi);
+        return;
+      }
+      if ((hi & m) != m) {
+        utf8Split(out, lo, (hi & ~m) - 1);
+        utf8Split(out, hi & ~m, hi);
+        return;
+      }
+    }
+  }
+  utf8Encode(hi, sequence.hi);
+  out.push_back(sequence);
+}
+
 struct NfaNode {
   std::array<std::size_t, 2> next;
-  char edge;
+  int edge;
   BitSet bitset;
   int anchor;
+  // on an epsilon node, the kinds it allows behind and ahead; 0 for any
+  int behind;
+  int ahead;
   int index;
   NfaNode(int index)
-      : next{SIZE_MAX, SIZE_MAX}, edge{0}, anchor{0}, index{index} {}
+      : next{SIZE_MAX, SIZE_MAX}, edge{edgeEpsilon}, anchor{0}, behind{0},
+        ahead{0}, index{index} {}
+  void reset(int index) {
+    next = {SIZE_MAX, SIZE_MAX};
+    edge = edgeEpsilon;
+    bitset.clear();
+    anchor = anchorNone;
+    behind = ahead = 0;
+    this->index = index;
+  }
+  bool holds(int kindBehind, int kindAhead) const {
+    return (!behind || (behind & kindBit(kindBehind))) &&
+           (!ahead || (ahead & kindBit(kindAhead)));
+  }
 };
 
 struct Nfa {
@@ -101,13 +237,13 @@ struct Nfa {
 
 static std::ostream &operator<<(std::ostream &os, const Nfa &nfa) {
   auto flags = os.flags();
-  os << fmt::format("{:-30}\n", " NFA ");
+  os << fmt::format("{:-^30}\n", " NFA ");
   for (int i = 0; i < nfa.nodes.size(); ++i) {
     if (nfa.nodes[i].index == -1) {
       continue;
     }
     os << "NFA state " << std::setw(2) << i << ": ";
-    if (nfa.nodes[i].next[0] == edgeEmpty) {
+    if (nfa.nodes[i].next[0] == SIZE_MAX) {
       os << "(TERMINAL)";
     } else {
       os << "--> " << std::setw(2) << nfa.nodes[i].next[0] << " ";
@@ -119,12 +255,18 @@ static std::ostream &operator<<(std::ostream &os, const Nfa &nfa) {
         break;
       case edgeEpsilon:
         os << "EPSILON ";
+        if (nfa.nodes[i].behind || nfa.nodes[i].ahead) {
+          os << fmt::format("(ASSERT behind {:02x} ahead {:02x}) ",
+                            nfa.nodes[i].behind, nfa.nodes[i].ahead);
+        }
         break;
       default:
         if (nfa.nodes[i].edge < ' ') {
-          os << "^" << nfa.nodes[i].edge;
+          os << fmt::format("^{}", static_cast<char>(nfa.nodes[i].edge + '@'));
+        } else if (nfa.nodes[i].edge >= 0x7F) {
+          os << fmt::format("\\x{:02X}", nfa.nodes[i].edge);
         } else {
-          os << nfa.nodes[i].edge;
+          os << static_cast<char>(nfa.nodes[i].edge);
         }
         break;
       }
@@ -134,38 +276,48 @@ static std::ostream &operator<<(std::ostream &os, const Nfa &nfa) {
     }
     os << '\n';
   }
-  os << fmt::format("{:-30}\n", "");
+  os << fmt::format("{:-^30}\n", "");
   return os;
 }
 
 struct ParserState {
 #ifdef DEBUG
   std::size_t indentLevel = 0;
+  // The parse trace goes to stderr so it never mixes with matched lines.
   void enter(std::string_view functionName) {
-    fmt::print("{: >{}}enter {}\n", "", indentLevel++, functionName);
+    fmt::print(stderr, "{: >{}}enter {}\n", "", indentLevel++, functionName);
   }
   void leave(std::string_view functionName) {
-    fmt::print("{: >{}}leave {}\n", "", --indentLevel, functionName);
+    fmt::print(stderr, "{: >{}}leave {}\n", "", --indentLevel, functionName);
   }
 #else
-  void enter(std::string_view functionName) {}
-  void leave(std::string_view functionName) {}
+  void enter(std::string_view) {}
+  void leave(std::string_view) {}
 #endif
 
 private:
+  // Slots [0, liveNfaStates) belong to the NFA being built; anything past that
+  // is left over from an earlier compilation and is reset on reuse instead of
+  // being reallocated.
   std::vector<NfaNode> nfaStates;
-  std::stack<std::size_t> discarded_nfa_states;
+  std::size_t liveNfaStates = 0;
+  std::vector<std::size_t> discarded_nfa_states;
 
   std::size_t allocateNfaNode() {
     if (!discarded_nfa_states.empty()) {
-      std::size_t n = discarded_nfa_states.top();
-      discarded_nfa_states.pop();
-      nfaStates[n].index = n;
+      std::size_t n = discarded_nfa_states.back();
+      discarded_nfa_states.pop_back();
+      nfaStates[n].reset(n);
       return n;
     }
 
-    nfaStates.emplace_back(nfaStates.size());
-    return nfaStates.size() - 1;
+    std::size_t n = liveNfaStates++;
+    if (n < nfaStates.size()) {
+      nfaStates[n].reset(n);
+    } else {
+      nfaStates.emplace_back(n);
+    }
+    return n;
   }
 
   void discardNfaNode(std::size_t index) {
@@ -173,8 +325,9 @@ private:
     node->index = -1;
     node->bitset.clear();
     node->anchor = anchorNone;
+    node->behind = node->ahead = 0;
     node->edge = edgeEmpty;
-    discarded_nfa_states.emplace(node->index);
+    discarded_nfa_states.push_back(index);
   }
 
   using RegexToken = int;
@@ -192,6 +345,8 @@ private:
   static constexpr RegexToken tokQuestionMark = 12;
   static constexpr RegexToken tokPipe = 13;
   static constexpr RegexToken tokPlus = 14;
+  static constexpr RegexToken tokWordBoundary = 15;
+  static constexpr RegexToken tokLeftBrace = 16;
 
   static constexpr std::array<RegexToken, 128> Tokmap{
       tokLiteral,   tokLiteral,     tokLiteral, tokLiteral,      tokLiteral,
@@ -218,14 +373,61 @@ private:
       tokLiteral,   tokLiteral,     tokLiteral, tokLiteral,      tokLiteral,
       tokLiteral,   tokLiteral,     tokLiteral, tokLiteral,      tokLiteral,
       tokLiteral,   tokLiteral,     tokLiteral, tokLiteral,      tokLiteral,
-      tokLiteral,   tokLiteral,     tokLiteral, tokLiteral,      tokPipe,
+      tokLiteral,   tokLiteral,     tokLiteral, tokLeftBrace,    tokPipe,
       tokLiteral,   tokLiteral,
   };
 
-  const char *input;
-  std::string start_of_input;
+  std::string_view input;
   RegexToken currentToken;
-  char lexeme;
+  int lexeme; // a byte, or a code point in UTF-8 mode
+  bool inQuote = false;
+  bool utf8;
+  bool icase;        // fold case in the rule being parsed
+  bool icaseDefault; // ...and in rules that do not say
+  // the bounds of the {m,n} just read, max repeatUnbounded for {m,}
+  int repeatMin;
+  int repeatMax;
+
+  static constexpr int repeatMaxCount = 1000;
+  static constexpr int repeatUnbounded = -1;
+  static constexpr std::size_t repeatMaxNodes = 262144;
+
+  static char peek(std::string_view s, std::size_t offset = 0) {
+    return offset < s.size() ? s[offset] : '\0';
+  }
+
+  static RegexToken tokenFor(int c) {
+    return static_cast<std::size_t>(c) < Tokmap.size() ? Tokmap[c] : tokLiteral;
+  }
+
+  // Decodes the UTF-8 sequence at the start of s and removes it.
+  static int utf8Decode(std::string_view &s) {
+    auto byte = [&](std::size_t i) {
+      return static_cast<unsigned char>(peek(s, i));
+    };
+    int length = byte(0) < 0x80   ? 1
+                 : byte(0) < 0xC2 ? 0
+                 : byte(0) < 0xE0 ? 2
+                 : byte(0) < 0xF0 ? 3
+                 : byte(0) < 0xF5 ? 4
+                                  : 0;
+    int c = length == 1 ? byte(0) : byte(0) & (0x7F >> length);
+    for (int i = 1; i < length; ++i) {
+      if ((byte(i) & 0xC0) != 0x80) {
+        length = 0;
+        break;
+      }
+      c = c << 6 | (byte(i) & 0x3F);
+    }
+    // overlong, surrogate and out of range encodings are invalid too
+    static constexpr std::array<int, 5> least{0, 0, 0x80, 0x800, 0x10000};
+    if (length == 0 || c < least[length] || c > utf8Max ||
+        (surrogateFirst <= c && c <= surrogateLast)) {
+      throw std::runtime_error{"invalid UTF-8 in the pattern."};
+    }
+    s.remove_prefix(length);
+    return c;
+  }
 
   static constexpr bool IS_HEX_DIGIT(char c) {
     return (c >= '0' && c <= '9') || (c >= 'a' && c <= 'f') ||
@@ -236,25 +438,29 @@ private:
     if (std::isdigit(c)) {
       return c - '0';
     }
-    return (std::toupper(c) - 'A') & 0xF;
+    return (std::toupper(c) - 'A' + 10) & 0xF;
   }
 
   static constexpr bool IS_OCT_DIGIT(char c) { return c >= '0' && c <= '7'; }
 
   static char oct2bin(char c) { return (c - '0') & 0x7; }
 
-  static char esc(const char **s) {
-    if ((*s)[0] != '\\') {
-      char rval = **s;
-      ++(*s);
+  // Reads one character of the pattern, which may be an escape: a byte, or in
+  // UTF-8 mode a whole code point, which \x{H...} can name.
+  static int esc(std::string_view &s, bool utf8) {
+    if (peek(s) != '\\') {
+      if (utf8) {
+        return utf8Decode(s);
+      }
+      int rval = static_cast<unsigned char>(peek(s));
+      s.remove_prefix(1);
       return rval;
     }
-    ++(*s);
-    char rval;
-    switch (std::toupper((*s)[0])) {
+    s.remove_prefix(1);
+    int rval;
+    switch (std::toupper(peek(s))) {
     case '\0':
-      rval = '\\';
-      break;
+      return '\\';
     case 'B':
       rval = '\b';
       break;
@@ -274,99 +480,142 @@ private:
       rval = '\x1b';
       break;
     case '^':
-      ++(*s);
-      rval = (*s)[0];
-      rval = std::toupper(rval) - '@';
+      s.remove_prefix(1);
+      rval = std::toupper(peek(s)) - '@';
       break;
     case 'X':
       rval = 0;
-      ++(*s);
-      if (IS_HEX_DIGIT((*s)[0])) {
-        rval = hex2bin((*s)[0]);
-        ++(*s);
-      }
-      if (IS_HEX_DIGIT((*s)[0])) {
-        rval <<= 4;
-        rval |= hex2bin((*s)[0]);
-        ++(*s);
-      }
-      if (IS_HEX_DIGIT((*s)[0])) {
-        rval <<= 4;
-        rval |= hex2bin((*s)[0]);
-        ++(*s);
-      }
-      --(*s);
-      break;
+      s.remove_prefix(1);
+      if (peek(s) == '{') {
+        s.remove_prefix(1);
+        for (int digits = 0; digits < 8 && IS_HEX_DIGIT(peek(s)); ++digits) {
+          rval = (rval << 4) | hex2bin(peek(s));
+          s.remove_prefix(1);
+        }
+        if (peek(s) != '}' || rval > (utf8 ? utf8Max : 0xFF) ||
+            (utf8 && surrogateFirst <= rval && rval <= surrogateLast)) {
+          throw std::runtime_error{"bad \\x{} escape."};
+        }
+        s.remove_prefix(1);
+        return rval;
+      }
+      // two digits at most: a byte, or a code point below 0x100
+      for (int digits = 0; digits < 2 && IS_HEX_DIGIT(peek(s)); ++digits) {
+        rval = (rval << 4) | hex2bin(peek(s));
+        s.remove_prefix(1);
+      }
+      return rval;
     default:
-      if (!IS_OCT_DIGIT((*s)[0])) {
-        rval = (*s)[0];
-      } else {
-        ++(*s);
-        rval = oct2bin((*s)[0]);
-        ++(*s);
-        if (IS_OCT_DIGIT((*s)[0])) {
-          rval <<= 3;
-          rval |= oct2bin((*s)[0]);
-          ++(*s);
+      if (!IS_OCT_DIGIT(peek(s))) {
+        if (utf8) {
+          return utf8Decode(s);
         }
-        if (IS_OCT_DIGIT((*s)[0])) {
-          rval <<= 3;
-          rval |= oct2bin((*s)[0]);
-          ++(*s);
+        rval = static_cast<unsigned char>(peek(s));
+      } else {
+        rval = 0;
+        for (int digits = 0; digits < 3 && IS_OCT_DIGIT(peek(s)); ++digits) {
+          rval = (rval << 3) | oct2bin(peek(s));
+          s.remove_prefix(1);
         }
-        --(*s);
-        break;
+        return rval & 0xFF;
       }
     }
-    ++(*s);
+    s.remove_prefix(1);
     return rval;
   }
 
   char advance() {
-    static bool inQuote = false;
-    static std::stack<const char *> stack;
     if (currentToken == tokEos && inQuote) {
       throw std::runtime_error{"Newline in quoted string"};
     }
+    if (input.empty()) {
+      currentToken = tokEos;
+      lexeme = '\0';
+      return currentToken;
+    }
     if (input[0] == '"') {
       inQuote = !inQuote;
-      ++input;
-      if (input[0] == '\0') {
+      input.remove_prefix(1);
+      if (input.empty()) {
         currentToken = tokEos;
         lexeme = '\0';
-        return lexeme;
+        return currentToken;
       }
     }
     bool sawEsc = input[0] == '\\';
+    bool wordBoundary = sawEsc && !inQuote && peek(input, 1) == 'b';
     if (!inQuote) {
-      lexeme = esc(&input);
+      lexeme = esc(input, utf8);
     } else {
-      if (sawEsc && input[1] == '"') {
-        input += 2;
+      if (sawEsc && peek(input, 1) == '"') {
+        input.remove_prefix(2);
         lexeme = '"';
+      } else if (utf8) {
+        lexeme = utf8Decode(input);
       } else {
-        lexeme = input[0];
-        ++input;
+        lexeme = static_cast<unsigned char>(input[0]);
+        input.remove_prefix(1);
       }
     }
-    currentToken = (inQuote || sawEsc) ? tokLiteral : Tokmap[lexeme];
+    currentToken = (inQuote || sawEsc) ? tokLiteral : tokenFor(lexeme);
+    if (wordBoundary) {
+      currentToken = tokWordBoundary;
+    }
     return currentToken;
   }
 
+  using Ranges = std::vector<std::pair<int, int>>;
+
+  // The members of the class, or the cases of the letter, being read, and
+  // what characterClass() makes of them in UTF-8 mode. Kept across
+  // compilations, so reading one does not allocate.
+  Ranges ranges;
+  Ranges mergedRanges;
+  std::vector<Utf8Sequence> utf8Sequences;
+  // The fragment repeat() copies, and where its copies start and end, kept
+  // for the same reason.
+  std::vector<std::size_t> fragment;
+  std::vector<bool> inFragment;
+  std::vector<std::size_t> copyOf;
+  std::vector<std::size_t> copyStarts;
+  std::vector<std::size_t> copyEnds;
+
+  void caseFold(Ranges *) const;
   void catExpr(std::size_t *, std::size_t *);
-  void dodash(BitSet *);
+  void characterClass(Ranges &, bool, std::size_t *, std::size_t *);
+  std::size_t cloneFragment(std::size_t, std::size_t *);
+  void closure(RegexToken, std::size_t *, std::size_t *);
+  void fragmentNodes(std::size_t);
+  bool readRepeat();
+  void repeat(std::size_t *, std::size_t *);
+  void dodash(Ranges *);
   void expr(std::size_t *, std::size_t *);
   void factor(std::size_t *, std::size_t *);
   bool firstInCat(RegexToken);
+  void literal(int, std::size_t *, std::size_t *);
   Nfa machine();
   std::size_t rule();
   void term(std::size_t *, std::size_t *);
+  std::size_t utf8Alternatives(const Utf8Sequence *, std::size_t, int,
+                               std::size_t);
 
 public:
-  Nfa thompson(std::string_view input) {
-    nfaStates.clear();
-    std::string t{input};
-    this->input = t.c_str();
+  // In UTF-8 mode the pattern is read as UTF-8 and matches UTF-8 text: each
+  // character, '.' and class member is a code point, compiled to the bytes
+  // that encode it. With icase, letters match either case; a rule starting
+  // with (?i) or (?-i) overrides it.
+  explicit ParserState(bool utf8 = false, bool icase = false)
+      : utf8{utf8}, icase{icase}, icaseDefault{icase} {}
+
+  // Parses `input` into a Thompson NFA. The pattern is read in place, and the
+  // nodes of `recycled` (typically the result of the previous call) are reused,
+  // so recompiling into a warm NFA performs no heap allocation.
+  Nfa thompson(std::string_view input, Nfa recycled = {}) {
+    nfaStates.swap(recycled.nodes);
+    liveNfaStates = 0;
+    discarded_nfa_states.clear();
+    this->input = input;
+    inQuote = false;
     currentToken = tokEos;
     advance();
     return machine();
@@ -382,23 +631,30 @@ void ParserState::catExpr(std::size_t *sp, std::size_t *ep) {
   }
   while (firstInCat(currentToken)) {
     factor(&e2Start, &e2End);
-    nfaStates[*ep] = nfaStates[e2Start];
+    NfaNode &end = nfaStates[*ep];
+    NfaNode &next = nfaStates[e2Start];
+    end.next = next.next;
+    end.edge = next.edge;
+    end.anchor = next.anchor;
+    end.behind = next.behind;
+    end.ahead = next.ahead;
+    end.bitset = next.bitset;
     discardNfaNode(e2Start);
     *ep = e2End;
   }
   leave("catExpr");
 }
 
-void ParserState::dodash(BitSet *bitset) {
-  char first;
+// Collects the members of a class, a range taking the place of the single
+// member before its dash.
+void ParserState::dodash(Ranges *ranges) {
   for (; !in(currentToken, {tokEos, tokRightBracket}); advance()) {
-    if (currentToken != tokDash) {
-      first = lexeme;
-      bitset->set(lexeme);
+    if (currentToken != tokDash || ranges->empty()) {
+      ranges->emplace_back(lexeme, lexeme);
     } else {
       advance();
-      for (; first <= lexeme; ++first) {
-        bitset->set(first);
+      if (lexeme >= ranges->back().first) {
+        ranges->back().second = lexeme;
       }
     }
   }
@@ -425,28 +681,174 @@ void ParserState::expr(std::size_t *sp, std::size_t *ep) {
 }
 
 void ParserState::factor(std::size_t *sp, std::size_t *ep) {
-  std::size_t start;
-  std::size_t end;
   enter("factor");
   term(sp, ep);
-  if (in(currentToken, {tokStar, tokPlus, tokQuestionMark})) {
-    start = allocateNfaNode();
-    end = allocateNfaNode();
-    nfaStates[start].next[0] = *sp;
-    nfaStates[*ep].next[0] = end;
-    if (in(currentToken, {tokStar, tokQuestionMark})) {
-      nfaStates[start].next[1] = end;
-    }
-    if (in(currentToken, {tokStar, tokPlus})) {
-      nfaStates[*ep].next[1] = *sp;
+  // each quantifier applies to what the ones before it built, so a{2}{3}
+  // is six a's and a*? is a*
+  for (;;) {
+    if (currentToken == tokLeftBrace && readRepeat()) {
+      repeat(sp, ep);
+    } else if (in(currentToken, {tokStar, tokPlus, tokQuestionMark})) {
+      closure(currentToken, sp, ep);
+    } else {
+      break;
     }
-    *sp = start;
-    *ep = end;
     advance();
   }
   leave("factor");
 }
 
+// Wraps sp -> ep in the closure for tok, '*', '+' or '?'.
+void ParserState::closure(RegexToken tok, std::size_t *sp, std::size_t *ep) {
+  std::size_t start = allocateNfaNode();
+  std::size_t end = allocateNfaNode();
+  nfaStates[start].next[0] = *sp;
+  nfaStates[*ep].next[0] = end;
+  if (in(tok, {tokStar, tokQuestionMark})) {
+    nfaStates[start].next[1] = end;
+  }
+  if (in(tok, {tokStar, tokPlus})) {
+    nfaStates[*ep].next[1] = *sp;
+  }
+  *sp = start;
+  *ep = end;
+}
+
+// Reads the bounds of {m}, {m,}, {m,n} or {,n} once the '{' is the current
+// token. Anything else leaves the input alone and the '{' a literal.
+bool ParserState::readRepeat() {
+  std::string_view s = input;
+  auto count = [&s] {
+    int n = 0;
+    for (; !s.empty() && std::isdigit(static_cast<unsigned char>(s[0]));
+         s.remove_prefix(1)) {
+      n = n > repeatMaxCount ? n : n * 10 + s[0] - '0';
+    }
+    return n;
+  };
+  bool hasMin = std::isdigit(static_cast<unsigned char>(peek(s)));
+  int min = count();
+  int max = min;
+  if (peek(s) == ',') {
+    s.remove_prefix(1);
+    max = std::isdigit(static_cast<unsigned char>(peek(s))) ? count()
+                                                            : repeatUnbounded;
+    hasMin = hasMin || max != repeatUnbounded;
+  }
+  if (!hasMin || peek(s) != '}') {
+    return false;
+  }
+  if (min > repeatMaxCount || max > repeatMaxCount) {
+    throw std::runtime_error{
+        fmt::format("repetition count above {}.", repeatMaxCount)};
+  }
+  if (max != repeatUnbounded && min > max) {
+    throw std::runtime_error{fmt::format(
+        "bad repetition {{{},{}}}: the minimum is above the maximum.", min,
+        max)};
+  }
+  input = s.substr(1);
+  repeatMin = min;
+  repeatMax = max;
+  return true;
+}
+
+// Collects the nodes of the fragment at start into `fragment`, start first.
+// Nothing leaves a fragment but its end, which has no edges yet.
+void ParserState::fragmentNodes(std::size_t start) {
+  fragment.assign(1, start);
+  inFragment.assign(nfaStates.size(), false);
+  inFragment[start] = true;
+  for (std::size_t i = 0; i < fragment.size(); ++i) {
+    for (std::size_t next : nfaStates[fragment[i]].next) {
+      if (next != SIZE_MAX && !inFragment[next]) {
+        inFragment[next] = true;
+        fragment.push_back(next);
+      }
+    }
+  }
+}
+
+// Copies the fragment, returning the copy of its start and setting *ep to the
+// copy of end.
+std::size_t ParserState::cloneFragment(std::size_t end, std::size_t *ep) {
+  copyOf.assign(nfaStates.size(), SIZE_MAX);
+  for (std::size_t node : fragment) {
+    std::size_t n = allocateNfaNode();
+    // assigned in place, into a node whose class storage is already there
+    nfaStates[n] = nfaStates[node];
+    nfaStates[n].index = n;
+    copyOf[node] = n;
+  }
+  for (std::size_t node : fragment) {
+    for (std::size_t &next : nfaStates[copyOf[node]].next) {
+      next = next != SIZE_MAX ? copyOf[next] : SIZE_MAX;
+    }
+  }
+  *ep = copyOf[end];
+  return copyOf[fragment[0]];
+}
+
+// Expands sp -> ep for the {m,n} just read: m copies in a row, then n - m
+// nested optional ones that all leave through one exit, so x{2,4} is
+// xx(x(x)?)? and takes a linear number of nodes and edges. {m,} ends in x+,
+// or is x* for m = 0.
+void ParserState::repeat(std::size_t *sp, std::size_t *ep) {
+  int min = repeatMin;
+  int max = repeatMax;
+  fragmentNodes(*sp);
+  if (max == 0) {
+    for (std::size_t node : fragment) {
+      discardNfaNode(node);
+    }
+    // two nodes, as catExpr() discards the start of what it appends
+    *sp = allocateNfaNode();
+    *ep = allocateNfaNode();
+    nfaStates[*sp].next[0] = *ep;
+    return;
+  }
+  int copies = max != repeatUnbounded ? max : std::max(min, 1);
+  if (copies * fragment.size() > repeatMaxNodes) {
+    throw std::runtime_error{
+        fmt::format("repetition {{{},{}}} would take over {} NFA nodes.", min,
+                    max != repeatUnbounded ? std::to_string(max) : "",
+                    repeatMaxNodes)};
+  }
+  std::vector<std::size_t> &starts = copyStarts;
+  std::vector<std::size_t> &ends = copyEnds;
+  starts.assign(1, *sp);
+  ends.assign(1, *ep);
+  for (int i = 1; i < copies; ++i) {
+    std::size_t end;
+    starts.push_back(cloneFragment(*ep, &end));
+    ends.push_back(end);
+  }
+
+  // the next piece hangs from the end of the last one, or is the start
+  std::size_t last = SIZE_MAX;
+  auto attach = [&](std::size_t start, std::size_t end) {
+    (last == SIZE_MAX ? *sp : nfaStates[last].next[0]) = start;
+    last = end;
+  };
+  int mandatory = max != repeatUnbounded ? min : copies - 1;
+  for (int i = 0; i < mandatory; ++i) {
+    attach(starts[i], ends[i]);
+  }
+  if (max == repeatUnbounded) {
+    closure(min > 0 ? tokPlus : tokStar, &starts.back(), &ends.back());
+    attach(starts.back(), ends.back());
+  } else {
+    std::size_t out = allocateNfaNode();
+    for (int i = min; i < max; ++i) {
+      std::size_t fork = allocateNfaNode();
+      nfaStates[fork].next = {starts[i], out};
+      attach(fork, ends[i]);
+    }
+    attach(out, out);
+  }
+  *ep = last;
+}
+
 bool ParserState::firstInCat(RegexToken tok) {
   switch (tok) {
   case tokRightParen:
@@ -471,40 +873,61 @@ bool ParserState::firstInCat(RegexToken tok) {
 Nfa ParserState::machine() {
   enter("machine");
   std::size_t p = allocateNfaNode();
-  NfaNode *pn = &nfaStates[p];
   std::size_t start = p;
-  pn->next[0] = rule();
+  std::size_t r = rule();
+  nfaStates[p].next[0] = r;
   while (currentToken != tokEos) {
-    pn->next[1] = allocateNfaNode();
-    p = pn->next[1];
-    pn = &nfaStates[p];
-    pn->next[0] = rule();
+    std::size_t q = allocateNfaNode();
+    nfaStates[p].next[1] = q;
+    p = q;
+    r = rule();
+    nfaStates[p].next[0] = r;
+  }
+  for (std::size_t i = liveNfaStates; i < nfaStates.size(); ++i) {
+    nfaStates[i].index = -1;
   }
   leave("machine");
-  return Nfa{.nodes = nfaStates, .startState = start};
+  return Nfa{.nodes = std::move(nfaStates), .startState = start};
 }
 
+// '^' and '$' are zero-width: an epsilon node asserting what lies behind or
+// ahead, so a rule reads no newline and anchors hold at the ends of a line.
+// A leading (?i) or (?-i) turns case folding on or off for the rule.
 std::size_t ParserState::rule() {
   std::size_t start;
   std::size_t end;
   int anchor = anchorNone;
   enter("rule");
+  icase = icaseDefault;
+  if (currentToken == tokLeftParen && !inQuote &&
+      (input.starts_with("?i)") || input.starts_with("?-i)"))) {
+    icase = input[1] == 'i';
+    input.remove_prefix(icase ? 3 : 4);
+    advance();
+  }
   if (currentToken == tokCarat) {
     start = allocateNfaNode();
-    nfaStates[start].edge = '\n';
+    nfaStates[start].behind = behindLineStart;
     anchor |= anchorLineStart;
     advance();
-    expr(&nfaStates[start].next[0], &end);
-  } else {
+    std::size_t exprStart;
+    if (firstInCat(currentToken)) {
+      expr(&exprStart, &end);
+    } else {
+      exprStart = end = allocateNfaNode();
+    }
+    nfaStates[start].next[0] = exprStart;
+  } else if (firstInCat(currentToken)) {
     expr(&start, &end);
+  } else {
+    start = end = allocateNfaNode();
   }
   if (currentToken == tokDollar) {
     advance();
-    nfaStates[end].next[0] = allocateNfaNode();
-    nfaStates[end].edge = edgeCharacterClass;
-    nfaStates[end].bitset.set('\n');
-    nfaStates[end].bitset.set('\r');
-    end = nfaStates[end].next[0];
+    std::size_t eol = allocateNfaNode();
+    nfaStates[end].next[0] = eol;
+    nfaStates[end].ahead = aheadLineEnd;
+    end = eol;
     anchor |= anchorLineEnd;
   }
 
@@ -524,45 +947,620 @@ void ParserState::term(std::size_t *sp, std::size_t *ep) {
     } else {
       throw std::runtime_error{"Missing close parenthesis."};
     }
-  } else {
+  } else if (currentToken == tokWordBoundary) {
+    // a word byte on exactly one side: one assertion per side it is on
     std::size_t start = allocateNfaNode();
+    std::size_t before = allocateNfaNode();
+    std::size_t after = allocateNfaNode();
+    std::size_t end = allocateNfaNode();
+    nfaStates[start].next = {before, after};
+    nfaStates[before].behind = kindBit(kindWord);
+    nfaStates[before].ahead = notWord;
+    nfaStates[before].next[0] = end;
+    nfaStates[after].behind = notWord;
+    nfaStates[after].ahead = kindBit(kindWord);
+    nfaStates[after].next[0] = end;
     *sp = start;
-    *ep = nfaStates[start].next[0] = allocateNfaNode();
-
-    if (!in(currentToken, {tokDot, tokLeftBracket})) {
-      nfaStates[start].edge = lexeme;
+    *ep = end;
+    advance();
+  } else if (!in(currentToken, {tokDot, tokLeftBracket})) {
+    // a letter that folds becomes a class of its cases, which byte classes
+    // keep together, so folding adds no DFA states
+    ranges.assign(1, {lexeme, lexeme});
+    caseFold(&ranges);
+    if (ranges.size() > 1) {
+      characterClass(ranges, false, sp, ep);
+    } else {
+      literal(lexeme, sp, ep);
+    }
+    advance();
+  } else {
+    ranges.clear();
+    bool complement = currentToken == tokDot;
+    if (!complement) {
       advance();
+      if (currentToken == tokCarat) {
+        advance();
+        complement = true;
+      }
+      if (currentToken != tokRightBracket) {
+        dodash(&ranges);
+      } else {
+        ranges.emplace_back('\0', ' ');
+      }
+      caseFold(&ranges);
+    }
+    advance();
+    if (complement) {
+      // '.' and negated classes never match a line break
+      ranges.emplace_back('\n', '\n');
+      ranges.emplace_back('\r', '\r');
+    }
+    characterClass(ranges, complement, sp, ep);
+  }
+  leave("term");
+}
+
+// Adds the other case of every letter in ranges when the rule folds case.
+// Bytes past ASCII are no letters.
+void ParserState::caseFold(Ranges *ranges) const {
+  if (!icase) {
+    return;
+  }
+  std::size_t runs = utf8 ? caseRuns.size() : 1;
+  std::size_t size = ranges->size();
+  for (std::size_t i = 0; i < size; ++i) {
+    for (std::size_t r = 0; r < runs; ++r) {
+      auto [first, last, delta] = caseRuns[r];
+      // the upper case run maps up by delta, the lower case one back down
+      for (int shift : {0, delta}) {
+        int lo = std::max((*ranges)[i].first, first + shift);
+        int hi = std::min((*ranges)[i].second, last + shift);
+        if (lo <= hi) {
+          ranges->emplace_back(lo + delta - 2 * shift, hi + delta - 2 * shift);
+        }
+      }
+    }
+  }
+}
+
+// Builds start -> end over the character c: one edge per byte of its
+// encoding.
+void ParserState::literal(int c, std::size_t *sp, std::size_t *ep) {
+  std::array<unsigned char, 4> bytes{static_cast<unsigned char>(c)};
+  int length = utf8 ? utf8Encode(c, bytes) : 1;
+  std::size_t node = *sp = allocateNfaNode();
+  for (int i = 0; i < length; ++i) {
+    std::size_t next = allocateNfaNode();
+    nfaStates[node].edge = bytes[i];
+    nfaStates[node].next[0] = next;
+    node = next;
+  }
+  *ep = node;
+}
+
+// Builds the alternatives for n sequences that agree on their first depth
+// bytes, sharing the nodes for a common next byte, and returns the first.
+std::size_t ParserState::utf8Alternatives(const Utf8Sequence *sequences,
+                                          std::size_t n, int depth,
+                                          std::size_t end) {
+  std::size_t head = SIZE_MAX;
+  std::size_t fork = SIZE_MAX;
+  for (std::size_t i = 0; i < n;) {
+    int lo = sequences[i].lo[depth];
+    int hi = sequences[i].hi[depth];
+    std::size_t j = i + 1;
+    while (j < n && sequences[j].lo[depth] == lo &&
+           sequences[j].hi[depth] == hi) {
+      ++j;
+    }
+    std::size_t next = depth + 1 < sequences[i].length
+                           ? utf8Alternatives(sequences + i, j - i, depth + 1, end)
+                           : end;
+    std::size_t edge = allocateNfaNode();
+    nfaStates[edge].edge = edgeCharacterClass;
+    for (int c = lo; c <= hi; ++c) {
+      nfaStates[edge].bitset.set(c);
+    }
+    nfaStates[edge].next[0] = next;
+    std::size_t link = edge;
+    if (j < n) {
+      link = allocateNfaNode();
+      nfaStates[link].next[0] = edge;
+    }
+    if (fork == SIZE_MAX) {
+      head = link;
     } else {
-      nfaStates[start].edge = edgeCharacterClass;
-      if (currentToken == tokDot) {
-        nfaStates[start].bitset.set('\n');
-        nfaStates[start].bitset.set('\r');
-        nfaStates[start].bitset.complement();
+      nfaStates[fork].next[1] = link;
+    }
+    fork = link;
+    i = j;
+  }
+  return head;
+}
+
+// Builds start -> end over one character of a class: the ranges, or
+// everything else when complement is set. Bytes take a single class edge. In
+// UTF-8 mode so does ASCII, and the code points beyond it become alternatives
+// of byte sequences, so the matcher still reads bytes.
+void ParserState::characterClass(Ranges &ranges, bool complement,
+                                 std::size_t *sp, std::size_t *ep) {
+  std::size_t start = allocateNfaNode();
+  std::size_t end = allocateNfaNode();
+  nfaStates[start].edge = edgeCharacterClass;
+  nfaStates[start].next[0] = end;
+  *sp = start;
+  *ep = end;
+  if (!utf8) {
+    for (auto [lo, hi] : ranges) {
+      for (int c = lo; c <= hi; ++c) {
+        nfaStates[start].bitset.set(c);
+      }
+    }
+    if (complement) {
+      nfaStates[start].bitset.complement();
+    }
+    return;
+  }
+
+  // sort and merge, then take the complement and drop the surrogates
+  std::sort(ranges.begin(), ranges.end());
+  Ranges &merged = mergedRanges;
+  merged.clear();
+  for (auto [lo, hi] : ranges) {
+    if (!merged.empty() && lo <= merged.back().second + 1) {
+      merged.back().second = std::max(merged.back().second, hi);
+    } else {
+      merged.emplace_back(lo, hi);
+    }
+  }
+  if (complement) {
+    // the ranges read are done with, so they take the inverse
+    Ranges &inverse = ranges;
+    inverse.clear();
+    int next = 0;
+    for (auto [lo, hi] : merged) {
+      if (lo > next) {
+        inverse.emplace_back(next, lo - 1);
+      }
+      next = hi + 1;
+    }
+    if (next <= utf8Max) {
+      inverse.emplace_back(next, utf8Max);
+    }
+    merged.swap(inverse);
+  }
+  std::vector<Utf8Sequence> &sequences = utf8Sequences;
+  sequences.clear();
+  bool ascii = false;
+  auto add = [&](int lo, int hi) {
+    for (int c = lo; c <= hi && c < 0x80; ++c) {
+      nfaStates[start].bitset.set(c);
+      ascii = true;
+    }
+    if (hi >= 0x80) {
+      utf8Split(sequences, std::max(lo, 0x80), hi);
+    }
+  };
+  for (auto [lo, hi] : merged) {
+    if (lo <= surrogateLast && hi >= surrogateFirst) {
+      if (lo < surrogateFirst) {
+        add(lo, surrogateFirst - 1);
+      }
+      lo = surrogateLast + 1;
+    }
+    if (lo <= hi) {
+      add(lo, hi);
+    }
+  }
+  if (sequences.empty()) {
+    return;
+  }
+  std::size_t rest =
+      utf8Alternatives(sequences.data(), sequences.size(), 0, end);
+  nfaStates[start].edge = edgeEpsilon;
+  if (!ascii) {
+    nfaStates[start].next[0] = rest;
+    return;
+  }
+  std::size_t asciiEdge = allocateNfaNode();
+  nfaStates[asciiEdge].edge = edgeCharacterClass;
+  std::swap(nfaStates[asciiEdge].bitset, nfaStates[start].bitset);
+  nfaStates[asciiEdge].next[0] = end;
+  nfaStates[start].next = {asciiEdge, rest};
+}
+
+// Simulates the NFA directly, one state set per input byte. There is no DFA
+// in this implementation, so this is what the grep driver runs on. The states
+// entered at a position are only closed over epsilon edges once the byte after
+// it is known, since that is when every assertion can be checked.
+class NfaMatcher {
+  const Nfa &_nfa;
+  std::vector<std::size_t> _entered;
+  std::vector<std::size_t> _current;
+  std::vector<std::size_t> _stack;
+  // _marks[i] == _generation when state i is already in the set being built.
+  std::vector<unsigned> _marks;
+  unsigned _generation = 0;
+  int _behind = kindEdge;
+  // Every rule starts with '^', so a match can only begin at the start of a
+  // line, and only if the line starts with a byte in _lineFirst.
+  bool _bolAnchored;
+  std::array<bool, 256> _lineFirst{};
+
+  void beginSet() {
+    if (++_generation == 0) {
+      std::fill(_marks.begin(), _marks.end(), 0);
+      _generation = 1;
+    }
+  }
+
+  // Adds the byte-reading states reachable from state to _current, and
+  // returns whether the end of a rule is reachable.
+  bool addClosure(std::size_t state, int ahead) {
+    bool accepting = false;
+    _stack.push_back(state);
+    while (!_stack.empty()) {
+      std::size_t s = _stack.back();
+      _stack.pop_back();
+      if (s == SIZE_MAX || _marks[s] == _generation) {
+        continue;
+      }
+      _marks[s] = _generation;
+      const NfaNode &node = _nfa.nodes[s];
+      if (node.next[0] == SIZE_MAX) {
+        accepting = true;
+      } else if (node.edge == edgeEpsilon) {
+        if (node.holds(_behind, ahead)) {
+          _stack.push_back(node.next[1]);
+          _stack.push_back(node.next[0]);
+        }
       } else {
-        advance();
-        if (currentToken == tokCarat) {
-          advance();
-          nfaStates[start].bitset.set('\n');
-          nfaStates[start].bitset.set('\r');
-          nfaStates[start].bitset.complement();
+        _current.push_back(s);
+      }
+    }
+    return accepting;
+  }
+
+  static bool matches(const NfaNode &node, unsigned char c) {
+    if (node.edge == edgeCharacterClass) {
+      return node.bitset.get(c);
+    }
+    return node.edge == c;
+  }
+
+  static bool bolAnchored(const Nfa &nfa) {
+    for (const NfaNode &node : nfa.nodes) {
+      if (node.index != -1 && node.next[0] == SIZE_MAX &&
+          !(node.anchor & anchorLineStart)) {
+        return false;
+      }
+    }
+    return true;
+  }
+
+public:
+  explicit NfaMatcher(const Nfa &nfa)
+      : _nfa{nfa}, _marks(nfa.nodes.size(), 0), _bolAnchored{bolAnchored(nfa)} {
+    for (int c = 0; c < 256 && _bolAnchored; ++c) {
+      startLine();
+      if (close(byteKind(c))) {
+        // an empty match at the line start: every line matches
+        _lineFirst.fill(true);
+        break;
+      }
+      _lineFirst[c] = std::any_of(_current.begin(), _current.end(),
+                                  [&](std::size_t s) {
+                                    return matches(_nfa.nodes[s], c);
+                                  });
+    }
+  }
+
+  // Starts a new line, which follows a newline or the start of the input.
+  void startLine() {
+    _entered.assign(1, _nfa.startState);
+    _behind = kindNewline;
+  }
+
+  // Closes the states entered at the current position, ahead of which lies a
+  // byte of the given kind. True if a match ends here.
+  bool close(int ahead) {
+    _current.clear();
+    beginSet();
+    bool accepting = false;
+    for (std::size_t s : _entered) {
+      accepting |= addClosure(s, ahead);
+    }
+    return accepting;
+  }
+
+  // Moves past byte c. Unless every rule starts with '^', the start state is
+  // entered again after every byte so that a match can begin anywhere in the
+  // line. Returns false once no state is left.
+  bool step(unsigned char c) {
+    _entered.clear();
+    for (std::size_t s : _current) {
+      const NfaNode &node = _nfa.nodes[s];
+      if (matches(node, c)) {
+        _entered.push_back(node.next[0]);
+      }
+    }
+    if (!_bolAnchored) {
+      _entered.push_back(_nfa.startState);
+    }
+    _behind = byteKind(c);
+    return !_entered.empty();
+  }
+
+  // True if the line holds a match; its end looks like the edge of the input
+  // to '$'.
+  bool matchLine(std::string_view line) {
+    if (_bolAnchored && !line.empty() &&
+        !_lineFirst[static_cast<unsigned char>(line[0])]) {
+      return false;
+    }
+    startLine();
+    for (unsigned char c : line) {
+      if (close(byteKind(c))) {
+        return true;
+      }
+      if (!step(c)) {
+        return false;
+      }
+    }
+    return close(kindEdge);
+  }
+};
+
+// Maps a file read-only into memory for the life of the object. A file that
+// claims to be empty, as those in procfs do, is read to its end instead.
+class MappedFile {
+  const char *_data = nullptr;
+  std::size_t _size = 0;
+  std::string _contents;
+
+public:
+  explicit MappedFile(const char *path) {
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) {
+      throw std::runtime_error{fmt::format("{}: {}", path, std::strerror(errno))};
+    }
+    struct stat st;
+    if (fstat(fd, &st) < 0) {
+      int error = errno;
+      close(fd);
+      throw std::runtime_error{fmt::format("{}: {}", path, std::strerror(error))};
+    }
+    _size = st.st_size;
+    if (_size > 0) {
+      void *map = mmap(nullptr, _size, PROT_READ, MAP_PRIVATE, fd, 0);
+      if (map == MAP_FAILED) {
+        int error = errno;
+        close(fd);
+        throw std::runtime_error{fmt::format("{}: {}", path, std::strerror(error))};
+      }
+      madvise(map, _size, MADV_SEQUENTIAL);
+      _data = static_cast<const char *>(map);
+    } else {
+      char buffer[1 << 16];
+      ssize_t n;
+      while ((n = read(fd, buffer, sizeof(buffer))) != 0) {
+        if (n < 0 && errno == EINTR) {
+          continue;
         }
-        if (currentToken != tokRightBracket) {
-          dodash(&nfaStates[start].bitset);
-        } else {
-          for (char c = '\0'; c <= ' '; ++c) {
-            nfaStates[start].bitset.set(c);
-          }
+        if (n < 0) {
+          int error = errno;
+          close(fd);
+          throw std::runtime_error{fmt::format("{}: {}", path, std::strerror(error))};
         }
+        _contents.append(buffer, n);
       }
-      advance();
     }
+    close(fd);
   }
-  leave("term");
+  MappedFile(const MappedFile &) = delete;
+  MappedFile &operator=(const MappedFile &) = delete;
+  ~MappedFile() {
+    if (_data) {
+      munmap(const_cast<char *>(_data), _size);
+    }
+  }
+  std::string_view view() const {
+    return _data ? std::string_view{_data, _size} : std::string_view{_contents};
+  }
+};
+
+struct GrepOptions {
+  bool countOnly = false;
+  bool stats = false;
+  bool metrics = false;
+  bool printNfa = false;
+  bool utf8 = false;
+  bool icase = false;
+};
+
+// Prints (or counts) the lines of text that match. Returns the number of
+// matching lines.
+static std::size_t grep(NfaMatcher &matcher, std::string_view text,
+                        std::string_view label, const GrepOptions &options) {
+  std::size_t matches = 0;
+  while (!text.empty()) {
+    // memchr is vectorized in any libc worth using
+    const void *nl = std::memchr(text.data(), '\n', text.size());
+    std::size_t length =
+        nl ? static_cast<const char *>(nl) - text.data() : text.size();
+    std::string_view line = text.substr(0, length);
+    if (matcher.matchLine(line)) {
+      ++matches;
+      if (!options.countOnly) {
+        if (!label.empty()) {
+          fmt::print("{}:", label);
+        }
+        std::fwrite(line.data(), 1, line.size(), stdout);
+        std::putchar('\n');
+      }
+    }
+    text.remove_prefix(std::min(length + 1, text.size()));
+  }
+  return matches;
+}
+
+// Quotes text as a JSON string.
+static std::string jsonString(std::string_view text) {
+  std::string out{"\""};
+  for (unsigned char c : text) {
+    if (c == '"' || c == '\\') {
+      out += '\\';
+      out += c;
+    } else if (c < 0x20) {
+      out += fmt::format("\\u{:04x}", c);
+    } else {
+      out += c;
+    }
+  }
+  return out + "\"";
+}
+
+static void usage(std::FILE *fp) {
+  fmt::print(fp, "usage: regex-cpp [-c] [-i] [-u] [--stats] [--metrics] PATTERN "
+                 "[FILE...]\n"
+                 "       regex-cpp [-i] [-u] --nfa PATTERN\n"
+                 "\n"
+                 "Prints the lines of each FILE (standard input for none or "
+                 "\"-\") that\n"
+                 "contain a match for PATTERN.\n"
+                 "\n"
+                 "  -c, --count   print the number of matching lines instead\n"
+                 "  -i, --ignore-case\n"
+                 "                fold case, ASCII letters only unless -u is "
+                 "given; a\n"
+                 "                rule can start with (?i) or (?-i) to choose "
+                 "for itself\n"
+                 "  -u, --utf8    read PATTERN as UTF-8 and match characters "
+                 "rather\n"
+                 "                than bytes: '.', classes and \\x{{HHHH}} are "
+                 "code points\n"
+                 "      --stats   report timing and throughput on stderr\n"
+                 "      --metrics report the compilation on stderr as a line of "
+                 "JSON:\n"
+                 "                the time it took, the NFA states and the "
+                 "heap they\n"
+                 "                take\n"
+                 "      --nfa     print the NFA built for PATTERN\n");
 }
 
-int main() {
-  ParserState state;
-  auto nfa = state.thompson("^[ \\t]*//[ \\t]*TRACE[ \\t]*#[0-9]+[ \\t]*$");
-  std::cout << nfa << "\n";
-  return 0;
+int main(int argc, char *argv[]) {
+  GrepOptions options;
+  int i = 1;
+  for (; i < argc && argv[i][0] == '-' && argv[i][1] != '\0'; ++i) {
+    std::string_view arg = argv[i];
+    if (arg == "--") {
+      ++i;
+      break;
+    } else if (arg == "-c" || arg == "--count") {
+      options.countOnly = true;
+    } else if (arg == "-i" || arg == "--ignore-case") {
+      options.icase = true;
+    } else if (arg == "-u" || arg == "--utf8") {
+      options.utf8 = true;
+    } else if (arg == "--stats") {
+      options.stats = true;
+    } else if (arg == "--metrics") {
+      options.metrics = true;
+    } else if (arg == "--nfa") {
+      options.printNfa = true;
+    } else if (arg == "-h" || arg == "--help") {
+      usage(stdout);
+      return 0;
+    } else {
+      fmt::print(stderr, "regex-cpp: unknown option '{}'\n", arg);
+      usage(stderr);
+      return 2;
+    }
+  }
+  if (i == argc) {
+    usage(stderr);
+    return 2;
+  }
+
+  using clock = std::chrono::steady_clock;
+  ParserState state{options.utf8, options.icase};
+  Nfa nfa;
+  std::string_view pattern = argv[i++];
+  auto compileStart = clock::now();
+  try {
+    nfa = state.thompson(pattern);
+  } catch (const std::runtime_error &e) {
+    fmt::print(stderr, "regex-cpp: {}\n", e.what());
+    return 2;
+  }
+  std::chrono::duration<double> compileTime = clock::now() - compileStart;
+  if (options.metrics) {
+    // the parser builds the Thompson NFA as it goes, so parsing is all there
+    // is to a compilation
+    std::size_t nfaBytes = sizeof(NfaNode) * nfa.nodes.capacity();
+    for (const NfaNode &node : nfa.nodes) {
+      nfaBytes += node.bitset.bytes();
+    }
+    fmt::print(stderr,
+               "{{\"compilation\": \"search\", \"pattern\": {}, \"seconds\": "
+               "{{\"parse\": {:.9f}}}, \"nfa_states\": {}, \"bytes\": {{\"nfa\": "
+               "{}}}}}\n",
+               jsonString(pattern), compileTime.count(), nfa.nodes.size(),
+               nfaBytes);
+  }
+  if (options.printNfa) {
+    std::cout << nfa << "\n";
+    return 0;
+  }
+
+  NfaMatcher matcher{nfa};
+  std::vector<std::string_view> files{argv + i, argv + argc};
+  if (files.empty()) {
+    files.push_back("-");
+  }
+  std::string standardInput;
+  std::size_t totalBytes = 0;
+  std::size_t totalMatches = 0;
+  bool failed = false;
+  auto scanStart = clock::now();
+  for (std::string_view file : files) {
+    std::string_view label = files.size() > 1 ? file : std::string_view{};
+    std::size_t matches;
+    try {
+      if (file == "-") {
+        standardInput.assign(std::istreambuf_iterator<char>{std::cin}, {});
+        matches = grep(matcher, standardInput, label, options);
+        totalBytes += standardInput.size();
+      } else {
+        MappedFile mapped{std::string{file}.c_str()};
+        matches = grep(matcher, mapped.view(), label, options);
+        totalBytes += mapped.view().size();
+      }
+    } catch (const std::runtime_error &e) {
+      fmt::print(stderr, "regex-cpp: {}\n", e.what());
+      failed = true;
+      continue;
+    }
+    if (options.countOnly) {
+      if (!label.empty()) {
+        fmt::print("{}:", label);
+      }
+      fmt::print("{}\n", matches);
+    }
+    totalMatches += matches;
+  }
+  std::fflush(stdout);
+  std::chrono::duration<double> scanTime = clock::now() - scanStart;
+
+  if (options.stats) {
+    fmt::print(stderr,
+               "// nfa states: {}; compiled in {:.3f} ms; scanned {} bytes in "
+               "{:.9f} s ({:.1f} MB/s), {} matching lines\n",
+               nfa.nodes.size(), compileTime.count() * 1e3, totalBytes,
+               scanTime.count(),
+               scanTime.count() > 0 ? totalBytes / scanTime.count() / 1e6 : 0.0,
+               totalMatches);
+  }
+  return failed ? 2 : totalMatches > 0 ? 0 : 1;
 }
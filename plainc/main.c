@@ -1,11 +1,36 @@
+#define _GNU_SOURCE
 #include <bitset.h>
+#include <ctype.h>
+#include <errno.h>
+#include <fcntl.h>
 #include <stdarg.h>
 #include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
 #include <vec.h>
 
-#define bitset_equals(b1, b2) bitset_intersection_count(b1, b2) == bitset_count(b1)
+#if defined(__linux__)
+#include <linux/io_uring.h>
+#include <sys/syscall.h>
+#if defined(__NR_io_uring_setup) && defined(__NR_io_uring_enter)
+#define HAVE_IO_URING 1
+#endif
+#endif
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define HAVE_X86_SIMD 1
+#endif
+
+#define bitset_equals(b1, b2)                                                                                          \
+    (bitset_count(b1) == bitset_count(b2) && bitset_intersection_count(b1, b2) == bitset_count(b1))
 
 #define EDGE_EMPTY (-3)
 #define EDGE_CHARACTER_CLASS (-2)
@@ -16,6 +41,30 @@
 #define ANCHOR_EOL (1 << 1)
 #define ANCHOR_BOTH (ANCHOR_BOL | ANCHOR_EOL)
 
+// Capture tags ride on epsilon nodes: passing through a tagged node records
+// the current position in capture slot tag - 1, so group g spans slots 2g and
+// 2g + 1. Group 0 is the whole match.
+#define TAG_NONE 0
+#define TAG_OPEN(group) (2 * (group) + 1)
+#define TAG_CLOSE(group) (2 * (group) + 2)
+
+// What can sit on either side of a position, for zero-width assertions:
+// KIND_EDGE is the start or the end of the input.
+#define KIND_EDGE 0
+#define KIND_NEWLINE 1
+#define KIND_RETURN 2
+#define KIND_WORD 3
+#define KIND_OTHER 4
+#define KINDS 5
+#define KIND_BIT(kind) (1 << (kind))
+#define KIND_UNKNOWN (-1) // the next byte has not been read yet
+
+// '^' holds after a newline, '$' before a newline or carriage return, and
+// both at the edges of the input.
+#define BEHIND_LINE_START (KIND_BIT(KIND_EDGE) | KIND_BIT(KIND_NEWLINE))
+#define AHEAD_LINE_END (KIND_BIT(KIND_EDGE) | KIND_BIT(KIND_NEWLINE) | KIND_BIT(KIND_RETURN))
+#define NOT_WORD (KIND_BIT(KIND_EDGE) | KIND_BIT(KIND_NEWLINE) | KIND_BIT(KIND_RETURN) | KIND_BIT(KIND_OTHER))
+
 typedef struct nfa_node_t
 {
     struct nfa_node_t *next[2];
@@ -23,7 +72,14 @@ typedef struct nfa_node_t
     bitset_t *bitset;
     bool complement;
     int anchor;
+    int tag;
+    // An epsilon node may assert what lies on either side of the position
+    // before its edges can be taken: the kinds allowed behind and ahead, as
+    // KIND_BIT() masks, 0 for no constraint.
+    int behind;
+    int ahead;
     int index;
+    int rule; // on the end of a rule, which one, counting from 0
 } nfa_node_t;
 
 typedef vec_t(nfa_node_t *) vec_nfa_node_t;
@@ -32,14 +88,74 @@ typedef struct
 {
     vec_nfa_node_t nfa;
     size_t start;
+    int groups; // capture groups, counting group 0
+    int nrules;
+    bool rule_sets; // DFA states record which rules they accept
 } nfa_t;
 
-static nfa_t thompson(const char *input);
+static nfa_t thompson(const char *input, bool utf8, bool icase);
 static void nfa_print(nfa_t *nfa);
 
+// The phases of a compilation, in pipeline order. The parser builds the
+// Thompson NFA as it goes, so "parse" covers both; "closure" is the part of
+// "subset" spent closing state sets over epsilon edges.
+typedef enum
+{
+    PHASE_PARSE,
+    PHASE_NFA, // reversing it, tagging it for captures, looping it for a search
+    PHASE_PLAN,
+    PHASE_SUBSET,
+    PHASE_CLOSURE,
+    PHASE_MINIMIZE,
+    PHASE_TRIE,   // a literal set's automaton, in place of subset construction
+    PHASE_TABLES, // the scanner's transition tables, accelerations and strides
+    PHASE_TDFA,
+    PHASE_EMIT, // the C source of --tables and --lex
+    PHASES,
+} compile_phase_t;
+
+static const char *const compile_phase_names[] = {
+    "parse", "nfa", "plan", "subset", "closure", "minimize", "trie", "tables", "tdfa", "emit",
+};
+
+// What a compilation took, summed over every automaton it builds: the
+// scanner, its reverse and the tagged DFA.
+typedef struct
+{
+    double seconds[PHASES];
+    long closures; // nfa_closure() calls
+    long moves;    // DFA states stepped over a byte class
+    int nfa_states;
+    int dfa_states;
+    int min_dfa_states;
+    size_t nfa_bytes;
+    size_t dfa_bytes; // subset construction's, see nfa_to_dfa()
+    size_t table_bytes;
+} compile_metrics_t;
+
+// The metrics of the compilation under way, NULL when none is measured; the
+// instrumented steps then cost a test of this pointer.
+static compile_metrics_t *metrics;
+
+static double seconds_now(void);
+
+static double metrics_start(void)
+{
+    return metrics ? seconds_now() : 0;
+}
+
+static void metrics_stop(compile_phase_t phase, double start)
+{
+    if (metrics)
+    {
+        metrics->seconds[phase] += seconds_now() - start;
+    }
+}
+
 typedef enum
 {
     tok_eoi,
+    tok_left_brace,
     tok_left_bracket,
     tok_right_bracket,
     tok_left_paren,
@@ -53,6 +169,7 @@ typedef enum
     tok_plus,
     tok_question_mark,
     tok_star,
+    tok_word_boundary,
 } regex_token_t;
 
 typedef struct
@@ -62,8 +179,16 @@ typedef struct
     const char *input;
     const char *input_start;
     regex_token_t current_token;
-    char current_lexeme;
+    int current_lexeme; // a byte, or a code point in UTF-8 mode
     bool in_quote;
+    bool utf8;
+    bool icase;         // fold case in the rule being parsed
+    bool icase_default; // ...and in rules that do not say
+    int groups;
+    int rules;
+    // the bounds of the {m,n} just read, max REPEAT_UNBOUNDED for {m,}
+    int repeat_min;
+    int repeat_max;
 } nfa_parser_state_t;
 
 static nfa_node_t *alloc_nfa(nfa_parser_state_t *state)
@@ -96,7 +221,7 @@ static void discard_nfa(nfa_parser_state_t *state, nfa_node_t *node)
     state->nfa.data[index] = NULL;
 }
 
-static regex_token_t regex_token_from_char(char c)
+static regex_token_t regex_token_from_char(int c)
 {
     switch (c)
     {
@@ -114,6 +239,8 @@ static regex_token_t regex_token_from_char(char c)
         return tok_dash;
     case '.':
         return tok_dot;
+    case '{':
+        return tok_left_brace;
     case '?':
         return tok_question_mark;
     case '[':
@@ -136,11 +263,87 @@ static void nfa_parser_state_init(nfa_parser_state_t *state, const char *input)
     state->current_lexeme = '\0';
     state->current_token = tok_eoi;
     state->in_quote = false;
+    state->utf8 = false;
+    state->icase = state->icase_default = false;
     state->input = input;
     state->input_start = input;
+    state->groups = 1;
+}
+
+#define UTF8_MAX 0x10FFFF
+#define SURROGATE_FIRST 0xD800
+#define SURROGATE_LAST 0xDFFF
+
+// Decodes the UTF-8 sequence at *input, leaving *input on its last byte.
+static int utf8_decode(const char **input)
+{
+    const unsigned char *p = (const unsigned char *)*input;
+    int length = p[0] < 0x80 ? 1 : p[0] < 0xC2 ? 0 : p[0] < 0xE0 ? 2 : p[0] < 0xF0 ? 3 : p[0] < 0xF5 ? 4 : 0;
+    int c = length == 1 ? p[0] : p[0] & (0x7F >> length);
+    for (int i = 1; i < length; ++i)
+    {
+        if ((p[i] & 0xC0) != 0x80)
+        {
+            length = 0;
+            break;
+        }
+        c = c << 6 | (p[i] & 0x3F);
+    }
+    // overlong, surrogate and out of range encodings are invalid too
+    static const int least[] = {0, 0, 0x80, 0x800, 0x10000};
+    if (length == 0 || c < least[length] || c > UTF8_MAX || (SURROGATE_FIRST <= c && c <= SURROGATE_LAST))
+    {
+        fprintf(stderr, "invalid UTF-8 in the pattern\n");
+        exit(2);
+    }
+    *input += length - 1;
+    return c;
+}
+
+// Encodes code point c into out, returning the number of bytes.
+static int utf8_encode(int c, unsigned char out[4])
+{
+    if (c < 0x80)
+    {
+        out[0] = c;
+        return 1;
+    }
+    int length = c < 0x800 ? 2 : c < 0x10000 ? 3 : 4;
+    for (int i = length - 1; i > 0; --i)
+    {
+        out[i] = 0x80 | (c & 0x3F);
+        c >>= 6;
+    }
+    out[0] = (0xF00 >> length) | c;
+    return length;
 }
 
-static char esc(const char **input)
+// Reads the hex digits of \xHH or \x{H...}, leaving *input on the last
+// character of the escape. The value is a byte, or a code point in UTF-8 mode.
+static int hex_escape(const char **input, bool utf8)
+{
+    bool braced = (*input)[1] == '{';
+    int max = braced ? 8 : 2;
+    int c = 0;
+    int digits = 0;
+    const char *p = *input + 1 + braced;
+    for (; digits < max && isxdigit((unsigned char)*p); ++digits, ++p)
+    {
+        c = c << 4 | (isdigit((unsigned char)*p) ? *p - '0' : (*p | 0x20) - 'a' + 10);
+    }
+    if (digits == 0 || (braced && *p != '}') || c > (utf8 ? UTF8_MAX : 0xFF) ||
+        (utf8 && SURROGATE_FIRST <= c && c <= SURROGATE_LAST))
+    {
+        fprintf(stderr, "bad hex escape in the pattern\n");
+        exit(2);
+    }
+    *input = braced ? p : p - 1;
+    return c;
+}
+
+// Reads one character of the pattern, leaving *input on its last byte: a
+// byte, or in UTF-8 mode a whole code point.
+static int esc(const char **input, bool utf8)
 {
     if (**input == '\\')
     {
@@ -153,9 +356,11 @@ static char esc(const char **input)
             return '\n';
         case 'r':
             return '\r';
+        case 'x':
+            return hex_escape(input, utf8);
         }
     }
-    return **input;
+    return utf8 ? utf8_decode(input) : (unsigned char)**input;
 }
 
 static regex_token_t advance(nfa_parser_state_t *state)
@@ -180,7 +385,7 @@ static regex_token_t advance(nfa_parser_state_t *state)
     bool saw_esc = *state->input == '\\';
     if (!state->in_quote)
     {
-        state->current_lexeme = esc(&state->input);
+        state->current_lexeme = esc(&state->input, state->utf8);
         ++state->input;
     }
     else
@@ -192,19 +397,27 @@ static regex_token_t advance(nfa_parser_state_t *state)
         }
         else
         {
-            state->current_lexeme = *state->input;
+            state->current_lexeme = state->utf8 ? utf8_decode(&state->input) : (unsigned char)*state->input;
             ++state->input;
         }
     }
     state->current_token = (state->in_quote || saw_esc) ? tok_literal : regex_token_from_char(state->current_lexeme);
+    if (saw_esc && !state->in_quote && state->current_lexeme == 'b')
+    {
+        state->current_token = tok_word_boundary;
+    }
     return state->current_token;
 }
 
 static void cat_expr(nfa_parser_state_t *state, nfa_node_t **sptr, nfa_node_t **eptr);
-static void do_dash(nfa_parser_state_t *state, bitset_t *set);
+static void class_nfa(nfa_parser_state_t *state, vec_int_t *ranges, bool complement, nfa_node_t **sptr,
+                      nfa_node_t **eptr);
+static void do_dash(nfa_parser_state_t *state, vec_int_t *ranges);
+static void case_fold(const nfa_parser_state_t *state, vec_int_t *ranges);
 static void expr(nfa_parser_state_t *state, nfa_node_t **sptr, nfa_node_t **eptr);
 static void factor(nfa_parser_state_t *state, nfa_node_t **sptr, nfa_node_t **eptr);
 static bool first_in_cat(regex_token_t token);
+static void literal_nfa(nfa_parser_state_t *state, int c, nfa_node_t **sptr, nfa_node_t **eptr);
 static nfa_node_t *machine(nfa_parser_state_t *state);
 static nfa_node_t *rule(nfa_parser_state_t *state);
 static void term(nfa_parser_state_t *state, nfa_node_t **sptr, nfa_node_t **eptr);
@@ -225,37 +438,58 @@ static nfa_node_t *machine(nfa_parser_state_t *state)
     return start;
 }
 
+// '^' and '$' are zero-width: an epsilon node asserting what lies behind or
+// ahead, so a rule reads no newline and anchors hold at the edges of the input.
+// A rule that starts with (?i) folds case, and one that starts with (?-i) does
+// not, whatever the pattern was compiled with.
 static nfa_node_t *rule(nfa_parser_state_t *state)
 {
     nfa_node_t *start = NULL;
     nfa_node_t *end = NULL;
     int anchor = ANCHOR_NONE;
+    state->icase = state->icase_default;
+    if (state->current_token == tok_left_paren && !state->in_quote &&
+        (strncmp(state->input, "?i)", 3) == 0 || strncmp(state->input, "?-i)", 4) == 0))
+    {
+        state->icase = state->input[1] == 'i';
+        state->input += state->icase ? 3 : 4;
+        advance(state);
+    }
     if (state->current_token == tok_carat)
     {
         start = alloc_nfa(state);
-        start->edge = '\n';
+        start->behind = BEHIND_LINE_START;
         anchor |= ANCHOR_BOL;
         advance(state);
-        expr(state, &start->next[0], &end);
+        if (first_in_cat(state->current_token))
+        {
+            expr(state, &start->next[0], &end);
+        }
+        else
+        {
+            end = start->next[0] = alloc_nfa(state);
+        }
     }
-    else
+    else if (first_in_cat(state->current_token))
     {
         expr(state, &start, &end);
     }
+    else
+    {
+        start = end = alloc_nfa(state);
+    }
 
     if (state->current_token == tok_dollar)
     {
         advance(state);
+        end->ahead = AHEAD_LINE_END;
         end->next[0] = alloc_nfa(state);
-        end->edge = EDGE_CHARACTER_CLASS;
-        end->bitset = bitset_create();
-        bitset_set(end->bitset, '\n');
-        bitset_set(end->bitset, '\r');
         end = end->next[0];
         anchor |= ANCHOR_EOL;
     }
 
     end->anchor = anchor;
+    end->rule = state->rules++;
     advance(state);
     return start;
 }
@@ -291,7 +525,13 @@ static void cat_expr(nfa_parser_state_t *state, nfa_node_t **sptr, nfa_node_t **
         nfa_node_t *e2_start;
         nfa_node_t *e2_end;
         factor(state, &e2_start, &e2_end);
+        // the end node takes over e2_start's edge but keeps its own index,
+        // and hands its old bitset to the node being discarded
+        int index = (*eptr)->index;
+        bitset_t *bitset = (*eptr)->bitset;
         memcpy(*eptr, e2_start, sizeof(nfa_node_t));
+        (*eptr)->index = index;
+        e2_start->bitset = bitset;
         discard_nfa(state, e2_start);
         *eptr = e2_end;
     }
@@ -308,44 +548,252 @@ static bool first_in_cat(regex_token_t token)
         return false;
     case tok_star:
         fprintf(stderr, "'*' must follow an expression.\n");
-        exit(1);
+        exit(2);
     case tok_plus:
         fprintf(stderr, "'+' must follow an expression.\n");
-        exit(1);
+        exit(2);
     case tok_question_mark:
         fprintf(stderr, "'?' must follow an expression.\n");
-        exit(1);
+        exit(2);
     case tok_right_bracket:
         fprintf(stderr, "encountered a stray ']'\n");
-        exit(1);
+        exit(2);
     case tok_carat:
         fprintf(stderr, "encountered a stray '^'\n");
-        exit(1);
+        exit(2);
     default:
         return true;
     }
 }
 
+// Wraps sptr -> eptr in the closure for token, '*', '+' or '?'.
+static void closure(nfa_parser_state_t *state, regex_token_t token, nfa_node_t **sptr, nfa_node_t **eptr)
+{
+    // next[0] is the preferred edge when tags are resolved, so going round
+    // the loop again comes before leaving it: closures are greedy
+    nfa_node_t *start = alloc_nfa(state);
+    nfa_node_t *end = alloc_nfa(state);
+    start->next[0] = *sptr;
+    (*eptr)->next[0] = end;
+    if (token == tok_star || token == tok_question_mark)
+    {
+        start->next[1] = end;
+    }
+    if (token == tok_star || token == tok_plus)
+    {
+        (*eptr)->next[0] = *sptr;
+        (*eptr)->next[1] = end;
+    }
+    *sptr = start;
+    *eptr = end;
+}
+
+#define REPEAT_MAX 1000         // the largest count {m,n} takes
+#define REPEAT_UNBOUNDED (-1)   // the max of {m,}
+#define REPEAT_MAX_NODES 262144 // the NFA nodes a repetition may expand to
+
+static int read_count(const char **p)
+{
+    int n = 0;
+    for (; isdigit((unsigned char)**p); ++*p)
+    {
+        n = n > REPEAT_MAX ? n : n * 10 + **p - '0';
+    }
+    return n;
+}
+
+// Reads the bounds of {m}, {m,}, {m,n} or {,n} once the '{' is the current
+// token, into repeat_min and repeat_max. Anything else leaves the input alone
+// and the '{' a literal.
+static bool read_repeat(nfa_parser_state_t *state)
+{
+    const char *p = state->input;
+    bool has_min = isdigit((unsigned char)*p);
+    int min = read_count(&p);
+    int max = min;
+    if (*p == ',')
+    {
+        ++p;
+        max = isdigit((unsigned char)*p) ? read_count(&p) : REPEAT_UNBOUNDED;
+        has_min = has_min || max != REPEAT_UNBOUNDED;
+    }
+    if (!has_min || *p != '}')
+    {
+        return false;
+    }
+    if (min > REPEAT_MAX || max > REPEAT_MAX)
+    {
+        fprintf(stderr, "regex-plainc: repetition count above %d\n", REPEAT_MAX);
+        exit(2);
+    }
+    if (max != REPEAT_UNBOUNDED && min > max)
+    {
+        fprintf(stderr, "regex-plainc: bad repetition {%d,%d}: the minimum is above the maximum\n", min, max);
+        exit(2);
+    }
+    state->input = p + 1;
+    state->repeat_min = min;
+    state->repeat_max = max;
+    return true;
+}
+
+// Gathers the nodes of the fragment at start, start first. Nothing leaves a
+// fragment but its end, which has no edges yet.
+static void fragment_nodes(nfa_node_t *start, vec_nfa_node_t *nodes)
+{
+    bitset_t *seen = bitset_create();
+    vec_push(nodes, start);
+    bitset_set(seen, start->index);
+    for (int i = 0; i < nodes->length; ++i)
+    {
+        for (int j = 0; j <= 1; ++j)
+        {
+            nfa_node_t *p = nodes->data[i]->next[j];
+            if (p && !bitset_get(seen, p->index))
+            {
+                bitset_set(seen, p->index);
+                vec_push(nodes, p);
+            }
+        }
+    }
+    bitset_free(seen);
+}
+
+// Copies the fragment made of nodes, returning the copy of its start and
+// setting *eptr to the copy of end.
+static nfa_node_t *clone_fragment(nfa_parser_state_t *state, const vec_nfa_node_t *nodes, nfa_node_t *end,
+                                  nfa_node_t **eptr)
+{
+    int indices = 0;
+    for (int i = 0; i < nodes->length; ++i)
+    {
+        indices = nodes->data[i]->index >= indices ? nodes->data[i]->index + 1 : indices;
+    }
+    nfa_node_t **copy_of = calloc(indices, sizeof(nfa_node_t *));
+    for (int i = 0; i < nodes->length; ++i)
+    {
+        nfa_node_t *node = nodes->data[i];
+        nfa_node_t *copy = alloc_nfa(state);
+        int index = copy->index;
+        bitset_free(copy->bitset);
+        memcpy(copy, node, sizeof(nfa_node_t));
+        copy->index = index;
+        copy->bitset = bitset_copy(node->bitset);
+        copy_of[node->index] = copy;
+    }
+    for (int i = 0; i < nodes->length; ++i)
+    {
+        nfa_node_t *copy = copy_of[nodes->data[i]->index];
+        for (int j = 0; j <= 1; ++j)
+        {
+            copy->next[j] = copy->next[j] ? copy_of[copy->next[j]->index] : NULL;
+        }
+    }
+    nfa_node_t *start = copy_of[nodes->data[0]->index];
+    *eptr = copy_of[end->index];
+    free(copy_of);
+    return start;
+}
+
+// Expands sptr -> eptr for the {m,n} just read: m copies in a row, then n - m
+// nested optional ones that all leave through one exit, so x{2,4} is
+// xx(x(x)?)? and takes a linear number of nodes and edges. {m,} ends in x+,
+// or is x* for m = 0. Groups inside keep their number in every copy.
+static void repeat(nfa_parser_state_t *state, nfa_node_t **sptr, nfa_node_t **eptr)
+{
+    int min = state->repeat_min;
+    int max = state->repeat_max;
+    vec_nfa_node_t nodes;
+    vec_init(&nodes);
+    fragment_nodes(*sptr, &nodes);
+    if (max == 0)
+    {
+        for (int i = 0; i < nodes.length; ++i)
+        {
+            discard_nfa(state, nodes.data[i]);
+        }
+        vec_deinit(&nodes);
+        // two nodes, as cat_expr() discards the start of what it appends
+        *sptr = alloc_nfa(state);
+        *eptr = (*sptr)->next[0] = alloc_nfa(state);
+        return;
+    }
+    int copies = max != REPEAT_UNBOUNDED ? max : min > 0 ? min : 1;
+    if ((long)copies * nodes.length > REPEAT_MAX_NODES)
+    {
+        if (max == REPEAT_UNBOUNDED)
+        {
+            fprintf(stderr, "regex-plainc: repetition {%d,} would take over %d NFA nodes\n", min, REPEAT_MAX_NODES);
+        }
+        else
+        {
+            fprintf(stderr, "regex-plainc: repetition {%d,%d} would take over %d NFA nodes\n", min, max,
+                    REPEAT_MAX_NODES);
+        }
+        exit(2);
+    }
+    nfa_node_t **starts = malloc(copies * sizeof(nfa_node_t *));
+    nfa_node_t **ends = malloc(copies * sizeof(nfa_node_t *));
+    starts[0] = *sptr;
+    ends[0] = *eptr;
+    for (int i = 1; i < copies; ++i)
+    {
+        starts[i] = clone_fragment(state, &nodes, *eptr, &ends[i]);
+    }
+    vec_deinit(&nodes);
+
+    // hole is the edge the next piece hangs from
+    nfa_node_t **hole = sptr;
+    int mandatory = max != REPEAT_UNBOUNDED ? min : copies - 1;
+    for (int i = 0; i < mandatory; ++i)
+    {
+        *hole = starts[i];
+        hole = &ends[i]->next[0];
+    }
+    if (max == REPEAT_UNBOUNDED)
+    {
+        closure(state, min > 0 ? tok_plus : tok_star, &starts[copies - 1], &ends[copies - 1]);
+        *hole = starts[copies - 1];
+        *eptr = ends[copies - 1];
+    }
+    else
+    {
+        nfa_node_t *out = alloc_nfa(state);
+        for (int i = min; i < max; ++i)
+        {
+            nfa_node_t *fork = alloc_nfa(state);
+            fork->next[0] = starts[i];
+            fork->next[1] = out;
+            *hole = fork;
+            hole = &ends[i]->next[0];
+        }
+        *hole = out;
+        *eptr = out;
+    }
+    free(starts);
+    free(ends);
+}
+
 static void factor(nfa_parser_state_t *state, nfa_node_t **sptr, nfa_node_t **eptr)
 {
     term(state, sptr, eptr);
-    if (state->current_token == tok_star || state->current_token == tok_plus ||
-        state->current_token == tok_question_mark)
+    // each quantifier applies to what the ones before it built, so a{2}{3}
+    // is six a's and a*? is a*
+    for (;;)
     {
-        nfa_node_t *start = alloc_nfa(state);
-        nfa_node_t *end = alloc_nfa(state);
-        start->next[0] = *sptr;
-        (*eptr)->next[0] = end;
-        if (state->current_token == tok_star || state->current_token == tok_question_mark)
+        if (state->current_token == tok_left_brace && read_repeat(state))
         {
-            start->next[1] = end;
+            repeat(state, sptr, eptr);
         }
-        if (state->current_token == tok_star || state->current_token == tok_plus)
+        else if (state->current_token == tok_star || state->current_token == tok_plus ||
+                 state->current_token == tok_question_mark)
         {
-            (*eptr)->next[1] = *sptr;
+            closure(state, state->current_token, sptr, eptr);
+        }
+        else
+        {
+            break;
         }
-        *sptr = start;
-        *eptr = end;
         advance(state);
     }
 }
@@ -354,844 +802,7473 @@ static void term(nfa_parser_state_t *state, nfa_node_t **sptr, nfa_node_t **eptr
 {
     if (state->current_token == tok_left_paren)
     {
+        // (e) becomes open -> e -> close, the tags numbering groups in the
+        // order their parentheses open; the close tag goes on e's end node and
+        // a fresh end follows it, as cat_expr() overwrites the end it is given
+        int group = state->groups++;
+        nfa_node_t *open = alloc_nfa(state);
+        nfa_node_t *close;
+        open->tag = TAG_OPEN(group);
         advance(state);
-        expr(state, sptr, eptr);
+        expr(state, &open->next[0], &close);
         if (state->current_token == tok_right_paren)
         {
             advance(state);
         }
         else
         {
-            fprintf(stderr, "Expected ')'");
-            exit(1);
+            fprintf(stderr, "Expected ')'\n");
+            exit(2);
         }
+        close->tag = TAG_CLOSE(group);
+        close->next[0] = alloc_nfa(state);
+        *sptr = open;
+        *eptr = close->next[0];
     }
-    else
+    else if (state->current_token == tok_word_boundary)
     {
+        // a word byte on exactly one side: one assertion per side it is on
         nfa_node_t *start = alloc_nfa(state);
+        nfa_node_t *before = alloc_nfa(state);
+        nfa_node_t *after = alloc_nfa(state);
+        nfa_node_t *end = alloc_nfa(state);
+        start->next[0] = before;
+        start->next[1] = after;
+        before->behind = KIND_BIT(KIND_WORD);
+        before->ahead = NOT_WORD;
+        before->next[0] = end;
+        after->behind = NOT_WORD;
+        after->ahead = KIND_BIT(KIND_WORD);
+        after->next[0] = end;
         *sptr = start;
-        *eptr = start->next[0] = alloc_nfa(state);
-        if (state->current_token != tok_dot && state->current_token != tok_left_bracket)
+        *eptr = end;
+        advance(state);
+    }
+    else if (state->current_token != tok_dot && state->current_token != tok_left_bracket)
+    {
+        // a letter that folds becomes a class of its cases, which byte
+        // classes keep together, so folding adds no DFA states
+        vec_int_t ranges;
+        vec_init(&ranges);
+        vec_push(&ranges, state->current_lexeme);
+        vec_push(&ranges, state->current_lexeme);
+        case_fold(state, &ranges);
+        if (ranges.length > 2)
         {
-            start->edge = state->current_lexeme;
-            advance(state);
+            class_nfa(state, &ranges, false, sptr, eptr);
         }
         else
         {
-            start->edge = EDGE_CHARACTER_CLASS;
-            start->bitset = bitset_create();
-            if (state->current_token == tok_dot)
+            literal_nfa(state, state->current_lexeme, sptr, eptr);
+        }
+        vec_deinit(&ranges);
+        advance(state);
+    }
+    else
+    {
+        vec_int_t ranges;
+        vec_init(&ranges);
+        bool complement = state->current_token == tok_dot;
+        if (!complement)
+        {
+            advance(state);
+            if (state->current_token == tok_carat)
+            {
+                advance(state);
+                complement = true;
+            }
+            if (state->current_token != tok_right_bracket)
             {
-                bitset_set(start->bitset, '\n');
-                bitset_set(start->bitset, '\r');
-                start->complement = true;
+                do_dash(state, &ranges);
             }
             else
             {
-                advance(state);
-                if (state->current_token == tok_carat)
-                {
-                    advance(state);
-                    bitset_set(start->bitset, '\n');
-                    bitset_set(start->bitset, '\r');
-                    start->complement = true;
-                }
-                if (state->current_token != tok_right_bracket)
-                {
-                    do_dash(state, start->bitset);
-                }
-                else
-                {
-                    for (char c = 0; c <= ' '; ++c)
-                    {
-                        bitset_set(start->bitset, c);
-                    }
-                }
+                vec_push(&ranges, 0);
+                vec_push(&ranges, ' ');
             }
-            advance(state);
+            case_fold(state, &ranges);
+        }
+        advance(state);
+        if (complement)
+        {
+            // '.' and negated classes never match a line break
+            int breaks[] = {'\n', '\n', '\r', '\r'};
+            vec_pusharr(&ranges, breaks, 4);
         }
+        class_nfa(state, &ranges, complement, sptr, eptr);
+        vec_deinit(&ranges);
     }
 }
 
-static void do_dash(nfa_parser_state_t *state, bitset_t *bitset)
+// Collects the members of a class as pairs of bounds, a range taking the
+// place of the single member before its dash.
+static void do_dash(nfa_parser_state_t *state, vec_int_t *ranges)
 {
-    register int first;
     for (; state->current_token != tok_eoi && state->current_token != tok_right_bracket; advance(state))
     {
-        if (state->current_token != tok_dash)
+        if (state->current_token != tok_dash || ranges->length == 0)
         {
-            first = state->current_lexeme;
-            bitset_set(bitset, first);
+            vec_push(ranges, state->current_lexeme);
+            vec_push(ranges, state->current_lexeme);
         }
         else
         {
             advance(state);
-            for (; first <= state->current_lexeme; ++first)
+            if (state->current_lexeme >= ranges->data[ranges->length - 2])
             {
-                bitset_set(bitset, first);
+                ranges->data[ranges->length - 1] = state->current_lexeme;
             }
         }
     }
 }
 
-static void ccl_print(bitset_t *set)
+// Runs of upper case letters, each with its lower case delta above: ASCII,
+// then the letters that fold in UTF-8 mode, Latin-1, Greek and Cyrillic.
+static const int case_runs[][3] = {
+    {'A', 'Z', 0x20},     {0xC0, 0xD6, 0x20},   {0xD8, 0xDE, 0x20},   {0x391, 0x3A1, 0x20},
+    {0x3A3, 0x3AB, 0x20}, {0x400, 0x40F, 0x50}, {0x410, 0x42F, 0x20},
+};
+
+// Adds to ranges, pairs of bounds, the other case of every letter in them
+// when the rule folds case. Bytes past ASCII are no letters.
+static void case_fold(const nfa_parser_state_t *state, vec_int_t *ranges)
 {
-    putchar('[');
-    for (int i = 0; i < 0x7F; ++i)
+    if (!state->icase)
     {
-        if (bitset_get(set, i))
+        return;
+    }
+    int runs = state->utf8 ? sizeof(case_runs) / sizeof(case_runs[0]) : 1;
+    int length = ranges->length;
+    for (int i = 0; i < length; i += 2)
+    {
+        for (int r = 0; r < runs; ++r)
         {
-            if (i < ' ')
-            {
-                printf("^%c", i + '@');
-            }
-            else
+            for (int side = 0; side <= 1; ++side)
             {
-                printf("%c", i);
+                // the upper case run maps up by its delta, the lower one down
+                int delta = side ? -case_runs[r][2] : case_runs[r][2];
+                int first = case_runs[r][0] + (side ? case_runs[r][2] : 0);
+                int last = case_runs[r][1] + (side ? case_runs[r][2] : 0);
+                int lo = ranges->data[i] > first ? ranges->data[i] : first;
+                int hi = ranges->data[i + 1] < last ? ranges->data[i + 1] : last;
+                if (lo <= hi)
+                {
+                    vec_push(ranges, lo + delta);
+                    vec_push(ranges, hi + delta);
+                }
             }
         }
     }
-    putchar(']');
 }
 
-static void nfa_print(nfa_t *nfa)
+// A run of code points that share an encoded length, as the range each of
+// their bytes falls in.
+typedef struct
 {
-    for (int i = 0; i < nfa->nfa.length; i++)
+    int length;
+    unsigned char lo[4];
+    unsigned char hi[4];
+} utf8_sequence_t;
+
+typedef vec_t(utf8_sequence_t) vec_utf8_sequence_t;
+
+// Splits the code points lo to hi, all beyond ASCII, into byte sequences
+// such that every combination of the bytes in a sequence's ranges encodes
+// one of them, in ascending order.
+static void utf8_split(vec_utf8_sequence_t *out, int lo, int hi)
+{
+    static const int last_of_length[] = {0x7FF, 0xFFFF};
+    for (int i = 0; i < 2; ++i)
     {
-        printf("NFA state %02d: ", nfa->nfa.data[i]->index);
-        if (nfa->nfa.data[i]->next[0] == NULL)
+        if (lo <= last_of_length[i] && hi > last_of_length[i])
         {
-            printf("(TERMINAL)");
+            utf8_split(out, lo, last_of_length[i]);
+            utf8_split(out, last_of_length[i] + 1, hi);
+            return;
         }
-        else
+    }
+    utf8_sequence_t sequence;
+    sequence.length = utf8_encode(lo, sequence.lo);
+    for (int i = 1; i < sequence.length; ++i)
+    {
+        // the bytes after a split point must run over their full range
+        int m = (1 << 6 * i) - 1;
+        if ((lo & ~m) != (hi & ~m))
         {
-            printf("--> %02d ", nfa->nfa.data[i]->next[0]->index);
-            printf("(%02d) on ", nfa->nfa.data[i]->next[1] ? nfa->nfa.data[i]->next[1]->index : -1);
-            switch (nfa->nfa.data[i]->edge)
+            if ((lo & m) != 0)
             {
-            case EDGE_CHARACTER_CLASS:
-                ccl_print(nfa->nfa.data[i]->bitset);
-                break;
-            case EDGE_EPSILON:
-                printf("EPSILON ");
-                break;
-            default:
-                printf("'%c'", nfa->nfa.data[i]->edge);
-                break;
+                utf8_split(out, lo, lo | m);
+                utf8_split(out, (lo | m) + 1, hi);
+                return;
+            }
+            if ((hi & m) != m)
+            {
+                utf8_split(out, lo, (hi & ~m) - 1);
+                utf8_split(out, hi & ~m, hi);
+                return;
             }
         }
-
-        if (i == nfa->start)
-        {
-            printf(" (START STATE)");
-        }
-        printf("\n");
     }
+    utf8_encode(hi, sequence.hi);
+    vec_push(out, sequence);
 }
 
-static nfa_t thompson(const char *input)
+// Builds the alternatives for n sequences that agree on their length and
+// first depth bytes, which must be fewer than the length, sharing the nodes
+// for a common next byte, and returns the first.
+static nfa_node_t *utf8_alternatives(nfa_parser_state_t *state, const utf8_sequence_t *sequences, int n, int depth,
+                                     nfa_node_t *end)
 {
-    nfa_parser_state_t state;
-    state.input = input;
-    state.input_start = input;
-    vec_init(&state.nfa);
-    state.in_quote = false;
-    vec_init(&state.discard_stack);
-    nfa_t out;
-    out.start = machine(&state)->index;
-    out.nfa = state.nfa;
-    for (int i = 0; i < out.nfa.length; ++i)
+    nfa_node_t *head = NULL;
+    nfa_node_t **link = &head;
+    for (int i = 0; i < n;)
     {
-        if (out.nfa.data[i])
+        int length = sequences[i].length;
+        int lo = sequences[i].lo[depth];
+        int hi = sequences[i].hi[depth];
+        // a common next byte is shared only within a length: the lead byte
+        // sets the length in UTF-8, but the walk down does not rely on that
+        int j = i + 1;
+        while (j < n && sequences[j].length == length && sequences[j].lo[depth] == lo &&
+               sequences[j].hi[depth] == hi)
         {
-            out.nfa.data[i]->index = i;
+            ++j;
         }
+        nfa_node_t *edge = alloc_nfa(state);
+        edge->edge = EDGE_CHARACTER_CLASS;
+        for (int c = lo; c <= hi; ++c)
+        {
+            bitset_set(edge->bitset, c);
+        }
+        // a sequence is at most as long as its arrays, the longest encoding
+        bool deeper = depth + 1 < length && depth + 1 < (int)sizeof(sequences[i].lo);
+        edge->next[0] = deeper ? utf8_alternatives(state, sequences + i, j - i, depth + 1, end) : end;
+        if (j < n)
+        {
+            nfa_node_t *fork = alloc_nfa(state);
+            fork->next[0] = edge;
+            *link = fork;
+            link = &fork->next[1];
+        }
+        else
+        {
+            *link = edge;
+        }
+        i = j;
     }
-    return out;
+    return head;
 }
 
-void nfa_free(nfa_t *nfa)
+static int compare_ranges(const void *a, const void *b)
 {
-    for (int i = 0; i < nfa->nfa.length; ++i)
+    return ((const int *)a)[0] - ((const int *)b)[0];
+}
+
+// Builds start -> end over one character of a class: the ranges, pairs of
+// bounds, or everything else when complement is set. Bytes take a single
+// class edge. In UTF-8 mode so does ASCII, and the code points beyond it
+// become alternatives of byte sequences, so the DFA still reads bytes.
+static void class_nfa(nfa_parser_state_t *state, vec_int_t *ranges, bool complement, nfa_node_t **sptr,
+                      nfa_node_t **eptr)
+{
+    nfa_node_t *start = alloc_nfa(state);
+    nfa_node_t *end = alloc_nfa(state);
+    start->edge = EDGE_CHARACTER_CLASS;
+    start->next[0] = end;
+    *sptr = start;
+    *eptr = end;
+    if (!state->utf8)
     {
-        if (nfa->nfa.data[i])
+        for (int i = 0; i < ranges->length; i += 2)
         {
-            bitset_free(nfa->nfa.data[i]->bitset);
-            free(nfa->nfa.data[i]);
+            for (int c = ranges->data[i]; c <= ranges->data[i + 1]; ++c)
+            {
+                bitset_set(start->bitset, c);
+            }
         }
+        start->complement = complement;
+        return;
     }
-    vec_deinit(&nfa->nfa);
-}
-
-typedef vec_t(bitset_t *) vec_bitset_t;
 
-typedef struct dfa_node_t
-{
-    bitset_t *bitset;
-    char id;
-    vec_t(struct dfa_node_t *) next;
-    vec_bitset_t chars;
-    int partition;
-    int index;
-} dfa_node_t;
-
-static dfa_node_t *epsilon_closure(nfa_t *nfa, bitset_t *input)
-{
-    vec_int_t stack;
-    vec_init(&stack);
-
-    for (int i = 0; i < nfa->nfa.length; ++i)
+    // sort and merge, then take the complement and drop the surrogates
+    qsort(ranges->data, ranges->length / 2, 2 * sizeof(int), compare_ranges);
+    vec_int_t merged;
+    vec_init(&merged);
+    for (int i = 0; i < ranges->length; i += 2)
     {
-        if (bitset_get(input, i))
+        if (merged.length > 0 && ranges->data[i] <= merged.data[merged.length - 1] + 1)
         {
-            vec_push(&stack, i);
+            if (ranges->data[i + 1] > merged.data[merged.length - 1])
+            {
+                merged.data[merged.length - 1] = ranges->data[i + 1];
+            }
+            continue;
         }
+        vec_push(&merged, ranges->data[i]);
+        vec_push(&merged, ranges->data[i + 1]);
     }
-
-    while (stack.length > 0)
+    if (complement)
     {
-        int i = vec_pop(&stack);
-        nfa_node_t *p = nfa->nfa.data[i];
-        if (p->edge == EDGE_EPSILON)
+        vec_int_t inverse;
+        vec_init(&inverse);
+        int next = 0;
+        for (int i = 0; i < merged.length; i += 2)
         {
-            for (int j = 0; j <= 1; ++j)
+            if (merged.data[i] > next)
             {
-                if (p->next[j])
-                {
-                    i = p->next[j]->index;
-                    if (!bitset_get(input, i))
-                    {
-                        bitset_set(input, i);
-                        vec_push(&stack, i);
-                    }
-                }
+                vec_push(&inverse, next);
+                vec_push(&inverse, merged.data[i] - 1);
             }
+            next = merged.data[i + 1] + 1;
+        }
+        if (next <= UTF8_MAX)
+        {
+            vec_push(&inverse, next);
+            vec_push(&inverse, UTF8_MAX);
         }
+        vec_deinit(&merged);
+        merged = inverse;
     }
-    vec_deinit(&stack);
-    dfa_node_t *dfa_node = malloc(sizeof(dfa_node_t));
-    dfa_node->bitset = input;
-    vec_init(&dfa_node->next);
-    vec_init(&dfa_node->chars);
-    return dfa_node;
-}
-
-static dfa_node_t *move(nfa_t *nfa, bitset_t *input, char c)
-{
-    bitset_t *outset = NULL;
-    for (int i = nfa->nfa.length - 1; i >= 0; --i)
+    vec_clear(ranges);
+    for (int i = 0; i < merged.length; i += 2)
     {
-        if (bitset_get(input, i))
+        int lo = merged.data[i];
+        int hi = merged.data[i + 1];
+        if (lo <= SURROGATE_LAST && hi >= SURROGATE_FIRST)
         {
-            nfa_node_t *p = nfa->nfa.data[i];
-            if (p->edge == c || p->edge == EDGE_CHARACTER_CLASS && (p->complement != bitset_get(p->bitset, c)))
+            if (lo < SURROGATE_FIRST)
             {
-                if (!outset)
-                {
-                    outset = bitset_create();
-                }
-                bitset_set(outset, p->next[0]->index);
+                vec_push(ranges, lo);
+                vec_push(ranges, SURROGATE_FIRST - 1);
             }
+            lo = SURROGATE_LAST + 1;
+        }
+        if (lo <= hi)
+        {
+            vec_push(ranges, lo);
+            vec_push(ranges, hi);
         }
     }
-    dfa_node_t *dfa_node = malloc(sizeof(dfa_node_t));
-    dfa_node->bitset = outset;
-    vec_init(&dfa_node->next);
-    vec_init(&dfa_node->chars);
-    return dfa_node;
+    vec_deinit(&merged);
+
+    vec_utf8_sequence_t sequences;
+    vec_init(&sequences);
+    for (int i = 0; i < ranges->length; i += 2)
+    {
+        for (int c = ranges->data[i]; c <= ranges->data[i + 1] && c < 0x80; ++c)
+        {
+            bitset_set(start->bitset, c);
+        }
+        if (ranges->data[i + 1] >= 0x80)
+        {
+            utf8_split(&sequences, ranges->data[i] < 0x80 ? 0x80 : ranges->data[i], ranges->data[i + 1]);
+        }
+    }
+    if (sequences.length > 0)
+    {
+        nfa_node_t *rest = utf8_alternatives(state, sequences.data, sequences.length, 0, end);
+        start->edge = EDGE_EPSILON;
+        if (bitset_count(start->bitset) == 0)
+        {
+            start->next[0] = rest;
+        }
+        else
+        {
+            nfa_node_t *ascii = alloc_nfa(state);
+            bitset_t *empty = ascii->bitset;
+            ascii->edge = EDGE_CHARACTER_CLASS;
+            ascii->bitset = start->bitset;
+            ascii->next[0] = end;
+            start->bitset = empty;
+            start->next[0] = ascii;
+            start->next[1] = rest;
+        }
+    }
+    vec_deinit(&sequences);
 }
 
-typedef vec_t(dfa_node_t *) dfa_t;
+// Builds start -> end over the character c: one edge per byte of its
+// encoding. A NUL byte takes a class edge, as edge 0 is epsilon.
+static void literal_nfa(nfa_parser_state_t *state, int c, nfa_node_t **sptr, nfa_node_t **eptr)
+{
+    unsigned char bytes[4] = {c};
+    int length = state->utf8 ? utf8_encode(c, bytes) : 1;
+    nfa_node_t *node = *sptr = alloc_nfa(state);
+    for (int i = 0; i < length; ++i)
+    {
+        if (bytes[i] == 0)
+        {
+            node->edge = EDGE_CHARACTER_CLASS;
+            bitset_set(node->bitset, 0);
+        }
+        else
+        {
+            node->edge = bytes[i];
+        }
+        node->next[0] = alloc_nfa(state);
+        node = node->next[0];
+    }
+    *eptr = node;
+}
 
-static dfa_t nfa_to_dfa(nfa_t *nfa)
+static void ccl_print(bitset_t *set)
 {
-    bitset_t *init = bitset_create();
-    bitset_set(init, nfa->start);
-    dfa_node_t *d0 = epsilon_closure(nfa, init);
-    dfa_t dfa;
-    dfa_t work;
-    vec_init(&dfa);
-    vec_init(&work);
-    vec_push(&dfa, d0);
-    vec_push(&work, d0);
-    char id = 'A';
-    while (work.length > 0)
+    putchar('[');
+    for (int i = 0; i < 256; ++i)
     {
-        dfa_node_t *di = vec_pop(&work);
-        di->id = id;
-        for (char c = 1; c < 0x7F; ++c)
+        if (bitset_get(set, i))
         {
-            dfa_node_t *dj = move(nfa, di->bitset, c);
-            if (dj->bitset)
+            if (i < ' ')
             {
-                dfa_node_t *s = epsilon_closure(nfa, dj->bitset);
-                free(dj);
-                dj = s;
-                bool unique = true;
-                bool in_next = false;
-                for (int i = 0; i < dfa.length; ++i)
-                {
-                    if (bitset_equals(dfa.data[i]->bitset, dj->bitset))
-                    {
-                        unique = false;
-                        for (int j = 0; j < di->next.length; ++j)
-                        {
-                            if (di->next.data[j] == dfa.data[i])
-                            {
-                                in_next = true;
-                                bitset_set(di->chars.data[j], c);
-                                break;
-                            }
-                        }
-                        if (!in_next)
-                        {
-                            vec_push(&di->next, dfa.data[i]);
-                        }
-                        dj->id = i + 'A';
-                        break;
-                    }
-                }
-                if (!in_next)
-                {
-                    bitset_t *b = bitset_create();
-                    bitset_set(b, c);
-                    vec_push(&di->chars, b);
-                }
-                if (unique)
-                {
-                    vec_push(&di->next, dj);
-                    vec_push(&dfa, dj);
-                    vec_push(&work, dj);
-                }
-                else
-                {
-                    if (dj->bitset)
-                    {
-                        bitset_free(dj->bitset);
-                    }
-                    free(dj);
-                }
+                printf("^%c", i + '@');
+            }
+            else if (i >= 0x7F)
+            {
+                printf("\\x%02X", i);
             }
             else
             {
-                // final state
-                if (dj->bitset)
-                {
-                    bitset_free(dj->bitset);
-                }
-                free(dj);
+                printf("%c", i);
             }
         }
-        ++id;
-    }
-    for (int i = 0; i < dfa.length; ++i)
-    {
-        dfa.data[i]->index = i;
     }
-    return dfa;
+    putchar(']');
 }
 
-static void dfa_to_dot(const dfa_t *dfa)
+static void nfa_print(nfa_t *nfa)
 {
-    printf("digraph test {\n");
-    for (int i = 0; i < dfa->length; ++i)
+    for (int i = 0; i < nfa->nfa.length; i++)
     {
-        const dfa_node_t *di = dfa->data[i];
-        for (int j = 0; j < di->next.length; ++j)
+        printf("NFA state %02d: ", nfa->nfa.data[i]->index);
+        if (nfa->nfa.data[i]->next[0] == NULL)
         {
-            const dfa_node_t *dj = di->next.data[j];
-            printf("%c -> %c [ label = \"'", di->id, dj->id);
-            bitset_t *b = di->chars.data[j];
-            for (char c = 0; c < 0x7F; ++c)
+            printf("(TERMINAL)");
+        }
+        else
+        {
+            printf("--> %02d ", nfa->nfa.data[i]->next[0]->index);
+            printf("(%02d) on ", nfa->nfa.data[i]->next[1] ? nfa->nfa.data[i]->next[1]->index : -1);
+            switch (nfa->nfa.data[i]->edge)
             {
-                if (bitset_get(b, c))
-                {
-                    if (c == '\'' || c == '"' || c == '\\')
-                    {
-                        printf("\\");
-                    }
-                    if (c < ' ')
-                    {
-                        printf("^%c", c + '@');
-                    }
-                    else
-                    {
-                        printf("%c", c);
-                    }
-                }
+            case EDGE_CHARACTER_CLASS:
+                ccl_print(nfa->nfa.data[i]->bitset);
+                break;
+            case EDGE_EPSILON:
+                printf("EPSILON ");
+                break;
+            default:
+                printf(nfa->nfa.data[i]->edge < 0x7F ? "'%c'" : "'\\x%02X'", nfa->nfa.data[i]->edge);
+                break;
             }
-            printf("'\" ]\n");
         }
-        // if (di->next.length == 0) {
-        //   printf("%c is an accepting state\n", di->id);
-        // }
+        if (nfa->nfa.data[i]->tag != TAG_NONE)
+        {
+            int tag = nfa->nfa.data[i]->tag - 1;
+            printf(" (%s %d)", tag % 2 ? "CLOSE" : "OPEN", tag / 2);
+        }
+        if (nfa->nfa.data[i]->behind || nfa->nfa.data[i]->ahead)
+        {
+            printf(" (ASSERT behind %02x ahead %02x)", nfa->nfa.data[i]->behind, nfa->nfa.data[i]->ahead);
+        }
+
+        if (i == nfa->start)
+        {
+            printf(" (START STATE)");
+        }
+        printf("\n");
     }
-    printf("}\n");
 }
 
-typedef vec_t(dfa_node_t *) partition_t;
-typedef vec_t(partition_t *) vec_partition_t;
+// In UTF-8 mode the pattern is read as UTF-8 and matches UTF-8 text: each
+// character, '.' and class member is a code point, compiled to the bytes that
+// encode it.
+// Adds an NFA just built to the metrics: its states and the heap they take.
+static void metrics_count_nfa(const nfa_t *nfa)
+{
+    if (!metrics)
+    {
+        return;
+    }
+    metrics->nfa_states += nfa->nfa.length;
+    metrics->nfa_bytes += sizeof(nfa_node_t *) * nfa->nfa.capacity;
+    for (int i = 0; i < nfa->nfa.length; ++i)
+    {
+        const nfa_node_t *node = nfa->nfa.data[i];
+        if (node)
+        {
+            metrics->nfa_bytes += sizeof(nfa_node_t) + sizeof(bitset_t) + bitset_size_in_bytes(node->bitset);
+        }
+    }
+}
 
-static dfa_node_t *do_goto(dfa_node_t *node, char c)
+static nfa_t thompson(const char *input, bool utf8, bool icase)
 {
-    for (int i = 0; i < node->chars.length; ++i)
+    double start = metrics_start();
+    nfa_parser_state_t state;
+    state.input = input;
+    state.input_start = input;
+    vec_init(&state.nfa);
+    state.in_quote = false;
+    state.utf8 = utf8;
+    state.icase = state.icase_default = icase;
+    vec_init(&state.discard_stack);
+    state.groups = 1;
+    state.rules = 0;
+    nfa_t out;
+    out.start = machine(&state)->index;
+    out.nfa = state.nfa;
+    out.groups = state.groups;
+    out.nrules = state.rules;
+    out.rule_sets = false;
+    for (int i = 0; i < out.nfa.length; ++i)
     {
-        if (bitset_get(node->chars.data[i], c))
+        if (out.nfa.data[i])
         {
-            return node->next.data[i];
+            out.nfa.data[i]->index = i;
         }
     }
-    return NULL;
+    metrics_stop(PHASE_PARSE, start);
+    metrics_count_nfa(&out);
+    return out;
 }
 
-static bool dfa_nodes_equivalent(dfa_node_t *n1, dfa_node_t *n2)
+void nfa_free(nfa_t *nfa)
 {
-    for (char c = 0; c < 0x7F; c++)
+    for (int i = 0; i < nfa->nfa.length; ++i)
     {
-        dfa_node_t *g1 = do_goto(n1, c);
-        dfa_node_t *g2 = do_goto(n2, c);
-        if (!g1 ^ !g2)
+        if (nfa->nfa.data[i])
         {
-            return false;
+            bitset_free(nfa->nfa.data[i]->bitset);
+            free(nfa->nfa.data[i]);
         }
-        if (g1 && g1->partition != g2->partition)
+    }
+    vec_deinit(&nfa->nfa);
+}
+
+static nfa_node_t *nfa_add_node(nfa_t *nfa)
+{
+    nfa_node_t *node = malloc(sizeof(nfa_node_t));
+    memset(node, 0, sizeof(nfa_node_t));
+    node->bitset = bitset_create();
+    node->index = nfa->nfa.length;
+    vec_push(&nfa->nfa, node);
+    return node;
+}
+
+// Brackets the whole NFA in the tags of group 0, so that a tagged DFA reports
+// where the match starts as well as where it ends. Each end of a rule becomes
+// a close tag followed by a new end.
+static void nfa_tag_match(nfa_t *nfa)
+{
+    int length = nfa->nfa.length;
+    for (int i = 0; i < length; ++i)
+    {
+        nfa_node_t *node = nfa->nfa.data[i];
+        if (node && node->next[0] == NULL)
         {
-            return false;
+            node->edge = EDGE_EPSILON;
+            node->tag = TAG_CLOSE(0);
+            node->next[0] = nfa_add_node(nfa);
+            node->next[0]->rule = node->rule;
         }
     }
-    return true;
+    nfa_node_t *open = nfa_add_node(nfa);
+    open->tag = TAG_OPEN(0);
+    open->next[0] = nfa->nfa.data[nfa->start];
+    nfa->start = open->index;
 }
 
-static dfa_t minimize_dfa(dfa_t *dfa)
+// Puts a loop over every byte in front of the NFA, so that a match may start
+// anywhere in the input rather than only at its first byte.
+static void nfa_unanchor(nfa_t *nfa)
 {
-    // accepting, nonaccepting
-    // for each partition:
-    //  for each state in the partition:
-    //   move all states that are not equivalent to the first
-    //   to a new partition
-    vec_partition_t partitions;
-    vec_init(&partitions);
-    partition_t *p0 = malloc(sizeof(partition_t));
-    vec_init(p0);
-    partition_t *p1 = malloc(sizeof(partition_t));
-    vec_init(p1);
-    for (int i = 0; i < dfa->length; i++)
+    nfa_node_t *loop = nfa_add_node(nfa);
+    nfa_node_t *start = nfa_add_node(nfa);
+    loop->edge = EDGE_CHARACTER_CLASS;
+    loop->complement = true;
+    loop->next[0] = start;
+    start->next[0] = nfa->nfa.data[nfa->start];
+    start->next[1] = loop;
+    nfa->start = start->index;
+}
+
+// True when every rule of the NFA carries the anchor: starts with '^' for
+// ANCHOR_BOL, ends in '$' for ANCHOR_EOL.
+static bool nfa_anchored(const nfa_t *nfa, int anchor)
+{
+    for (int i = 0; i < nfa->nfa.length; ++i)
     {
-        if (dfa->data[i]->next.length == 0)
+        nfa_node_t *node = nfa->nfa.data[i];
+        if (node && node->next[0] == NULL && !(node->anchor & anchor))
         {
-            dfa->data[i]->partition = 0;
-            vec_push(p0, dfa->data[i]);
+            return false;
         }
-        else
+    }
+    return true;
+}
+
+// Points node at every node in targets through a chain of epsilon nodes. A
+// node with nowhere to go becomes an empty class that loops on itself, since
+// an epsilon node without successors would accept.
+static void nfa_fan_out(nfa_t *nfa, nfa_node_t *node, const vec_int_t *targets)
+{
+    if (targets->length == 0)
+    {
+        node->edge = EDGE_CHARACTER_CLASS;
+        node->next[0] = node;
+        return;
+    }
+    node->edge = EDGE_EPSILON;
+    for (int k = 0; k < targets->length; ++k)
+    {
+        if (k > 0 && k < targets->length - 1)
         {
-            dfa->data[i]->partition = 1;
-            vec_push(p1, dfa->data[i]);
+            node->next[1] = nfa_add_node(nfa);
+            node = node->next[1];
         }
+        node->next[k == 0 || k < targets->length - 1 ? 0 : 1] = nfa->nfa.data[targets->data[k]];
     }
-    vec_push(&partitions, p0);
-    vec_push(&partitions, p1);
-    for (int i = 0; i < partitions.length; ++i)
+}
+
+// Builds the NFA for the reversed language: it starts at the ends of the
+// rules, follows every edge backwards and accepts where the original started.
+// Node i of the original is node i of the reverse. An edge u -c-> v turns into
+// a new node v -> [c] -> u, since the label of an edge lives on its source.
+// Assertions stay on their node with behind and ahead swapped; tags and
+// anchors are dropped.
+static nfa_t nfa_reverse(const nfa_t *nfa)
+{
+    nfa_t out;
+    vec_init(&out.nfa);
+    out.groups = 1;
+    out.nrules = 1;
+    out.rule_sets = false;
+    int length = nfa->nfa.length;
+    vec_int_t *edges = malloc((length + 1) * sizeof(vec_int_t));
+    for (int i = 0; i <= length; ++i)
     {
-        dfa_node_t *first = partitions.data[i]->data[0];
-        partition_t *new_partition = NULL;
-        for (int j = 0; j < partitions.data[i]->length; ++j)
+        vec_init(&edges[i]);
+    }
+    for (int i = 0; i < length; ++i)
+    {
+        nfa_add_node(&out);
+    }
+    for (int i = 0; i < length; ++i)
+    {
+        nfa_node_t *node = nfa->nfa.data[i];
+        if (!node || !node->next[0])
         {
-            dfa_node_t *dij = partitions.data[i]->data[j];
-            if (dfa_nodes_equivalent(first, dij))
-            {
-                continue;
-            }
-            if (new_partition == NULL)
+            continue;
+        }
+        out.nfa.data[i]->behind = node->ahead;
+        out.nfa.data[i]->ahead = node->behind;
+        if (node->edge == EDGE_EPSILON)
+        {
+            for (int j = 0; j <= 1; ++j)
             {
-                new_partition = malloc(sizeof(partition_t));
-                vec_init(new_partition);
+                if (node->next[j])
+                {
+                    vec_push(&edges[node->next[j]->index], i);
+                }
             }
-            vec_push(new_partition, dij);
-            dij->partition = partitions.length;
+            continue;
         }
-        if (new_partition != NULL)
+        nfa_node_t *edge = nfa_add_node(&out);
+        edge->edge = node->edge;
+        edge->complement = node->complement;
+        bitset_free(edge->bitset);
+        edge->bitset = bitset_copy(node->bitset);
+        edge->next[0] = out.nfa.data[i];
+        vec_push(&edges[node->next[0]->index], edge->index);
+    }
+
+    // the original start leads to the new accepting node; the new start (kept
+    // in edges[length]) leads to every end of a rule
+    nfa_node_t *end = nfa_add_node(&out);
+    vec_push(&edges[nfa->start], end->index);
+    for (int i = 0; i < length; ++i)
+    {
+        if (nfa->nfa.data[i] && nfa->nfa.data[i]->next[0] == NULL)
         {
-            vec_push(&partitions, new_partition);
+            vec_push(&edges[length], i);
         }
     }
+    nfa_node_t *start = nfa_add_node(&out);
+    out.start = start->index;
+    for (int i = 0; i < length; ++i)
+    {
+        nfa_fan_out(&out, out.nfa.data[i], &edges[i]);
+    }
+    nfa_fan_out(&out, start, &edges[length]);
 
-    vec_t(vec_int_t) pointers;
-    vec_init(&pointers);
-    for (int i = 0; i < partitions.length; ++i)
-    {
-        vec_int_t nx;
-        vec_init(&nx);
-        for (int j = 0; j < partitions.data[i]->data[0]->next.length; ++j)
-        {
-            vec_push(&nx, partitions.data[i]->data[0]->next.data[j]->partition);
-        }
-        vec_push(&pointers, nx);
-    }
-
-    dfa_t new_dfa;
-    vec_init(&new_dfa);
-    for (int i = 0; i < partitions.length; ++i)
-    {
-        dfa_node_t *node = malloc(sizeof(dfa_node_t));
-        dfa_node_t *old = partitions.data[i]->data[0];
-        node->index = i;
-        node->bitset = bitset_create();
-        node->id = i + 'A';
-        node->partition = i;
-        vec_init(&node->next);
-        vec_init(&node->chars);
-        for (int j = 0; j < old->chars.length; ++j)
-        {
-            vec_push(&node->chars, bitset_copy(old->chars.data[j]));
-        }
-        vec_push(&new_dfa, node);
-    }
-    for (int i = 0; i < partitions.length; ++i)
+    for (int i = 0; i <= length; ++i)
     {
-        vec_deinit(partitions.data[i]);
-    }
-    vec_deinit(&partitions);
-    for (int i = 0; i < new_dfa.length; ++i)
-    {
-        for (int j = 0; j < pointers.data[i].length; ++j)
-        {
-            vec_push(&new_dfa.data[i]->next, new_dfa.data[pointers.data[i].data[j]]);
-        }
+        vec_deinit(&edges[i]);
     }
-    vec_deinit(&pointers);
-    return new_dfa;
+    free(edges);
+    return out;
 }
 
-static void emit_comment(const char *comment, ...)
+typedef vec_t(bitset_t *) vec_bitset_t;
+
+// A DFA state also knows what lies behind it, since the assertions of its
+// NFA nodes that look ahead are only settled by the next byte. A match that
+// ends before that byte is flagged on the state the byte leads to.
+typedef struct dfa_node_t
 {
-    va_list args;
-    va_start(args, comment);
-    while (comment)
+    bitset_t *bitset;
+    char id;
+    vec_t(struct dfa_node_t *) next;
+    vec_bitset_t chars;
+    bool accepting;
+    bool accept_before; // a match ended just before the byte that led here
+    bool accept_at_end; // a match ends here if the input does
+    int context;        // the kind of byte behind, -1 when no assertion waits on it
+    int starts;         // KIND_BIT() of each kind of position matching starts after
+    int partition;
+    int index;
+    // For an NFA with rule_sets, the rules accepted here or before the byte
+    // that led here, and those accepted besides if the input ends here;
+    // NULL for none.
+    bitset_t *rules;
+    bitset_t *rules_at_end;
+} dfa_node_t;
+
+static int byte_kind(unsigned char c)
+{
+    if (c == '\n')
     {
-        printf("// %s\n", comment);
-        comment = va_arg(args, const char *);
+        return KIND_NEWLINE;
     }
-    va_end(args);
+    if (c == '\r')
+    {
+        return KIND_RETURN;
+    }
+    return c == '_' || ('0' <= c && c <= '9') || ('a' <= (c | 0x20) && (c | 0x20) <= 'z') ? KIND_WORD : KIND_OTHER;
 }
 
-static void emit_yy_next(const char *name)
+static bool nfa_assertion_holds(const nfa_node_t *p, int behind, int ahead)
 {
-    emit_comment("yy_next(state, c) is given the current state and next character,", "and evaluates to the next state.",
-                 NULL);
-    printf("#define yy_next(state, c)    %s[state][c]\n", name);
+    return (!p->behind || (p->behind & KIND_BIT(behind))) &&
+           (!p->ahead || (ahead != KIND_UNKNOWN && (p->ahead & KIND_BIT(ahead))));
 }
 
-static void emit_dfa_state_table(const dfa_t *dfa)
+// Adds to set every node reachable over epsilon edges whose assertions hold
+// between a byte of kind `behind` and one of kind `ahead`, which may be
+// KIND_UNKNOWN. Returns whether the end of a rule is among them; *waiting, if
+// given, is set when a node's assertion could still hold once the next byte
+// is known.
+static bool nfa_closure(const nfa_t *nfa, bitset_t *set, int behind, int ahead, bool *waiting)
 {
-    printf("{\n");
-    printf("/* 00000 */ { ");
-    for (char c = 0; c < 0x7F; ++c)
+    double start = metrics_start();
+    vec_int_t stack;
+    vec_init(&stack);
+    for (size_t i = 0; nextSetBit(set, &i); ++i)
     {
-        printf("   -1, ");
+        vec_push(&stack, i);
     }
-    printf("},\n");
-    for (int i = 0; i < dfa->length; ++i)
+    bool accepting = false;
+    if (waiting)
     {
-        dfa_node_t *node = dfa->data[i];
-        printf("/* %05d */ { ", i + 1);
-        for (char c = 0; c < 0x7F; ++c)
+        *waiting = false;
+    }
+    while (stack.length > 0)
+    {
+        int i = vec_pop(&stack);
+        nfa_node_t *p = nfa->nfa.data[i];
+        if (p->edge != EDGE_EPSILON)
         {
-            bool found = false;
-            for (int j = 0; j < node->next.length; ++j)
+            continue;
+        }
+        if (p->next[0] == NULL)
+        {
+            // only the end of a rule is left without an outgoing edge
+            accepting = true;
+            continue;
+        }
+        if (!nfa_assertion_holds(p, behind, ahead))
+        {
+            if (waiting && p->ahead && ahead == KIND_UNKNOWN && (!p->behind || (p->behind & KIND_BIT(behind))))
             {
-                if (bitset_get(node->chars.data[j], c))
+                *waiting = true;
+            }
+            continue;
+        }
+        for (int j = 0; j <= 1; ++j)
+        {
+            if (p->next[j])
+            {
+                i = p->next[j]->index;
+                if (!bitset_get(set, i))
                 {
-                    found = true;
-                    printf("%5d, ", node->next.data[j]->index);
+                    bitset_set(set, i);
+                    vec_push(&stack, i);
                 }
             }
-            if (!found)
+        }
+    }
+    vec_deinit(&stack);
+    if (metrics)
+    {
+        ++metrics->closures;
+        metrics_stop(PHASE_CLOSURE, start);
+    }
+    return accepting;
+}
+
+// The rules whose ends are among the nodes in set, but for those in
+// `except`, which may be NULL; NULL when there are none.
+static bitset_t *nfa_rules_ended(const nfa_t *nfa, const bitset_t *set, const bitset_t *except)
+{
+    bitset_t *rules = NULL;
+    for (size_t i = 0; nextSetBit(set, &i); ++i)
+    {
+        const nfa_node_t *p = nfa->nfa.data[i];
+        if (p->edge == EDGE_EPSILON && p->next[0] == NULL && !(except && bitset_get(except, p->rule)))
+        {
+            if (!rules)
             {
-                printf("    0, ");
+                rules = bitset_create();
             }
+            bitset_set(rules, p->rule);
         }
-        printf("},\n");
     }
-    printf("};\n");
+    return rules;
 }
 
-#define NCOLS 10
-#define TYPE "YY_TTYPE"
-#define STORAGE_CLASS "YYPRIVATE"
-#define DECODING_ROUTINE_STORAGE_CLASS "YYPRIVATE"
-#define INDENT "          "
+static bool rule_sets_equal(const bitset_t *a, const bitset_t *b)
+{
+    return a && b ? bitset_equals(a, b) : a == b;
+}
 
-static void dfa_free(dfa_t *dfa)
+// Makes the DFA state for the NFA nodes in set, entered over a byte of kind
+// `behind`; takes ownership of set.
+static dfa_node_t *dfa_state(const nfa_t *nfa, bitset_t *set, int behind, bool accept_before)
 {
-    for (int i = 0; i < dfa->length; ++i)
+    dfa_node_t *dfa_node = malloc(sizeof(dfa_node_t));
+    bool waiting;
+    dfa_node->bitset = set;
+    dfa_node->accepting = nfa_closure(nfa, set, behind, KIND_UNKNOWN, &waiting);
+    dfa_node->accept_before = accept_before;
+    dfa_node->accept_at_end = dfa_node->accepting;
+    dfa_node->context = waiting ? behind : -1;
+    dfa_node->starts = 0;
+    dfa_node->rules = nfa->rule_sets ? nfa_rules_ended(nfa, set, NULL) : NULL;
+    dfa_node->rules_at_end = NULL;
+    // with rule sets, the end of the input may yet add rules to an accepting
+    // state
+    if (waiting && (!dfa_node->accepting || nfa->rule_sets))
     {
-        for (int j = 0; j < dfa->data[i]->chars.length; ++j)
+        bitset_t *end = bitset_copy(set);
+        dfa_node->accept_at_end = nfa_closure(nfa, end, behind, KIND_EDGE, NULL);
+        if (nfa->rule_sets)
         {
-            bitset_free(dfa->data[i]->chars.data[j]);
+            dfa_node->rules_at_end = nfa_rules_ended(nfa, end, dfa_node->rules);
         }
-        bitset_free(dfa->data[i]->bitset);
-        vec_deinit(&dfa->data[i]->chars);
-        vec_deinit(&dfa->data[i]->next);
-        free(dfa->data[i]);
+        bitset_free(end);
     }
-    vec_deinit(dfa);
+    vec_init(&dfa_node->next);
+    vec_init(&dfa_node->chars);
+    return dfa_node;
 }
 
-typedef vec_t(vec_int_t) dtran_t;
+// A literal edge is never 0, which is EDGE_EPSILON, so no byte follows one.
+static bool nfa_edge_matches(const nfa_node_t *p, unsigned char c)
+{
+    return (p->edge == c && c != EDGE_EPSILON) || p->edge == EDGE_CHARACTER_CLASS && (p->complement != bitset_get(p->bitset, c));
+}
 
-dtran_t make_dtran(const dfa_t *dfa)
+static dfa_node_t *move(nfa_t *nfa, bitset_t *input, unsigned char c)
 {
-    dtran_t result;
-    vec_init(&result);
-    for (int i = 0; i < dfa->length; ++i)
+    bitset_t *outset = NULL;
+    for (size_t i = 0; nextSetBit(input, &i); ++i)
     {
-        vec_int_t dtran_row;
-        vec_init(&dtran_row);
-        for (int c = 0; c < 0x80; ++c)
-        {
-            vec_push(&dtran_row, -1);
-        }
-        for (int j = 0; j < dfa->data[i]->chars.length; ++j)
+        nfa_node_t *p = nfa->nfa.data[i];
+        if (nfa_edge_matches(p, c))
         {
-            for (int c = 0; c < 0x80; ++c)
+            if (!outset)
             {
-                if (bitset_get(dfa->data[i]->chars.data[j], c))
-                {
-                    dtran_row.data[c] = dfa->data[i]->next.data[j]->index;
-                }
+                outset = bitset_create();
             }
+            bitset_set(outset, p->next[0]->index);
         }
-        vec_push(&result, dtran_row);
     }
-    return result;
+    dfa_node_t *dfa_node = malloc(sizeof(dfa_node_t));
+    dfa_node->bitset = outset;
+    dfa_node->accepting = false;
+    vec_init(&dfa_node->next);
+    vec_init(&dfa_node->chars);
+    return dfa_node;
 }
 
-static void show_dtran(const dtran_t *dtran)
+typedef vec_t(dfa_node_t *) dfa_t;
+
+// The states of a DFA by their NFA sets, open addressed and kept at most
+// half full, so subset construction finds a state again in constant time.
+typedef struct
 {
-    printf("{\n");
-    for (int i = 0; i < dtran->length; ++i)
+    int *buckets; // state numbers, -1 for none
+    unsigned mask;
+    int count;
+} dfa_hash_t;
+
+static unsigned dfa_node_hash(const dfa_node_t *node)
+{
+    unsigned h = 2166136261u ^ (unsigned)(node->context + 1) ^ (node->accept_before ? 0x100u : 0);
+    for (size_t i = 0; nextSetBit(node->bitset, &i); ++i)
     {
-        printf("  [%d] = { ", i);
-        for (int j = 0; j < dtran->data[i].length; ++j)
-        {
-            printf("%d, ", dtran->data[i].data[j]);
-        }
-        printf("},\n");
+        h = (h ^ (unsigned)i) * 16777619u;
     }
-    printf("};\n");
+    return h;
 }
 
-static const char *bin_to_ascii(int c, bool use_hex)
+// size is a power of two
+static void dfa_hash_init(dfa_hash_t *hash, int size)
 {
-    static char buf[8];
-    c &= 0xFF;
-    if (' ' <= c && c < 0x7F && c != '\'' && c != '\\')
+    hash->buckets = malloc(sizeof(int) * size);
+    hash->mask = size - 1;
+    hash->count = 0;
+    for (int b = 0; b < size; ++b)
     {
-        buf[0] = c;
-        buf[1] = '\0';
+        hash->buckets[b] = -1;
     }
-    else
+}
+
+static int dfa_find(const dfa_hash_t *hash, const dfa_t *dfa, const dfa_node_t *node)
+{
+    for (unsigned b = dfa_node_hash(node) & hash->mask;; b = (b + 1) & hash->mask)
     {
-        buf[0] = '\\';
-        buf[2] = '\0';
-        switch (c)
+        int i = hash->buckets[b];
+        if (i < 0)
         {
-        case '\\':
-            buf[1] = '\\';
-            break;
-        case '\'':
-            buf[1] = '\'';
-            break;
-        case '\b':
-            buf[1] = 'b';
-            break;
-        case '\f':
-            buf[1] = 'f';
-            break;
-        case '\t':
-            buf[1] = 't';
-            break;
-        case '\r':
-            buf[1] = 'r';
-            break;
-        case '\n':
-            buf[1] = 'n';
-            break;
-        default:
-            sprintf(&buf[1], use_hex ? "x%03x" : "%03o", c);
-            break;
+            return -1;
+        }
+        const dfa_node_t *di = dfa->data[i];
+        if (di->context == node->context && di->accept_before == node->accept_before &&
+            bitset_equals(di->bitset, node->bitset) && rule_sets_equal(di->rules, node->rules))
+        {
+            return i;
         }
     }
-    return buf;
 }
 
-static void printv(FILE *fp, const char **argv)
+// Adds state i of dfa, which the hash does not hold yet.
+static void dfa_hash_insert(dfa_hash_t *hash, const dfa_t *dfa, int i)
 {
-    while (*argv)
+    if (2 * (hash->count + 1) > (int)hash->mask + 1)
     {
-        fprintf(fp, "%s\n", *argv++);
+        free(hash->buckets);
+        dfa_hash_init(hash, 2 * (hash->mask + 1));
+        for (int j = 0; j < i; ++j)
+        {
+            dfa_hash_insert(hash, dfa, j);
+        }
+    }
+    unsigned b = dfa_node_hash(dfa->data[i]) & hash->mask;
+    while (hash->buckets[b] >= 0)
+    {
+        b = (b + 1) & hash->mask;
     }
+    hash->buckets[b] = i;
+    ++hash->count;
 }
 
-static void comment(FILE *fp, const char **argv)
+static void dfa_node_free(dfa_node_t *node)
 {
-    fprintf(fp, "\n/*---------------------------------------\n");
-    while (*argv)
+    bitset_free(node->bitset);
+    if (node->rules)
     {
-        fprintf(fp, " * %s\n", *argv++);
+        bitset_free(node->rules);
     }
-    fprintf(fp, " */\n\n");
+    if (node->rules_at_end)
+    {
+        bitset_free(node->rules_at_end);
+    }
+    vec_deinit(&node->next);
+    vec_deinit(&node->chars);
+    free(node);
 }
 
-static int pairs(FILE *fp, const dtran_t *dtran, const char *name, int threshold, bool numbers)
-{
-    // https://stackoverflow.com/a/29960371
+static int nfa_byte_classes(const nfa_t *nfa, unsigned char class_of[256]);
+static void dfa_free(dfa_t *dfa);
 
-    int num_cells = 0;
-    for (int i = 0; i < dtran->length; ++i)
+// The state that reading c leads to from di, or NULL when none does.
+static dfa_node_t *dfa_next(nfa_t *nfa, const dfa_node_t *di, unsigned char c)
+{
+    // assertions waiting on the next byte are settled before reading it
+    bitset_t *now = di->bitset;
+    bool before = false;
+    bitset_t *before_rules = NULL;
+    if (metrics)
     {
-        int ntransitions = 0;
-        for (int *p = dtran->data[i].data, j = dtran->data[i].length; --j >= 0; ++p)
+        ++metrics->moves;
+    }
+    if (di->context >= 0)
+    {
+        now = bitset_copy(di->bitset);
+        before = nfa_closure(nfa, now, di->context, byte_kind(c), NULL) && !di->accepting;
+        if (nfa->rule_sets)
         {
-            if (*p != -1)
-            {
-                ++ntransitions;
-            }
+            // even after di accepted, c may settle the assertions of more rules
+            before_rules = nfa_rules_ended(nfa, now, di->rules);
+            before = before || before_rules != NULL;
         }
-        if (ntransitions > 0)
-        {
-            fprintf(fp, "%s %s %s%-d[] = { ", STORAGE_CLASS, TYPE, name, i);
-            ++num_cells;
-            if (ntransitions > threshold)
-            {
-                fprintf(fp, "0,\n" INDENT);
-            }
-            else
-            {
-                fprintf(fp, "%5d, ", ntransitions);
-                if (threshold > 5)
-                {
-                    fprintf(fp, "\n" INDENT);
-                }
+    }
+    dfa_node_t *dj = move(nfa, now, c);
+    if (now != di->bitset)
+    {
+        bitset_free(now);
+    }
+    if (!dj->bitset && !before)
+    {
+        // final state
+        free(dj);
+        return NULL;
+    }
+    // a match that ended before c still needs a state to report it, even
+    // when nothing can follow
+    bitset_t *set = dj->bitset ? dj->bitset : bitset_create();
+    free(dj);
+    dfa_node_t *next = dfa_state(nfa, set, byte_kind(c), before);
+    if (before_rules && next->rules)
+    {
+        bitset_inplace_union(next->rules, before_rules);
+        bitset_free(before_rules);
+    }
+    else if (before_rules)
+    {
+        next->rules = before_rules;
+    }
+    return next;
+}
+
+// Budgets for subset construction, which is exponential in the worst case.
+// A scanner whose DFA would exceed one falls back to a lazy DFA.
+typedef struct
+{
+    int max_dfa_states;
+    size_t max_dfa_bytes;
+} compile_limits_t;
+
+#define DFA_MAX_STATES 8192
+#define DFA_MAX_BYTES (32 << 20)
+
+static const compile_limits_t default_limits = {DFA_MAX_STATES, DFA_MAX_BYTES};
+
+// The heap a DFA state takes, counting its NFA set but not its transitions.
+static size_t dfa_node_bytes(const dfa_node_t *node)
+{
+    return sizeof(dfa_node_t) + sizeof(bitset_t) + bitset_size_in_bytes(node->bitset) +
+           (node->rules ? sizeof(bitset_t) + bitset_size_in_bytes(node->rules) : 0);
+}
+
+// Subset construction. There is a start state for each kind of position a
+// match can start after, the edge of the input first; they only differ when
+// the pattern has assertions. Every byte of a class leads to the same state,
+// so each state is stepped once per class rather than once per byte. When
+// the DFA outgrows a budget of limits, construction stops with *exceeded
+// naming the budget, and what was built is returned, unfinished; *bytes is
+// the heap it took.
+static dfa_t nfa_to_dfa(nfa_t *nfa, const compile_limits_t *limits, const char **exceeded, size_t *bytes)
+{
+    double start = metrics_start();
+    dfa_t dfa;
+    dfa_t work;
+    vec_init(&dfa);
+    vec_init(&work);
+    unsigned char class_of[256];
+    int representative[256];
+    bitset_t *members[256];
+    int classes = nfa_byte_classes(nfa, class_of);
+    for (int k = 0; k < classes; ++k)
+    {
+        members[k] = bitset_create();
+    }
+    for (int c = 0xFF; c >= 0; --c)
+    {
+        representative[class_of[c]] = c;
+        bitset_set(members[class_of[c]], c);
+    }
+    dfa_hash_t hash;
+    dfa_hash_init(&hash, 64);
+    *exceeded = NULL;
+    *bytes = 0;
+    for (int k = 0; k < KINDS; ++k)
+    {
+        bitset_t *init = bitset_create();
+        bitset_set(init, nfa->start);
+        dfa_node_t *dk = dfa_state(nfa, init, k, false);
+        int i = dfa_find(&hash, &dfa, dk);
+        if (i < 0)
+        {
+            *bytes += dfa_node_bytes(dk);
+            vec_push(&dfa, dk);
+            vec_push(&work, dk);
+            i = dfa.length - 1;
+            dfa_hash_insert(&hash, &dfa, i);
+        }
+        else
+        {
+            dfa_node_free(dk);
+        }
+        dfa.data[i]->starts |= KIND_BIT(k);
+    }
+    char id = 'A';
+    while (work.length > 0 && !*exceeded)
+    {
+        dfa_node_t *di = vec_pop(&work);
+        di->id = id;
+        for (int k = 0; k < classes; ++k)
+        {
+            dfa_node_t *dj = dfa_next(nfa, di, representative[k]);
+            if (!dj)
+            {
+                continue;
+            }
+            int i = dfa_find(&hash, &dfa, dj);
+            if (i >= 0)
+            {
+                dfa_node_free(dj);
+                dj = dfa.data[i];
+            }
+            else
+            {
+                *bytes += dfa_node_bytes(dj);
+                vec_push(&dfa, dj);
+                vec_push(&work, dj);
+                dfa_hash_insert(&hash, &dfa, dfa.length - 1);
+            }
+            int j = 0;
+            while (j < di->next.length && di->next.data[j] != dj)
+            {
+                ++j;
+            }
+            if (j == di->next.length)
+            {
+                // the edge and the bitset of the bytes on it
+                *bytes += 2 * sizeof(void *) + sizeof(bitset_t) + 256 / 8;
+                vec_push(&di->next, dj);
+                vec_push(&di->chars, bitset_create());
             }
+            bitset_inplace_union(di->chars.data[j], members[k]);
+        }
+        ++id;
+        *exceeded = dfa.length > limits->max_dfa_states ? "state"
+                    : *bytes > limits->max_dfa_bytes    ? "memory"
+                                                        : NULL;
+    }
+    for (int k = 0; k < classes; ++k)
+    {
+        bitset_free(members[k]);
+    }
+    vec_deinit(&work);
+    free(hash.buckets);
+    for (int i = 0; i < dfa.length; ++i)
+    {
+        dfa.data[i]->index = i;
+    }
+    if (metrics)
+    {
+        metrics->dfa_states += dfa.length;
+        metrics->dfa_bytes += *bytes;
+        metrics_stop(PHASE_SUBSET, start);
+    }
+    return dfa;
+}
 
-            int nprinted = dtran->data[i].length;
-            int ncommas = ntransitions;
-            for (int *p = dtran->data[i].data, j = 0; j < dtran->data[i].length; ++j, ++p)
+// The engine planner. Before subset construction, a pass over the NFA
+// estimates how large the DFA would grow and looks for a literal every match
+// starts with, so that a pattern bound to blow up goes to the lazy engine
+// without building states only to throw them away.
+typedef enum
+{
+    PLAN_FULL,    // the whole DFA, built up front
+    PLAN_LAZY,    // states built as the input reaches them
+    PLAN_LITERAL, // the whole DFA, entered where its literal prefix is found
+} plan_engine_t;
+
+static const char *const plan_engine_names[] = {
+    "full",
+    "lazy",
+    "literal",
+};
+
+#define PLAN_LITERAL_MAX 64  // the longest literal prefix kept
+#define PLAN_LAZY_MARGIN 16  // how far over budget an estimate goes lazy untried
+#define PLAN_MAX_STATES 1e18 // where the estimate saturates
+
+typedef struct
+{
+    int nfa_nodes;
+    int positions; // NFA nodes that read a byte
+    bool search;   // a match may start at any offset
+    // groups of positions that carry on over some of the bytes a match
+    // starts on, but not all of them; see plan_estimate()
+    int ambiguous;
+    double states; // estimated DFA states
+    double bytes;  // and the heap they would take
+    unsigned char literal[PLAN_LITERAL_MAX];
+    int literal_length; // the bytes every match starts with, 0 for none
+    plan_engine_t engine;
+    char reason[128];
+    bool layout; // renumber the states for locality; see scanner_layout()
+    // for a literal set, built as a trie, the literals and their bytes; the
+    // NFA and estimate are then left at 0
+    int literals;
+    int literal_bytes;
+} plan_t;
+
+// Where a scan spends its time. profile_scan() takes the walk grep does
+// through the DFA, from the line start state on until a match or the death
+// of the walk, but a byte at a time without acceleration, so that every byte
+// counts against the state that read it.
+typedef struct
+{
+    int states;
+    int classes;
+    unsigned char class_of[256];
+    size_t total;    // bytes walked
+    size_t *bytes;   // read in each state
+    size_t *visits;  // times the walk started in or moved to each state
+    size_t *accepts; // matches found on entering each state
+    size_t *edges;   // transitions taken, states x classes
+    // where the walk is, so that input can come a chunk at a time
+    int state;
+    bool skipping; // to the end of the line, past a match or the walk's death
+} scan_profile_t;
+
+// Transitions of the profile from state over the bytes in chars.
+static size_t profile_edge(const scan_profile_t *profile, int state, const bitset_t *chars)
+{
+    bool seen[256] = {false};
+    size_t taken = 0;
+    for (int c = 0; c < 256; ++c)
+    {
+        int k = profile->class_of[c];
+        if (bitset_get(chars, c) && !seen[k])
+        {
+            seen[k] = true;
+            taken += profile->edges[(size_t)state * profile->classes + k];
+        }
+    }
+    return taken;
+}
+
+// Prints the DFA for dot(1). With a profile of the scanner built from it,
+// states are shaded by the share of the bytes they read, and edges are
+// labelled with the transitions taken and drawn the wider the more there are.
+static void dfa_to_dot(const dfa_t *dfa, const scan_profile_t *profile)
+{
+    printf("digraph dfa {\n");
+    if (profile)
+    {
+        printf("rankdir = LR\nnode [ style = filled, colorscheme = ylorrd9 ]\n");
+    }
+    size_t busiest = 1;
+    for (int i = 0; profile && i < dfa->length; ++i)
+    {
+        for (int j = 0; j < dfa->data[i]->next.length; ++j)
+        {
+            size_t taken = profile_edge(profile, i, dfa->data[i]->chars.data[j]);
+            busiest = taken > busiest ? taken : busiest;
+        }
+    }
+    for (int i = 0; i < dfa->length; ++i)
+    {
+        const dfa_node_t *di = dfa->data[i];
+        const char *shape = di->accepting || di->accept_at_end ? "doublecircle" : "circle";
+        if (profile)
+        {
+            double share = profile->total ? (double)profile->bytes[i] / profile->total : 0;
+            printf("%d [ shape = %s, fillcolor = %d, label = \"%d\\n%.1f%%\\n%zu in, %zu matched\" ]\n", i, shape,
+                   1 + (int)(share * 8.999), i, share * 100, profile->visits[i], profile->accepts[i]);
+        }
+        else
+        {
+            printf("%d [ shape = %s ]\n", i, shape);
+        }
+        for (int j = 0; j < di->next.length; ++j)
+        {
+            const dfa_node_t *dj = di->next.data[j];
+            printf("%d -> %d [ label = \"'", i, dj->index);
+            bitset_t *b = di->chars.data[j];
+            for (int c = 0; c < 256; ++c)
             {
-                if (ntransitions > threshold)
+                if (bitset_get(b, c))
                 {
-                    ++num_cells;
-                    --nprinted;
-                    fprintf(fp, "%5d", *p);
-                    if (j < dtran->data[i].length - 1)
+                    if (c == '\'' || c == '"' || c == '\\')
                     {
-                        fprintf(fp, ", ");
+                        printf("\\");
                     }
-                }
-                else if (*p != -1)
-                {
-                    num_cells += 2;
-                    if (numbers)
+                    if (c < ' ')
                     {
-                        fprintf(fp, "%d,%d", j, *p);
+                        printf("^%c", c + '@');
                     }
-                    else
+                    else if (c >= 0x7F)
                     {
-                        fprintf(fp, "'%s',%d", bin_to_ascii(j, 0), *p);
+                        printf("\\\\x%02X", c);
                     }
-                    nprinted -= 2;
-                    if (--ncommas > 0)
+                    else
                     {
-                        fprintf(fp, ", ");
+                        printf("%c", c);
                     }
                 }
-                if (nprinted <= 0)
-                {
-                    fprintf(fp, "\n" INDENT);
-                    nprinted = dtran->data[i].length;
-                }
             }
-            fprintf(fp, "};\n");
-        }
-    }
-    fprintf(fp, "\n%s %s *%s[%d] =\n{\n" INDENT, STORAGE_CLASS, TYPE, name, dtran->length);
-    int nprinted = 10;
-    for (int i = 0; i < dtran->length - 1; ++i)
-    {
-        int ntransitions = 0;
-        for (int *p = dtran->data[i].data, j = dtran->data[i].length; --j >= 0; ++p)
-        {
-            if (*p != -1)
+            if (profile)
             {
-                ++ntransitions;
+                size_t taken = profile_edge(profile, i, b);
+                printf("'\\n%zu\", penwidth = %.1f ]\n", taken, 1 + 7.0 * taken / busiest);
+            }
+            else
+            {
+                printf("'\" ]\n");
             }
         }
-        fprintf(fp, ntransitions ? "%s%-d, " : "NULL, ", name, i);
-        if (--nprinted <= 0)
+    }
+    printf("}\n");
+}
+
+typedef vec_t(dfa_node_t *) partition_t;
+typedef vec_t(partition_t *) vec_partition_t;
+
+static dfa_node_t *do_goto(dfa_node_t *node, unsigned char c)
+{
+    for (int i = 0; i < node->chars.length; ++i)
+    {
+        if (bitset_get(node->chars.data[i], c))
         {
-            fprintf(fp, "\n" INDENT);
-            nprinted = 10;
+            return node->next.data[i];
         }
     }
-    fprintf(fp, "%s%-d\n};\n\n", name, dtran->length - 1);
-    return num_cells;
+    return NULL;
 }
 
-static void pnext(FILE *fp, const char *name)
+static bool dfa_nodes_equivalent(dfa_node_t *n1, dfa_node_t *n2)
 {
-    static const char *toptext[] = {
-        "Given the current state and the current input character, return ",
-        "the next state.",
-        NULL,
-    };
-    static const char *boptext[] = {
-        "  int i;", "  if (p)",
-        "  {",      "    if ((i = *p++) == 0)",
-        "    {",    "      return p[c];",
-        "    }",    "    for (; --i >= 0; p += 2)",
-        "    {",    "      if (c == p[0])",
-        "      {",  "        return p[1];",
-        "      }",  "    }",
-        "  }",      "  return YYF;",
-        "}",        NULL,
-    };
-    fprintf(fp, "\n/*------------------------------------------------*/\n");
-    fprintf(fp, "%s %s yy_next(int cur_state, unsigned int c)\n", DECODING_ROUTINE_STORAGE_CLASS, TYPE);
-    fprintf(fp, "{\n");
-    comment(fp, toptext);
-    fprintf(fp, "  %s *p = %s[cur_state];\n", TYPE, name);
-    printv(fp, boptext);
+    for (int c = 0; c < 256; c++)
+    {
+        dfa_node_t *g1 = do_goto(n1, c);
+        dfa_node_t *g2 = do_goto(n2, c);
+        if (!g1 ^ !g2)
+        {
+            return false;
+        }
+        if (g1 && g1->partition != g2->partition)
+        {
+            return false;
+        }
+    }
+    return true;
 }
 
-int main(int argc, char *argv[])
+static dfa_t minimize_dfa(dfa_t *dfa)
 {
-    nfa_t nfa = thompson("^[ \\t]*//[ \\t]*TRACE[ \\t]*#[0-9]+[ \\t]*$");
-    // nfa_print(&nfa);
-    nfa_t nfa2 = thompson("^[ \\t]*#[0-9]+.*$");
-    // nfa_print(&nfa2);
+    double began = metrics_start();
+    // one partition per way of accepting: here, before the last byte, at
+    // the end of the input, and with rule sets per set of rules accepted
+    // for each partition:
+    //  for each state in the partition:
+    //   move all states that are not equivalent to the first
+    //   to a new partition
+    vec_partition_t partitions;
+    vec_init(&partitions);
+    int by_accept[8] = {-1, -1, -1, -1, -1, -1, -1, -1};
+    for (int i = 0; i < dfa->length; i++)
+    {
+        dfa_node_t *di = dfa->data[i];
+        int key = di->accepting | di->accept_before << 1 | di->accept_at_end << 2;
+        int p = by_accept[key];
+        if (di->rules || di->rules_at_end)
+        {
+            p = -1;
+            for (int j = 0; j < partitions.length && p < 0; ++j)
+            {
+                const dfa_node_t *first = partitions.data[j]->data[0];
+                if ((first->accepting | first->accept_before << 1 | first->accept_at_end << 2) == key &&
+                    rule_sets_equal(first->rules, di->rules) && rule_sets_equal(first->rules_at_end, di->rules_at_end))
+                {
+                    p = j;
+                }
+            }
+        }
+        if (p < 0)
+        {
+            partition_t *partition = malloc(sizeof(partition_t));
+            vec_init(partition);
+            p = partitions.length;
+            vec_push(&partitions, partition);
+            if (!di->rules && !di->rules_at_end)
+            {
+                by_accept[key] = p;
+            }
+        }
+        di->partition = p;
+        vec_push(partitions.data[p], di);
+    }
+    // splitting one partition can make members of an earlier one
+    // distinguishable, so repeat until a whole pass splits nothing
+    bool split = true;
+    while (split)
+    {
+        split = false;
+        for (int i = 0; i < partitions.length; ++i)
+        {
+            partition_t *partition = partitions.data[i];
+            dfa_node_t *first = partition->data[0];
+            partition_t *new_partition = NULL;
+            for (int j = 1; j < partition->length; ++j)
+            {
+                dfa_node_t *dij = partition->data[j];
+                if (dfa_nodes_equivalent(first, dij))
+                {
+                    continue;
+                }
+                if (new_partition == NULL)
+                {
+                    new_partition = malloc(sizeof(partition_t));
+                    vec_init(new_partition);
+                }
+                vec_push(new_partition, dij);
+                vec_splice(partition, j, 1);
+                --j;
+                dij->partition = partitions.length;
+            }
+            if (new_partition != NULL)
+            {
+                vec_push(&partitions, new_partition);
+                split = true;
+            }
+        }
+    }
+    // keep the start state first, as nfa_to_dfa() does
+    int start = dfa->data[0]->partition;
+    if (start != 0)
+    {
+        partition_t *t = partitions.data[0];
+        partitions.data[0] = partitions.data[start];
+        partitions.data[start] = t;
+        for (int j = 0; j < partitions.data[0]->length; ++j)
+        {
+            partitions.data[0]->data[j]->partition = 0;
+        }
+        for (int j = 0; j < partitions.data[start]->length; ++j)
+        {
+            partitions.data[start]->data[j]->partition = start;
+        }
+    }
 
-    dfa_t dfa = nfa_to_dfa(&nfa);
-    // dfa_to_dot(&dfa);
-    dfa_t min = minimize_dfa(&dfa);
-    // dfa_to_dot(&min);
+    vec_t(vec_int_t) pointers;
+    vec_init(&pointers);
+    for (int i = 0; i < partitions.length; ++i)
+    {
+        vec_int_t nx;
+        vec_init(&nx);
+        for (int j = 0; j < partitions.data[i]->data[0]->next.length; ++j)
+        {
+            vec_push(&nx, partitions.data[i]->data[0]->next.data[j]->partition);
+        }
+        vec_push(&pointers, nx);
+    }
 
-    emit_yy_next("UNMIN_TABLE");
-    printf("static const int UNMIN_TABLE[][] = ");
-    emit_dfa_state_table(&dfa);
+    dfa_t new_dfa;
+    vec_init(&new_dfa);
+    for (int i = 0; i < partitions.length; ++i)
+    {
+        dfa_node_t *node = malloc(sizeof(dfa_node_t));
+        dfa_node_t *old = partitions.data[i]->data[0];
+        node->index = i;
+        node->bitset = bitset_create();
+        node->id = i + 'A';
+        node->accepting = old->accepting;
+        node->accept_before = old->accept_before;
+        node->accept_at_end = old->accept_at_end;
+        node->rules = old->rules ? bitset_copy(old->rules) : NULL;
+        node->rules_at_end = old->rules_at_end ? bitset_copy(old->rules_at_end) : NULL;
+        node->context = -1;
+        node->starts = 0;
+        node->partition = i;
+        vec_init(&node->next);
+        vec_init(&node->chars);
+        for (int j = 0; j < old->chars.length; ++j)
+        {
+            vec_push(&node->chars, bitset_copy(old->chars.data[j]));
+        }
+        vec_push(&new_dfa, node);
+    }
+    for (int i = 0; i < partitions.length; ++i)
+    {
+        for (int j = 0; j < partitions.data[i]->length; ++j)
+        {
+            new_dfa.data[i]->starts |= partitions.data[i]->data[j]->starts;
+        }
+        vec_deinit(partitions.data[i]);
+        free(partitions.data[i]);
+    }
+    vec_deinit(&partitions);
+    for (int i = 0; i < new_dfa.length; ++i)
+    {
+        for (int j = 0; j < pointers.data[i].length; ++j)
+        {
+            vec_push(&new_dfa.data[i]->next, new_dfa.data[pointers.data[i].data[j]]);
+        }
+    }
+    vec_deinit(&pointers);
+    if (metrics)
+    {
+        metrics->min_dfa_states += new_dfa.length;
+        metrics_stop(PHASE_MINIMIZE, began);
+    }
+    return new_dfa;
+}
+
+static void emit_comment(const char *comment, ...)
+{
+    va_list args;
+    va_start(args, comment);
+    while (comment)
+    {
+        printf("// %s\n", comment);
+        comment = va_arg(args, const char *);
+    }
+    va_end(args);
+}
+
+static void emit_yy_next(const char *name)
+{
+    emit_comment("yy_next(state, c) is given the current state and next character,", "and evaluates to the next state.",
+                 NULL);
+    printf("#define yy_next(state, c)    %s[state][c]\n", name);
+}
+
+static void emit_dfa_state_table(const dfa_t *dfa)
+{
+    printf("{\n");
+    printf("/* 00000 */ { ");
+    for (int c = 0; c < 256; ++c)
+    {
+        printf("   -1, ");
+    }
+    printf("},\n");
+    for (int i = 0; i < dfa->length; ++i)
+    {
+        dfa_node_t *node = dfa->data[i];
+        printf("/* %05d */ { ", i + 1);
+        for (int c = 0; c < 256; ++c)
+        {
+            bool found = false;
+            for (int j = 0; j < node->next.length; ++j)
+            {
+                if (bitset_get(node->chars.data[j], c))
+                {
+                    found = true;
+                    printf("%5d, ", node->next.data[j]->index);
+                }
+            }
+            if (!found)
+            {
+                printf("    0, ");
+            }
+        }
+        printf("},\n");
+    }
+    printf("};\n");
+}
+
+#define NCOLS 10
+#define TYPE "YY_TTYPE"
+#define STORAGE_CLASS "YYPRIVATE"
+#define DECODING_ROUTINE_STORAGE_CLASS "YYPRIVATE"
+#define INDENT "          "
+
+static void dfa_free(dfa_t *dfa)
+{
+    for (int i = 0; i < dfa->length; ++i)
+    {
+        for (int j = 0; j < dfa->data[i]->chars.length; ++j)
+        {
+            bitset_free(dfa->data[i]->chars.data[j]);
+        }
+        bitset_free(dfa->data[i]->bitset);
+        vec_deinit(&dfa->data[i]->chars);
+        vec_deinit(&dfa->data[i]->next);
+        free(dfa->data[i]);
+    }
+    vec_deinit(dfa);
+}
+
+typedef vec_t(vec_int_t) dtran_t;
+
+dtran_t make_dtran(const dfa_t *dfa)
+{
+    dtran_t result;
+    vec_init(&result);
+    for (int i = 0; i < dfa->length; ++i)
+    {
+        vec_int_t dtran_row;
+        vec_init(&dtran_row);
+        for (int c = 0; c < 256; ++c)
+        {
+            vec_push(&dtran_row, -1);
+        }
+        for (int j = 0; j < dfa->data[i]->chars.length; ++j)
+        {
+            for (int c = 0; c < 256; ++c)
+            {
+                if (bitset_get(dfa->data[i]->chars.data[j], c))
+                {
+                    dtran_row.data[c] = dfa->data[i]->next.data[j]->index;
+                }
+            }
+        }
+        vec_push(&result, dtran_row);
+    }
+    return result;
+}
+
+static void show_dtran(const dtran_t *dtran)
+{
+    printf("{\n");
+    for (int i = 0; i < dtran->length; ++i)
+    {
+        printf("  [%d] = { ", i);
+        for (int j = 0; j < dtran->data[i].length; ++j)
+        {
+            printf("%d, ", dtran->data[i].data[j]);
+        }
+        printf("},\n");
+    }
+    printf("};\n");
+}
+
+static void dtran_free(dtran_t *dtran)
+{
+    for (int i = 0; i < dtran->length; ++i)
+    {
+        vec_deinit(&dtran->data[i]);
+    }
+    vec_deinit(dtran);
+}
+
+// A state is accelerated when it loops on every byte but a handful; the
+// scanner then searches for the next escaping byte instead of stepping
+// through the run one transition at a time.
+#define ACCEL_MAX_ESCAPES 4
+
+#define STATE_ACCEPTING (1 << 0)
+#define STATE_ACCELERATED (1 << 1)
+#define STATE_ACCEPTING_BEFORE (1 << 2) // a match ended before the byte just read
+#define STATE_ACCEPTING_AT_END (1 << 3) // a match ends here if the input does
+
+// Teddy searches for many short prefixes at once, fingerprinting the first
+// `width` bytes of each in nibble masks. Prefixes are dealt out to eight
+// buckets, one bit each; lo[j] and hi[j] map the low and the high nibble of
+// the j-th byte of a position to the buckets with a prefix that may read a
+// byte with that nibble there. A position is a candidate when a bucket's bit
+// survives the AND of the masks of its bytes, which pshufb looks up for 16
+// positions at once. A candidate is only that: the DFA walk from it decides.
+#define TEDDY_WIDTH 3
+#define TEDDY_BUCKETS 8
+#define TEDDY_MAX_PREFIXES 512
+#define TEDDY_MAX_RATE 0.05 // the most candidates per byte of text it pays for
+
+typedef struct
+{
+    int width;
+    bool simd; // the CPU has pshufb
+    unsigned char lo[TEDDY_WIDTH][16];
+    unsigned char hi[TEDDY_WIDTH][16];
+} teddy_t;
+
+typedef struct
+{
+    unsigned char escapes[ACCEL_MAX_ESCAPES];
+    int nescapes;
+    // some byte >= 0x80 escapes; all of them are then stopped at, which the
+    // sign bit checks instead of a compare each
+    bool escape_high;
+    // A start state that only leaves on the first byte of a literal every
+    // match starts with can skip to the next place the whole literal is
+    // found, searching for its rarest byte, at literal[rare]; literal_length
+    // is 0 otherwise.
+    const unsigned char *literal;
+    int literal_length;
+    int rare;
+    // A start state that many prefixes lead out of can instead skip to the
+    // next candidate teddy finds for them; NULL otherwise.
+    const teddy_t *teddy;
+} accel_t;
+
+// The shuffle engine keeps one byte per DFA state in a 128-bit register,
+// counting the dead state, and folds its transition vectors over blocks of
+// input small enough for a byte to hold an offset into the block. A search
+// takes shorter blocks, since it reads a block that accepts again byte by byte.
+#define SHUFFLE_MAX_STATES 16
+#define SHUFFLE_BLOCK 64
+#define SHUFFLE_FIND_BLOCK 16
+
+// A stride-2 table has a row per state and a column per pair of byte
+// classes; it is only built while it stays well inside a typical L2 cache.
+// An entry is the state two bytes on, with STRIDE2_MID_ACCEPT set when the
+// state between the two bytes accepts and STRIDE2_MID_BEFORE when it accepts
+// before the first of them.
+#define STRIDE2_MAX_BYTES (256 * 1024)
+#define STRIDE2_MID_ACCEPT 0x80000000u
+#define STRIDE2_MID_BEFORE 0x40000000u
+#define STRIDE2_STATE_MASK 0x3FFFFFFFu
+
+// A lazy DFA caches the states the input reaches in a table of
+// LAZY_CACHE_STATES rows, where a transition not taken yet reads
+// LAZY_UNKNOWN. A full cache is flushed but for the start states.
+#define LAZY_CACHE_STATES 4096
+#define LAZY_UNKNOWN (-2)
+
+typedef enum
+{
+    ENGINE_TABLE,
+    ENGINE_SHUFFLE,
+    ENGINE_STRIDE2,
+    ENGINE_LAZY,
+    ENGINE_BATCH, // the table, walking lines as independent records in lockstep
+} scanner_engine_t;
+
+static const char *const scanner_engine_names[] = {
+    "table",
+    "shuffle",
+    "stride2",
+    "lazy",
+    "batch",
+};
+
+typedef struct
+{
+    int nfa_states;
+    int dfa_states; // when the DFA was built in full
+    size_t dfa_bytes;
+    // the budget subset construction ran out of, "state" or "memory", for
+    // the lazy engine; NULL when the DFA was built in full
+    const char *fallback;
+    int min_dfa_states;
+    int classes;
+    int accelerated_states;
+    size_t table_bytes;
+    size_t stride2_bytes;
+    scanner_engine_t engine;
+    int tdfa_states; // 0 without COMPILE_CAPTURES
+    int tdfa_registers;
+    int teddy_prefixes; // 0 when the start state does without teddy
+    int teddy_width;
+    plan_t plan;
+    compile_metrics_t metrics; // zero unless compiled with COMPILE_METRICS
+} compile_stats_t;
+
+typedef struct tdfa_t tdfa_t;
+typedef struct lazy_dfa_t lazy_dfa_t;
+
+typedef struct scanner_t
+{
+    int states;
+    int classes;
+    int start; // starts[KIND_EDGE]
+    // the state to start in after each kind of byte, for assertions
+    int starts[KINDS];
+    unsigned char class_of[256];
+    // (states + 1) x classes, -1 where the DFA has no transition; the extra
+    // row belongs to the dead state, so a walk that maps -1 to `states` can
+    // keep indexing without a branch. For the lazy engine `states` is the
+    // size of its cache.
+    int *table;
+    unsigned char *flags;
+    accel_t *accel;
+    scanner_engine_t engine;
+    // classes x SHUFFLE_MAX_STATES next-state vectors, the dead state being
+    // number `states`; NULL when the DFA does not fit
+    unsigned char *shuffle;
+    unsigned char shuffle_accepting[SHUFFLE_MAX_STATES];
+    unsigned char shuffle_before[SHUFFLE_MAX_STATES];
+    // (states + 1) x classes x classes; NULL when it would be too large
+    uint32_t *stride2;
+    // the NFA and the cached states of the lazy engine, NULL for the others
+    lazy_dfa_t *lazy;
+    // the literal the start states skip to, NULL unless planned
+    unsigned char *literal;
+    // the prefixes the start state skips to, NULL unless they pay
+    teddy_t *teddy;
+    // capture groups, counting group 0, and the tagged DFA that extracts
+    // them; NULL unless compiled with COMPILE_CAPTURES or when too large
+    int groups;
+    tdfa_t *tdfa;
+    // the DFA of the reversed pattern, walked backwards from the end of a
+    // match to find its start; NULL unless compiled with COMPILE_REVERSE
+    struct scanner_t *reverse;
+    bool eol_anchored; // every rule ends in '$'
+    // Every rule starts with '^', so a search is left anchored and restarted
+    // at each line start. When a match can only begin with a few bytes,
+    // line_first finds the next line that starts with one of them.
+    bool bol_anchored;
+    bool skip_lines;
+    accel_t line_first;
+    // With COMPILE_RULE_SETS, each state's dfa_node_t rules and rules_at_end;
+    // NULL otherwise, and for the lazy engine, whose cached states hold them.
+    int nrules;
+    bitset_t **rules;
+    bitset_t **rules_at_end;
+    compile_stats_t stats;
+} scanner_t;
+
+static int dtran_get(const dtran_t *dtran, int state, int c)
+{
+    return c < dtran->data[state].length ? dtran->data[state].data[c] : -1;
+}
+
+static int make_byte_classes(const dtran_t *dtran, unsigned char *class_of)
+{
+    int representative[256];
+    int classes = 0;
+    for (int c = 0; c < 256; ++c)
+    {
+        int k = 0;
+        for (; k < classes; ++k)
+        {
+            int r = representative[k];
+            int s = 0;
+            while (s < dtran->length && dtran_get(dtran, s, c) == dtran_get(dtran, s, r))
+            {
+                ++s;
+            }
+            if (s == dtran->length)
+            {
+                break;
+            }
+        }
+        if (k == classes)
+        {
+            representative[classes++] = c;
+        }
+        class_of[c] = k;
+    }
+    return classes;
+}
+
+// A state that accepts before the byte leading to it reports a different end
+// on every turn of its loop, so it is never skipped through.
+static bool find_accel(const scanner_t *scanner, int state, accel_t *accel)
+{
+    const int *row = &scanner->table[state * scanner->classes];
+    if (scanner->flags[state] & STATE_ACCEPTING_BEFORE)
+    {
+        return false;
+    }
+    accel->nescapes = 0;
+    accel->escape_high = false;
+    accel->literal_length = 0;
+    accel->teddy = NULL;
+    for (int c = 0x80; c < 256; ++c)
+    {
+        if (row[scanner->class_of[c]] != state)
+        {
+            accel->escape_high = true;
+            break;
+        }
+    }
+    for (int c = 0; c < 0x80; ++c)
+    {
+        if (row[scanner->class_of[c]] == state)
+        {
+            continue;
+        }
+        if (accel->nescapes == ACCEL_MAX_ESCAPES)
+        {
+            return false;
+        }
+        accel->escapes[accel->nescapes++] = c;
+    }
+    return true;
+}
+
+static bool shuffle_supported(void)
+{
+#ifdef HAVE_X86_SIMD
+    return __builtin_cpu_supports("ssse3");
+#else
+    return false;
+#endif
+}
+
+static bool make_shuffle_tables(scanner_t *scanner)
+{
+    int dead = scanner->states;
+    scanner->shuffle = NULL;
+    if (dead >= SHUFFLE_MAX_STATES || !shuffle_supported())
+    {
+        return true;
+    }
+    scanner->shuffle = aligned_alloc(SHUFFLE_MAX_STATES, (size_t)scanner->classes * SHUFFLE_MAX_STATES);
+    if (!scanner->shuffle)
+    {
+        return false;
+    }
+    memset(scanner->shuffle_accepting, 0, SHUFFLE_MAX_STATES);
+    memset(scanner->shuffle_before, 0, SHUFFLE_MAX_STATES);
+    for (int k = 0; k < scanner->classes; ++k)
+    {
+        unsigned char *v = &scanner->shuffle[k * SHUFFLE_MAX_STATES];
+        for (int s = 0; s < SHUFFLE_MAX_STATES; ++s)
+        {
+            int next = s < scanner->states ? scanner->table[s * scanner->classes + k] : dead;
+            v[s] = next < 0 ? dead : next;
+        }
+    }
+    for (int s = 0; s < scanner->states; ++s)
+    {
+        if (scanner->flags[s] & STATE_ACCEPTING)
+        {
+            scanner->shuffle_accepting[s] = 0xFF;
+        }
+        if (scanner->flags[s] & STATE_ACCEPTING_BEFORE)
+        {
+            scanner->shuffle_before[s] = 0xFF;
+        }
+    }
+    return true;
+}
+
+static bool make_stride2_table(scanner_t *scanner)
+{
+    const int classes = scanner->classes;
+    const int dead = scanner->states;
+    size_t bytes = sizeof(uint32_t) * (size_t)(scanner->states + 1) * classes * classes;
+    scanner->stride2 = NULL;
+    scanner->stats.stride2_bytes = 0;
+    if (bytes > STRIDE2_MAX_BYTES)
+    {
+        return true;
+    }
+    scanner->stride2 = malloc(bytes);
+    if (!scanner->stride2)
+    {
+        return false;
+    }
+    for (int s = 0; s <= scanner->states; ++s)
+    {
+        for (int c1 = 0; c1 < classes; ++c1)
+        {
+            uint32_t *entry = &scanner->stride2[((size_t)s * classes + c1) * classes];
+            int mid = s == dead ? -1 : scanner->table[s * classes + c1];
+            for (int c2 = 0; c2 < classes; ++c2)
+            {
+                if (mid < 0)
+                {
+                    entry[c2] = dead;
+                    continue;
+                }
+                int next = scanner->table[mid * classes + c2];
+                entry[c2] = next < 0 ? dead : next;
+                if (scanner->flags[mid] & STATE_ACCEPTING)
+                {
+                    entry[c2] |= STRIDE2_MID_ACCEPT;
+                }
+                if (scanner->flags[mid] & STATE_ACCEPTING_BEFORE)
+                {
+                    entry[c2] |= STRIDE2_MID_BEFORE;
+                }
+            }
+        }
+    }
+    scanner->stats.stride2_bytes = bytes;
+    return true;
+}
+
+// Switches the execution engine, returning false when the compiled DFA cannot
+// run on the requested one.
+static bool scanner_select_engine(scanner_t *scanner, scanner_engine_t engine)
+{
+    if ((engine == ENGINE_SHUFFLE && !scanner->shuffle) || (engine == ENGINE_STRIDE2 && !scanner->stride2) ||
+        (scanner->lazy && engine != ENGINE_LAZY))
+    {
+        return false;
+    }
+    scanner->engine = engine;
+    scanner->stats.engine = engine;
+    return true;
+}
+
+// A state's place in the layout, sorted on by scanner_layout().
+typedef struct
+{
+    bool accepting;
+    size_t heat; // bytes read there in a profile
+    int rank;    // breadth first
+    int state;
+} layout_key_t;
+
+static int compare_layout_keys(const void *a, const void *b)
+{
+    const layout_key_t *x = a;
+    const layout_key_t *y = b;
+    if (x->accepting != y->accepting)
+    {
+        return x->accepting - y->accepting;
+    }
+    if (x->heat != y->heat)
+    {
+        return x->heat > y->heat ? -1 : 1;
+    }
+    return x->rank - y->rank;
+}
+
+// Renumbers the states so that the rows a walk goes through together share
+// cache lines and pages. Subset construction numbers states in the order its
+// work stack found them and minimization by partition, which scatters the
+// hot rows through the table. Here the start states come first, the edge one
+// as state 0, then the others breadth first from them or, given a profile of
+// this scanner, by the bytes read in them, busiest first. Accepting states go
+// last, next to the dead state's row. The tables built on the state numbers
+// are built again; a lazy DFA is left as it is.
+static bool scanner_layout(scanner_t *scanner, const scan_profile_t *profile)
+{
+    if (scanner->lazy)
+    {
+        return true;
+    }
+    const int states = scanner->states;
+    const int classes = scanner->classes;
+    int *order = malloc(sizeof(int) * states);
+    int *renumber = malloc(sizeof(int) * states);
+    layout_key_t *keys = malloc(sizeof(layout_key_t) * states);
+    int *table = malloc(sizeof(int) * (size_t)(states + 1) * classes);
+    unsigned char *flags = calloc(states + 1, 1);
+    accel_t *accel = malloc(sizeof(accel_t) * states);
+    bitset_t **rules = scanner->rules ? malloc(sizeof(bitset_t *) * states) : NULL;
+    bitset_t **rules_at_end = scanner->rules ? malloc(sizeof(bitset_t *) * states) : NULL;
+    if (!order || !renumber || !keys || !table || !flags || !accel || (scanner->rules && (!rules || !rules_at_end)))
+    {
+        free(order);
+        free(renumber);
+        free(keys);
+        free(table);
+        free(flags);
+        free(accel);
+        free(rules);
+        free(rules_at_end);
+        return false;
+    }
+    for (int s = 0; s < states; ++s)
+    {
+        renumber[s] = -1;
+    }
+    int length = 0;
+    for (int k = -1; k < KINDS; ++k)
+    {
+        int s = scanner->starts[k < 0 ? KIND_EDGE : k];
+        if (renumber[s] < 0)
+        {
+            renumber[s] = length;
+            order[length++] = s;
+        }
+    }
+    const int starts = length;
+    for (int head = 0; head < length; ++head)
+    {
+        for (int k = 0; k < classes; ++k)
+        {
+            int t = scanner->table[order[head] * classes + k];
+            if (t >= 0 && renumber[t] < 0)
+            {
+                renumber[t] = length;
+                order[length++] = t;
+            }
+        }
+    }
+    for (int s = 0; s < states; ++s)
+    {
+        if (renumber[s] < 0)
+        {
+            order[length++] = s;
+        }
+    }
+    for (int i = starts; i < states; ++i)
+    {
+        int s = order[i];
+        keys[i] = (layout_key_t){
+            .accepting = (scanner->flags[s] & STATE_ACCEPTING) != 0,
+            .heat = profile ? profile->bytes[s] : 0,
+            .rank = i,
+            .state = s,
+        };
+    }
+    qsort(keys + starts, states - starts, sizeof(layout_key_t), compare_layout_keys);
+    for (int i = starts; i < states; ++i)
+    {
+        order[i] = keys[i].state;
+    }
+    for (int i = 0; i < states; ++i)
+    {
+        renumber[order[i]] = i;
+    }
+    free(order);
+    free(keys);
+
+    for (int s = 0; s < states; ++s)
+    {
+        int r = renumber[s];
+        flags[r] = scanner->flags[s];
+        accel[r] = scanner->accel[s];
+        if (rules)
+        {
+            rules[r] = scanner->rules[s];
+            rules_at_end[r] = scanner->rules_at_end[s];
+        }
+        for (int k = 0; k < classes; ++k)
+        {
+            int t = scanner->table[s * classes + k];
+            table[r * classes + k] = t < 0 ? -1 : renumber[t];
+        }
+    }
+    for (int k = 0; k < classes; ++k)
+    {
+        table[states * classes + k] = -1;
+    }
+    free(scanner->table);
+    free(scanner->flags);
+    free(scanner->accel);
+    scanner->table = table;
+    scanner->flags = flags;
+    scanner->accel = accel;
+    if (rules)
+    {
+        free(scanner->rules);
+        free(scanner->rules_at_end);
+        scanner->rules = rules;
+        scanner->rules_at_end = rules_at_end;
+    }
+    for (int k = 0; k < KINDS; ++k)
+    {
+        scanner->starts[k] = renumber[scanner->starts[k]];
+    }
+    scanner->start = scanner->starts[KIND_EDGE];
+    free(renumber);
+    bool ok = true;
+    if (scanner->shuffle)
+    {
+        free(scanner->shuffle);
+        ok = make_shuffle_tables(scanner);
+    }
+    if (scanner->stride2)
+    {
+        free(scanner->stride2);
+        ok = make_stride2_table(scanner) && ok;
+    }
+    return ok;
+}
+
+// Allocates the table, flags and accelerations of a scanner with states and
+// classes, the dead state's row filled in; returns false when out of memory.
+static bool scanner_alloc(scanner_t *scanner, int states, int classes)
+{
+    scanner->states = states;
+    scanner->start = 0;
+    scanner->classes = classes;
+    scanner->table = malloc(sizeof(int) * (states + 1) * classes);
+    scanner->flags = calloc(states + 1, 1);
+    scanner->accel = calloc(states, sizeof(accel_t));
+    scanner->shuffle = NULL;
+    scanner->stride2 = NULL;
+    scanner->lazy = NULL;
+    if (!scanner->table || !scanner->flags || !scanner->accel)
+    {
+        return false;
+    }
+    for (int k = 0; k < classes; ++k)
+    {
+        scanner->table[states * classes + k] = -1;
+    }
+    return true;
+}
+
+// Accelerates the states of a scanner whose table, flags and start states
+// are filled in, and picks the engine that walks it.
+static bool scanner_finish(scanner_t *scanner)
+{
+    scanner->stats.classes = scanner->classes;
+    scanner->stats.min_dfa_states = scanner->states;
+    scanner->stats.table_bytes = sizeof(int) * (size_t)(scanner->states + 1) * scanner->classes;
+    scanner->stats.accelerated_states = 0;
+    for (int s = 0; s < scanner->states; ++s)
+    {
+        if (find_accel(scanner, s, &scanner->accel[s]))
+        {
+            scanner->flags[s] |= STATE_ACCELERATED;
+            ++scanner->stats.accelerated_states;
+        }
+    }
+    if (!make_shuffle_tables(scanner) || !make_stride2_table(scanner))
+    {
+        return false;
+    }
+    scanner_select_engine(scanner, scanner->shuffle   ? ENGINE_SHUFFLE
+                                   : scanner->stride2 ? ENGINE_STRIDE2
+                                                      : ENGINE_TABLE);
+    return true;
+}
+
+static bool scanner_init(scanner_t *scanner, const dfa_t *min)
+{
+    dtran_t dtran = make_dtran(min);
+    int classes = make_byte_classes(&dtran, scanner->class_of);
+    if (!scanner_alloc(scanner, dtran.length, classes))
+    {
+        dtran_free(&dtran);
+        return false;
+    }
+    for (int s = 0; s < scanner->states; ++s)
+    {
+        for (int c = 0; c < 256; ++c)
+        {
+            scanner->table[s * classes + scanner->class_of[c]] = dtran_get(&dtran, s, c);
+        }
+    }
+    dtran_free(&dtran);
+
+    for (int s = 0; s < scanner->states; ++s)
+    {
+        const dfa_node_t *node = min->data[s];
+        scanner->flags[s] = (node->accepting ? STATE_ACCEPTING : 0) |
+                            (node->accept_before ? STATE_ACCEPTING_BEFORE : 0) |
+                            (node->accept_at_end ? STATE_ACCEPTING_AT_END : 0);
+        for (int k = 0; k < KINDS; ++k)
+        {
+            if (node->starts & KIND_BIT(k))
+            {
+                scanner->starts[k] = s;
+            }
+        }
+    }
+    return scanner_finish(scanner);
+}
+
+// Takes over the rule sets of the states of min, for COMPILE_RULE_SETS.
+static bool scanner_init_rules(scanner_t *scanner, dfa_t *min)
+{
+    scanner->rules = malloc(sizeof(bitset_t *) * scanner->states);
+    scanner->rules_at_end = malloc(sizeof(bitset_t *) * scanner->states);
+    if (!scanner->rules || !scanner->rules_at_end)
+    {
+        free(scanner->rules);
+        free(scanner->rules_at_end);
+        scanner->rules = scanner->rules_at_end = NULL;
+        return false;
+    }
+    for (int s = 0; s < scanner->states; ++s)
+    {
+        dfa_node_t *node = min->data[s];
+        scanner->rules[s] = node->rules;
+        scanner->rules_at_end[s] = node->rules_at_end;
+        node->rules = node->rules_at_end = NULL;
+    }
+    return true;
+}
+
+// The lazy engine runs subset construction one transition at a time, when a
+// walk first takes it, so only the states the input reaches are ever built.
+struct lazy_dfa_t
+{
+    nfa_t nfa;
+    dfa_t states; // the start states first
+    int pinned;   // start states, kept on a flush
+    dfa_hash_t hash;
+    int flushes;
+};
+
+// Caches node, which the cache has room for and does not hold yet.
+static int lazy_add(const scanner_t *scanner, dfa_node_t *node)
+{
+    lazy_dfa_t *lazy = scanner->lazy;
+    int i = lazy->states.length;
+    node->index = i;
+    vec_push(&lazy->states, node);
+    dfa_hash_insert(&lazy->hash, &lazy->states, i);
+    for (int k = 0; k < scanner->classes; ++k)
+    {
+        scanner->table[i * scanner->classes + k] = LAZY_UNKNOWN;
+    }
+    scanner->flags[i] = (node->accepting ? STATE_ACCEPTING : 0) | (node->accept_before ? STATE_ACCEPTING_BEFORE : 0) |
+                        (node->accept_at_end ? STATE_ACCEPTING_AT_END : 0);
+    return i;
+}
+
+// Empties the cache but for the start states, whose transitions are
+// forgotten too, as they lead to states that are gone.
+static void lazy_flush(const scanner_t *scanner)
+{
+    lazy_dfa_t *lazy = scanner->lazy;
+    while (lazy->states.length > lazy->pinned)
+    {
+        dfa_node_free(vec_pop(&lazy->states));
+    }
+    free(lazy->hash.buckets);
+    dfa_hash_init(&lazy->hash, 2 * LAZY_CACHE_STATES);
+    dfa_t pinned = lazy->states;
+    vec_init(&lazy->states);
+    for (int i = 0; i < pinned.length; ++i)
+    {
+        lazy_add(scanner, pinned.data[i]);
+    }
+    vec_deinit(&pinned);
+    ++lazy->flushes;
+}
+
+// Makes the transition from state on c that the table does not have yet,
+// and returns where it leads, -1 when nowhere. After a flush, state is gone
+// and only the state returned is valid.
+static int lazy_step(const scanner_t *scanner, int state, unsigned char c)
+{
+    lazy_dfa_t *lazy = scanner->lazy;
+    dfa_node_t *next = dfa_next(&lazy->nfa, lazy->states.data[state], c);
+    int i = next ? dfa_find(&lazy->hash, &lazy->states, next) : -1;
+    bool flushed = false;
+    if (i >= 0)
+    {
+        dfa_node_free(next);
+    }
+    else if (next)
+    {
+        if (lazy->states.length == scanner->states)
+        {
+            lazy_flush(scanner);
+            flushed = true;
+        }
+        i = lazy_add(scanner, next);
+    }
+    if (!flushed || state < lazy->pinned)
+    {
+        scanner->table[state * scanner->classes + scanner->class_of[c]] = i;
+    }
+    return i;
+}
+
+// The state after reading c in state, -1 for none; a lazy DFA makes the
+// transition the first time it is taken.
+static inline int scanner_next(const scanner_t *scanner, int state, unsigned char c)
+{
+    int next = scanner->table[state * scanner->classes + scanner->class_of[c]];
+    return next != LAZY_UNKNOWN ? next : lazy_step(scanner, state, c);
+}
+
+// Sets up the lazy engine for nfa, taking it over.
+static bool lazy_init(scanner_t *scanner, nfa_t *nfa)
+{
+    lazy_dfa_t *lazy = calloc(1, sizeof(lazy_dfa_t));
+    scanner->lazy = lazy;
+    scanner->states = LAZY_CACHE_STATES;
+    scanner->classes = nfa_byte_classes(nfa, scanner->class_of);
+    scanner->table = malloc(sizeof(int) * (scanner->states + 1) * scanner->classes);
+    scanner->flags = calloc(scanner->states + 1, 1);
+    scanner->accel = calloc(scanner->states, sizeof(accel_t));
+    scanner->shuffle = NULL;
+    scanner->stride2 = NULL;
+    if (!lazy || !scanner->table || !scanner->flags || !scanner->accel)
+    {
+        nfa_free(nfa);
+        return false;
+    }
+    lazy->nfa = *nfa;
+    vec_init(&lazy->states);
+    dfa_hash_init(&lazy->hash, 2 * LAZY_CACHE_STATES);
+    for (int k = 0; k < scanner->classes; ++k)
+    {
+        scanner->table[scanner->states * scanner->classes + k] = -1;
+    }
+    for (int k = 0; k < KINDS; ++k)
+    {
+        bitset_t *init = bitset_create();
+        bitset_set(init, lazy->nfa.start);
+        dfa_node_t *node = dfa_state(&lazy->nfa, init, k, false);
+        int i = dfa_find(&lazy->hash, &lazy->states, node);
+        if (i >= 0)
+        {
+            dfa_node_free(node);
+        }
+        scanner->starts[k] = i >= 0 ? i : lazy_add(scanner, node);
+    }
+    lazy->pinned = lazy->states.length;
+    scanner->start = scanner->starts[KIND_EDGE];
+    scanner->stats.classes = scanner->classes;
+    scanner->stats.min_dfa_states = 0;
+    scanner->stats.table_bytes = sizeof(int) * (size_t)(scanner->states + 1) * scanner->classes;
+    scanner->stats.stride2_bytes = 0;
+    scanner->stats.accelerated_states = 0;
+    scanner_select_engine(scanner, ENGINE_LAZY);
+    return true;
+}
+
+static void lazy_free(lazy_dfa_t *lazy)
+{
+    if (lazy)
+    {
+        nfa_free(&lazy->nfa);
+        for (int i = 0; i < lazy->states.length; ++i)
+        {
+            dfa_node_free(lazy->states.data[i]);
+        }
+        vec_deinit(&lazy->states);
+        free(lazy->hash.buckets);
+        free(lazy);
+    }
+}
+
+// A tagged DFA (Laurikari) for capture groups. Each state is an ordered list
+// of NFA configurations, highest priority first, and each configuration
+// keeps the register that holds every tag. Transitions carry the register
+// operations that keep those values current, so a single pass over the input
+// yields the submatch offsets. Configurations that rank below an accepting one
+// are dropped, which gives leftmost-first semantics: the answer a
+// backtracking matcher would give. An assertion that looks ahead stays a
+// configuration of its own until the next byte, or the end of the input,
+// settles it.
+
+#define TDFA_MAX_STATES 4096
+#define REG_NULL 0   // never written; reads as an unset tag
+#define OP_AFTER -1  // an operation source: the offset after the byte read
+#define OP_BEFORE -2 // the offset of the byte read, for tags passed settling an assertion on it
+#define TDFA_NOW -1  // in a final map: the offset the match ends at
+
+typedef struct
+{
+    int dst;
+    int src; // the register copied, or OP_AFTER or OP_BEFORE
+} tdfa_op_t;
+
+typedef vec_t(tdfa_op_t) vec_tdfa_op_t;
+
+struct tdfa_t
+{
+    int states;
+    int classes;
+    int tags;
+    int registers;
+    int start; // -1 if nothing can match
+    unsigned char class_of[256];
+    int *next; // states x classes, -1 where the match cannot go on
+    // states x classes + 1 offsets into ops for each transition
+    int *op_start;
+    tdfa_op_t *ops;
+    tdfa_op_t *init_ops; // applied at offset 0, before entering start
+    int init_count;
+    bool *accepting;
+    int *final; // states x tags: the register holding each tag on acceptance
+    // Matches that an assertion completes just before a byte or at the end of
+    // the input. Each is an offset into finals, where the tags registers of a
+    // final map are read before the transition's operations, or -1.
+    int *before; // states x classes
+    int *at_end; // states
+    int *finals;
+    ptrdiff_t *regs;
+};
+
+typedef struct
+{
+    int count;
+    int *nfa;    // count NFA nodes, highest priority first
+    int *regs;   // count x tags
+    int accept;  // index of the accepting configuration, -1 if none
+    int context; // the kind of byte behind, when an assertion waits; else -1
+} tdfa_state_t;
+
+typedef vec_t(tdfa_state_t) vec_tdfa_state_t;
+
+typedef struct
+{
+    const nfa_t *nfa;
+    int tags;
+    int registers;
+    int temp; // scratch register for breaking copy cycles, 0 until needed
+    vec_tdfa_state_t states;
+    // the state being built
+    vec_int_t nfa_out;
+    vec_int_t regs_out;
+    int context_out;
+    // the configurations left once the waiting assertions are settled, and
+    // the registers of a match they complete
+    vec_int_t nfa_settled;
+    vec_int_t regs_settled;
+    vec_int_t final_out;
+    int *fresh;        // per tag, the register set to the offset after the byte
+    int *fresh_before; // ...and to the offset of the byte, while settling
+    unsigned *marks;
+    unsigned generation;
+    // register renaming between a new state and an existing one
+    vec_int_t forward;
+    vec_int_t backward;
+} tdfa_builder_t;
+
+// Splits the bytes into classes that every NFA edge either contains or
+// excludes, and that never mix kinds of byte if an assertion looks at them.
+static int nfa_byte_classes(const nfa_t *nfa, unsigned char class_of[256])
+{
+    bool asserts = false;
+    for (int i = 0; i < nfa->nfa.length && !asserts; ++i)
+    {
+        const nfa_node_t *p = nfa->nfa.data[i];
+        asserts = p && (p->behind || p->ahead);
+    }
+    int size[256] = {0};
+    // the kinds of byte are 1 to KINDS - 1
+    int classes = asserts ? KINDS - 1 : 1;
+    for (int c = 0; c < 256; ++c)
+    {
+        class_of[c] = asserts ? byte_kind(c) - 1 : 0;
+        ++size[class_of[c]];
+    }
+    for (int i = 0; i < nfa->nfa.length; ++i)
+    {
+        const nfa_node_t *p = nfa->nfa.data[i];
+        if (!p || p->next[0] == NULL || p->edge == EDGE_EPSILON)
+        {
+            continue;
+        }
+        int inside[256] = {0};
+        int split[256];
+        for (int c = 0; c < 256; ++c)
+        {
+            inside[class_of[c]] += nfa_edge_matches(p, c);
+        }
+        for (int k = 0; k < classes; ++k)
+        {
+            split[k] = inside[k] > 0 && inside[k] < size[k] ? classes++ : -1;
+        }
+        for (int c = 0; c < 256; ++c)
+        {
+            int k = class_of[c];
+            if (split[k] >= 0 && nfa_edge_matches(p, c))
+            {
+                class_of[c] = split[k];
+                --size[k];
+                ++size[split[k]];
+            }
+        }
+    }
+    return classes;
+}
+
+static bool tdfa_waiting(const nfa_node_t *p)
+{
+    return p->edge == EDGE_EPSILON && p->next[0] != NULL;
+}
+
+static void tdfa_new_generation(tdfa_builder_t *b)
+{
+    if (++b->generation == 0)
+    {
+        memset(b->marks, 0, sizeof(unsigned) * b->nfa->nfa.length);
+        b->generation = 1;
+    }
+}
+
+// Adds the configurations reachable from node over epsilon edges whose
+// assertions hold between bytes of kinds behind and ahead, in priority order,
+// applying the tags passed on the way. A node that looks ahead while ahead is
+// KIND_UNKNOWN is added as a configuration that waits for the next byte. Tags
+// take fresh registers, set from src.
+static void tdfa_closure(tdfa_builder_t *b, const nfa_node_t *node, const int *regs, int behind, int ahead,
+                         int *fresh, int src)
+{
+    if (b->marks[node->index] == b->generation)
+    {
+        return;
+    }
+    b->marks[node->index] = b->generation;
+    if (tdfa_waiting(node))
+    {
+        if (node->behind && !(node->behind & KIND_BIT(behind)))
+        {
+            return;
+        }
+        if (node->ahead && ahead == KIND_UNKNOWN)
+        {
+            vec_push(&b->nfa_out, node->index);
+            for (int t = 0; t < b->tags; ++t)
+            {
+                vec_push(&b->regs_out, regs[t]);
+            }
+            return;
+        }
+        if (node->ahead && !(node->ahead & KIND_BIT(ahead)))
+        {
+            return;
+        }
+    }
+    int tagged[b->tags];
+    if (node->tag != TAG_NONE)
+    {
+        int t = node->tag - 1;
+        memcpy(tagged, regs, sizeof(int) * b->tags);
+        if (!fresh[t])
+        {
+            fresh[t] = b->registers++;
+        }
+        tagged[t] = fresh[t];
+        regs = tagged;
+    }
+    if (tdfa_waiting(node))
+    {
+        tdfa_closure(b, node->next[0], regs, behind, ahead, fresh, src);
+        if (node->next[1])
+        {
+            tdfa_closure(b, node->next[1], regs, behind, ahead, fresh, src);
+        }
+    }
+    else
+    {
+        vec_push(&b->nfa_out, node->index);
+        for (int t = 0; t < b->tags; ++t)
+        {
+            vec_push(&b->regs_out, regs[t]);
+        }
+    }
+}
+
+// The operation source that sets fresh register r.
+static int tdfa_fresh_source(const tdfa_builder_t *b, int r)
+{
+    for (int t = 0; t < b->tags; ++t)
+    {
+        if (b->fresh_before[t] == r)
+        {
+            return OP_BEFORE;
+        }
+    }
+    return OP_AFTER;
+}
+
+// Keeps the registers of the accepting configuration i of nfa_out in
+// final_out, with those set on this step, from first_fresh on, read as the
+// offset the match ends at.
+static void tdfa_keep_final(tdfa_builder_t *b, int i, int first_fresh)
+{
+    vec_clear(&b->final_out);
+    for (int t = 0; t < b->tags; ++t)
+    {
+        int r = b->regs_out.data[i * b->tags + t];
+        vec_push(&b->final_out, r >= first_fresh ? TDFA_NOW : r);
+    }
+}
+
+// Builds the configurations that follow state on byte c into nfa_out and
+// regs_out, or the initial ones when state is negative. The assertions that
+// wait in state are settled on c first; when that completes a match ending
+// before c, *before is set and final_out holds its final map. Returns how
+// many configurations survive the cut below the first accepting one, if cut.
+static int tdfa_step(tdfa_builder_t *b, int state, int c, bool cut, int *accept, bool *before)
+{
+    int first_fresh = b->registers;
+    vec_clear(&b->nfa_out);
+    vec_clear(&b->regs_out);
+    memset(b->fresh, 0, sizeof(int) * b->tags);
+    memset(b->fresh_before, 0, sizeof(int) * b->tags);
+    tdfa_new_generation(b);
+    *before = false;
+    int kind = state < 0 ? KIND_EDGE : byte_kind(c);
+    if (state < 0)
+    {
+        int unset[b->tags];
+        memset(unset, 0, sizeof(unset));
+        tdfa_closure(b, b->nfa->nfa.data[b->nfa->start], unset, KIND_EDGE, KIND_UNKNOWN, b->fresh, OP_AFTER);
+    }
+    else
+    {
+        tdfa_state_t from = b->states.data[state];
+        for (int i = 0; i < from.count; ++i)
+        {
+            const nfa_node_t *p = b->nfa->nfa.data[from.nfa[i]];
+            if (tdfa_waiting(p))
+            {
+                tdfa_closure(b, p, &from.regs[i * b->tags], from.context, kind, b->fresh_before, OP_BEFORE);
+            }
+            else if (p->next[0] && b->marks[p->index] != b->generation)
+            {
+                b->marks[p->index] = b->generation;
+                vec_push(&b->nfa_out, p->index);
+                for (int t = 0; t < b->tags; ++t)
+                {
+                    vec_push(&b->regs_out, from.regs[i * b->tags + t]);
+                }
+            }
+        }
+        for (int i = 0; i < b->nfa_out.length; ++i)
+        {
+            if (b->nfa->nfa.data[b->nfa_out.data[i]]->next[0] == NULL)
+            {
+                *before = true;
+                tdfa_keep_final(b, i, first_fresh);
+                b->nfa_out.length = i;
+                break;
+            }
+        }
+        vec_int_t swap = b->nfa_settled;
+        b->nfa_settled = b->nfa_out;
+        b->nfa_out = swap;
+        swap = b->regs_settled;
+        b->regs_settled = b->regs_out;
+        b->regs_out = swap;
+        vec_clear(&b->nfa_out);
+        vec_clear(&b->regs_out);
+        tdfa_new_generation(b);
+        for (int i = 0; i < b->nfa_settled.length; ++i)
+        {
+            const nfa_node_t *p = b->nfa->nfa.data[b->nfa_settled.data[i]];
+            if (nfa_edge_matches(p, c))
+            {
+                tdfa_closure(b, p->next[0], &b->regs_settled.data[i * b->tags], kind, KIND_UNKNOWN, b->fresh,
+                             OP_AFTER);
+            }
+        }
+    }
+    *accept = -1;
+    b->context_out = -1;
+    for (int i = 0; i < b->nfa_out.length; ++i)
+    {
+        const nfa_node_t *p = b->nfa->nfa.data[b->nfa_out.data[i]];
+        if (p->next[0] == NULL)
+        {
+            *accept = i;
+            return cut ? i + 1 : b->nfa_out.length;
+        }
+        if (tdfa_waiting(p))
+        {
+            b->context_out = kind;
+        }
+    }
+    return b->nfa_out.length;
+}
+
+// Settles the assertions that wait in state against the end of the input.
+// Returns whether that completes a match that ranks above the state's own,
+// leaving its final map in final_out.
+static bool tdfa_at_end(tdfa_builder_t *b, int state)
+{
+    tdfa_state_t from = b->states.data[state];
+    if (from.context < 0)
+    {
+        return false;
+    }
+    int first_fresh = b->registers;
+    vec_clear(&b->nfa_out);
+    vec_clear(&b->regs_out);
+    memset(b->fresh_before, 0, sizeof(int) * b->tags);
+    tdfa_new_generation(b);
+    bool found = false;
+    for (int i = 0; i < from.count && !found; ++i)
+    {
+        const nfa_node_t *p = b->nfa->nfa.data[from.nfa[i]];
+        if (p->next[0] == NULL)
+        {
+            break;
+        }
+        int seen = b->nfa_out.length;
+        if (tdfa_waiting(p))
+        {
+            tdfa_closure(b, p, &from.regs[i * b->tags], from.context, KIND_EDGE, b->fresh_before, OP_BEFORE);
+        }
+        for (int j = seen; j < b->nfa_out.length && !found; ++j)
+        {
+            if (b->nfa->nfa.data[b->nfa_out.data[j]]->next[0] == NULL)
+            {
+                tdfa_keep_final(b, j, first_fresh);
+                found = true;
+            }
+        }
+    }
+    b->registers = first_fresh;
+    return found;
+}
+
+// Tries to rename the registers of the state just built into those of
+// existing. On success forward maps each of the new registers.
+static bool tdfa_rename(tdfa_builder_t *b, const tdfa_state_t *existing)
+{
+    int n = existing->count * b->tags;
+    while (b->forward.length < b->registers)
+    {
+        vec_push(&b->forward, -1);
+        vec_push(&b->backward, -1);
+    }
+    bool ok = true;
+    for (int k = 0; k < n && ok; ++k)
+    {
+        int r = b->regs_out.data[k];
+        int q = existing->regs[k];
+        if (r == REG_NULL || q == REG_NULL)
+        {
+            ok = r == q;
+        }
+        else if (b->forward.data[r] < 0 && b->backward.data[q] < 0)
+        {
+            b->forward.data[r] = q;
+            b->backward.data[q] = r;
+        }
+        else
+        {
+            ok = b->forward.data[r] == q && b->backward.data[q] == r;
+        }
+    }
+    if (!ok)
+    {
+        for (int k = 0; k < n; ++k)
+        {
+            b->forward.data[b->regs_out.data[k]] = -1;
+            b->backward.data[existing->regs[k]] = -1;
+        }
+    }
+    return ok;
+}
+
+// Turns the parallel copies in forward into a sequence that never overwrites
+// a register before it has been read, then adds the position sets.
+static void tdfa_rename_ops(tdfa_builder_t *b, const tdfa_state_t *existing, int first_fresh, vec_tdfa_op_t *ops)
+{
+    vec_tdfa_op_t copies;
+    vec_init(&copies);
+    int n = existing->count * b->tags;
+    for (int k = 0; k < n; ++k)
+    {
+        int r = b->regs_out.data[k];
+        int q = existing->regs[k];
+        if (r == REG_NULL || b->forward.data[r] < 0)
+        {
+            continue;
+        }
+        b->forward.data[r] = -1;
+        b->backward.data[q] = -1;
+        if (r >= first_fresh)
+        {
+            continue;
+        }
+        if (r != q)
+        {
+            tdfa_op_t op = {q, r};
+            vec_push(&copies, op);
+        }
+    }
+    while (copies.length > 0)
+    {
+        bool progress = false;
+        for (int i = 0; i < copies.length; ++i)
+        {
+            bool read_later = false;
+            for (int j = 0; j < copies.length && !read_later; ++j)
+            {
+                read_later = j != i && copies.data[j].src == copies.data[i].dst;
+            }
+            if (!read_later)
+            {
+                vec_push(ops, copies.data[i]);
+                vec_splice(&copies, i, 1);
+                --i;
+                progress = true;
+            }
+        }
+        if (!progress)
+        {
+            // every pending copy is on a cycle: park one destination's value
+            if (!b->temp)
+            {
+                b->temp = b->registers++;
+            }
+            int parked = copies.data[0].dst;
+            tdfa_op_t save = {b->temp, parked};
+            vec_push(ops, save);
+            for (int j = 0; j < copies.length; ++j)
+            {
+                if (copies.data[j].src == parked)
+                {
+                    copies.data[j].src = b->temp;
+                }
+            }
+        }
+    }
+    vec_deinit(&copies);
+    for (int k = 0; k < n; ++k)
+    {
+        int r = b->regs_out.data[k];
+        int q = existing->regs[k];
+        if (r >= first_fresh && b->backward.data[q] != -2)
+        {
+            tdfa_op_t op = {q, tdfa_fresh_source(b, r)};
+            vec_push(ops, op);
+            b->backward.data[q] = -2;
+        }
+    }
+    for (int k = 0; k < n; ++k)
+    {
+        b->backward.data[existing->regs[k]] = -1;
+    }
+}
+
+// Finds or adds the state just built and appends the operations that lead to
+// it. Returns the state, or -1 when there are too many.
+static int tdfa_intern(tdfa_builder_t *b, int count, int accept, int first_fresh, vec_tdfa_op_t *ops)
+{
+    for (int s = 0; s < b->states.length; ++s)
+    {
+        tdfa_state_t *existing = &b->states.data[s];
+        if (existing->count == count && existing->context == b->context_out &&
+            memcmp(existing->nfa, b->nfa_out.data, sizeof(int) * count) == 0 && tdfa_rename(b, existing))
+        {
+            b->registers = first_fresh;
+            tdfa_rename_ops(b, existing, first_fresh, ops);
+            return s;
+        }
+    }
+    if (b->states.length == TDFA_MAX_STATES)
+    {
+        return -1;
+    }
+    tdfa_state_t state;
+    state.count = count;
+    state.accept = accept;
+    state.context = b->context_out;
+    state.nfa = malloc(sizeof(int) * count);
+    state.regs = malloc(sizeof(int) * count * b->tags);
+    memcpy(state.nfa, b->nfa_out.data, sizeof(int) * count);
+    memcpy(state.regs, b->regs_out.data, sizeof(int) * count * b->tags);
+    for (int t = 0; t < b->tags; ++t)
+    {
+        if (b->fresh[t])
+        {
+            tdfa_op_t op = {b->fresh[t], OP_AFTER};
+            vec_push(ops, op);
+        }
+        if (b->fresh_before[t])
+        {
+            tdfa_op_t op = {b->fresh_before[t], OP_BEFORE};
+            vec_push(ops, op);
+        }
+    }
+    vec_push(&b->states, state);
+    return b->states.length - 1;
+}
+
+static void tdfa_free(tdfa_t *tdfa)
+{
+    if (tdfa)
+    {
+        free(tdfa->next);
+        free(tdfa->op_start);
+        free(tdfa->ops);
+        free(tdfa->init_ops);
+        free(tdfa->accepting);
+        free(tdfa->final);
+        free(tdfa->before);
+        free(tdfa->at_end);
+        free(tdfa->finals);
+        free(tdfa->regs);
+        free(tdfa);
+    }
+}
+
+// Determinizes a tagged NFA, matching from the start of a line. Returns NULL
+// if it needs more than TDFA_MAX_STATES states.
+static tdfa_t *tdfa_build(const nfa_t *nfa)
+{
+    tdfa_t *tdfa = calloc(1, sizeof(tdfa_t));
+    tdfa_builder_t b;
+    b.nfa = nfa;
+    b.tags = 2 * nfa->groups;
+    b.registers = REG_NULL + 1;
+    b.temp = 0;
+    b.generation = 0;
+    b.fresh = calloc(b.tags, sizeof(int));
+    b.fresh_before = calloc(b.tags, sizeof(int));
+    b.marks = calloc(nfa->nfa.length, sizeof(unsigned));
+    vec_init(&b.states);
+    vec_init(&b.nfa_out);
+    vec_init(&b.regs_out);
+    vec_init(&b.nfa_settled);
+    vec_init(&b.regs_settled);
+    vec_init(&b.final_out);
+    vec_init(&b.forward);
+    vec_init(&b.backward);
+    vec_int_t next;
+    vec_int_t op_start;
+    vec_int_t before;
+    vec_int_t at_end;
+    vec_int_t finals;
+    vec_tdfa_op_t ops;
+    vec_init(&next);
+    vec_init(&op_start);
+    vec_init(&before);
+    vec_init(&at_end);
+    vec_init(&finals);
+    vec_init(&ops);
+
+    tdfa->tags = b.tags;
+    tdfa->classes = nfa_byte_classes(nfa, tdfa->class_of);
+    unsigned char representative[256];
+    for (int c = 0xFF; c >= 0; --c)
+    {
+        representative[tdfa->class_of[c]] = c;
+    }
+
+    int accept;
+    bool accept_before;
+    int count = tdfa_step(&b, -1, 0, true, &accept, &accept_before);
+    tdfa->start = tdfa_intern(&b, count, accept, REG_NULL + 1, &ops);
+    tdfa->init_count = ops.length;
+    tdfa->init_ops = malloc(sizeof(tdfa_op_t) * (ops.length + 1));
+    memcpy(tdfa->init_ops, ops.data, sizeof(tdfa_op_t) * ops.length);
+    vec_clear(&ops);
+
+    bool ok = true;
+    for (int s = 0; s < b.states.length && ok; ++s)
+    {
+        for (int k = 0; k < tdfa->classes && ok; ++k)
+        {
+            vec_push(&op_start, ops.length);
+            int target = -1;
+            int final = -1;
+            int first_fresh = b.registers;
+            count = tdfa_step(&b, s, representative[k], true, &accept, &accept_before);
+            if (accept_before)
+            {
+                final = finals.length;
+                vec_pusharr(&finals, b.final_out.data, b.tags);
+            }
+            if (count > 0)
+            {
+                target = tdfa_intern(&b, count, accept, first_fresh, &ops);
+                ok = target >= 0;
+            }
+            else
+            {
+                b.registers = first_fresh;
+            }
+            vec_push(&next, target);
+            vec_push(&before, final);
+        }
+        int final = -1;
+        if (tdfa_at_end(&b, s))
+        {
+            final = finals.length;
+            vec_pusharr(&finals, b.final_out.data, b.tags);
+        }
+        vec_push(&at_end, final);
+    }
+    vec_push(&op_start, ops.length);
+    vec_push(&finals, 0);
+
+    if (ok)
+    {
+        tdfa->states = b.states.length;
+        tdfa->registers = b.registers;
+        tdfa->next = next.data;
+        tdfa->op_start = op_start.data;
+        tdfa->ops = ops.data;
+        tdfa->before = before.data;
+        tdfa->at_end = at_end.data;
+        tdfa->finals = finals.data;
+        tdfa->accepting = calloc(tdfa->states, sizeof(bool));
+        tdfa->final = calloc((size_t)tdfa->states * b.tags, sizeof(int));
+        tdfa->regs = malloc(sizeof(ptrdiff_t) * b.registers);
+        for (int s = 0; s < tdfa->states; ++s)
+        {
+            tdfa_state_t *state = &b.states.data[s];
+            tdfa->accepting[s] = state->accept >= 0;
+            if (state->accept >= 0)
+            {
+                memcpy(&tdfa->final[s * b.tags], &state->regs[state->accept * b.tags], sizeof(int) * b.tags);
+            }
+        }
+    }
+    else
+    {
+        vec_deinit(&next);
+        vec_deinit(&op_start);
+        vec_deinit(&before);
+        vec_deinit(&at_end);
+        vec_deinit(&finals);
+        vec_deinit(&ops);
+        tdfa_free(tdfa);
+        tdfa = NULL;
+    }
+
+    for (int s = 0; s < b.states.length; ++s)
+    {
+        free(b.states.data[s].nfa);
+        free(b.states.data[s].regs);
+    }
+    vec_deinit(&b.states);
+    vec_deinit(&b.nfa_out);
+    vec_deinit(&b.regs_out);
+    vec_deinit(&b.nfa_settled);
+    vec_deinit(&b.regs_settled);
+    vec_deinit(&b.final_out);
+    vec_deinit(&b.forward);
+    vec_deinit(&b.backward);
+    free(b.fresh);
+    free(b.fresh_before);
+    free(b.marks);
+    return tdfa;
+}
+
+static void tdfa_capture(const tdfa_t *tdfa, const int *final, ptrdiff_t now, ptrdiff_t *captures)
+{
+    for (int t = 0; t < tdfa->tags; ++t)
+    {
+        captures[t] = final[t] == TDFA_NOW ? now : tdfa->regs[final[t]];
+    }
+}
+
+// Runs the tagged DFA from the start of input. Returns the end of the
+// leftmost-first match, or -1, and fills captures with 2 * groups offsets,
+// -1 for a group that took no part in the match.
+static ptrdiff_t tdfa_match(const tdfa_t *tdfa, const unsigned char *input, size_t length, ptrdiff_t *captures)
+{
+    ptrdiff_t *regs = tdfa->regs;
+    ptrdiff_t end = -1;
+    int s = tdfa->start;
+    if (s < 0)
+    {
+        return -1;
+    }
+    regs[REG_NULL] = -1;
+    for (int i = 0; i < tdfa->init_count; ++i)
+    {
+        const tdfa_op_t *op = &tdfa->init_ops[i];
+        regs[op->dst] = op->src < 0 ? 0 : regs[op->src];
+    }
+    if (tdfa->accepting[s])
+    {
+        end = 0;
+        tdfa_capture(tdfa, &tdfa->final[s * tdfa->tags], 0, captures);
+    }
+    for (size_t i = 0; i < length; ++i)
+    {
+        int k = s * tdfa->classes + tdfa->class_of[input[i]];
+        if (tdfa->before[k] >= 0)
+        {
+            end = i;
+            tdfa_capture(tdfa, &tdfa->finals[tdfa->before[k]], i, captures);
+        }
+        int next = tdfa->next[k];
+        if (next < 0)
+        {
+            return end;
+        }
+        for (int o = tdfa->op_start[k]; o < tdfa->op_start[k + 1]; ++o)
+        {
+            const tdfa_op_t *op = &tdfa->ops[o];
+            regs[op->dst] = op->src == OP_AFTER ? (ptrdiff_t)i + 1 : op->src == OP_BEFORE ? (ptrdiff_t)i : regs[op->src];
+        }
+        s = next;
+        if (tdfa->accepting[s])
+        {
+            end = i + 1;
+            tdfa_capture(tdfa, &tdfa->final[s * tdfa->tags], i + 1, captures);
+        }
+    }
+    if (tdfa->at_end[s] >= 0)
+    {
+        end = length;
+        tdfa_capture(tdfa, &tdfa->finals[tdfa->at_end[s]], length, captures);
+    }
+    return end;
+}
+
+static void scanner_free(scanner_t *scanner)
+{
+    for (int s = 0; scanner->rules && s < scanner->states; ++s)
+    {
+        if (scanner->rules[s])
+        {
+            bitset_free(scanner->rules[s]);
+        }
+        if (scanner->rules_at_end[s])
+        {
+            bitset_free(scanner->rules_at_end[s]);
+        }
+    }
+    free(scanner->rules);
+    free(scanner->rules_at_end);
+    free(scanner->table);
+    free(scanner->flags);
+    free(scanner->accel);
+    free(scanner->shuffle);
+    free(scanner->stride2);
+    free(scanner->literal);
+    free(scanner->teddy);
+    lazy_free(scanner->lazy);
+    tdfa_free(scanner->tdfa);
+    if (scanner->reverse)
+    {
+        scanner_free(scanner->reverse);
+        free(scanner->reverse);
+    }
+}
+
+// Collects the bytes a line must start with for a match to begin there, as
+// the escapes of an accelerated state. Fails when every line matches or there
+// are too many such bytes to search for. An empty match at the end of the
+// input is no line of its own, so it does not count.
+static bool find_line_first(const scanner_t *scanner, accel_t *accel)
+{
+    int start = scanner->starts[KIND_NEWLINE];
+    if (scanner->flags[start] & STATE_ACCEPTING)
+    {
+        return false;
+    }
+    accel->nescapes = 0;
+    accel->escape_high = false;
+    accel->literal_length = 0;
+    for (int c = 0; c < 256; ++c)
+    {
+        if (scanner_next(scanner, start, c) < 0)
+        {
+            continue;
+        }
+        if (c >= 0x80)
+        {
+            accel->escape_high = true;
+        }
+        else if (accel->nescapes == ACCEL_MAX_ESCAPES)
+        {
+            return false;
+        }
+        else
+        {
+            accel->escapes[accel->nescapes++] = c;
+        }
+    }
+    return true;
+}
+
+// scanner_compile() flags; a search for a pattern whose rules all start with
+// '^' stays anchored, and its caller restarts it at every line start
+#define COMPILE_SEARCH (1 << 0)   // matches may start anywhere, not only at offset 0
+#define COMPILE_CAPTURES (1 << 1) // also build a tagged DFA for capture groups
+#define COMPILE_REVERSE (1 << 2)  // also build the reverse DFA of the pattern
+#define COMPILE_UTF8 (1 << 3)     // read the pattern as UTF-8 and match UTF-8 text
+#define COMPILE_ICASE (1 << 4)    // fold case in rules that do not start with (?-i)
+#define COMPILE_FULL (1 << 5)     // build the whole DFA up front, whatever the estimate
+#define COMPILE_LAZY (1 << 6)     // build states lazily, whatever the estimate
+#define COMPILE_LITERAL (1 << 7)  // use the literal prefilter whenever there is one
+#define COMPILE_METRICS (1 << 8)  // measure the compilation into stats.metrics
+#define COMPILE_UNORDERED (1 << 9) // keep the states in the order subset construction found them
+#define COMPILE_RULE_SETS (1 << 10) // record in each state which rules it accepts
+#define COMPILE_REVERSE_SEARCH (1 << 11) // let the reverse DFA's matches end anywhere before the walk's start
+#define COMPILE_TEDDY (1 << 12) // give a search's start state a teddy whenever it can have one
+
+typedef struct
+{
+    uint64_t w[4];
+} byte_set_t;
+
+static bool byte_sets_meet(const byte_set_t *a, const byte_set_t *b)
+{
+    return ((a->w[0] & b->w[0]) | (a->w[1] & b->w[1]) | (a->w[2] & b->w[2]) | (a->w[3] & b->w[3])) != 0;
+}
+
+static bool byte_sets_equal(const byte_set_t *a, const byte_set_t *b)
+{
+    return memcmp(a, b, sizeof(byte_set_t)) == 0;
+}
+
+static int plan_find(int *parent, int i)
+{
+    while (parent[i] != i)
+    {
+        parent[i] = parent[parent[i]];
+        i = parent[i];
+    }
+    return i;
+}
+
+// Collects the bytes every match starts with: the chain of single bytes from
+// the start, up to the first fork, assertion or class of more than one byte.
+static void plan_literal(plan_t *plan, const nfa_t *nfa)
+{
+    const nfa_node_t *p = nfa->nfa.data[nfa->start];
+    plan->literal_length = 0;
+    while (p && plan->literal_length < PLAN_LITERAL_MAX)
+    {
+        if (p->edge == EDGE_EPSILON)
+        {
+            if (p->next[1] || p->behind || p->ahead)
+            {
+                return;
+            }
+            p = p->next[0];
+            continue;
+        }
+        int only = -1;
+        for (int c = 0; c < 256; ++c)
+        {
+            if (nfa_edge_matches(p, c))
+            {
+                if (only >= 0)
+                {
+                    return;
+                }
+                only = c;
+            }
+        }
+        if (only < 0)
+        {
+            return;
+        }
+        plan->literal[plan->literal_length++] = only;
+        p = p->next[0];
+    }
+}
+
+// Estimates the DFA of nfa from its positions and how ambiguous they are.
+// Positions joined by epsilon edges are read together, in a group. A match
+// can start on any byte a position of the start group reads; a group that
+// goes on to further positions on some of those bytes but not all of them
+// leaves the threads it carries at different offsets, which the DFA state has
+// to tell apart, doubling the states it may need. Groups that read just the
+// bytes a match starts on, or none of them, move their threads in step. The
+// estimate is a rough upper bound, good for orders of magnitude.
+static void plan_estimate(plan_t *plan, const nfa_t *nfa)
+{
+    int n = nfa->nfa.length;
+    int *parent = malloc(sizeof(int) * n);
+    byte_set_t *bytes = calloc(n, sizeof(byte_set_t));
+    bool *reads = calloc(n, sizeof(bool));     // a group has positions
+    bool *ambiguous = calloc(n, sizeof(bool)); // and is counted already
+    for (int i = 0; i < n; ++i)
+    {
+        parent[i] = i;
+    }
+    plan->nfa_nodes = 0;
+    plan->positions = 0;
+    for (int i = 0; i < n; ++i)
+    {
+        const nfa_node_t *p = nfa->nfa.data[i];
+        if (!p)
+        {
+            continue;
+        }
+        ++plan->nfa_nodes;
+        if (p->edge == EDGE_EPSILON)
+        {
+            for (int j = 0; j <= 1; ++j)
+            {
+                if (p->next[j])
+                {
+                    parent[plan_find(parent, i)] = plan_find(parent, p->next[j]->index);
+                }
+            }
+            continue;
+        }
+        ++plan->positions;
+        for (int c = 0; c < 256; ++c)
+        {
+            if (nfa_edge_matches(p, c))
+            {
+                bytes[i].w[c >> 6] |= 1ull << (c & 63);
+            }
+        }
+    }
+    int start = plan_find(parent, nfa->start);
+    byte_set_t first = {{0}};
+    for (int i = 0; i < n; ++i)
+    {
+        const nfa_node_t *p = nfa->nfa.data[i];
+        if (p && p->edge != EDGE_EPSILON)
+        {
+            int g = plan_find(parent, i);
+            reads[g] = true;
+            for (int k = 0; g == start && k < 4; ++k)
+            {
+                first.w[k] |= bytes[i].w[k];
+            }
+        }
+    }
+    plan->ambiguous = 0;
+    for (int i = 0; i < n; ++i)
+    {
+        const nfa_node_t *p = nfa->nfa.data[i];
+        if (!p || p->edge == EDGE_EPSILON || !reads[plan_find(parent, p->next[0]->index)])
+        {
+            continue;
+        }
+        int g = plan_find(parent, i);
+        if (g != start && !ambiguous[g] && byte_sets_meet(&bytes[i], &first) && !byte_sets_equal(&bytes[i], &first))
+        {
+            ambiguous[g] = true;
+            ++plan->ambiguous;
+        }
+    }
+    plan->states = plan->positions + (plan->ambiguous < 60 ? (double)(1ull << plan->ambiguous) : PLAN_MAX_STATES);
+    plan->states = plan->states < PLAN_MAX_STATES ? plan->states : PLAN_MAX_STATES;
+    // a state's NFA set and, say, two edges out of it
+    double state_bytes = sizeof(dfa_node_t) + sizeof(bitset_t) + (n + 63) / 64 * 8 +
+                         2 * (2 * sizeof(void *) + sizeof(bitset_t) + 256 / 8);
+    plan->bytes = plan->states * state_bytes;
+    free(parent);
+    free(bytes);
+    free(reads);
+    free(ambiguous);
+}
+
+// Picks the engine for nfa, as parsed and before it is set up for a search,
+// unless flags force one.
+static void plan_engine(plan_t *plan, const nfa_t *nfa, int flags, const compile_limits_t *limits)
+{
+    double start = metrics_start();
+    plan->search = (flags & COMPILE_SEARCH) && !nfa_anchored(nfa, ANCHOR_BOL);
+    plan->layout = !(flags & COMPILE_UNORDERED);
+    plan->literals = plan->literal_bytes = 0;
+    plan_estimate(plan, nfa);
+    plan_literal(plan, nfa);
+    if (!plan->search)
+    {
+        // the prefilter only helps a walk that may skip ahead to a match
+        plan->literal_length = 0;
+    }
+    bool over = plan->states > (double)limits->max_dfa_states * PLAN_LAZY_MARGIN ||
+                plan->bytes > (double)limits->max_dfa_bytes * PLAN_LAZY_MARGIN;
+    if (flags & COMPILE_LAZY)
+    {
+        plan->engine = PLAN_LAZY;
+        snprintf(plan->reason, sizeof(plan->reason), "forced");
+    }
+    else if (flags & COMPILE_LITERAL && plan->literal_length > 0)
+    {
+        plan->engine = PLAN_LITERAL;
+        snprintf(plan->reason, sizeof(plan->reason), "forced");
+    }
+    else if (flags & (COMPILE_FULL | COMPILE_LITERAL))
+    {
+        plan->engine = PLAN_FULL;
+        snprintf(plan->reason, sizeof(plan->reason), "%s",
+                 flags & COMPILE_FULL ? "forced" : "no literal prefix to search for");
+    }
+    else if (over)
+    {
+        plan->engine = PLAN_LAZY;
+        snprintf(plan->reason, sizeof(plan->reason), "the estimate is over %d times the budget", PLAN_LAZY_MARGIN);
+    }
+    else if (plan->literal_length > 1)
+    {
+        // a single byte is searched for as fast by the start state's accel
+        plan->engine = PLAN_LITERAL;
+        snprintf(plan->reason, sizeof(plan->reason), "every match starts with a %d byte literal",
+                 plan->literal_length);
+    }
+    else
+    {
+        plan->engine = PLAN_FULL;
+        snprintf(plan->reason, sizeof(plan->reason), "the estimate is within %d times the budget", PLAN_LAZY_MARGIN);
+    }
+    metrics_stop(PHASE_PLAN, start);
+}
+
+// A pattern whose rules are all alternations of literals, such as a keyword
+// or blocklist list, skips the Thompson NFA and subset construction: its
+// automaton is built straight from the literals, as a trie, or for a search
+// as the Aho-Corasick automaton of the literals. Either has a state per byte
+// of them at most, so it is built in time linear in their length.
+typedef struct
+{
+    vec_char_t bytes; // the literals end to end
+    vec_int_t ends;   // where each ends in bytes
+    vec_int_t rules;  // and which rule it belongs to
+    int nrules;
+} literal_set_t;
+
+static void literal_set_free(literal_set_t *set)
+{
+    vec_deinit(&set->bytes);
+    vec_deinit(&set->ends);
+    vec_deinit(&set->rules);
+}
+
+// Reads pattern into set the way thompson() would, returning false, with
+// nothing to free, unless every rule is an alternation of literals that are
+// not empty. With icase the letters of the literals are kept in lower case;
+// a literal past ASCII then folds in UTF-8 mode, which takes the NFA.
+static bool literal_set_parse(literal_set_t *set, const char *pattern, bool utf8, bool icase)
+{
+    nfa_parser_state_t state;
+    nfa_parser_state_init(&state, pattern);
+    state.utf8 = utf8;
+    vec_init(&set->bytes);
+    vec_init(&set->ends);
+    vec_init(&set->rules);
+    set->nrules = 1;
+    int start = 0;
+    bool ok = true;
+    bool rule_ended = false;
+    for (advance(&state); ok; advance(&state))
+    {
+        regex_token_t token = state.current_token;
+        if (token == tok_literal || token == tok_dash)
+        {
+            unsigned char bytes[4] = {state.current_lexeme};
+            int length = utf8 ? utf8_encode(state.current_lexeme, bytes) : 1;
+            ok = !(icase && utf8 && bytes[0] >= 0x80);
+            for (int i = 0; i < length; ++i)
+            {
+                vec_push(&set->bytes, icase && 'A' <= bytes[i] && bytes[i] <= 'Z' ? bytes[i] | 0x20 : bytes[i]);
+            }
+            rule_ended = false;
+            continue;
+        }
+        if (token == tok_eoi && rule_ended)
+        {
+            // a ')' at the end starts no rule
+            --set->nrules;
+            break;
+        }
+        ok = set->bytes.length > start && (token == tok_pipe || token == tok_right_paren || token == tok_eoi);
+        if (ok)
+        {
+            vec_push(&set->ends, set->bytes.length);
+            vec_push(&set->rules, set->nrules - 1);
+            start = set->bytes.length;
+            rule_ended = token == tok_right_paren;
+            set->nrules += rule_ended;
+        }
+        if (token == tok_eoi)
+        {
+            break;
+        }
+    }
+    if (!ok)
+    {
+        literal_set_free(set);
+    }
+    return ok;
+}
+
+// Builds the automaton of set into scanner: a trie of the literals, reversed
+// for the backward walk, or with COMPILE_SEARCH the Aho-Corasick automaton,
+// its failure links resolved into the table so that every state goes on over
+// every byte. The literals' bytes have a class each, both cases of a letter
+// sharing one with COMPILE_ICASE, and the bytes in none of them another.
+static bool scanner_init_trie(scanner_t *scanner, const literal_set_t *set, int flags, bool reversed)
+{
+    bool search = flags & COMPILE_SEARCH;
+    bool rule_sets = (flags & COMPILE_RULE_SETS) && !reversed;
+    const unsigned char *bytes = (const unsigned char *)set->bytes.data;
+    bool used[256] = {false};
+    for (int i = 0; i < set->bytes.length; ++i)
+    {
+        used[bytes[i]] = true;
+    }
+    int classes = 0;
+    for (int c = 0; c < 256; ++c)
+    {
+        scanner->class_of[c] = used[c] ? classes++ : 0;
+    }
+    if (classes < 256)
+    {
+        for (int c = 0; c < 256; ++c)
+        {
+            scanner->class_of[c] = used[c] ? scanner->class_of[c] : classes;
+        }
+        ++classes;
+    }
+    if (flags & COMPILE_ICASE)
+    {
+        for (int c = 'a'; c <= 'z'; ++c)
+        {
+            scanner->class_of[toupper(c)] = used[c] ? scanner->class_of[c] : scanner->class_of[toupper(c)];
+        }
+    }
+
+    int bound = set->bytes.length + 1;
+    bitset_t **rules = rule_sets ? calloc(bound, sizeof(bitset_t *)) : NULL;
+    if (!scanner_alloc(scanner, bound, classes) || (rule_sets && !rules))
+    {
+        free(rules);
+        return false;
+    }
+    // the trie grows a level at a time, each literal's walk a byte deeper, so
+    // that its states are numbered breadth first; rows are filled in as
+    // states are made, leaving the pages of the bound no trie reaches alone
+    int *table = scanner->table;
+    int *at = malloc(sizeof(int) * set->ends.length);
+    int *deeper = malloc(sizeof(int) * set->ends.length);
+    if (!at || !deeper)
+    {
+        free(at);
+        free(deeper);
+        free(rules);
+        return false;
+    }
+    for (int i = 0; i < set->ends.length; ++i)
+    {
+        at[i] = 0;
+        deeper[i] = i;
+    }
+    for (int k = 0; k < classes; ++k)
+    {
+        table[k] = -1;
+    }
+    int states = 1;
+    for (int depth = 0, walks = set->ends.length; walks > 0; ++depth)
+    {
+        int kept = 0;
+        for (int j = 0; j < walks; ++j)
+        {
+            int i = deeper[j];
+            int from = i > 0 ? set->ends.data[i - 1] : 0;
+            int to = set->ends.data[i];
+            int *t = &table[at[i] * classes + scanner->class_of[bytes[reversed ? to - 1 - depth : from + depth]]];
+            if (*t < 0)
+            {
+                for (int k = 0; k < classes; ++k)
+                {
+                    table[states * classes + k] = -1;
+                }
+                *t = states++;
+            }
+            at[i] = *t;
+            if (depth + 1 < to - from)
+            {
+                deeper[kept++] = i;
+                continue;
+            }
+            scanner->flags[at[i]] = STATE_ACCEPTING | STATE_ACCEPTING_AT_END;
+            if (rule_sets)
+            {
+                rules[at[i]] = rules[at[i]] ? rules[at[i]] : bitset_create();
+                bitset_set(rules[at[i]], set->rules.data[i]);
+            }
+        }
+        walks = kept;
+    }
+    free(at);
+    free(deeper);
+
+    if (search)
+    {
+        // A state's failure link is the state of the longest proper suffix
+        // of its bytes. States go up in depth, so both a state's link and the
+        // state it got its link from are done with before it is reached:
+        // the transitions it lacks are its link's, and it also accepts what
+        // its link does.
+        int *fail = malloc(sizeof(int) * states);
+        if (!fail)
+        {
+            free(rules);
+            return false;
+        }
+        fail[0] = 0;
+        for (int s = 0; s < states; ++s)
+        {
+            int f = fail[s];
+            scanner->flags[s] |= scanner->flags[f];
+            if (rule_sets && s > 0 && rules[f])
+            {
+                rules[s] = rules[s] ? rules[s] : bitset_create();
+                bitset_inplace_union(rules[s], rules[f]);
+            }
+            for (int k = 0; k < classes; ++k)
+            {
+                int *t = &table[s * classes + k];
+                int next = s > 0 ? table[f * classes + k] : 0;
+                if (*t < 0)
+                {
+                    *t = next;
+                }
+                else
+                {
+                    fail[*t] = next;
+                }
+            }
+        }
+        free(fail);
+    }
+
+    // give back the states the literals' shared prefixes left over
+    scanner->states = states;
+    for (int k = 0; k < classes; ++k)
+    {
+        table[states * classes + k] = -1;
+    }
+    scanner->flags[states] = 0;
+    int *shrunk = realloc(table, sizeof(int) * (states + 1) * classes);
+    scanner->table = shrunk ? shrunk : table;
+    for (int k = 0; k < KINDS; ++k)
+    {
+        scanner->starts[k] = 0;
+    }
+    if (metrics)
+    {
+        metrics->dfa_states += states;
+        metrics->min_dfa_states += states;
+    }
+    scanner->stats.dfa_states = states;
+    if (rule_sets)
+    {
+        scanner->rules = rules;
+        scanner->rules_at_end = calloc(states, sizeof(bitset_t *));
+        return scanner->rules_at_end != NULL;
+    }
+    return true;
+}
+
+// Plans a literal set, which is built in full whatever the budgets: its
+// automaton has a state per byte of the literals at most. A search enters it
+// where the prefix the literals share is found, like a pattern's literal
+// prefix, unless case folds.
+static void plan_trie(plan_t *plan, const literal_set_t *set, int flags)
+{
+    double start = metrics_start();
+    memset(plan, 0, sizeof(plan_t));
+    plan->search = flags & COMPILE_SEARCH;
+    // the trie is numbered breadth first as it grows
+    plan->layout = false;
+    plan->literals = set->ends.length;
+    plan->literal_bytes = set->bytes.length;
+    if (plan->search && !(flags & COMPILE_ICASE))
+    {
+        const char *first = set->bytes.data;
+        int shortest = set->ends.data[0];
+        for (int i = 1; i < set->ends.length; ++i)
+        {
+            int from = set->ends.data[i - 1];
+            int length = set->ends.data[i] - from;
+            shortest = length < shortest ? length : shortest;
+            while (shortest > 0 && memcmp(first, &set->bytes.data[from], shortest) != 0)
+            {
+                --shortest;
+            }
+        }
+        plan->literal_length = shortest < PLAN_LITERAL_MAX ? shortest : PLAN_LITERAL_MAX;
+        memcpy(plan->literal, first, plan->literal_length);
+    }
+    if (flags & COMPILE_LITERAL && plan->literal_length > 0)
+    {
+        plan->engine = PLAN_LITERAL;
+        snprintf(plan->reason, sizeof(plan->reason), "forced");
+    }
+    else if (flags & (COMPILE_FULL | COMPILE_LITERAL))
+    {
+        plan->engine = PLAN_FULL;
+        snprintf(plan->reason, sizeof(plan->reason), "%s",
+                 flags & COMPILE_FULL ? "forced" : "no literal prefix to search for");
+    }
+    else if (plan->literal_length > 1)
+    {
+        plan->engine = PLAN_LITERAL;
+        snprintf(plan->reason, sizeof(plan->reason), "every match starts with a %d byte literal",
+                 plan->literal_length);
+    }
+    else
+    {
+        plan->engine = PLAN_FULL;
+        snprintf(plan->reason, sizeof(plan->reason), "every rule is an alternation of literals");
+    }
+    metrics_stop(PHASE_PLAN, start);
+}
+
+// How common a byte is in text, roughly: the higher the more, so that a
+// literal is searched for by the byte of it that stops the search the least.
+static int byte_rank(unsigned char c)
+{
+    if (c == ' ' || c == '\n' || strchr("etaoinsrhl", c))
+    {
+        return 5;
+    }
+    if (islower(c) || isdigit(c))
+    {
+        return 4;
+    }
+    if (ispunct(c) || c == '\t')
+    {
+        return 3;
+    }
+    if (isupper(c))
+    {
+        return 2;
+    }
+    return c >= 0x80 ? 1 : 0;
+}
+
+// Hands literal to the accelerated start states that only leave on its first
+// byte. Those loop on any other byte, so no match starts before the next
+// occurrence of the whole literal, which is where their walk resumes.
+static void scanner_use_literal(scanner_t *scanner, const unsigned char *literal, int length)
+{
+    if (scanner->engine == ENGINE_LAZY || !(scanner->literal = malloc(length)))
+    {
+        return;
+    }
+    memcpy(scanner->literal, literal, length);
+    for (int k = 0; k < KINDS; ++k)
+    {
+        int s = scanner->starts[k];
+        accel_t *accel = &scanner->accel[s];
+        if ((scanner->flags[s] & STATE_ACCELERATED) && accel->nescapes == 1 && !accel->escape_high &&
+            accel->escapes[0] == literal[0])
+        {
+            accel->literal = scanner->literal;
+            accel->literal_length = length;
+            accel->rare = 0;
+            for (int i = 1; i < length; ++i)
+            {
+                accel->rare = byte_rank(literal[i]) < byte_rank(literal[accel->rare]) ? i : accel->rare;
+            }
+        }
+    }
+}
+
+// A path out of the start state, as the byte classes it reads.
+typedef struct
+{
+    unsigned char classes[TEDDY_WIDTH];
+    int length;
+} teddy_path_t;
+
+static int compare_teddy_paths(const void *a, const void *b)
+{
+    const teddy_path_t *x = a;
+    const teddy_path_t *y = b;
+    int order = memcmp(x->classes, y->classes, TEDDY_WIDTH);
+    return order ? order : x->length - y->length;
+}
+
+// Whether the walk along path and then class k, to state, ends up where a
+// walk from the start state over a shorter suffix of it would: the matches
+// begun where the path did are then all dead, and those begun later are
+// found from their own start.
+static bool teddy_path_restarts(const scanner_t *scanner, const teddy_path_t *path, int depth, int k, int state)
+{
+    for (int m = 1; m <= depth; ++m)
+    {
+        int s = scanner->start;
+        for (int j = m; j < depth && s >= 0; ++j)
+        {
+            s = scanner->table[s * scanner->classes + path->classes[j]];
+        }
+        if (s >= 0 && scanner->table[s * scanner->classes + k] == state)
+        {
+            return true;
+        }
+    }
+    return false;
+}
+
+// Collects the paths from state on, depth bytes from the start state, until
+// width bytes deep. A byte that leads back to the start state, or that
+// restarts the walk, ends every match begun where the path did; a path ends
+// early where it accepts or dies. Returns false when there are more than
+// TEDDY_MAX_PREFIXES.
+static bool teddy_paths(const scanner_t *scanner, int state, teddy_path_t *path, int depth, int width,
+                        teddy_path_t *paths, int *npaths)
+{
+    for (int k = 0; k < scanner->classes; ++k)
+    {
+        int t = scanner->table[state * scanner->classes + k];
+        if (t == scanner->start || (t >= 0 && teddy_path_restarts(scanner, path, depth, k, t)))
+        {
+            continue;
+        }
+        path->classes[depth] = k;
+        path->length = depth + 1;
+        if (t >= 0 && depth + 1 < width && !(scanner->flags[t] & (STATE_ACCEPTING | STATE_ACCEPTING_BEFORE)))
+        {
+            if (!teddy_paths(scanner, t, path, depth + 1, width, paths, npaths))
+            {
+                return false;
+            }
+            continue;
+        }
+        if (*npaths == TEDDY_MAX_PREFIXES)
+        {
+            return false;
+        }
+        paths[(*npaths)++] = *path;
+    }
+    return true;
+}
+
+// The share of text bytes that are c, roughly, after byte_rank().
+static double byte_frequency(unsigned char c)
+{
+    static const double by_rank[] = {0.0005, 0.001, 0.005, 0.005, 0.02, 0.06};
+    return by_rank[byte_rank(c)];
+}
+
+// Hands the start state of a search a teddy for the paths out of it, when it
+// would stop at fewer bytes than the start state's own acceleration. Every
+// start state must be the same one, as the walk resumes in it at a
+// candidate: the start states of assertions that look behind would have to
+// be told apart by the byte before. force drops the comparison with the
+// acceleration. Returns false when out of memory.
+static bool scanner_use_teddy(scanner_t *scanner, bool force)
+{
+    int start = scanner->start;
+    for (int k = 0; k < KINDS; ++k)
+    {
+        if (scanner->starts[k] != start)
+        {
+            return true;
+        }
+    }
+    if (scanner->engine == ENGINE_LAZY ||
+        (scanner->flags[start] & (STATE_ACCEPTING | STATE_ACCEPTING_BEFORE | STATE_ACCEPTING_AT_END)))
+    {
+        return true;
+    }
+    teddy_path_t *paths = malloc(sizeof(teddy_path_t) * TEDDY_MAX_PREFIXES);
+    if (!paths)
+    {
+        return false;
+    }
+    // the widest fingerprint with few enough paths to tell apart
+    int width = TEDDY_WIDTH;
+    int npaths = 0;
+    teddy_path_t path = {{0}, 0};
+    while (width > 0 && (npaths = 0, !teddy_paths(scanner, start, &path, 0, width, paths, &npaths)))
+    {
+        --width;
+    }
+    if (width == 0 || npaths == 0)
+    {
+        free(paths);
+        return true;
+    }
+    teddy_t *teddy = calloc(1, sizeof(teddy_t));
+    if (!teddy)
+    {
+        free(paths);
+        return false;
+    }
+    teddy->width = width;
+    teddy->simd = shuffle_supported();
+    // like paths share a bucket, where they blur the least
+    qsort(paths, npaths, sizeof(teddy_path_t), compare_teddy_paths);
+    for (int i = 0; i < npaths; ++i)
+    {
+        unsigned char bucket = 1 << (i * TEDDY_BUCKETS / npaths);
+        for (int j = 0; j < width; ++j)
+        {
+            for (int c = 0; c < 256; ++c)
+            {
+                if (j >= paths[i].length || scanner->class_of[c] == paths[i].classes[j])
+                {
+                    teddy->lo[j][c & 0x0F] |= bucket;
+                    teddy->hi[j][c >> 4] |= bucket;
+                }
+            }
+        }
+    }
+    free(paths);
+
+    // how often a byte of text is a candidate, with the nibbles of the
+    // prefixes in a bucket blurred together, against how often the start
+    // state's own acceleration stops
+    double rate = 0;
+    for (int b = 0; b < TEDDY_BUCKETS; ++b)
+    {
+        double p = 1;
+        for (int j = 0; j < width; ++j)
+        {
+            double q = 0;
+            for (int c = 0; c < 256; ++c)
+            {
+                q += teddy->lo[j][c & 0x0F] & teddy->hi[j][c >> 4] & 1 << b ? byte_frequency(c) : 0;
+            }
+            p *= q < 1 ? q : 1;
+        }
+        rate += p;
+    }
+    double accel_rate = 1;
+    const accel_t *accel = &scanner->accel[start];
+    if (scanner->flags[start] & STATE_ACCELERATED)
+    {
+        accel_rate = 0;
+        for (int c = 0; c < 256; ++c)
+        {
+            bool escapes = c >= 0x80 ? accel->escape_high : memchr(accel->escapes, c, accel->nescapes) != NULL;
+            accel_rate += escapes ? byte_frequency(c) : 0;
+        }
+    }
+    if (!force && (rate > TEDDY_MAX_RATE || rate >= accel_rate))
+    {
+        free(teddy);
+        return true;
+    }
+    scanner->teddy = teddy;
+    scanner->accel[start] = (accel_t){.teddy = teddy};
+    if (!(scanner->flags[start] & STATE_ACCELERATED))
+    {
+        scanner->flags[start] |= STATE_ACCELERATED;
+        ++scanner->stats.accelerated_states;
+    }
+    scanner->stats.teddy_prefixes = npaths;
+    scanner->stats.teddy_width = width;
+    return true;
+}
+
+// Adds the tables of a scanner set up since start to the metrics, if it was;
+// returns ok.
+static bool metrics_count_tables(const scanner_t *scanner, double start, bool ok)
+{
+    metrics_stop(PHASE_TABLES, start);
+    if (metrics && ok)
+    {
+        metrics->table_bytes += scanner->stats.table_bytes + scanner->stats.stride2_bytes +
+                                (scanner->shuffle ? (size_t)scanner->classes * SHUFFLE_MAX_STATES : 0) +
+                                (scanner->states + 1) + sizeof(accel_t) * scanner->states;
+    }
+    return ok;
+}
+
+// Sets up what every scanner starts from, whatever builds its tables.
+static void scanner_begin(scanner_t *scanner, int groups, int nrules, int nfa_states, const plan_t *plan)
+{
+    scanner->groups = groups;
+    scanner->nrules = nrules;
+    scanner->rules = NULL;
+    scanner->rules_at_end = NULL;
+    scanner->tdfa = NULL;
+    scanner->reverse = NULL;
+    scanner->literal = NULL;
+    scanner->teddy = NULL;
+    scanner->eol_anchored = false;
+    scanner->bol_anchored = false;
+    scanner->skip_lines = false;
+    scanner->stats.nfa_states = nfa_states;
+    scanner->stats.teddy_prefixes = 0;
+    scanner->stats.teddy_width = 0;
+    scanner->stats.dfa_bytes = 0;
+    scanner->stats.fallback = NULL;
+    scanner->stats.tdfa_states = 0;
+    scanner->stats.tdfa_registers = 0;
+    scanner->stats.plan = *plan;
+}
+
+// Builds the scanner for nfa as planned and frees it, unless the lazy engine
+// takes it over: when planned, or when the DFA turns out to be over budget.
+static bool scanner_build(scanner_t *scanner, nfa_t *nfa, const compile_limits_t *limits, const plan_t *plan)
+{
+    scanner_begin(scanner, nfa->groups, nfa->nrules, nfa->nfa.length, plan);
+    if (plan->engine == PLAN_LAZY)
+    {
+        scanner->stats.dfa_states = 0;
+        double start = metrics_start();
+        return metrics_count_tables(scanner, start, lazy_init(scanner, nfa));
+    }
+    const char *exceeded;
+    dfa_t dfa = nfa_to_dfa(nfa, limits, &exceeded, &scanner->stats.dfa_bytes);
+    scanner->stats.dfa_states = dfa.length;
+    scanner->stats.fallback = exceeded;
+    if (exceeded)
+    {
+        dfa_free(&dfa);
+        double start = metrics_start();
+        return metrics_count_tables(scanner, start, lazy_init(scanner, nfa));
+    }
+    dfa_t min = minimize_dfa(&dfa);
+    double start = metrics_start();
+    bool ok = metrics_count_tables(scanner, start,
+                                   scanner_init(scanner, &min) && (!nfa->rule_sets || scanner_init_rules(scanner, &min)) &&
+                                       (!plan->layout || scanner_layout(scanner, NULL)));
+    dfa_free(&min);
+    dfa_free(&dfa);
+    nfa_free(nfa);
+    return ok;
+}
+
+// Builds the scanner for a literal set as planned, reversed for the
+// backward walk.
+static bool scanner_build_trie(scanner_t *scanner, const literal_set_t *set, int flags, bool reversed,
+                               const plan_t *plan)
+{
+    scanner_begin(scanner, 1, reversed ? 1 : set->nrules, 0, plan);
+    double start = metrics_start();
+    bool ok = scanner_init_trie(scanner, set, flags, reversed);
+    metrics_stop(PHASE_TRIE, start);
+    start = metrics_start();
+    return metrics_count_tables(scanner, start, ok && scanner_finish(scanner));
+}
+
+// Compiles a literal set the way scanner_compile() would the pattern it was
+// read from.
+static bool scanner_compile_trie(scanner_t *scanner, const literal_set_t *set, int flags)
+{
+    plan_t plan;
+    plan_trie(&plan, set, flags);
+    scanner_t *reverse = NULL;
+    bool ok = true;
+    if (flags & COMPILE_REVERSE)
+    {
+        int reverse_flags = flags & COMPILE_REVERSE_SEARCH ? flags | COMPILE_SEARCH : flags & ~COMPILE_SEARCH;
+        plan_t reverse_plan;
+        plan_trie(&reverse_plan, set, reverse_flags);
+        reverse = malloc(sizeof(scanner_t));
+        ok = scanner_build_trie(reverse, set, reverse_flags, true, &reverse_plan);
+    }
+    ok = scanner_build_trie(scanner, set, flags, false, &plan) && ok;
+    if (ok && plan.engine == PLAN_LITERAL)
+    {
+        scanner_use_literal(scanner, plan.literal, plan.literal_length);
+    }
+    else if (ok && plan.search)
+    {
+        ok = scanner_use_teddy(scanner, flags & COMPILE_TEDDY);
+    }
+    scanner->reverse = reverse;
+    return ok;
+}
+
+// Compiles pattern within limits, or the default ones when NULL.
+static bool scanner_compile(scanner_t *scanner, const char *pattern, int flags, const compile_limits_t *limits)
+{
+    limits = limits ? limits : &default_limits;
+    compile_metrics_t *outer = metrics;
+    memset(&scanner->stats.metrics, 0, sizeof(compile_metrics_t));
+    if (flags & COMPILE_METRICS)
+    {
+        metrics = &scanner->stats.metrics;
+    }
+    // the lazy engine walks an NFA, and captures take a tagged one
+    literal_set_t set;
+    double start = metrics_start();
+    bool literals = !(flags & (COMPILE_LAZY | COMPILE_CAPTURES)) &&
+                    literal_set_parse(&set, pattern, flags & COMPILE_UTF8, flags & COMPILE_ICASE);
+    metrics_stop(PHASE_PARSE, start);
+    if (literals)
+    {
+        bool ok = scanner_compile_trie(scanner, &set, flags);
+        literal_set_free(&set);
+        metrics = outer;
+        return ok;
+    }
+    nfa_t nfa = thompson(pattern, flags & COMPILE_UTF8, flags & COMPILE_ICASE);
+    nfa.rule_sets = flags & COMPILE_RULE_SETS;
+    bool eol_anchored = nfa_anchored(&nfa, ANCHOR_EOL);
+    bool bol_anchored = nfa_anchored(&nfa, ANCHOR_BOL);
+    plan_t plan;
+    plan_engine(&plan, &nfa, flags, limits);
+    scanner_t *reverse = NULL;
+    bool ok = true;
+    if (flags & COMPILE_REVERSE)
+    {
+        // reversed before the search loop goes in front: the backward walk
+        // starts at a known end and runs until the pattern can reach no
+        // further, unless it is a search of its own for where matches start
+        start = metrics_start();
+        nfa_t reversed = nfa_reverse(&nfa);
+        if (flags & COMPILE_REVERSE_SEARCH)
+        {
+            nfa_unanchor(&reversed);
+        }
+        metrics_stop(PHASE_NFA, start);
+        metrics_count_nfa(&reversed);
+        plan_t reverse_plan;
+        plan_engine(&reverse_plan, &reversed, flags & ~COMPILE_SEARCH, limits);
+        reverse = malloc(sizeof(scanner_t));
+        ok = scanner_build(reverse, &reversed, limits, &reverse_plan);
+    }
+    start = metrics_start();
+    if (flags & COMPILE_CAPTURES)
+    {
+        nfa_tag_match(&nfa);
+    }
+    if ((flags & COMPILE_SEARCH) && !bol_anchored)
+    {
+        nfa_unanchor(&nfa);
+    }
+    metrics_stop(PHASE_NFA, start);
+    start = metrics_start();
+    tdfa_t *tdfa = flags & COMPILE_CAPTURES ? tdfa_build(&nfa) : NULL;
+    metrics_stop(PHASE_TDFA, start);
+    ok = scanner_build(scanner, &nfa, limits, &plan) && ok;
+    if (ok && plan.engine == PLAN_LITERAL)
+    {
+        scanner_use_literal(scanner, plan.literal, plan.literal_length);
+    }
+    else if (ok && plan.search)
+    {
+        ok = scanner_use_teddy(scanner, flags & COMPILE_TEDDY);
+    }
+    scanner->reverse = reverse;
+    scanner->eol_anchored = eol_anchored;
+    scanner->bol_anchored = bol_anchored;
+    scanner->skip_lines = ok && bol_anchored && find_line_first(scanner, &scanner->line_first);
+    scanner->tdfa = tdfa;
+    scanner->stats.tdfa_states = tdfa ? tdfa->states : 0;
+    scanner->stats.tdfa_registers = tdfa ? tdfa->registers : 0;
+    metrics = outer;
+    return ok;
+}
+
+static void print_compile_stats(FILE *fp, const compile_stats_t *stats)
+{
+    // a literal set goes straight to its automaton, a state per trie node,
+    // with no nfa before it and nothing to minimize
+    if (stats->plan.literals)
+    {
+        fprintf(fp, "// trie nodes: %d, dfa states: %d", stats->dfa_states, stats->min_dfa_states);
+    }
+    else
+    {
+        fprintf(fp, "// nfa states: %d, dfa states: %d, minimized: %d", stats->nfa_states, stats->dfa_states,
+                stats->min_dfa_states);
+    }
+    fprintf(fp, ", byte classes: %d, accelerated: %d, table: %zu bytes, stride-2 table: %zu bytes, engine: %s\n",
+            stats->classes, stats->accelerated_states, stats->table_bytes, stats->stride2_bytes,
+            scanner_engine_names[stats->engine]);
+    if (stats->fallback)
+    {
+        fprintf(fp, "// subset construction over the %s budget after %d states, %zu bytes: states are built lazily\n",
+                stats->fallback, stats->dfa_states, stats->dfa_bytes);
+    }
+    if (stats->tdfa_states)
+    {
+        fprintf(fp, "// tagged dfa states: %d, registers: %d\n", stats->tdfa_states, stats->tdfa_registers);
+    }
+    if (stats->teddy_prefixes)
+    {
+        fprintf(fp, "// teddy: %d prefixes out of the start state, %d bytes of each in %d buckets\n",
+                stats->teddy_prefixes, stats->teddy_width, TEDDY_BUCKETS);
+    }
+}
+
+// Whether a prefix of teddy's may start at p, of which n bytes are left; the
+// bytes past them could be anything.
+static inline bool teddy_candidate(const teddy_t *teddy, const unsigned char *p, size_t n)
+{
+    unsigned char buckets = 0xFF;
+    for (int j = 0; j < teddy->width && (size_t)j < n; ++j)
+    {
+        buckets &= teddy->lo[j][p[j] & 0x0F] & teddy->hi[j][p[j] >> 4];
+    }
+    return buckets != 0;
+}
+
+#ifdef HAVE_X86_SIMD
+// Tests 16 positions a round, while the bytes of their fingerprints are all
+// in range. Returns the first candidate, or where the rounds stopped short.
+__attribute__((target("ssse3"))) static size_t teddy_skip_simd(const teddy_t *teddy, const unsigned char *p,
+                                                               size_t n)
+{
+    const __m128i nibble = _mm_set1_epi8(0x0F);
+    __m128i lo[TEDDY_WIDTH];
+    __m128i hi[TEDDY_WIDTH];
+    for (int j = 0; j < teddy->width; ++j)
+    {
+        lo[j] = _mm_loadu_si128((const __m128i *)teddy->lo[j]);
+        hi[j] = _mm_loadu_si128((const __m128i *)teddy->hi[j]);
+    }
+    size_t i = 0;
+    for (; i + 16 + teddy->width - 1 <= n; i += 16)
+    {
+        __m128i buckets = _mm_set1_epi8((char)0xFF);
+        for (int j = 0; j < teddy->width; ++j)
+        {
+            __m128i v = _mm_loadu_si128((const __m128i *)(p + i + j));
+            __m128i low = _mm_shuffle_epi8(lo[j], _mm_and_si128(v, nibble));
+            __m128i high = _mm_shuffle_epi8(hi[j], _mm_and_si128(_mm_srli_epi16(v, 4), nibble));
+            buckets = _mm_and_si128(buckets, _mm_and_si128(low, high));
+        }
+        int mask = _mm_movemask_epi8(_mm_cmpeq_epi8(buckets, _mm_setzero_si128())) ^ 0xFFFF;
+        if (mask)
+        {
+            return i + __builtin_ctz(mask);
+        }
+    }
+    return i;
+}
+#endif
+
+// Returns the offset of the first candidate in [p, p + n), or n for none.
+static size_t teddy_skip(const teddy_t *teddy, const unsigned char *p, size_t n)
+{
+    size_t i = 0;
+#ifdef HAVE_X86_SIMD
+    if (teddy->simd)
+    {
+        i = teddy_skip_simd(teddy, p, n);
+    }
+#endif
+    while (i < n && !teddy_candidate(teddy, p + i, n - i))
+    {
+        ++i;
+    }
+    return i;
+}
+
+// Returns the offset of the first byte in [p, p + n) that leaves an
+// accelerated state, or n when the whole range loops. A start state with
+// teddy may leave earlier, but only comes back to itself before a candidate.
+static size_t accel_skip(const accel_t *accel, const unsigned char *p, size_t n)
+{
+    size_t i = 0;
+    if (accel->teddy)
+    {
+        return teddy_skip(accel->teddy, p, n);
+    }
+    if (accel->nescapes == 0 && !accel->escape_high)
+    {
+        return n;
+    }
+    if (accel->literal_length > 0 && n >= (size_t)accel->literal_length)
+    {
+        size_t last = n - accel->literal_length;
+        const unsigned char *hit;
+        while (i <= last && (hit = memchr(p + i + accel->rare, accel->literal[accel->rare], last - i + 1)))
+        {
+            i = hit - p - accel->rare;
+            if (memcmp(p + i, accel->literal, accel->literal_length) == 0)
+            {
+                return i;
+            }
+            ++i;
+        }
+        // a literal cut short by the end of the range is stepped into
+        i = last + 1;
+    }
+#if defined(HAVE_X86_SIMD) && defined(__SSE2__)
+    __m128i e0 = _mm_set1_epi8((char)accel->escapes[0]);
+    __m128i e1 = _mm_set1_epi8((char)accel->escapes[accel->nescapes > 1 ? 1 : 0]);
+    __m128i e2 = _mm_set1_epi8((char)accel->escapes[accel->nescapes > 2 ? 2 : 0]);
+    __m128i e3 = _mm_set1_epi8((char)accel->escapes[accel->nescapes > 3 ? 3 : 0]);
+    int high = accel->escape_high ? 0xFFFF : 0;
+    if (accel->nescapes == 0)
+    {
+        // only the high half escapes, which the sign bit already covers
+        e0 = e1 = e2 = e3 = _mm_set1_epi8((char)0x80);
+    }
+    for (; i + 16 <= n; i += 16)
+    {
+        __m128i v = _mm_loadu_si128((const __m128i *)(p + i));
+        __m128i hit = _mm_or_si128(_mm_or_si128(_mm_cmpeq_epi8(v, e0), _mm_cmpeq_epi8(v, e1)),
+                                   _mm_or_si128(_mm_cmpeq_epi8(v, e2), _mm_cmpeq_epi8(v, e3)));
+        int mask = _mm_movemask_epi8(hit) | (_mm_movemask_epi8(v) & high);
+        if (mask)
+        {
+            return i + __builtin_ctz(mask);
+        }
+    }
+#endif
+    for (; i < n; ++i)
+    {
+        if (p[i] >= 0x80 ? accel->escape_high : memchr(accel->escapes, p[i], accel->nescapes) != NULL)
+        {
+            return i;
+        }
+    }
+    return n;
+}
+
+// Like accel_skip(), but only stops at escapes right after a newline. p[-1]
+// must be readable; one pass tests each byte and the one before it.
+static size_t accel_skip_line_start(const accel_t *accel, const unsigned char *p, size_t n)
+{
+    size_t i = 0;
+    if (accel->nescapes == 0 && !accel->escape_high)
+    {
+        return n;
+    }
+#if defined(HAVE_X86_SIMD) && defined(__SSE2__)
+    __m128i e0 = _mm_set1_epi8((char)accel->escapes[0]);
+    __m128i e1 = _mm_set1_epi8((char)accel->escapes[accel->nescapes > 1 ? 1 : 0]);
+    __m128i e2 = _mm_set1_epi8((char)accel->escapes[accel->nescapes > 2 ? 2 : 0]);
+    __m128i e3 = _mm_set1_epi8((char)accel->escapes[accel->nescapes > 3 ? 3 : 0]);
+    __m128i newline = _mm_set1_epi8('\n');
+    int high = accel->escape_high ? 0xFFFF : 0;
+    if (accel->nescapes == 0)
+    {
+        e0 = e1 = e2 = e3 = _mm_set1_epi8((char)0x80);
+    }
+    for (; i + 16 <= n; i += 16)
+    {
+        __m128i v = _mm_loadu_si128((const __m128i *)(p + i));
+        __m128i before = _mm_loadu_si128((const __m128i *)(p + i - 1));
+        int after_newline = _mm_movemask_epi8(_mm_cmpeq_epi8(before, newline));
+        if (!after_newline)
+        {
+            continue;
+        }
+        __m128i hit = _mm_or_si128(_mm_or_si128(_mm_cmpeq_epi8(v, e0), _mm_cmpeq_epi8(v, e1)),
+                                   _mm_or_si128(_mm_cmpeq_epi8(v, e2), _mm_cmpeq_epi8(v, e3)));
+        int mask = (_mm_movemask_epi8(hit) | (_mm_movemask_epi8(v) & high)) & after_newline;
+        if (mask)
+        {
+            return i + __builtin_ctz(mask);
+        }
+    }
+#endif
+    for (; i < n; ++i)
+    {
+        if (p[i - 1] == '\n' &&
+            (p[i] >= 0x80 ? accel->escape_high : memchr(accel->escapes, p[i], accel->nescapes) != NULL))
+        {
+            return i;
+        }
+    }
+    return n;
+}
+
+// The end of the longest match so far after reading input[i - 1] into a state
+// with the given flags.
+static inline ptrdiff_t accept_after(unsigned char flags, size_t i, ptrdiff_t last_accept)
+{
+    return flags & STATE_ACCEPTING ? (ptrdiff_t)i : flags & STATE_ACCEPTING_BEFORE ? (ptrdiff_t)i - 1 : last_accept;
+}
+
+static ptrdiff_t table_match(const scanner_t *scanner, int state, const unsigned char *input, size_t length)
+{
+    ptrdiff_t last_accept = (scanner->flags[state] & STATE_ACCEPTING) ? 0 : -1;
+    size_t i = 0;
+    while (i < length)
+    {
+        unsigned char flags = scanner->flags[state];
+        if (flags & STATE_ACCELERATED)
+        {
+            i += accel_skip(&scanner->accel[state], input + i, length - i);
+            if (flags & STATE_ACCEPTING)
+            {
+                last_accept = i;
+            }
+            if (i == length)
+            {
+                break;
+            }
+        }
+        state = scanner_next(scanner, state, input[i++]);
+        if (state < 0)
+        {
+            return last_accept;
+        }
+        last_accept = accept_after(scanner->flags[state], i, last_accept);
+    }
+    return scanner->flags[state] & STATE_ACCEPTING_AT_END ? (ptrdiff_t)length : last_accept;
+}
+
+// Takes two bytes per lookup in the stride-2 table, falling back to the
+// stride-1 table for a trailing odd byte.
+static ptrdiff_t stride2_match(const scanner_t *scanner, int state, const unsigned char *input, size_t length)
+{
+    const int classes = scanner->classes;
+    const int dead = scanner->states;
+    ptrdiff_t last_accept = (scanner->flags[state] & STATE_ACCEPTING) ? 0 : -1;
+    size_t i = 0;
+    while (i + 1 < length)
+    {
+        unsigned char flags = scanner->flags[state];
+        if (flags & STATE_ACCELERATED)
+        {
+            i += accel_skip(&scanner->accel[state], input + i, length - i);
+            if (flags & STATE_ACCEPTING)
+            {
+                last_accept = i;
+            }
+            if (i + 1 >= length)
+            {
+                break;
+            }
+        }
+        uint32_t entry = scanner->stride2[((size_t)state * classes + scanner->class_of[input[i]]) * classes +
+                                          scanner->class_of[input[i + 1]]];
+        if (entry & STRIDE2_MID_ACCEPT)
+        {
+            last_accept = i + 1;
+        }
+        else if (entry & STRIDE2_MID_BEFORE)
+        {
+            last_accept = i;
+        }
+        state = entry & STRIDE2_STATE_MASK;
+        i += 2;
+        if (state == dead)
+        {
+            return last_accept;
+        }
+        last_accept = accept_after(scanner->flags[state], i, last_accept);
+    }
+    if (i < length)
+    {
+        state = scanner->table[state * classes + scanner->class_of[input[i]]];
+        if (state < 0)
+        {
+            return last_accept;
+        }
+        last_accept = accept_after(scanner->flags[state], i + 1, last_accept);
+    }
+    return scanner->flags[state] & STATE_ACCEPTING_AT_END ? (ptrdiff_t)length : last_accept;
+}
+
+#ifdef HAVE_X86_SIMD
+// Steps every DFA state at once: within a block, v[s] is where state s ends up
+// after the bytes read so far, so one pshufb per byte composes the next
+// transition onto it and blocks do not depend on each other. The real state is
+// only looked up at block boundaries, where `last` holds, per starting state,
+// two past the offset of the latest accept inside the block, so that an
+// accept before its first byte still reads as nonzero.
+__attribute__((target("ssse3"))) static ptrdiff_t shuffle_match(const scanner_t *scanner, int state,
+                                                                const unsigned char *input, size_t length)
+{
+    const __m128i identity = _mm_setr_epi8(0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15);
+    const __m128i accepting = _mm_loadu_si128((const __m128i *)scanner->shuffle_accepting);
+    const __m128i before = _mm_loadu_si128((const __m128i *)scanner->shuffle_before);
+    const int dead = scanner->states;
+    ptrdiff_t last_accept = (scanner->flags[state] & STATE_ACCEPTING) ? 0 : -1;
+    size_t i = 0;
+    while (i < length)
+    {
+        unsigned char flags = scanner->flags[state];
+        if (flags & STATE_ACCELERATED)
+        {
+            i += accel_skip(&scanner->accel[state], input + i, length - i);
+            if (flags & STATE_ACCEPTING)
+            {
+                last_accept = i;
+            }
+            if (i == length)
+            {
+                break;
+            }
+        }
+        size_t n = length - i < SHUFFLE_BLOCK ? length - i : SHUFFLE_BLOCK;
+        __m128i v = identity;
+        __m128i last = _mm_setzero_si128();
+        for (size_t j = 0; j < n; ++j)
+        {
+            const __m128i *t = (const __m128i *)&scanner->shuffle[scanner->class_of[input[i + j]] * SHUFFLE_MAX_STATES];
+            v = _mm_shuffle_epi8(_mm_load_si128(t), v);
+            __m128i hit = _mm_shuffle_epi8(before, v);
+            last = _mm_or_si128(_mm_andnot_si128(hit, last), _mm_and_si128(hit, _mm_set1_epi8((char)(j + 1))));
+            hit = _mm_shuffle_epi8(accepting, v);
+            last = _mm_or_si128(_mm_andnot_si128(hit, last), _mm_and_si128(hit, _mm_set1_epi8((char)(j + 2))));
+        }
+        unsigned char lanes[SHUFFLE_MAX_STATES];
+        unsigned char lasts[SHUFFLE_MAX_STATES];
+        _mm_storeu_si128((__m128i *)lanes, v);
+        _mm_storeu_si128((__m128i *)lasts, last);
+        if (lasts[state])
+        {
+            last_accept = i + lasts[state] - 1;
+        }
+        state = lanes[state];
+        i += n;
+        if (state == dead)
+        {
+            return last_accept;
+        }
+    }
+    return scanner->flags[state] & STATE_ACCEPTING_AT_END ? (ptrdiff_t)length : last_accept;
+}
+#endif
+
+static ptrdiff_t scanner_run(const scanner_t *scanner, int state, const unsigned char *input, size_t length)
+{
+    if (scanner->engine == ENGINE_STRIDE2)
+    {
+        return stride2_match(scanner, state, input, length);
+    }
+#ifdef HAVE_X86_SIMD
+    if (scanner->engine == ENGINE_SHUFFLE)
+    {
+        return shuffle_match(scanner, state, input, length);
+    }
+#endif
+    return table_match(scanner, state, input, length);
+}
+
+// Runs the DFA on input + offset and returns the length of the longest prefix
+// of it that matches, or -1 when none does. The assertions that look behind
+// the start see input[offset - 1].
+static ptrdiff_t scanner_match_from(const scanner_t *scanner, const unsigned char *input, size_t length,
+                                    size_t offset)
+{
+    int state = scanner->starts[offset > 0 ? byte_kind(input[offset - 1]) : KIND_EDGE];
+    return scanner_run(scanner, state, input + offset, length - offset);
+}
+
+// Number of independent walks advanced in lockstep by scanner_match_batch(),
+// and the bytes each one takes between checks for finished walks.
+#define BATCH_LANES 8
+#define BATCH_ROUND 16
+
+// Lines the batch engine gathers for a call to scanner_match_batch(), unless
+// --batch says otherwise.
+#define BATCH_LINES 256
+
+typedef struct
+{
+    const unsigned char *p;
+    const unsigned char *begin;
+    const unsigned char *end;
+    int state;
+    ptrdiff_t last_accept;
+    size_t index;
+} batch_lane_t;
+
+// Walks the rest of a lane one byte at a time, as table_match() would.
+static ptrdiff_t batch_lane_finish(const scanner_t *scanner, batch_lane_t *lane)
+{
+    int state = lane->state;
+    while (state != scanner->states && lane->p != lane->end)
+    {
+        unsigned char flags = scanner->flags[state];
+        if (flags & STATE_ACCELERATED)
+        {
+            lane->p += accel_skip(&scanner->accel[state], lane->p, lane->end - lane->p);
+            if (flags & STATE_ACCEPTING)
+            {
+                lane->last_accept = lane->p - lane->begin;
+            }
+            if (lane->p == lane->end)
+            {
+                break;
+            }
+        }
+        state = scanner_next(scanner, state, *lane->p++);
+        if (state < 0)
+        {
+            return lane->last_accept;
+        }
+        lane->last_accept = accept_after(scanner->flags[state], lane->p - lane->begin, lane->last_accept);
+    }
+    if (state != scanner->states && (scanner->flags[state] & STATE_ACCEPTING_AT_END))
+    {
+        lane->last_accept = lane->end - lane->begin;
+    }
+    return lane->last_accept;
+}
+
+// Computes scanner_run() from state for each of `count` buffers, storing the
+// results in `results`. Up to BATCH_LANES buffers are walked at once in rounds of
+// BATCH_ROUND bytes, taking one byte from each in turn so that the table loads
+// of different buffers overlap. Inside a round a walk that dies simply stays
+// in the dead state. Between rounds, dead lanes are retired, and lanes with
+// less than a round left are finished one byte at a time so that the next
+// round can run at full length; their slots are refilled with new buffers.
+static void scanner_match_batch(const scanner_t *scanner, int state, const unsigned char *const *inputs,
+                                const size_t *lengths, size_t count, ptrdiff_t *results)
+{
+    if (scanner->lazy)
+    {
+        // a flush would strand the states of the other lanes
+        for (size_t n = 0; n < count; ++n)
+        {
+            results[n] = scanner_run(scanner, state, inputs[n], lengths[n]);
+        }
+        return;
+    }
+    const int dead = scanner->states;
+    const int *table = scanner->table;
+    const unsigned char *class_of = scanner->class_of;
+    const unsigned char *state_flags = scanner->flags;
+    const int classes = scanner->classes;
+    batch_lane_t lanes[BATCH_LANES];
+    size_t next = 0;
+    int active = 0;
+    for (;;)
+    {
+        while (active < BATCH_LANES && next < count)
+        {
+            batch_lane_t *lane = &lanes[active];
+            lane->p = lane->begin = inputs[next];
+            lane->end = inputs[next] + lengths[next];
+            lane->state = state;
+            lane->last_accept = (state_flags[state] & STATE_ACCEPTING) ? 0 : -1;
+            lane->index = next++;
+            if (lengths[next - 1] < BATCH_ROUND)
+            {
+                results[lane->index] = batch_lane_finish(scanner, lane);
+            }
+            else
+            {
+                ++active;
+            }
+        }
+        if (active == 0)
+        {
+            break;
+        }
+        // the walks live in locals for the round; stores into the lanes would
+        // otherwise force the scanner's fields to be reloaded on every step
+        int states[BATCH_LANES];
+        ptrdiff_t accepts[BATCH_LANES];
+        ptrdiff_t offsets[BATCH_LANES];
+        const unsigned char *ps[BATCH_LANES];
+        for (int l = 0; l < active; ++l)
+        {
+            states[l] = lanes[l].state;
+            accepts[l] = lanes[l].last_accept;
+            offsets[l] = lanes[l].p - lanes[l].begin + 1;
+            ps[l] = lanes[l].p;
+        }
+        for (int k = 0; k < BATCH_ROUND; ++k)
+        {
+            for (int l = 0; l < active; ++l)
+            {
+                int next = table[states[l] * classes + class_of[ps[l][k]]];
+                next = next < 0 ? dead : next;
+                states[l] = next;
+                // accepts are data dependent and differ between lanes, so
+                // select instead of branching
+                unsigned char flags = state_flags[next];
+                accepts[l] = (flags & STATE_ACCEPTING_BEFORE) ? offsets[l] + k - 1 : accepts[l];
+                accepts[l] = (flags & STATE_ACCEPTING) ? offsets[l] + k : accepts[l];
+            }
+        }
+        for (int l = 0; l < active; ++l)
+        {
+            lanes[l].state = states[l];
+            lanes[l].last_accept = accepts[l];
+            lanes[l].p += BATCH_ROUND;
+        }
+        for (int l = 0; l < active; ++l)
+        {
+            batch_lane_t *lane = &lanes[l];
+            unsigned char flags = state_flags[lane->state];
+            if ((flags & STATE_ACCELERATED) && lane->p != lane->end)
+            {
+                lane->p += accel_skip(&scanner->accel[lane->state], lane->p, lane->end - lane->p);
+                if (flags & STATE_ACCEPTING)
+                {
+                    lane->last_accept = lane->p - lane->begin;
+                }
+            }
+            if (lane->state == dead || lane->end - lane->p < BATCH_ROUND)
+            {
+                results[lane->index] = batch_lane_finish(scanner, lane);
+                lanes[l--] = lanes[--active];
+            }
+        }
+    }
+}
+
+// Runs the DFA from *state until the earliest accept, one byte at a time.
+// Returns true with *offset at the end of that match, which is just past the
+// byte read last or, when that byte settled an assertion, just before it.
+// Otherwise returns false with *offset at the end of the input or just past
+// the byte that killed the walk. *state is left in the state the walk stopped
+// in, -1 once it has died.
+static bool table_find(const scanner_t *scanner, int *state, const unsigned char *input, size_t length,
+                       size_t *offset)
+{
+    int s = *state;
+    size_t i = 0;
+    bool found = (scanner->flags[s] & STATE_ACCEPTING) != 0;
+    while (!found && i < length)
+    {
+        unsigned char flags = scanner->flags[s];
+        if (flags & STATE_ACCELERATED)
+        {
+            i += accel_skip(&scanner->accel[s], input + i, length - i);
+            if (i == length)
+            {
+                break;
+            }
+        }
+        s = scanner_next(scanner, s, input[i++]);
+        if (s < 0)
+        {
+            break;
+        }
+        found = (scanner->flags[s] & (STATE_ACCEPTING | STATE_ACCEPTING_BEFORE)) != 0;
+    }
+    *state = s;
+    *offset = i;
+    if (found)
+    {
+        *offset -= (scanner->flags[s] & STATE_ACCEPTING_BEFORE) != 0;
+    }
+    return found;
+}
+
+// Like table_find(), two bytes per lookup in the stride-2 table. A pair that
+// accepts or kills the walk is read again one byte at a time, to tell which of
+// its bytes did.
+static bool stride2_find(const scanner_t *scanner, int *state, const unsigned char *input, size_t length,
+                         size_t *offset)
+{
+    const int classes = scanner->classes;
+    const int dead = scanner->states;
+    int s = *state;
+    size_t i = 0;
+    while (i + 1 < length && !(scanner->flags[s] & STATE_ACCEPTING))
+    {
+        if (scanner->flags[s] & STATE_ACCELERATED)
+        {
+            i += accel_skip(&scanner->accel[s], input + i, length - i);
+            if (i + 1 >= length)
+            {
+                break;
+            }
+        }
+        uint32_t entry = scanner->stride2[((size_t)s * classes + scanner->class_of[input[i]]) * classes +
+                                          scanner->class_of[input[i + 1]]];
+        int next = entry & STRIDE2_STATE_MASK;
+        if ((entry & (STRIDE2_MID_ACCEPT | STRIDE2_MID_BEFORE)) || next == dead ||
+            (scanner->flags[next] & (STATE_ACCEPTING | STATE_ACCEPTING_BEFORE)))
+        {
+            break;
+        }
+        s = next;
+        i += 2;
+    }
+    *state = s;
+    bool found = table_find(scanner, state, input + i, length - i, offset);
+    *offset += i;
+    return found;
+}
+
+#ifdef HAVE_X86_SIMD
+// Like table_find(), stepping every state at once over a block as
+// shuffle_match() does. Only whether the block accepts or dies anywhere is
+// kept; such a block is read again one byte at a time for where it did.
+__attribute__((target("ssse3"))) static bool shuffle_find(const scanner_t *scanner, int *state,
+                                                          const unsigned char *input, size_t length,
+                                                          size_t *offset)
+{
+    const __m128i identity = _mm_setr_epi8(0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15);
+    const __m128i accepting = _mm_loadu_si128((const __m128i *)scanner->shuffle_accepting);
+    const __m128i before = _mm_loadu_si128((const __m128i *)scanner->shuffle_before);
+    const int dead = scanner->states;
+    int s = *state;
+    size_t i = 0;
+    while (i < length && !(scanner->flags[s] & STATE_ACCEPTING))
+    {
+        if (scanner->flags[s] & STATE_ACCELERATED)
+        {
+            i += accel_skip(&scanner->accel[s], input + i, length - i);
+            if (i == length)
+            {
+                break;
+            }
+            // the byte that ended the skip is the likeliest to accept, and a
+            // block would be wasted on it
+            int next = scanner->table[s * scanner->classes + scanner->class_of[input[i]]];
+            if (next < 0 || (scanner->flags[next] & (STATE_ACCEPTING | STATE_ACCEPTING_BEFORE)))
+            {
+                break;
+            }
+            s = next;
+            ++i;
+            continue;
+        }
+        size_t n = length - i < SHUFFLE_FIND_BLOCK ? length - i : SHUFFLE_FIND_BLOCK;
+        __m128i v = identity;
+        __m128i hits = _mm_setzero_si128();
+        for (size_t j = 0; j < n; ++j)
+        {
+            const __m128i *t = (const __m128i *)&scanner->shuffle[scanner->class_of[input[i + j]] * SHUFFLE_MAX_STATES];
+            v = _mm_shuffle_epi8(_mm_load_si128(t), v);
+            hits = _mm_or_si128(hits, _mm_or_si128(_mm_shuffle_epi8(before, v), _mm_shuffle_epi8(accepting, v)));
+        }
+        unsigned char lanes[SHUFFLE_MAX_STATES];
+        unsigned char hit[SHUFFLE_MAX_STATES];
+        _mm_storeu_si128((__m128i *)lanes, v);
+        _mm_storeu_si128((__m128i *)hit, hits);
+        if (hit[s] || lanes[s] == dead)
+        {
+            break;
+        }
+        s = lanes[s];
+        i += n;
+    }
+    *state = s;
+    bool found = table_find(scanner, state, input + i, length - i, offset);
+    *offset += i;
+    return found;
+}
+#endif
+
+// Searches with the engine the scanner runs on, as table_find() does. at_end
+// says whether the input ends with this block, for the assertions that look
+// past it.
+static bool scanner_find(const scanner_t *scanner, int *state, const unsigned char *input, size_t length,
+                         bool at_end, size_t *offset)
+{
+    bool found;
+    if (scanner->engine == ENGINE_STRIDE2)
+    {
+        found = stride2_find(scanner, state, input, length, offset);
+    }
+#ifdef HAVE_X86_SIMD
+    else if (scanner->engine == ENGINE_SHUFFLE)
+    {
+        found = shuffle_find(scanner, state, input, length, offset);
+    }
+#endif
+    else
+    {
+        found = table_find(scanner, state, input, length, offset);
+    }
+    if (!found && at_end && *offset == length && *state >= 0 &&
+        (scanner->flags[*state] & STATE_ACCEPTING_AT_END))
+    {
+        found = true;
+    }
+    return found;
+}
+
+static int scanner_step(const scanner_t *scanner, int state, unsigned char c)
+{
+    return state < 0 ? -1 : scanner_next(scanner, state, c);
+}
+
+// The rules state accepts as it is entered, or those it accepts besides if
+// the input ends there when at_end; NULL for none.
+static const bitset_t *scanner_rules(const scanner_t *scanner, int state, bool at_end)
+{
+    if (scanner->lazy)
+    {
+        const dfa_node_t *node = scanner->lazy->states.data[state];
+        return at_end ? node->rules_at_end : node->rules;
+    }
+    return at_end ? scanner->rules_at_end[state] : scanner->rules[state];
+}
+
+// Adds every rule that matches somewhere in line to matched, in one walk of
+// a scanner compiled with COMPILE_RULE_SETS. Unlike a search, the walk goes
+// on past the first match, up to the end of the line or where the DFA dies.
+// The line is bounded by newlines or the edges of the input, which the
+// assertions all treat alike.
+static void scanner_match_rules(const scanner_t *scanner, const unsigned char *line, size_t length,
+                                bitset_t *matched)
+{
+    int state = scanner->starts[KIND_NEWLINE];
+    for (size_t i = 0;; ++i)
+    {
+        // only the flags are read for most bytes
+        const bitset_t *rules = scanner->flags[state] & (STATE_ACCEPTING | STATE_ACCEPTING_BEFORE)
+                                    ? scanner_rules(scanner, state, false)
+                                    : NULL;
+        if (rules)
+        {
+            bitset_inplace_union(matched, rules);
+        }
+        if (i == length)
+        {
+            break;
+        }
+        if (scanner->flags[state] & STATE_ACCELERATED)
+        {
+            // a turn of the loop adds no rules the first one did not
+            i += accel_skip(&scanner->accel[state], line + i, length - i);
+            if (i == length)
+            {
+                break;
+            }
+        }
+        state = scanner_next(scanner, state, line[i]);
+        if (state < 0)
+        {
+            return;
+        }
+    }
+    const bitset_t *at_end = scanner_rules(scanner, state, true);
+    if (at_end)
+    {
+        bitset_inplace_union(matched, at_end);
+    }
+}
+
+// Marks in starts[i], for i from 0 to length, whether a match begins at
+// line[i], given the reverse DFA of the pattern built with
+// COMPILE_REVERSE_SEARCH: walked back from the end of the line, it accepts
+// wherever some match that ends by then begins. One walk covers the line,
+// where trying every start forwards would be quadratic. Whatever lies past
+// the line is taken as the edge of the input.
+static void scanner_match_starts(const scanner_t *reverse, const unsigned char *line, size_t length, bool *starts)
+{
+    int s = reverse->starts[KIND_NEWLINE];
+    starts[length] = reverse->flags[s] & STATE_ACCEPTING;
+    for (size_t i = length; i > 0; --i)
+    {
+        s = scanner_next(reverse, s, line[i - 1]);
+        if (s < 0)
+        {
+            memset(starts, false, i);
+            return;
+        }
+        starts[i] |= (reverse->flags[s] & STATE_ACCEPTING_BEFORE) != 0;
+        starts[i - 1] = reverse->flags[s] & STATE_ACCEPTING;
+    }
+    starts[0] |= (reverse->flags[s] & STATE_ACCEPTING_AT_END) != 0;
+}
+
+// Whether a match ends at line[length], which is a byte of the given kind,
+// and starts within the line, given the reverse DFA of the pattern. The walk
+// stops at the first accept or as soon as the DFA dies, which for most lines
+// is a few bytes in. Whatever precedes the line is taken as the edge of the
+// input, which every assertion treats as it treats a newline.
+static bool scanner_line_end_matches(const scanner_t *reverse, const unsigned char *line, size_t length, int kind)
+{
+    int s = reverse->starts[kind];
+    for (size_t i = length;;)
+    {
+        if (reverse->flags[s] & (STATE_ACCEPTING | STATE_ACCEPTING_BEFORE))
+        {
+            return true;
+        }
+        if (i == 0)
+        {
+            return (reverse->flags[s] & STATE_ACCEPTING_AT_END) != 0;
+        }
+        s = scanner_next(reverse, s, line[--i]);
+        if (s < 0)
+        {
+            return false;
+        }
+    }
+}
+
+// Writes s as a JSON string.
+static void print_json_string(FILE *fp, const char *s)
+{
+    fputc('"', fp);
+    for (; *s; ++s)
+    {
+        unsigned char c = *s;
+        if (c == '"' || c == '\\')
+        {
+            fprintf(fp, "\\%c", c);
+        }
+        else if (c < 0x20)
+        {
+            fprintf(fp, "\\u%04x", c);
+        }
+        else
+        {
+            fputc(c, fp);
+        }
+    }
+    fputc('"', fp);
+}
+
+static bool profile_init(scan_profile_t *profile, const scanner_t *scanner)
+{
+    profile->states = scanner->states;
+    profile->classes = scanner->classes;
+    memcpy(profile->class_of, scanner->class_of, sizeof(profile->class_of));
+    profile->total = 0;
+    profile->bytes = calloc(scanner->states, sizeof(size_t));
+    profile->visits = calloc(scanner->states, sizeof(size_t));
+    profile->accepts = calloc(scanner->states, sizeof(size_t));
+    profile->edges = calloc((size_t)scanner->states * scanner->classes, sizeof(size_t));
+    profile->state = scanner->starts[KIND_EDGE];
+    profile->skipping = false;
+    return profile->bytes && profile->visits && profile->accepts && profile->edges;
+}
+
+static void profile_free(scan_profile_t *profile)
+{
+    free(profile->bytes);
+    free(profile->visits);
+    free(profile->accepts);
+    free(profile->edges);
+}
+
+// Walks input as the next part of the text being profiled.
+static void profile_scan(scan_profile_t *profile, const scanner_t *scanner, const unsigned char *input, size_t length)
+{
+    const int line_state = scanner->starts[KIND_NEWLINE];
+    size_t i = 0;
+    while (i < length)
+    {
+        if (profile->skipping)
+        {
+            const unsigned char *nl = memchr(input + i, '\n', length - i);
+            if (!nl)
+            {
+                break;
+            }
+            i = nl - input + 1;
+            profile->skipping = false;
+            profile->state = line_state;
+            ++profile->visits[line_state];
+            continue;
+        }
+        int s = profile->state;
+        if (scanner->flags[s] & STATE_ACCEPTING)
+        {
+            // an empty match, there before a byte is read
+            ++profile->accepts[s];
+            profile->skipping = true;
+            continue;
+        }
+        unsigned char c = input[i++];
+        int k = scanner->class_of[c];
+        int t = scanner->table[s * scanner->classes + k];
+        ++profile->total;
+        ++profile->bytes[s];
+        ++profile->edges[(size_t)s * scanner->classes + k];
+        if (t >= 0 && t != s)
+        {
+            ++profile->visits[t];
+        }
+        bool found = t >= 0 && (scanner->flags[t] & (STATE_ACCEPTING | STATE_ACCEPTING_BEFORE));
+        if (found)
+        {
+            ++profile->accepts[t];
+        }
+        if (t < 0 || found)
+        {
+            profile->skipping = c != '\n';
+            t = line_state;
+            profile->visits[t] += !profile->skipping;
+        }
+        profile->state = t;
+    }
+}
+
+// Starts the walk over at the start of a file.
+static void profile_rewind(scan_profile_t *profile, const scanner_t *scanner)
+{
+    profile->state = scanner->starts[KIND_EDGE];
+    profile->skipping = false;
+    ++profile->visits[profile->state];
+}
+
+// Prints the profile as JSON: per state, the bytes it read, the times it was
+// entered and the matches found there, and the transitions out of it by
+// target, -1 for the walk dying.
+static void print_profile(FILE *fp, const char *pattern, const scanner_t *scanner, const scan_profile_t *profile)
+{
+    fprintf(fp, "{\"pattern\": ");
+    print_json_string(fp, pattern);
+    fprintf(fp, ", \"bytes\": %zu, \"states\": [", profile->total);
+    size_t *taken = malloc(sizeof(size_t) * (profile->states + 1));
+    for (int s = 0; s < profile->states; ++s)
+    {
+        fprintf(fp, "%s\n  {\"state\": %d, \"accepting\": %s, \"bytes\": %zu, \"share\": %.4f, \"visits\": %zu, "
+                    "\"accepts\": %zu, \"transitions\": [",
+                s > 0 ? "," : "", s, scanner->flags[s] & STATE_ACCEPTING ? "true" : "false", profile->bytes[s],
+                profile->total ? (double)profile->bytes[s] / profile->total : 0.0, profile->visits[s],
+                profile->accepts[s]);
+        // by target, the dead one last
+        memset(taken, 0, sizeof(size_t) * (profile->states + 1));
+        for (int k = 0; k < profile->classes; ++k)
+        {
+            int t = scanner->table[s * scanner->classes + k];
+            taken[t < 0 ? profile->states : t] += profile->edges[(size_t)s * profile->classes + k];
+        }
+        bool first = true;
+        for (int t = 0; t <= profile->states; ++t)
+        {
+            if (taken[t])
+            {
+                fprintf(fp, "%s{\"to\": %d, \"count\": %zu}", first ? "" : ", ", t < profile->states ? t : -1,
+                        taken[t]);
+                first = false;
+            }
+        }
+        fprintf(fp, "]}");
+    }
+    fprintf(fp, "\n]}\n");
+    free(taken);
+}
+
+static const char *bin_to_ascii(int c, bool use_hex)
+{
+    static char buf[8];
+    c &= 0xFF;
+    if (' ' <= c && c < 0x7F && c != '\'' && c != '\\')
+    {
+        buf[0] = c;
+        buf[1] = '\0';
+    }
+    else
+    {
+        buf[0] = '\\';
+        buf[2] = '\0';
+        switch (c)
+        {
+        case '\\':
+            buf[1] = '\\';
+            break;
+        case '\'':
+            buf[1] = '\'';
+            break;
+        case '\b':
+            buf[1] = 'b';
+            break;
+        case '\f':
+            buf[1] = 'f';
+            break;
+        case '\t':
+            buf[1] = 't';
+            break;
+        case '\r':
+            buf[1] = 'r';
+            break;
+        case '\n':
+            buf[1] = 'n';
+            break;
+        default:
+            sprintf(&buf[1], use_hex ? "x%03x" : "%03o", c);
+            break;
+        }
+    }
+    return buf;
+}
+
+static void printv(FILE *fp, const char **argv)
+{
+    while (*argv)
+    {
+        fprintf(fp, "%s\n", *argv++);
+    }
+}
+
+static void comment(FILE *fp, const char **argv)
+{
+    fprintf(fp, "\n/*---------------------------------------\n");
+    while (*argv)
+    {
+        fprintf(fp, " * %s\n", *argv++);
+    }
+    fprintf(fp, " */\n\n");
+}
+
+static int pairs(FILE *fp, const dtran_t *dtran, const char *name, int threshold, bool numbers)
+{
+    // https://stackoverflow.com/a/29960371
+
+    int num_cells = 0;
+    for (int i = 0; i < dtran->length; ++i)
+    {
+        int ntransitions = 0;
+        for (int *p = dtran->data[i].data, j = dtran->data[i].length; --j >= 0; ++p)
+        {
+            if (*p != -1)
+            {
+                ++ntransitions;
+            }
+        }
+        if (ntransitions > 0)
+        {
+            fprintf(fp, "%s %s %s%-d[] = { ", STORAGE_CLASS, TYPE, name, i);
+            ++num_cells;
+            if (ntransitions > threshold)
+            {
+                fprintf(fp, "0,\n" INDENT);
+            }
+            else
+            {
+                fprintf(fp, "%5d, ", ntransitions);
+                if (threshold > 5)
+                {
+                    fprintf(fp, "\n" INDENT);
+                }
+            }
+
+            int nprinted = dtran->data[i].length;
+            int ncommas = ntransitions;
+            for (int *p = dtran->data[i].data, j = 0; j < dtran->data[i].length; ++j, ++p)
+            {
+                if (ntransitions > threshold)
+                {
+                    ++num_cells;
+                    --nprinted;
+                    fprintf(fp, "%5d", *p);
+                    if (j < dtran->data[i].length - 1)
+                    {
+                        fprintf(fp, ", ");
+                    }
+                }
+                else if (*p != -1)
+                {
+                    num_cells += 2;
+                    if (numbers)
+                    {
+                        fprintf(fp, "%d,%d", j, *p);
+                    }
+                    else
+                    {
+                        fprintf(fp, "'%s',%d", bin_to_ascii(j, 0), *p);
+                    }
+                    nprinted -= 2;
+                    if (--ncommas > 0)
+                    {
+                        fprintf(fp, ", ");
+                    }
+                }
+                if (nprinted <= 0)
+                {
+                    fprintf(fp, "\n" INDENT);
+                    nprinted = dtran->data[i].length;
+                }
+            }
+            fprintf(fp, "};\n");
+        }
+    }
+    fprintf(fp, "\n%s %s *%s[%d] =\n{\n" INDENT, STORAGE_CLASS, TYPE, name, dtran->length);
+    int nprinted = 10;
+    for (int i = 0; i < dtran->length; ++i)
+    {
+        int ntransitions = 0;
+        for (int *p = dtran->data[i].data, j = dtran->data[i].length; --j >= 0; ++p)
+        {
+            if (*p != -1)
+            {
+                ++ntransitions;
+            }
+        }
+        bool last = i == dtran->length - 1;
+        fprintf(fp, ntransitions ? "%s%-d" : "NULL", name, i);
+        fprintf(fp, last ? "\n};\n\n" : ", ");
+        if (!last && --nprinted <= 0)
+        {
+            fprintf(fp, "\n" INDENT);
+            nprinted = 10;
+        }
+    }
+    return num_cells;
+}
+
+static void pnext(FILE *fp, const char *name)
+{
+    static const char *toptext[] = {
+        "Given the current state and the current input character, return ",
+        "the next state.",
+        NULL,
+    };
+    static const char *boptext[] = {
+        "  int i;", "  if (p)",
+        "  {",      "    if ((i = *p++) == 0)",
+        "    {",    "      return p[c];",
+        "    }",    "    for (; --i >= 0; p += 2)",
+        "    {",    "      if (c == (unsigned int)p[0])",
+        "      {",  "        return p[1];",
+        "      }",  "    }",
+        "  }",      "  return YYF;",
+        "}",        NULL,
+    };
+    fprintf(fp, "\n/*------------------------------------------------*/\n");
+    fprintf(fp, "%s %s yy_next(int cur_state, unsigned int c)\n", DECODING_ROUTINE_STORAGE_CLASS, TYPE);
+    fprintf(fp, "{\n");
+    comment(fp, toptext);
+    fprintf(fp, "  %s *p = %s[cur_state];\n", TYPE, name);
+    printv(fp, boptext);
+}
+
+// The rest of a generated scanner, emitted by emit_scanner() after the
+// tables: an input layer in the style of Holub's ii_ routines and a
+// longest-match yylex() driver on top of it.
+static void emit_scanner_support(FILE *fp)
+{
+    static const char *input_layer[] = {
+        "/*------------------------------------------------*/",
+        "/* Input. The buffer starts out as two halves of YY_BUFSIZE bytes and",
+        " * is refilled a half at a time. Only the current lexeme is moved to make",
+        " * room, and only once less than half the buffer is free. A lexeme longer",
+        " * than half the buffer grows it.",
+        " */",
+        "",
+        "#ifndef YY_BUFSIZE",
+        "#define YY_BUFSIZE (16 * 1024)",
+        "#endif",
+        "#ifndef YY_READ",
+        "#define YY_READ(fd, buf, n) read(fd, buf, n)",
+        "#endif",
+        "",
+        "YYPRIVATE unsigned char *Ii_buf;   /* input buffer */",
+        "YYPRIVATE size_t Ii_size;          /* bytes in Ii_buf, not counting the terminator slot */",
+        "YYPRIVATE unsigned char *Ii_end;   /* just past the last byte read */",
+        "YYPRIVATE unsigned char *Ii_next;  /* next byte ii_advance() returns */",
+        "YYPRIVATE unsigned char *Ii_smark; /* start of the current lexeme */",
+        "YYPRIVATE unsigned char *Ii_emark; /* end of the current lexeme */",
+        "YYPRIVATE int Ii_fd = -1;",
+        "YYPRIVATE int Ii_eof;              /* YY_READ() has returned 0 */",
+        "YYPRIVATE int Ii_lineno = 1;       /* line and column of Ii_smark */",
+        "YYPRIVATE int Ii_column = 1;",
+        "YYPRIVATE int Ii_termchar = -1;    /* byte ii_term() replaced, -1 if none */",
+        "YYPRIVATE int Ii_prev = EOF;       /* the byte before Ii_smark, EOF at the start */",
+        "",
+        "/* Opens a new input file, standard input for NULL or \"-\". Returns the",
+        " * file descriptor, or -1 with errno set.",
+        " */",
+        "YYPRIVATE int ii_newfile(const char *name)",
+        "{",
+        "  int fd = name == NULL || strcmp(name, \"-\") == 0 ? 0 : open(name, O_RDONLY);",
+        "  if (fd < 0)",
+        "  {",
+        "    return -1;",
+        "  }",
+        "  if (Ii_buf == NULL)",
+        "  {",
+        "    Ii_size = 2 * YY_BUFSIZE;",
+        "    if ((Ii_buf = malloc(Ii_size + 1)) == NULL)",
+        "    {",
+        "      if (fd != 0)",
+        "      {",
+        "        close(fd);",
+        "      }",
+        "      return -1;",
+        "    }",
+        "  }",
+        "  if (Ii_fd > 0)",
+        "  {",
+        "    close(Ii_fd);",
+        "  }",
+        "  Ii_fd = fd;",
+        "  Ii_end = Ii_next = Ii_smark = Ii_emark = Ii_buf;",
+        "  Ii_eof = 0;",
+        "  Ii_lineno = Ii_column = 1;",
+        "  Ii_termchar = -1;",
+        "  Ii_prev = EOF;",
+        "  return fd;",
+        "}",
+        "",
+        "/* Reads more input, first making room for it. Returns the number of bytes",
+        " * read, 0 at end of input or -1 on an error.",
+        " */",
+        "YYPRIVATE int ii_fillbuf(void)",
+        "{",
+        "  ptrdiff_t n;",
+        "  if (Ii_eof)",
+        "  {",
+        "    return 0;",
+        "  }",
+        "  if ((size_t)(Ii_buf + Ii_size - Ii_end) < Ii_size / 2)",
+        "  {",
+        "    n = Ii_smark - Ii_buf;",
+        "    if (n > 0)",
+        "    {",
+        "      memmove(Ii_buf, Ii_smark, Ii_end - Ii_smark);",
+        "      Ii_end -= n;",
+        "      Ii_next -= n;",
+        "      Ii_smark -= n;",
+        "      Ii_emark -= n;",
+        "    }",
+        "    if ((size_t)(Ii_buf + Ii_size - Ii_end) < Ii_size / 2)",
+        "    {",
+        "      ptrdiff_t end = Ii_end - Ii_buf;",
+        "      ptrdiff_t next = Ii_next - Ii_buf;",
+        "      ptrdiff_t smark = Ii_smark - Ii_buf;",
+        "      ptrdiff_t emark = Ii_emark - Ii_buf;",
+        "      unsigned char *grown = realloc(Ii_buf, 2 * Ii_size + 1);",
+        "      if (grown == NULL)",
+        "      {",
+        "        return -1;",
+        "      }",
+        "      Ii_buf = grown;",
+        "      Ii_end = grown + end;",
+        "      Ii_next = grown + next;",
+        "      Ii_smark = grown + smark;",
+        "      Ii_emark = grown + emark;",
+        "      Ii_size *= 2;",
+        "    }",
+        "  }",
+        "  do",
+        "  {",
+        "    n = YY_READ(Ii_fd, Ii_end, Ii_buf + Ii_size - Ii_end);",
+        "  } while (n < 0 && errno == EINTR);",
+        "  if (n <= 0)",
+        "  {",
+        "    Ii_eof = n == 0;",
+        "    return n < 0 ? -1 : 0;",
+        "  }",
+        "  Ii_end += n;",
+        "  return n;",
+        "}",
+        "",
+        "/* Returns the next input byte and moves past it, or EOF. */",
+        "YYPRIVATE int ii_advance(void)",
+        "{",
+        "  if (Ii_next >= Ii_end && ii_fillbuf() <= 0)",
+        "  {",
+        "    return EOF;",
+        "  }",
+        "  return *Ii_next++;",
+        "}",
+        "",
+        "/* Returns the byte n positions ahead without moving, ii_look(1) being the",
+        " * one ii_advance() returns next; EOF if the input ends first.",
+        " */",
+        "YYPRIVATE int ii_look(int n)",
+        "{",
+        "  while (Ii_end - Ii_next < n)",
+        "  {",
+        "    if (ii_fillbuf() <= 0)",
+        "    {",
+        "      return EOF;",
+        "    }",
+        "  }",
+        "  return Ii_next[n - 1];",
+        "}",
+        "",
+        "/* Moves back n bytes, but not past the start of the lexeme. Returns the",
+        " * number of bytes actually pushed back.",
+        " */",
+        "YYPRIVATE int ii_pushback(int n)",
+        "{",
+        "  if (n > Ii_next - Ii_smark)",
+        "  {",
+        "    n = Ii_next - Ii_smark;",
+        "  }",
+        "  Ii_next -= n;",
+        "  if (Ii_emark > Ii_next)",
+        "  {",
+        "    Ii_emark = Ii_next;",
+        "  }",
+        "  return n;",
+        "}",
+        "",
+        "/* Starts a new lexeme at the current position. */",
+        "YYPRIVATE void ii_mark_start(void)",
+        "{",
+        "  unsigned char *p = Ii_smark;",
+        "  unsigned char *nl;",
+        "  if (Ii_next > Ii_smark)",
+        "  {",
+        "    Ii_prev = Ii_next[-1];",
+        "  }",
+        "  while ((nl = memchr(p, '\\n', Ii_next - p)) != NULL)",
+        "  {",
+        "    ++Ii_lineno;",
+        "    Ii_column = 1;",
+        "    p = nl + 1;",
+        "  }",
+        "  Ii_column += Ii_next - p;",
+        "  Ii_smark = Ii_emark = Ii_next;",
+        "}",
+        "",
+        "/* Ends the lexeme at the current position: the longest match so far. */",
+        "YYPRIVATE void ii_mark_end(void)",
+        "{",
+        "  Ii_emark = Ii_next;",
+        "}",
+        "",
+        "/* Backs up to the end of the lexeme, dropping whatever was read past it. */",
+        "YYPRIVATE void ii_to_mark(void)",
+        "{",
+        "  Ii_next = Ii_emark;",
+        "}",
+        "",
+        "/* Null-terminates the lexeme in place; ii_unterm() undoes it. */",
+        "YYPRIVATE void ii_term(void)",
+        "{",
+        "  if (Ii_termchar < 0)",
+        "  {",
+        "    Ii_termchar = *Ii_emark;",
+        "    *Ii_emark = '\\0';",
+        "  }",
+        "}",
+        "",
+        "YYPRIVATE void ii_unterm(void)",
+        "{",
+        "  if (Ii_termchar >= 0)",
+        "  {",
+        "    *Ii_emark = (unsigned char)Ii_termchar;",
+        "    Ii_termchar = -1;",
+        "  }",
+        "}",
+        "",
+        "YYPRIVATE char *ii_text(void) { return (char *)Ii_smark; }",
+        "YYPRIVATE int ii_length(void) { return Ii_emark - Ii_smark; }",
+        "YYPRIVATE int ii_lineno(void) { return Ii_lineno; }",
+        "YYPRIVATE int ii_column(void) { return Ii_column; }",
+        "YYPRIVATE int ii_prev(void) { return Ii_prev; }",
+        NULL,
+    };
+    static const char *driver[] = {
+        "/*------------------------------------------------*/",
+        "/* yylex() returns the rule, counted from 1, of the longest match starting",
+        " * at the current position, the first rule where several match that much,",
+        " * YY_UNMATCHED for a single byte that starts no match, and YY_EOF at the",
+        " * end of the input. Either way yytext is the null-terminated lexeme, yyleng",
+        " * its length, and yylineno and yycolumn where it starts. Input is standard",
+        " * input unless ii_newfile() was called first.",
+        " */",
+        "",
+        "#define YY_EOF 0",
+        "#define YY_UNMATCHED (-1)",
+        "",
+        "char *yytext;",
+        "int yyleng;",
+        "int yylineno;",
+        "int yycolumn;",
+        "",
+        "int yylex(void)",
+        "{",
+        "  int state;",
+        "  int accepted = 0;",
+        "  int rule = 0;",
+        "  int length = 0;",
+        "  int next;",
+        "  int c;",
+        "  if (Ii_buf == NULL && ii_newfile(NULL) < 0)",
+        "  {",
+        "    return YY_EOF;",
+        "  }",
+        "  ii_unterm();",
+        "  ii_mark_start();",
+        "  state = Yystart[yy_kind(ii_prev())];",
+        "  while ((c = ii_look(1)) != EOF && (next = yy_next(state, c)) != YYF)",
+        "  {",
+        "    if ((Yyaccept[next] & YY_BEFORE) && length > 0)",
+        "    {",
+        "      ii_mark_end();",
+        "      accepted = 1;",
+        "      rule = Yyrule[next];",
+        "    }",
+        "    ii_advance();",
+        "    ++length;",
+        "    state = next;",
+        "    if (Yyaccept[state] & YY_ACCEPT)",
+        "    {",
+        "      ii_mark_end();",
+        "      accepted = 1;",
+        "      rule = Yyrule[state];",
+        "    }",
+        "  }",
+        "  if (c == EOF && (Yyaccept[state] & YY_AT_END) && length > 0)",
+        "  {",
+        "    ii_mark_end();",
+        "    accepted = 1;",
+        "    rule = Yyrule_at_end[state];",
+        "  }",
+        "  ii_to_mark();",
+        "  if (!accepted)",
+        "  {",
+        "    if (ii_advance() == EOF)",
+        "    {",
+        "      return YY_EOF;",
+        "    }",
+        "    ii_mark_end();",
+        "  }",
+        "  ii_term();",
+        "  yytext = ii_text();",
+        "  yyleng = ii_length();",
+        "  yylineno = ii_lineno();",
+        "  yycolumn = ii_column();",
+        "  return accepted ? rule : YY_UNMATCHED;",
+        "}",
+        "",
+        "#ifdef YY_MAIN",
+        "int main(int argc, char *argv[])",
+        "{",
+        "  int token;",
+        "  if (argc > 1 && ii_newfile(argv[1]) < 0)",
+        "  {",
+        "    perror(argv[1]);",
+        "    return 2;",
+        "  }",
+        "  while ((token = yylex()) != YY_EOF)",
+        "  {",
+        "    if (token != YY_UNMATCHED)",
+        "    {",
+        "      printf(\"%d:%d: %d: %s\\n\", yylineno, yycolumn, token, yytext);",
+        "    }",
+        "  }",
+        "  return 0;",
+        "}",
+        "#endif",
+        NULL,
+    };
+    printv(fp, input_layer);
+    printv(fp, driver);
+}
+
+// Prints the metrics of a compilation as a line of JSON; `what` names it.
+static void print_compile_metrics(FILE *fp, const char *what, const char *pattern, const compile_metrics_t *m)
+{
+    fprintf(fp, "{\"compilation\": \"%s\", \"pattern\": ", what);
+    print_json_string(fp, pattern);
+    fprintf(fp, ", \"seconds\": {");
+    for (int i = 0; i < PHASES; ++i)
+    {
+        fprintf(fp, "%s\"%s\": %.9f", i > 0 ? ", " : "", compile_phase_names[i], m->seconds[i]);
+    }
+    fprintf(fp,
+            "}, \"nfa_states\": %d, \"dfa_states\": %d, \"min_dfa_states\": %d, \"closures\": %ld, "
+            "\"moves\": %ld, \"bytes\": {\"nfa\": %zu, \"dfa\": %zu, \"tables\": %zu}}\n",
+            m->nfa_states, m->dfa_states, m->min_dfa_states, m->closures, m->moves, m->nfa_bytes, m->dfa_bytes,
+            m->table_bytes);
+}
+
+// The DFA of nfa in full, for the emitters, which have no lazy engine to
+// fall back on: a pattern over budget is an error.
+static dfa_t emit_dfa(nfa_t *nfa, const char *pattern)
+{
+    const char *exceeded;
+    size_t bytes;
+    dfa_t dfa = nfa_to_dfa(nfa, &default_limits, &exceeded, &bytes);
+    if (exceeded)
+    {
+        fprintf(stderr, "regex-plainc: the DFA of '%s' is over the %s budget after %d states\n", pattern, exceeded,
+                dfa.length);
+        exit(2);
+    }
+    return dfa;
+}
+
+// The first of rules, counted from 1, or 0 for none.
+static int first_rule(const bitset_t *rules)
+{
+    size_t r = 0;
+    return rules && nextSetBit(rules, &r) ? (int)r + 1 : 0;
+}
+
+// Writes a complete scanner for pattern to fp: compressed transition tables,
+// yy_next(), the accepting states and their rules, and the input layer and
+// driver.
+static void emit_scanner(FILE *fp, const char *pattern, int flags)
+{
+    compile_metrics_t measured = {0};
+    metrics = flags & COMPILE_METRICS ? &measured : NULL;
+    nfa_t nfa = thompson(pattern, flags & COMPILE_UTF8, flags & COMPILE_ICASE);
+    // states keep apart the rules they accept, for Yyrule
+    nfa.rule_sets = true;
+    dfa_t dfa = emit_dfa(&nfa, pattern);
+    dfa_t min = minimize_dfa(&dfa);
+    double start = metrics_start();
+    dtran_t dtran = make_dtran(&min);
+
+    fprintf(fp, "/* Generated by regex-plainc --lex from the pattern\n *\n *   ");
+    for (const char *p = pattern; *p; ++p)
+    {
+        fputc(*p, fp);
+        if (*p == '*' && p[1] == '/')
+        {
+            fputc(' ', fp); // keep the pattern from closing the comment
+        }
+    }
+    fprintf(fp, "\n *\n * Compile with -DYY_MAIN for a driver that prints every match.\n */\n\n");
+    fprintf(fp, "#include <errno.h>\n#include <fcntl.h>\n#include <stddef.h>\n#include <stdio.h>\n"
+                "#include <stdlib.h>\n#include <string.h>\n#include <unistd.h>\n\n");
+    fprintf(fp, "#ifndef YYPRIVATE\n#ifdef __GNUC__\n#define YYPRIVATE static __attribute__((unused))\n#else\n"
+                "#define YYPRIVATE static\n#endif\n#endif\n");
+    // the pairs of a compressed row hold bytes as well as states, and a byte
+    // past 0x7F does not fit in a signed char
+    bool high_bytes = false;
+    for (int i = 0; i < dtran.length && !high_bytes; ++i)
+    {
+        for (int c = 0x80; c < 256 && !high_bytes; ++c)
+        {
+            high_bytes = dtran.data[i].data[c] != -1;
+        }
+    }
+    fprintf(fp, "typedef %s YY_TTYPE;\n",
+            min.length < 0x7F && !high_bytes ? "signed char" : min.length < 0x7FFF ? "short" : "int");
+    fprintf(fp, "#define YYF (-1)\n\n");
+
+    pairs(fp, &dtran, "Yy_nxt", 5, true);
+    pnext(fp, "Yy_nxt");
+
+    fprintf(fp, "\n/* yy_kind(c) is what the anchors see of the byte c, or of the edge of the\n"
+                " * input for EOF, and Yystart[kind] the state a lexeme starts in after it.\n */\n");
+    fprintf(fp,
+            "#define yy_kind(c) ((c) == EOF ? %d : (c) == '\\n' ? %d : (c) == '\\r' ? %d : \\\n"
+            "  (c) == '_' || ((c) >= '0' && (c) <= '9') || (((c) | 0x20) >= 'a' && ((c) | 0x20) <= 'z') ? %d : %d)\n",
+            KIND_EDGE, KIND_NEWLINE, KIND_RETURN, KIND_WORD, KIND_OTHER);
+    fprintf(fp, "%s %s Yystart[%d] = {", STORAGE_CLASS, TYPE, KINDS);
+    for (int k = 0; k < KINDS; ++k)
+    {
+        for (int i = 0; i < min.length; ++i)
+        {
+            if (min.data[i]->starts & KIND_BIT(k))
+            {
+                fprintf(fp, k < KINDS - 1 ? "%d, " : "%d};\n", i);
+            }
+        }
+    }
+
+    fprintf(fp, "\n/* Yyaccept[state] says whether state is accepting (YY_ACCEPT), ends a\n"
+                " * match before the byte that led to it (YY_BEFORE), or ends one if the\n"
+                " * input ends there (YY_AT_END).\n */\n");
+    fprintf(fp, "#define YY_ACCEPT 1\n#define YY_BEFORE 2\n#define YY_AT_END 4\n");
+    fprintf(fp, "%s %s Yyaccept[%d] =\n{\n" INDENT, STORAGE_CLASS, TYPE, min.length);
+    for (int i = 0; i < min.length; ++i)
+    {
+        const dfa_node_t *node = min.data[i];
+        fprintf(fp, i < min.length - 1 ? "%d, " : "%d\n",
+                node->accepting | node->accept_before << 1 | node->accept_at_end << 2);
+        if (i % 10 == 9 && i < min.length - 1)
+        {
+            fprintf(fp, "\n" INDENT);
+        }
+    }
+    fprintf(fp, "};\n");
+
+    fprintf(fp, "\n/* Yyrule[state] is the rule, counted from 1, of the match that state ends\n"
+                " * as it is entered, the first rule where several end there, and\n"
+                " * Yyrule_at_end[state] that of the match it ends if the input ends there;\n"
+                " * 0 for none.\n */\n");
+    for (int at_end = 0; at_end < 2; ++at_end)
+    {
+        fprintf(fp, "%s int %s[%d] =\n{\n" INDENT, STORAGE_CLASS, at_end ? "Yyrule_at_end" : "Yyrule", min.length);
+        for (int i = 0; i < min.length; ++i)
+        {
+            const dfa_node_t *node = min.data[i];
+            int rule = first_rule(node->rules);
+            int rule_at_end = at_end ? first_rule(node->rules_at_end) : 0;
+            rule = rule_at_end && (!rule || rule_at_end < rule) ? rule_at_end : rule;
+            fprintf(fp, i < min.length - 1 ? "%d, " : "%d\n", rule);
+            if (i % 10 == 9 && i < min.length - 1)
+            {
+                fprintf(fp, "\n" INDENT);
+            }
+        }
+        fprintf(fp, "};\n");
+    }
+
+    emit_scanner_support(fp);
+
+    dtran_free(&dtran);
+    dfa_free(&min);
+    dfa_free(&dfa);
+    nfa_free(&nfa);
+    metrics_stop(PHASE_EMIT, start);
+    if (metrics)
+    {
+        print_compile_metrics(stderr, "lex", pattern, metrics);
+        metrics = NULL;
+    }
+}
+
+static void emit_tables(const char *pattern, int flags)
+{
+    compile_metrics_t measured = {0};
+    metrics = flags & COMPILE_METRICS ? &measured : NULL;
+    nfa_t nfa = thompson(pattern, flags & COMPILE_UTF8, flags & COMPILE_ICASE);
+    dfa_t dfa = emit_dfa(&nfa, pattern);
+    dfa_t min = minimize_dfa(&dfa);
+    double start = metrics_start();
+
+    emit_yy_next("UNMIN_TABLE");
+    printf("static const int UNMIN_TABLE[][] = ");
+    emit_dfa_state_table(&dfa);
     emit_yy_next("MIN_TABLE");
     printf("static const int MIN_TABLE[][] = ");
     emit_dfa_state_table(&min);
 
-    dtran_t dtran = make_dtran(&min);
-    show_dtran(&dtran);
+    dtran_t dtran = make_dtran(&min);
+    show_dtran(&dtran);
+
+    pairs(stdout, &dtran, "Yy_nxt", 5, true);
+    pnext(stdout, "Yy_nxt");
+
+    dtran_free(&dtran);
+    dfa_free(&min);
+    dfa_free(&dfa);
+    nfa_free(&nfa);
+    metrics_stop(PHASE_EMIT, start);
+    if (metrics)
+    {
+        print_compile_metrics(stderr, "tables", pattern, metrics);
+        metrics = NULL;
+    }
+}
+
+typedef enum
+{
+    INPUT_MMAP,
+    INPUT_URING,
+    INPUT_PREAD,
+} input_method_t;
+
+static const char *const input_method_names[] = {"mmap", "io_uring", "pread"};
+
+// Reads are issued READ_CHUNK bytes at a time into page-aligned buffers, with
+// up to READ_DEPTH of them in flight on the io_uring path.
+#define READ_CHUNK (1 << 20)
+#define READ_DEPTH 4
+#define READ_ALIGN 4096
+
+typedef struct
+{
+    const scanner_t *scanner;
+    // the state for a line that follows a newline
+    int line_state;
+    bool count_only;
+    // print the capture groups of the leftmost-first match instead of the
+    // line, which is gathered into `line` first
+    bool groups;
+    // print each match on a line of its own instead of the line; `bounds` is
+    // the anchored scanner with the reverse DFA that finds where matches
+    // start, which it marks in `starts`, a flag per byte of the line
+    bool only_matching;
+    const scanner_t *bounds;
+    bool *starts;
+    size_t starts_capacity;
+    // the pattern only matches at line ends, so lines are checked backwards
+    // from their newline with bounds->reverse rather than scanned forwards
+    bool line_ends;
+    // print the numbers of every rule that matches a line before it; each
+    // line is scanned whole, with the rules found gathered into `matched`
+    bool rule_sets;
+    bitset_t *matched;
+    // for the batch engine, the number of complete lines matched at once as
+    // independent records, and where they and their results are gathered;
+    // 0 otherwise
+    size_t batch;
+    const unsigned char **batch_lines;
+    size_t *batch_lengths;
+    ptrdiff_t *batch_results;
+    const char *label;
+    size_t matches;
+
+    // Input arrives in chunks and everything below carries over from one
+    // chunk to the next, so a match or a line may straddle a seam.
+    int state;
+    bool skipping;      // the rest of the current line is not scanned...
+    bool printing;      // ...because it matched and is being copied out
+    unsigned char last; // the last byte of the previous chunk
+    // the current line's bytes from earlier chunks, for printing a line
+    // that turns out to match in a later one
+    unsigned char *partial;
+    size_t partial_length;
+    size_t partial_capacity;
+    unsigned char *line;
+    size_t line_length;
+    size_t line_capacity;
+    ptrdiff_t *captures;
+} grep_t;
+
+static void grep_reset(grep_t *grep)
+{
+    grep->matches = 0;
+    grep->state = grep->scanner->start;
+    grep->skipping = false;
+    grep->printing = false;
+    grep->last = '\n';
+    grep->partial_length = 0;
+}
+
+static void buffer_append(unsigned char **data, size_t *length, size_t *capacity, const unsigned char *bytes,
+                          size_t count)
+{
+    // an empty piece of a line may come before there is a buffer to copy to
+    if (count == 0)
+    {
+        return;
+    }
+    if (*length + count > *capacity)
+    {
+        size_t grown_capacity = *capacity ? *capacity : 256;
+        while (grown_capacity < *length + count)
+        {
+            grown_capacity *= 2;
+        }
+        unsigned char *grown = realloc(*data, grown_capacity);
+        if (!grown)
+        {
+            // only costs the start of a very long line in the output
+            *length = 0;
+            return;
+        }
+        *data = grown;
+        *capacity = grown_capacity;
+    }
+    memcpy(*data + *length, bytes, count);
+    *length += count;
+}
+
+static void grep_keep_partial(grep_t *grep, const unsigned char *bytes, size_t length)
+{
+    buffer_append(&grep->partial, &grep->partial_length, &grep->partial_capacity, bytes, length);
+}
+
+static void grep_put(grep_t *grep, const unsigned char *bytes, size_t length)
+{
+    if (grep->groups || grep->only_matching)
+    {
+        buffer_append(&grep->line, &grep->line_length, &grep->line_capacity, bytes, length);
+    }
+    else if (length > 0)
+    {
+        fwrite(bytes, 1, length, stdout);
+    }
+}
+
+// Prints each match in a line gathered for -o, leftmost first and the
+// longest from there, as grep -o does. The reverse DFA marks where matches
+// start in one walk back over the line, and the anchored DFA runs forwards
+// from the first mark past the previous match for the longest one. The line
+// is bounded by newlines or the edges of the input, which the assertions all
+// treat alike.
+static void grep_print_matches(grep_t *grep)
+{
+    const scanner_t *bounds = grep->bounds;
+    const unsigned char *text = grep->line;
+    size_t length = grep->line_length;
+    if (length + 1 > grep->starts_capacity)
+    {
+        bool *grown = realloc(grep->starts, length + 1);
+        if (!grown)
+        {
+            // only costs the matches of a very long line in the output
+            return;
+        }
+        grep->starts = grown;
+        grep->starts_capacity = length + 1;
+    }
+    scanner_match_starts(bounds->reverse, text, length, grep->starts);
+    for (size_t pos = 0; pos <= length; ++pos)
+    {
+        if (!grep->starts[pos])
+        {
+            continue;
+        }
+        ptrdiff_t match = scanner_match_from(bounds, text, length, pos);
+        if (match > 0)
+        {
+            if (grep->label)
+            {
+                fputs(grep->label, stdout);
+                putchar(':');
+            }
+            fwrite(text + pos, 1, match, stdout);
+            putchar('\n');
+            // the loop steps past the last byte of the match
+            pos += match - 1;
+        }
+    }
+}
+
+// Finishes a matching line. With --groups the line was gathered and only now
+// goes through the tagged DFA.
+static void grep_end_line(grep_t *grep)
+{
+    if (grep->only_matching)
+    {
+        grep_print_matches(grep);
+        return;
+    }
+    if (!grep->groups)
+    {
+        putchar('\n');
+        return;
+    }
+    const tdfa_t *tdfa = grep->scanner->tdfa;
+    ptrdiff_t length = grep->line_length;
+    if (tdfa_match(tdfa, grep->line, grep->line_length, grep->captures) >= 0)
+    {
+        int groups = grep->scanner->groups;
+        for (int g = groups > 1 ? 1 : 0; g < groups; ++g)
+        {
+            ptrdiff_t start = grep->captures[2 * g];
+            ptrdiff_t end = grep->captures[2 * g + 1];
+            if (g > 1)
+            {
+                putchar('\t');
+            }
+            if (start >= 0 && end >= 0)
+            {
+                start = start > length ? length : start;
+                end = end < start ? start : end > length ? length : end;
+                fwrite(grep->line + start, 1, end - start, stdout);
+            }
+        }
+    }
+    putchar('\n');
+}
+
+// Reports a matching line: whatever of it came from earlier chunks if
+// with_partial, then length bytes from line. An incomplete line is finished
+// by grep_chunk() as the rest of it arrives.
+static void grep_emit(grep_t *grep, const unsigned char *line, size_t length, bool with_partial, bool complete)
+{
+    ++grep->matches;
+    if (grep->count_only)
+    {
+        return;
+    }
+    if (grep->label && !grep->only_matching)
+    {
+        fputs(grep->label, stdout);
+        putchar(':');
+    }
+    grep->line_length = 0;
+    if (with_partial)
+    {
+        grep_put(grep, grep->partial, grep->partial_length);
+    }
+    grep_put(grep, line, length);
+    if (complete)
+    {
+        grep_end_line(grep);
+    }
+    else
+    {
+        grep->printing = true;
+    }
+}
+
+// True when the walk of a reverse DFA that starts before a newline or a
+// carriage return can never go on past the newline before a line: every state
+// it reaches within a line either dies on '\n' or accepts there.
+static bool reverse_stays_in_line(const scanner_t *reverse)
+{
+    if (reverse->lazy)
+    {
+        // exploring every state is what the lazy engine is there to avoid
+        return false;
+    }
+    bool *seen = calloc(reverse->states, sizeof(bool));
+    vec_int_t work;
+    vec_init(&work);
+    bool stays = true;
+    int first[] = {reverse->starts[KIND_NEWLINE], reverse->starts[KIND_RETURN]};
+    for (int k = 0; k < 2; ++k)
+    {
+        if (!seen[first[k]])
+        {
+            seen[first[k]] = true;
+            vec_push(&work, first[k]);
+        }
+    }
+    while (stays && work.length > 0)
+    {
+        int s = vec_pop(&work);
+        for (int c = 0; c < 256; ++c)
+        {
+            int t = scanner_step(reverse, s, c);
+            if (c == '\n')
+            {
+                stays = t < 0 || (reverse->flags[t] & (STATE_ACCEPTING | STATE_ACCEPTING_BEFORE));
+            }
+            else if (t >= 0 && !seen[t])
+            {
+                seen[t] = true;
+                vec_push(&work, t);
+            }
+        }
+    }
+    vec_deinit(&work);
+    free(seen);
+    return stays;
+}
+
+// Whether a '$'-anchored match ends at the end of the line. '$' also matches
+// before a carriage return, so the walk is repeated from each of those.
+static bool grep_line_end_matches(const grep_t *grep, const unsigned char *line, size_t length)
+{
+    const scanner_t *reverse = grep->bounds->reverse;
+    if (scanner_line_end_matches(reverse, line, length, KIND_NEWLINE))
+    {
+        return true;
+    }
+    const unsigned char *end = line + length;
+    for (const unsigned char *cr = memchr(line, '\r', length); cr; cr = memchr(cr + 1, '\r', end - cr - 1))
+    {
+        if (scanner_line_end_matches(reverse, line, cr - line, KIND_RETURN))
+        {
+            return true;
+        }
+    }
+    return false;
+}
+
+// Reports a line with the numbers of the rules that match in it, counted
+// from 1, before it: "1,4<TAB>line".
+static void grep_line_rules(grep_t *grep, const unsigned char *line, size_t length)
+{
+    bitset_clear(grep->matched);
+    scanner_match_rules(grep->scanner, line, length, grep->matched);
+    if (bitset_count(grep->matched) == 0)
+    {
+        return;
+    }
+    ++grep->matches;
+    if (grep->count_only)
+    {
+        return;
+    }
+    if (grep->label)
+    {
+        fputs(grep->label, stdout);
+        putchar(':');
+    }
+    const char *separator = "";
+    for (size_t r = 0; nextSetBit(grep->matched, &r); ++r)
+    {
+        printf("%s%zu", separator, r + 1);
+        separator = ",";
+    }
+    putchar('\t');
+    fwrite(line, 1, length, stdout);
+    putchar('\n');
+}
+
+// Checks a whole line and reports it if it matches: from its end for
+// line_ends, rule by rule for rule_sets, and as a record of its own for the
+// batch engine.
+static void grep_whole_line(grep_t *grep, const unsigned char *line, size_t length)
+{
+    if (grep->rule_sets)
+    {
+        grep_line_rules(grep, line, length);
+    }
+    else if (grep->batch)
+    {
+        if (scanner_run(grep->scanner, grep->line_state, line, length) >= 0)
+        {
+            grep_emit(grep, line, length, false, true);
+        }
+    }
+    else if (grep_line_end_matches(grep, line, length))
+    {
+        grep_emit(grep, line, length, false, true);
+    }
+}
+
+// Scans the next chunk a line at a time, checking each line whole. A line
+// left incomplete at the end of the chunk is kept in `partial`. For rule
+// sets, the lines before the next byte that leaves an accelerated line start
+// state, or before teddy's next candidate, hold no match and are skipped.
+static void grep_chunk_lines(grep_t *grep, const unsigned char *chunk, size_t length)
+{
+    const scanner_t *scanner = grep->scanner;
+    unsigned char line_flags = scanner->lazy ? 0 : scanner->flags[grep->line_state];
+    const accel_t *skip = grep->rule_sets && (line_flags & STATE_ACCELERATED) &&
+                                  !(line_flags & (STATE_ACCEPTING | STATE_ACCEPTING_AT_END))
+                              ? &scanner->accel[grep->line_state]
+                              : NULL;
+    size_t pos = 0;
+    if (grep->last != '\n')
+    {
+        const unsigned char *nl = memchr(chunk, '\n', length);
+        size_t stop = nl ? (size_t)(nl - chunk) : length;
+        grep_keep_partial(grep, chunk, stop);
+        if (!nl)
+        {
+            grep->last = chunk[length - 1];
+            return;
+        }
+        grep_whole_line(grep, grep->partial, grep->partial_length);
+        grep->partial_length = 0;
+        pos = stop + 1;
+    }
+    while (pos < length)
+    {
+        if (skip)
+        {
+            size_t hit = pos + accel_skip(skip, chunk + pos, length - pos);
+            const unsigned char *last = memrchr(chunk + pos, '\n', hit - pos);
+            pos = last ? (size_t)(last - chunk) + 1 : pos;
+            if (pos == length)
+            {
+                break;
+            }
+        }
+        const unsigned char *nl = memchr(chunk + pos, '\n', length - pos);
+        if (!nl)
+        {
+            grep_keep_partial(grep, chunk + pos, length - pos);
+            break;
+        }
+        size_t stop = nl - chunk;
+        grep_whole_line(grep, chunk + pos, stop - pos);
+        pos = stop + 1;
+    }
+    grep->last = chunk[length - 1];
+}
+
+// Scans the next chunk for the batch engine. The complete lines in it are
+// gathered grep->batch at a time and walked together by
+// scanner_match_batch() with the search DFA, each from the line start state
+// to its end, then reported in order. A line cut by a seam is kept in
+// `partial` and checked alone once complete.
+static void grep_chunk_batch(grep_t *grep, const unsigned char *chunk, size_t length)
+{
+    size_t pos = 0;
+    if (grep->last != '\n')
+    {
+        const unsigned char *nl = memchr(chunk, '\n', length);
+        size_t stop = nl ? (size_t)(nl - chunk) : length;
+        grep_keep_partial(grep, chunk, stop);
+        if (!nl)
+        {
+            grep->last = chunk[length - 1];
+            return;
+        }
+        grep_whole_line(grep, grep->partial, grep->partial_length);
+        grep->partial_length = 0;
+        pos = stop + 1;
+    }
+    while (pos < length)
+    {
+        size_t count = 0;
+        while (count < grep->batch && pos < length)
+        {
+            const unsigned char *nl = memchr(chunk + pos, '\n', length - pos);
+            if (!nl)
+            {
+                grep_keep_partial(grep, chunk + pos, length - pos);
+                pos = length;
+                break;
+            }
+            grep->batch_lines[count] = chunk + pos;
+            grep->batch_lengths[count] = nl - (chunk + pos);
+            ++count;
+            pos = nl - chunk + 1;
+        }
+        scanner_match_batch(grep->scanner, grep->line_state, grep->batch_lines, grep->batch_lengths, count,
+                            grep->batch_results);
+        for (size_t n = 0; n < count; ++n)
+        {
+            if (grep->batch_results[n] >= 0)
+            {
+                grep_emit(grep, grep->batch_lines[n], grep->batch_lengths[n], false, true);
+            }
+        }
+    }
+    grep->last = chunk[length - 1];
+}
+
+// Moves pos, the start of a line, on to the next line that starts with a
+// byte a match can begin with. Returns length if no line in the chunk does.
+static size_t grep_skip_lines(const grep_t *grep, const unsigned char *chunk, size_t pos, size_t length)
+{
+    const accel_t *first = &grep->scanner->line_first;
+    if (pos == length || accel_skip(first, chunk + pos, 1) == 0)
+    {
+        return pos;
+    }
+    return pos + 1 + accel_skip_line_start(first, chunk + pos + 1, length - pos - 1);
+}
+
+// Scans the next chunk of input. The DFA runs across line boundaries and only
+// restarts after a reported line or a byte that killed it. A DFA anchored at
+// line starts dies early in most lines; where it would die on their first
+// byte, the lines are not scanned at all.
+static void grep_chunk(grep_t *grep, const unsigned char *chunk, size_t length)
+{
+    if (grep->line_ends || grep->rule_sets)
+    {
+        grep_chunk_lines(grep, chunk, length);
+        return;
+    }
+    if (grep->batch)
+    {
+        grep_chunk_batch(grep, chunk, length);
+        return;
+    }
+    const scanner_t *scanner = grep->scanner;
+    size_t pos = 0;
+    while (pos < length)
+    {
+        if (grep->skipping)
+        {
+            const unsigned char *nl = memchr(chunk + pos, '\n', length - pos);
+            size_t stop = nl ? (size_t)(nl - chunk) : length;
+            if (grep->printing && !grep->count_only)
+            {
+                grep_put(grep, chunk + pos, stop - pos);
+                if (nl)
+                {
+                    grep_end_line(grep);
+                }
+            }
+            if (!nl)
+            {
+                break;
+            }
+            grep->skipping = false;
+            grep->printing = false;
+            grep->state = grep->line_state;
+            pos = stop + 1;
+            continue;
+        }
+
+        if (scanner->skip_lines && (grep->state == grep->line_state || grep->state == scanner->start) &&
+            (pos > 0 ? chunk[pos - 1] : grep->last) == '\n')
+        {
+            size_t start = grep_skip_lines(grep, chunk, pos, length);
+            if (start == length)
+            {
+                // the rest of a line cut off at the end of the chunk is skipped too
+                grep->skipping = chunk[length - 1] != '\n';
+                break;
+            }
+            if (start > pos)
+            {
+                grep->state = grep->line_state;
+                pos = start;
+            }
+        }
+
+        size_t offset;
+        bool found = scanner_find(scanner, &grep->state, chunk + pos, length - pos, false, &offset);
+        size_t end = pos + offset;
+        if (found)
+        {
+            // report the line that holds the end of the match
+            const unsigned char *nl = memrchr(chunk, '\n', end);
+            size_t start = nl ? (size_t)(nl - chunk) + 1 : 0;
+            const unsigned char *eol = memchr(chunk + end, '\n', length - end);
+            size_t stop = eol ? (size_t)(eol - chunk) : length;
+            grep_emit(grep, chunk + start, stop - start, !nl, eol != NULL);
+            grep->state = grep->line_state;
+            grep->skipping = !eol;
+            pos = stop + 1;
+        }
+        else if (grep->state < 0)
+        {
+            // died on chunk[end - 1]; nothing more can match before the next line
+            grep->state = grep->line_state;
+            grep->skipping = chunk[end - 1] != '\n';
+            pos = end;
+        }
+        else
+        {
+            break;
+        }
+    }
+
+    const unsigned char *nl = memrchr(chunk, '\n', length);
+    if (nl)
+    {
+        grep->partial_length = 0;
+        grep_keep_partial(grep, nl + 1, chunk + length - (nl + 1));
+    }
+    else
+    {
+        grep_keep_partial(grep, chunk, length);
+    }
+    grep->last = chunk[length - 1];
+}
+
+// Ends the input, where assertions that look ahead see the edge of it.
+static void grep_finish(grep_t *grep)
+{
+    const scanner_t *scanner = grep->scanner;
+    if (grep->line_ends || grep->rule_sets || grep->batch)
+    {
+        if (grep->last != '\n')
+        {
+            grep_whole_line(grep, grep->partial, grep->partial_length);
+        }
+        return;
+    }
+    if (grep->printing)
+    {
+        if (!grep->count_only)
+        {
+            grep_end_line(grep);
+        }
+    }
+    else if (!grep->skipping && grep->last != '\n')
+    {
+        if (grep->state >= 0 && (scanner->flags[grep->state] & STATE_ACCEPTING_AT_END))
+        {
+            grep_emit(grep, NULL, 0, true, true);
+        }
+    }
+}
+
+static bool grep_mmap(grep_t *grep, int fd, size_t size)
+{
+    if (size == 0)
+    {
+        return true;
+    }
+    void *map = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (map == MAP_FAILED)
+    {
+        return false;
+    }
+    madvise(map, size, MADV_SEQUENTIAL);
+    grep_chunk(grep, map, size);
+    munmap(map, size);
+    return true;
+}
+
+// Reads the file a chunk at a time; positional reads for files, plain ones
+// for pipes and terminals.
+static bool grep_read(grep_t *grep, int fd, bool seekable, size_t *bytes)
+{
+    unsigned char *buffer = aligned_alloc(READ_ALIGN, READ_CHUNK);
+    if (!buffer)
+    {
+        return false;
+    }
+    *bytes = 0;
+    for (;;)
+    {
+        ssize_t n = seekable ? pread(fd, buffer, READ_CHUNK, *bytes) : read(fd, buffer, READ_CHUNK);
+        if (n < 0 && errno == EINTR)
+        {
+            continue;
+        }
+        if (n <= 0)
+        {
+            free(buffer);
+            return n == 0;
+        }
+        grep_chunk(grep, buffer, n);
+        *bytes += n;
+    }
+}
+
+#ifdef HAVE_IO_URING
+// Just enough of io_uring to keep a few reads in flight, set up through the
+// raw system calls rather than liburing.
+typedef struct
+{
+    int fd;
+    unsigned *sq_tail;
+    unsigned *sq_mask;
+    unsigned *sq_array;
+    unsigned *cq_head;
+    unsigned *cq_tail;
+    unsigned *cq_mask;
+    struct io_uring_sqe *sqes;
+    struct io_uring_cqe *cqes;
+    void *sq_ring;
+    void *cq_ring;
+    size_t sq_ring_size;
+    size_t cq_ring_size;
+    size_t sqes_size;
+    unsigned pending; // queued but not yet submitted
+} uring_t;
+
+static bool uring_init(uring_t *ring, unsigned entries)
+{
+    struct io_uring_params params;
+    memset(&params, 0, sizeof(params));
+    memset(ring, 0, sizeof(*ring));
+    ring->fd = syscall(__NR_io_uring_setup, entries, &params);
+    if (ring->fd < 0)
+    {
+        return false;
+    }
+    ring->sq_ring_size = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+    ring->cq_ring_size = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+    bool single_mmap = (params.features & IORING_FEAT_SINGLE_MMAP) != 0;
+    if (single_mmap)
+    {
+        ring->sq_ring_size = ring->cq_ring_size =
+            ring->sq_ring_size > ring->cq_ring_size ? ring->sq_ring_size : ring->cq_ring_size;
+    }
+    ring->sq_ring = mmap(NULL, ring->sq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring->fd,
+                         IORING_OFF_SQ_RING);
+    ring->cq_ring = single_mmap ? ring->sq_ring
+                                : mmap(NULL, ring->cq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                                       ring->fd, IORING_OFF_CQ_RING);
+    ring->sqes_size = params.sq_entries * sizeof(struct io_uring_sqe);
+    ring->sqes =
+        mmap(NULL, ring->sqes_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQES);
+    if (ring->sq_ring == MAP_FAILED || ring->cq_ring == MAP_FAILED || ring->sqes == MAP_FAILED)
+    {
+        if (ring->sq_ring != MAP_FAILED)
+        {
+            munmap(ring->sq_ring, ring->sq_ring_size);
+        }
+        if (!single_mmap && ring->cq_ring != MAP_FAILED)
+        {
+            munmap(ring->cq_ring, ring->cq_ring_size);
+        }
+        if (ring->sqes != MAP_FAILED)
+        {
+            munmap(ring->sqes, ring->sqes_size);
+        }
+        close(ring->fd);
+        return false;
+    }
+    char *sq = ring->sq_ring;
+    char *cq = ring->cq_ring;
+    ring->sq_tail = (unsigned *)(sq + params.sq_off.tail);
+    ring->sq_mask = (unsigned *)(sq + params.sq_off.ring_mask);
+    ring->sq_array = (unsigned *)(sq + params.sq_off.array);
+    ring->cq_head = (unsigned *)(cq + params.cq_off.head);
+    ring->cq_tail = (unsigned *)(cq + params.cq_off.tail);
+    ring->cq_mask = (unsigned *)(cq + params.cq_off.ring_mask);
+    ring->cqes = (struct io_uring_cqe *)(cq + params.cq_off.cqes);
+    return true;
+}
+
+static void uring_free(uring_t *ring)
+{
+    munmap(ring->sqes, ring->sqes_size);
+    if (ring->cq_ring != ring->sq_ring)
+    {
+        munmap(ring->cq_ring, ring->cq_ring_size);
+    }
+    munmap(ring->sq_ring, ring->sq_ring_size);
+    close(ring->fd);
+}
+
+static void uring_queue_read(uring_t *ring, int fd, void *buffer, unsigned length, uint64_t offset,
+                             uint64_t user_data)
+{
+    unsigned tail = *ring->sq_tail;
+    unsigned index = tail & *ring->sq_mask;
+    struct io_uring_sqe *sqe = &ring->sqes[index];
+    memset(sqe, 0, sizeof(*sqe));
+    sqe->opcode = IORING_OP_READ;
+    sqe->fd = fd;
+    sqe->addr = (uintptr_t)buffer;
+    sqe->len = length;
+    sqe->off = offset;
+    sqe->user_data = user_data;
+    ring->sq_array[index] = index;
+    __atomic_store_n(ring->sq_tail, tail + 1, __ATOMIC_RELEASE);
+    ++ring->pending;
+}
+
+// Submits whatever is queued and, if wait, blocks for at least one completion.
+static bool uring_enter(uring_t *ring, bool wait)
+{
+    for (;;)
+    {
+        int submitted = syscall(__NR_io_uring_enter, ring->fd, ring->pending, wait ? 1 : 0,
+                                wait ? IORING_ENTER_GETEVENTS : 0, NULL, 0);
+        if (submitted >= 0)
+        {
+            ring->pending -= submitted;
+            return true;
+        }
+        if (errno != EINTR)
+        {
+            return false;
+        }
+    }
+}
+
+static bool uring_reap(uring_t *ring, uint64_t *user_data, int *result)
+{
+    unsigned head = *ring->cq_head;
+    if (head == __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE))
+    {
+        return false;
+    }
+    struct io_uring_cqe *cqe = &ring->cqes[head & *ring->cq_mask];
+    *user_data = cqe->user_data;
+    *result = cqe->res;
+    __atomic_store_n(ring->cq_head, head + 1, __ATOMIC_RELEASE);
+    return true;
+}
+
+typedef struct
+{
+    uint64_t offset;
+    int result;
+    bool busy;
+    bool done;
+} read_slot_t;
+
+// Keeps READ_DEPTH reads in flight and scans them in file order as they
+// complete, so the DFA never waits on a page fault.
+static bool grep_uring(grep_t *grep, uring_t *ring, int fd, size_t size)
+{
+    unsigned char *buffers = aligned_alloc(READ_ALIGN, (size_t)READ_CHUNK * READ_DEPTH);
+    if (!buffers)
+    {
+        return false;
+    }
+    read_slot_t slots[READ_DEPTH] = {0};
+    uint64_t next_read = 0;
+    for (int i = 0; i < READ_DEPTH && next_read < size; ++i, next_read += READ_CHUNK)
+    {
+        slots[i] = (read_slot_t){.offset = next_read, .busy = true};
+        uring_queue_read(ring, fd, buffers + (size_t)i * READ_CHUNK, READ_CHUNK, next_read, i);
+    }
+
+    bool ok = uring_enter(ring, false);
+    for (size_t k = 0; ok; ++k)
+    {
+        int i = k % READ_DEPTH;
+        read_slot_t *slot = &slots[i];
+        if (!slot->busy)
+        {
+            break;
+        }
+        while (ok && !slot->done)
+        {
+            ok = uring_enter(ring, true);
+            uint64_t user_data;
+            int result;
+            while (ok && uring_reap(ring, &user_data, &result))
+            {
+                slots[user_data].result = result;
+                slots[user_data].done = true;
+            }
+        }
+        if (!ok)
+        {
+            break;
+        }
+        if (slot->result == -EINVAL || slot->result == -EOPNOTSUPP)
+        {
+            // kernels before 5.6 and some file systems turn IORING_OP_READ
+            // down; the chunk is read below as if it had come back empty
+            slot->result = 0;
+        }
+        if (slot->result < 0)
+        {
+            errno = -slot->result;
+            ok = false;
+            break;
+        }
+
+        unsigned char *buffer = buffers + (size_t)i * READ_CHUNK;
+        size_t length = slot->result;
+        size_t wanted = size - slot->offset < READ_CHUNK ? size - slot->offset : READ_CHUNK;
+        while (length < wanted)
+        {
+            // a short read; finish the chunk synchronously
+            ssize_t n = pread(fd, buffer + length, wanted - length, slot->offset + length);
+            if (n < 0 && errno == EINTR)
+            {
+                continue;
+            }
+            if (n < 0)
+            {
+                ok = false;
+                break;
+            }
+            if (n == 0)
+            {
+                break;
+            }
+            length += n;
+        }
+        if (ok && length > 0)
+        {
+            grep_chunk(grep, buffer, length);
+        }
+
+        if (next_read < size)
+        {
+            *slot = (read_slot_t){.offset = next_read, .busy = true};
+            uring_queue_read(ring, fd, buffer, READ_CHUNK, next_read, i);
+            next_read += READ_CHUNK;
+            ok = ok && uring_enter(ring, false);
+        }
+        else
+        {
+            slot->busy = false;
+        }
+    }
+
+    // nothing may still be writing into the buffers once they are freed
+    int saved_errno = errno;
+    for (int i = 0; i < READ_DEPTH; ++i)
+    {
+        while (slots[i].busy && !slots[i].done && uring_enter(ring, true))
+        {
+            uint64_t user_data;
+            int result;
+            while (uring_reap(ring, &user_data, &result))
+            {
+                slots[user_data].done = true;
+            }
+        }
+    }
+    errno = saved_errno;
+    free(buffers);
+    return ok;
+}
+#endif
+
+typedef struct
+{
+    input_method_t method;
+#ifdef HAVE_IO_URING
+    uring_t ring;
+#endif
+} input_t;
+
+// Sets up the requested input method, falling back to plain reads when
+// io_uring is missing or not permitted.
+static void input_init(input_t *input, input_method_t method)
+{
+    input->method = method;
+    if (method == INPUT_URING)
+    {
+#ifdef HAVE_IO_URING
+        if (uring_init(&input->ring, READ_DEPTH))
+        {
+            return;
+        }
+#endif
+        input->method = INPUT_PREAD;
+    }
+}
+
+static void input_free(input_t *input)
+{
+#ifdef HAVE_IO_URING
+    if (input->method == INPUT_URING)
+    {
+        uring_free(&input->ring);
+    }
+#endif
+}
+
+// Greps one file, or standard input for "-". Returns the number of bytes
+// scanned, or -1 if the file could not be read.
+static ptrdiff_t grep_file(grep_t *grep, const char *path, input_t *input)
+{
+    grep_reset(grep);
+    bool standard_input = strcmp(path, "-") == 0;
+    int fd = standard_input ? STDIN_FILENO : open(path, O_RDONLY);
+    struct stat st;
+    if (fd < 0 || fstat(fd, &st) < 0)
+    {
+        fprintf(stderr, "regex-plainc: %s: %s\n", path, strerror(errno));
+        if (fd >= 0 && !standard_input)
+        {
+            close(fd);
+        }
+        return -1;
+    }
+    // files in procfs and sysfs claim to be empty and are read to the end
+    // like pipes
+    bool regular = S_ISREG(st.st_mode) && st.st_size > 0;
+    size_t bytes = regular ? st.st_size : 0;
+    bool ok;
+    if (!regular)
+    {
+        ok = grep_read(grep, fd, false, &bytes);
+    }
+    else if (input->method == INPUT_MMAP)
+    {
+        ok = grep_mmap(grep, fd, bytes);
+    }
+#ifdef HAVE_IO_URING
+    else if (input->method == INPUT_URING)
+    {
+        posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+        ok = grep_uring(grep, &input->ring, fd, bytes);
+    }
+#endif
+    else
+    {
+        posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+        ok = grep_read(grep, fd, true, &bytes);
+    }
+    if (ok)
+    {
+        grep_finish(grep);
+    }
+    else
+    {
+        fprintf(stderr, "regex-plainc: %s: %s\n", path, strerror(errno));
+    }
+    if (!standard_input)
+    {
+        close(fd);
+    }
+    return ok ? (ptrdiff_t)bytes : -1;
+}
+
+// The analysis behind a plan, for --explain.
+static void print_plan(FILE *fp, const plan_t *plan, const compile_limits_t *limits)
+{
+    if (plan->literals)
+    {
+        fprintf(fp, "// literals: %d, %d bytes, built as %s; no nfa\n", plan->literals, plan->literal_bytes,
+                plan->search ? "an Aho-Corasick automaton" : "a trie");
+    }
+    else
+    {
+        fprintf(fp, "// nfa: %d nodes, %d of them positions that read a byte; %s\n", plan->nfa_nodes,
+                plan->positions, plan->search ? "a match may start at any offset" : "matches start at line starts");
+        fprintf(fp, "// ambiguous groups: %d, going on over some of the bytes a match starts on\n", plan->ambiguous);
+        fprintf(fp, "// estimate: %.0f dfa states, %.0f bytes; budget: %d states, %zu bytes\n", plan->states,
+                plan->bytes, limits->max_dfa_states, limits->max_dfa_bytes);
+    }
+    fprintf(fp, "// literal prefix: ");
+    for (int i = 0; i < plan->literal_length; ++i)
+    {
+        fprintf(fp, "%s", bin_to_ascii(plan->literal[i], true));
+    }
+    fprintf(fp, "%s\n", plan->literal_length ? "" : "none");
+    fprintf(fp, "// plan: %s, %s\n", plan_engine_names[plan->engine], plan->reason);
+    fprintf(fp, "// layout: %s\n",
+            plan->layout     ? "start states, the others breadth first, accepting states last"
+            : plan->literals ? "breadth first, as the trie grew"
+                             : "discovery order");
+}
+
+static double seconds_now(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+// Adds a scan of the file at path, "-" for standard input, to profile.
+static bool profile_file(scan_profile_t *profile, const scanner_t *scanner, const char *path)
+{
+    static unsigned char buffer[READ_CHUNK];
+    bool standard_input = strcmp(path, "-") == 0;
+    int fd = standard_input ? STDIN_FILENO : open(path, O_RDONLY);
+    if (fd < 0)
+    {
+        fprintf(stderr, "regex-plainc: %s: %s\n", path, strerror(errno));
+        return false;
+    }
+    profile_rewind(profile, scanner);
+    ssize_t n;
+    while ((n = read(fd, buffer, sizeof(buffer))) > 0)
+    {
+        profile_scan(profile, scanner, buffer, n);
+    }
+    if (n < 0)
+    {
+        fprintf(stderr, "regex-plainc: %s: %s\n", path, strerror(errno));
+    }
+    if (!standard_input)
+    {
+        close(fd);
+    }
+    return n == 0;
+}
 
-    pairs(stdout, &dtran, "test", 5, true);
-    pnext(stdout, "yy_next");
+// --train: lays the states of scanner out by where a scan of the file at
+// path spends its bytes.
+static bool train_layout(scanner_t *scanner, const char *path)
+{
+    if (scanner->lazy)
+    {
+        return true;
+    }
+    scan_profile_t profile = {0};
+    bool ok = profile_init(&profile, scanner) && profile_file(&profile, scanner, path) &&
+              scanner_layout(scanner, &profile);
+    profile_free(&profile);
+    return ok;
+}
 
+// --profile: builds the search DFA for pattern in full, walks each file
+// through it and prints where the walk spent its time, as JSON or, for dot,
+// as a heatmap of the DFA.
+static int profile_files(const char *pattern, int flags, bool dot, const char **files, int nfiles)
+{
+    nfa_t nfa = thompson(pattern, flags & COMPILE_UTF8, flags & COMPILE_ICASE);
+    if (!nfa_anchored(&nfa, ANCHOR_BOL))
+    {
+        nfa_unanchor(&nfa);
+    }
+    dfa_t dfa = emit_dfa(&nfa, pattern);
+    dfa_t min = minimize_dfa(&dfa);
+    scanner_t scanner = {0};
+    scan_profile_t profile = {0};
+    if (!scanner_init(&scanner, &min) || !profile_init(&profile, &scanner))
+    {
+        fprintf(stderr, "regex-plainc: out of memory compiling '%s'\n", pattern);
+        exit(2);
+    }
+    int status = 0;
+    for (int f = 0; f < nfiles; ++f)
+    {
+        status = profile_file(&profile, &scanner, files[f]) ? status : 2;
+    }
+    if (dot)
+    {
+        dfa_to_dot(&min, &profile);
+    }
+    else
+    {
+        print_profile(stdout, pattern, &scanner, &profile);
+    }
+    profile_free(&profile);
+    scanner_free(&scanner);
     dfa_free(&min);
     dfa_free(&dfa);
-    // nfa_free(&nfa);
-    // nfa_free(&nfa2);
-    return 0;
+    nfa_free(&nfa);
+    return status;
+}
+
+// -f: the pattern in the file at path, for patterns too long for a command
+// line, without the newlines that end the file. Returns NULL after saying why
+// when it cannot be read.
+static char *read_pattern_file(const char *path)
+{
+    FILE *fp = strcmp(path, "-") == 0 ? stdin : fopen(path, "rb");
+    if (!fp)
+    {
+        fprintf(stderr, "regex-plainc: %s: %s\n", path, strerror(errno));
+        return NULL;
+    }
+    size_t length = 0;
+    size_t capacity = 4096;
+    char *pattern = malloc(capacity);
+    size_t n;
+    while (pattern && (n = fread(pattern + length, 1, capacity - length - 1, fp)) > 0)
+    {
+        length += n;
+        if (length + 1 == capacity)
+        {
+            capacity *= 2;
+            char *grown = realloc(pattern, capacity);
+            if (!grown)
+            {
+                free(pattern);
+            }
+            pattern = grown;
+        }
+    }
+    bool failed = ferror(fp) || !pattern;
+    if (fp != stdin)
+    {
+        fclose(fp);
+    }
+    if (failed)
+    {
+        fprintf(stderr, "regex-plainc: %s: %s\n", path, pattern ? strerror(errno) : "out of memory");
+        free(pattern);
+        return NULL;
+    }
+    while (length > 0 && pattern[length - 1] == '\n')
+    {
+        --length;
+    }
+    pattern[length] = '\0';
+    return pattern;
+}
+
+static void usage(FILE *fp)
+{
+    fprintf(fp, "usage: regex-plainc [-c] [-g] [-i] [-o] [-u] [--set] [--stats] [--metrics] [--max-states=N]\n"
+                "                    [--max-dfa-bytes=N] [--engine=ENGINE] [--batch=N] [--layout=LAYOUT]\n"
+                "                    [--train=FILE] [--io=METHOD] PATTERN [FILE...]\n"
+                "       regex-plainc [-g] [-i] [-u] [--metrics] [--max-states=N] [--max-dfa-bytes=N]\n"
+                "                    [--engine=ENGINE] --explain PATTERN\n"
+                "       regex-plainc [-i] [-u] [--metrics] --tables PATTERN\n"
+                "       regex-plainc [-i] [-u] [--metrics] --lex PATTERN > scanner.c\n"
+                "       regex-plainc [-i] [-u] --profile=json|dot PATTERN [FILE...]\n"
+                "\n"
+                "Prints the lines of each FILE (standard input for none or \"-\") that\n"
+                "contain a match for PATTERN.\n"
+                "Wherever PATTERN is expected, -f FILE can stand in for it.\n"
+                "\n"
+                "  -c, --count   print the number of matching lines instead\n"
+                "  -g, --groups  print the capture groups of the leftmost match in each\n"
+                "                matching line, tab separated, or the match itself\n"
+                "                when the pattern has no groups\n"
+                "  -i, --ignore-case\n"
+                "                fold case, ASCII letters only unless -u is given;\n"
+                "                a rule can start with (?i) or (?-i) to choose\n"
+                "                for itself\n"
+                "  -o, --only-matching\n"
+                "                print every match in a matching line on a line of\n"
+                "                its own\n"
+                "  -u, --utf8    read PATTERN as UTF-8 and match characters rather\n"
+                "                than bytes: '.', classes and \\x{HHHH} are code points\n"
+                "      --set     print before each matching line the numbers of all\n"
+                "                the rules of PATTERN that match in it, counted from\n"
+                "                1, found in a single scan of the line\n"
+                "      --stats   report compile statistics and throughput on stderr\n"
+                "      --metrics report on stderr, as a line of JSON per compilation,\n"
+                "                the time each phase took, the states built and the\n"
+                "                heap they take\n"
+                "  -f, --file=FILE\n"
+                "                read PATTERN from FILE, less the newlines it ends in\n"
+                "      --max-states=N, --max-dfa-bytes=N\n"
+                "                budgets for building the DFA up front, 8192 states\n"
+                "                and 32 MB by default; a pattern over either is\n"
+                "                scanned with a DFA built lazily as the input needs it\n"
+                "      --engine=auto|full|lazy|literal|table|shuffle|stride2|batch|teddy\n"
+                "                how to match: as planned from an estimate of the DFA\n"
+                "                (the default), with the DFA built up front, with a\n"
+                "                DFA built lazily, or with the DFA entered where the\n"
+                "                literal every match starts with is found; the last\n"
+                "                four build the DFA up front and walk it a byte at a\n"
+                "                time, all its states at once in SIMD blocks, two\n"
+                "                bytes at a time, or over several lines at once,\n"
+                "                failing when it does not fit; teddy builds it up\n"
+                "                front and looks for where matches may start with\n"
+                "                teddy, failing when the pattern gives it no prefixes\n"
+                "      --batch=N lines the batch engine walks per batch, 256 by default\n"
+                "      --layout=bfs|none\n"
+                "                how DFA states are numbered: the start states first,\n"
+                "                the others breadth first and the accepting ones last\n"
+                "                (the default), or as subset construction found them\n"
+                "      --train=FILE\n"
+                "                number the states busiest first, by the bytes a scan\n"
+                "                of FILE reads in each\n"
+                "      --explain print how PATTERN was planned and compiled\n"
+                "      --io=mmap|uring|pread\n"
+                "                how files are read: mapped into memory (the default),\n"
+                "                streamed with io_uring (pread where unavailable) or\n"
+                "                streamed with pread\n"
+                "      --tables  emit the generated C tables for PATTERN\n"
+                "      --lex     emit a complete C scanner for PATTERN: tables, a\n"
+                "                buffered input layer and a longest-match yylex()\n"
+                "      --profile=json|dot\n"
+                "                scan the FILEs a byte at a time and print, per DFA\n"
+                "                state, the bytes read there, the times it was\n"
+                "                entered, the matches found and the transitions\n"
+                "                taken: as JSON, or as a graph for dot(1) shaded by\n"
+                "                where the bytes went\n");
+}
+
+int main(int argc, char *argv[])
+{
+    bool count_only = false;
+    bool stats = false;
+    bool tables = false;
+    bool lex = false;
+    bool groups = false;
+    bool only_matching = false;
+    bool utf8 = false;
+    bool icase = false;
+    bool explain = false;
+    bool measure = false;
+    bool rule_sets = false;
+    const char *profile = NULL;
+    const char *train = NULL;
+    const char *pattern_file = NULL;
+    int engine = 0;
+    int run_on = -1; // the engine the full DFA is forced onto, -1 for the one picked
+    size_t batch = BATCH_LINES;
+    int layout = 0;
+    compile_limits_t limits = default_limits;
+    input_method_t method = INPUT_MMAP;
+    int i = 1;
+    for (; i < argc && argv[i][0] == '-' && argv[i][1] != '\0'; ++i)
+    {
+        if (strcmp(argv[i], "--") == 0)
+        {
+            ++i;
+            break;
+        }
+        else if (strcmp(argv[i], "-c") == 0 || strcmp(argv[i], "--count") == 0)
+        {
+            count_only = true;
+        }
+        else if (strcmp(argv[i], "--stats") == 0)
+        {
+            stats = true;
+        }
+        else if (strcmp(argv[i], "--set") == 0)
+        {
+            rule_sets = true;
+        }
+        else if (strcmp(argv[i], "-f") == 0 && i + 1 < argc)
+        {
+            pattern_file = argv[++i];
+        }
+        else if (strncmp(argv[i], "--file=", 7) == 0)
+        {
+            pattern_file = argv[i] + 7;
+        }
+        else if (strcmp(argv[i], "--metrics") == 0)
+        {
+            measure = true;
+        }
+        else if (strcmp(argv[i], "--tables") == 0)
+        {
+            tables = true;
+        }
+        else if (strcmp(argv[i], "-g") == 0 || strcmp(argv[i], "--groups") == 0)
+        {
+            groups = true;
+        }
+        else if (strcmp(argv[i], "-o") == 0 || strcmp(argv[i], "--only-matching") == 0)
+        {
+            only_matching = true;
+        }
+        else if (strcmp(argv[i], "-i") == 0 || strcmp(argv[i], "--ignore-case") == 0)
+        {
+            icase = true;
+        }
+        else if (strcmp(argv[i], "-u") == 0 || strcmp(argv[i], "--utf8") == 0)
+        {
+            utf8 = true;
+        }
+        else if (strcmp(argv[i], "--lex") == 0)
+        {
+            lex = true;
+        }
+        else if (strncmp(argv[i], "--batch=", 8) == 0 && atoi(argv[i] + 8) > 0)
+        {
+            batch = atoi(argv[i] + 8);
+        }
+        else if (strncmp(argv[i], "--max-states=", 13) == 0 && atoi(argv[i] + 13) > 0)
+        {
+            limits.max_dfa_states = atoi(argv[i] + 13);
+        }
+        else if (strncmp(argv[i], "--max-dfa-bytes=", 16) == 0 && atol(argv[i] + 16) > 0)
+        {
+            limits.max_dfa_bytes = atol(argv[i] + 16);
+        }
+        else if (strcmp(argv[i], "--engine=auto") == 0)
+        {
+            engine = 0;
+        }
+        else if (strcmp(argv[i], "--engine=full") == 0)
+        {
+            engine = COMPILE_FULL;
+        }
+        else if (strcmp(argv[i], "--engine=lazy") == 0)
+        {
+            engine = COMPILE_LAZY;
+        }
+        else if (strcmp(argv[i], "--engine=literal") == 0)
+        {
+            engine = COMPILE_LITERAL;
+        }
+        else if (strcmp(argv[i], "--engine=table") == 0)
+        {
+            engine = COMPILE_FULL;
+            run_on = ENGINE_TABLE;
+        }
+        else if (strcmp(argv[i], "--engine=shuffle") == 0)
+        {
+            engine = COMPILE_FULL;
+            run_on = ENGINE_SHUFFLE;
+        }
+        else if (strcmp(argv[i], "--engine=stride2") == 0)
+        {
+            engine = COMPILE_FULL;
+            run_on = ENGINE_STRIDE2;
+        }
+        else if (strcmp(argv[i], "--engine=batch") == 0)
+        {
+            engine = COMPILE_FULL;
+            run_on = ENGINE_BATCH;
+        }
+        else if (strcmp(argv[i], "--engine=teddy") == 0)
+        {
+            engine = COMPILE_FULL | COMPILE_TEDDY;
+        }
+        else if (strcmp(argv[i], "--layout=bfs") == 0)
+        {
+            layout = 0;
+        }
+        else if (strcmp(argv[i], "--layout=none") == 0)
+        {
+            layout = COMPILE_UNORDERED;
+        }
+        else if (strncmp(argv[i], "--train=", 8) == 0 && argv[i][8])
+        {
+            train = argv[i] + 8;
+        }
+        else if (strcmp(argv[i], "--explain") == 0)
+        {
+            explain = true;
+        }
+        else if (strcmp(argv[i], "--profile=json") == 0 || strcmp(argv[i], "--profile=dot") == 0)
+        {
+            profile = argv[i] + 10;
+        }
+        else if (strcmp(argv[i], "--io=mmap") == 0)
+        {
+            method = INPUT_MMAP;
+        }
+        else if (strcmp(argv[i], "--io=uring") == 0)
+        {
+            method = INPUT_URING;
+        }
+        else if (strcmp(argv[i], "--io=pread") == 0)
+        {
+            method = INPUT_PREAD;
+        }
+        else if (strcmp(argv[i], "-h") == 0 || strcmp(argv[i], "--help") == 0)
+        {
+            usage(stdout);
+            return 0;
+        }
+        else
+        {
+            fprintf(stderr, "regex-plainc: unknown option '%s'\n", argv[i]);
+            usage(stderr);
+            return 2;
+        }
+    }
+    if (i == argc && !pattern_file)
+    {
+        usage(stderr);
+        return 2;
+    }
+    const char *pattern = pattern_file ? read_pattern_file(pattern_file) : argv[i++];
+    if (!pattern)
+    {
+        return 2;
+    }
+    int syntax = (utf8 ? COMPILE_UTF8 : 0) | (icase ? COMPILE_ICASE : 0) | (measure ? COMPILE_METRICS : 0);
+    if (rule_sets)
+    {
+        // lines are printed whole, after their rules
+        groups = only_matching = false;
+    }
+    if (tables)
+    {
+        emit_tables(pattern, syntax);
+        return 0;
+    }
+    if (lex)
+    {
+        emit_scanner(stdout, pattern, syntax);
+        return 0;
+    }
+    if (profile)
+    {
+        const char *standard_input[] = {"-"};
+        return profile_files(pattern, syntax, strcmp(profile, "dot") == 0,
+                             i < argc ? (const char **)&argv[i] : standard_input, i < argc ? argc - i : 1);
+    }
+
+    scanner_t scanner;
+    double compile_start = seconds_now();
+    if (!scanner_compile(&scanner, pattern,
+                         syntax | engine | layout | COMPILE_SEARCH | (groups ? COMPILE_CAPTURES : 0) |
+                             (rule_sets ? COMPILE_RULE_SETS : 0),
+                         &limits))
+    {
+        fprintf(stderr, "regex-plainc: out of memory compiling '%s'\n", pattern);
+        return 2;
+    }
+    if (train && !train_layout(&scanner, train))
+    {
+        scanner_free(&scanner);
+        return 2;
+    }
+    if (run_on >= 0 && !scanner_select_engine(&scanner, run_on))
+    {
+        fprintf(stderr, "regex-plainc: the DFA of '%s' cannot run on the %s engine\n", pattern,
+                scanner_engine_names[run_on]);
+        scanner_free(&scanner);
+        return 2;
+    }
+    if ((engine & COMPILE_TEDDY) && !scanner.teddy)
+    {
+        fprintf(stderr, "regex-plainc: the search for '%s' cannot start with teddy\n", pattern);
+        scanner_free(&scanner);
+        return 2;
+    }
+    if (measure)
+    {
+        print_compile_metrics(stderr, "search", pattern, &scanner.stats.metrics);
+    }
+    if (explain)
+    {
+        print_plan(stdout, &scanner.stats.plan, &limits);
+        print_compile_stats(stdout, &scanner.stats);
+        scanner_free(&scanner);
+        return 0;
+    }
+    if (groups && !scanner.tdfa)
+    {
+        fprintf(stderr, "regex-plainc: '%s' needs more than %d tagged DFA states for --groups\n", pattern,
+                TDFA_MAX_STATES);
+        scanner_free(&scanner);
+        return 2;
+    }
+    // the anchored pattern and its reverse, for where -o matches start, which
+    // the reverse searches the whole line for, and for checking lines from
+    // their ends when every rule ends in '$'
+    scanner_t bounds;
+    bool with_bounds = (only_matching && !groups) || (scanner.eol_anchored && !rule_sets);
+    int bounds_flags = COMPILE_REVERSE | (only_matching && !groups ? COMPILE_REVERSE_SEARCH : 0);
+    if (with_bounds && !scanner_compile(&bounds, pattern, syntax | engine | layout | bounds_flags, &limits))
+    {
+        fprintf(stderr, "regex-plainc: out of memory compiling '%s'\n", pattern);
+        scanner_free(&scanner);
+        return 2;
+    }
+    if (with_bounds && run_on >= 0)
+    {
+        // only the search is held to the engine; the bounds keep theirs
+        // when their own DFA does not fit it
+        scanner_select_engine(&bounds, run_on);
+    }
+    if (with_bounds && measure)
+    {
+        print_compile_metrics(stderr, "bounds", pattern, &bounds.stats.metrics);
+    }
+    double compile_time = seconds_now() - compile_start;
+
+    static char output[1 << 16];
+    setvbuf(stdout, output, _IOFBF, sizeof(output));
+    grep_t grep = {
+        .scanner = &scanner,
+        .line_state = scanner.starts[KIND_NEWLINE],
+        .count_only = count_only,
+        .groups = groups,
+        .only_matching = only_matching && !groups,
+        .bounds = with_bounds ? &bounds : NULL,
+        .rule_sets = rule_sets,
+        .matched = rule_sets ? bitset_create() : NULL,
+        .batch = run_on == ENGINE_BATCH && !rule_sets ? batch : 0,
+        .label = NULL,
+        .captures = groups ? malloc(sizeof(ptrdiff_t) * 2 * scanner.groups) : NULL,
+    };
+    // an accelerated start state already skips most of a line faster than
+    // the backward walk could
+    grep.line_ends = with_bounds && scanner.eol_anchored && !(scanner.flags[grep.line_state] & STATE_ACCELERATED) &&
+                     !grep.batch && reverse_stays_in_line(bounds.reverse);
+    if (grep.batch)
+    {
+        grep.batch_lines = malloc(sizeof(const unsigned char *) * grep.batch);
+        grep.batch_lengths = malloc(sizeof(size_t) * grep.batch);
+        grep.batch_results = malloc(sizeof(ptrdiff_t) * grep.batch);
+    }
+    input_t input;
+    input_init(&input, method);
+    const char *standard_input[] = {"-"};
+    const char **files = i < argc ? (const char **)&argv[i] : standard_input;
+    int nfiles = i < argc ? argc - i : 1;
+    size_t total_bytes = 0;
+    size_t total_matches = 0;
+    bool failed = false;
+    double scan_start = seconds_now();
+    for (int f = 0; f < nfiles; ++f)
+    {
+        grep.label = nfiles > 1 ? files[f] : NULL;
+        ptrdiff_t bytes = grep_file(&grep, files[f], &input);
+        if (bytes < 0)
+        {
+            failed = true;
+            continue;
+        }
+        if (count_only)
+        {
+            if (grep.label)
+            {
+                printf("%s:", grep.label);
+            }
+            printf("%zu\n", grep.matches);
+        }
+        total_bytes += bytes;
+        total_matches += grep.matches;
+    }
+    fflush(stdout);
+    double scan_time = seconds_now() - scan_start;
+
+    if (stats)
+    {
+        print_compile_stats(stderr, &scanner.stats);
+        const plan_t *plan = &scanner.stats.plan;
+        if (plan->literals)
+        {
+            fprintf(stderr, "// plan: %s, %s; %d literals, %d bytes\n", plan_engine_names[plan->engine], plan->reason,
+                    plan->literals, plan->literal_bytes);
+        }
+        else
+        {
+            fprintf(stderr, "// plan: %s, %s; estimated %.0f dfa states\n", plan_engine_names[plan->engine],
+                    plan->reason, plan->states);
+        }
+        const char *how = grep.rule_sets       ? " for every rule"
+                          : grep.line_ends     ? " from line ends"
+                          : scanner.skip_lines ? " skipping to line starts"
+                                               : "";
+        fprintf(stderr,
+                "// compiled in %.3f ms; scanned %zu bytes with %s%s in %.9f s (%.1f MB/s), %zu matching lines\n",
+                compile_time * 1e3, total_bytes, input_method_names[input.method], how, scan_time,
+                scan_time > 0 ? total_bytes / scan_time / 1e6 : 0.0, total_matches);
+    }
+    input_free(&input);
+    free(grep.partial);
+    free(grep.line);
+    free(grep.starts);
+    free(grep.captures);
+    free(grep.batch_lines);
+    free(grep.batch_lengths);
+    free(grep.batch_results);
+    if (grep.matched)
+    {
+        bitset_free(grep.matched);
+    }
+    if (with_bounds)
+    {
+        scanner_free(&bounds);
+    }
+    scanner_free(&scanner);
+    return failed ? 2 : total_matches > 0 ? 0 : 1;
 }
@@ -0,0 +1,61 @@
+// Checks that recompiling into a warm NFA performs no heap allocation, by
+// counting the calls to a replaced operator new around ParserState::thompson.
+#include <cstdlib>
+#include <new>
+
+static long allocations = 0;
+
+void *operator new(std::size_t size) {
+  ++allocations;
+  if (void *p = std::malloc(size ? size : 1)) {
+    return p;
+  }
+  throw std::bad_alloc{};
+}
+void *operator new[](std::size_t size) { return operator new(size); }
+void operator delete(void *p) noexcept { std::free(p); }
+void operator delete[](void *p) noexcept { std::free(p); }
+void operator delete(void *p, std::size_t) noexcept { std::free(p); }
+void operator delete[](void *p, std::size_t) noexcept { std::free(p); }
+
+// regex-cpp is a single translation unit; its main() is renamed out of the
+// way so the parser can be driven directly.
+#define main regexCppMain
+#include "../cpp/main.cpp"
+#undef main
+
+int main() {
+  static constexpr const char *patterns[] = {
+      R"(^[ \t]*//[ \t]*TRACE[ \t]*#[0-9]+[ \t]*$)",
+      "(a|b)*abb",
+      "[0-9]{1,8}x",
+      "(ab|cd){2,}e?",
+      R"(\bword\b|[^a-z]+)",
+      "(?i)Case[A-Z]",
+      "[^é]x|.ü+",
+  };
+  static constexpr int warmups = 2;
+  static constexpr int rounds = 100;
+  int failures = 0;
+  for (int mode = 0; mode < 4; ++mode) {
+    bool utf8 = mode & 1;
+    bool icase = mode & 2;
+    for (const char *pattern : patterns) {
+      ParserState state{utf8, icase};
+      Nfa nfa;
+      for (int i = 0; i < warmups; ++i) {
+        nfa = state.thompson(pattern, std::move(nfa));
+      }
+      long before = allocations;
+      for (int i = 0; i < rounds; ++i) {
+        nfa = state.thompson(pattern, std::move(nfa));
+      }
+      long warm = allocations - before;
+      fmt::print("{} {}{}{} {} allocations in {} warm recompiles\n",
+                 warm ? "FAIL" : "ok  ", utf8 ? "-u " : "", icase ? "-i " : "",
+                 pattern, warm, rounds);
+      failures += warm != 0;
+    }
+  }
+  return failures ? EXIT_FAILURE : EXIT_SUCCESS;
+}
@@ -0,0 +1,274 @@
+// Output checks for regex-plainc.
+//
+// Runs every case below through the program once per engine, with the case's
+// options and its input in a file, and compares what it prints with what the
+// case expects, which is what grep -E prints for it, or for --set what the
+// program is documented to print. Prints a line per failure and exits with 1
+// if there was any.
+
+#define _GNU_SOURCE
+#include <errno.h>
+#include <fcntl.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#define MAX_ARGS 16
+#define MAX_OUTPUT (1 << 20)
+
+typedef struct
+{
+    const char *options; // separated by spaces, "" for none
+    const char *pattern;
+    const char *input;
+    const char *expected;
+} check_case_t;
+
+// 64 bytes, so that a line made of a few of them runs past a SIMD block, a
+// stride and the literal prefilter's window
+#define X64 "xxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxx"
+
+static const check_case_t cases[] = {
+    // matching lines
+    {"", "ab+c", "xabbc\nac\nabc\n", "xabbc\nabc\n"},
+    {"", "z", "abc\n", ""},
+    {"", "[^a-c]x", "ax\ndx\n\n", "dx\n"},
+    {"", "b$", "ab\ncb", "ab\ncb\n"},
+    {"", "^ab$", "ab\nabc\nxab\n", "ab\n"},
+    {"", "\\bcat\\b", "cat\nconcat\na cat.\n", "cat\na cat.\n"},
+    {"-c", "a|b", "a\nc\nb\n\n", "2\n"},
+    {"-c", "^$", "a\n\nb\n\n", "2\n"},
+    {"-c", "foo|bar|bazz", "foo\nba\nxbazzx\nbaz\n", "2\n"},
+    {"-i", "hello", "HeLLo world\nbye\n", "HeLLo world\n"},
+    {"-c -i", "foo|bar", "FOO\nBaR\nbaz\n", "2\n"},
+    // lines longer than the blocks and strides the engines walk
+    {"", "needle", X64 X64 "needle\n" X64 X64 X64 "\n", X64 X64 "needle\n"},
+    {"-c", "^x+$", X64 X64 "\n" X64 "y" X64 "\n", "1\n"},
+    {"-o", "y+", X64 "yy" X64 "y" X64 "\n", "yy\ny\n"},
+    // each quantifier applies to what the ones before it built
+    {"", "a{2}{2}", "aaa\naaaa\n", "aaaa\n"},
+    {"-o", "(ab){2}", "abababab\n", "abab\nabab\n"},
+    {"", "^a*{2}b$", "b\naab\nacb\n", "b\naab\n"},
+    // rules are separated by a ')' that opens no group
+    {"--set", "foo)bar", "foo bar\nbar\nnone\nfoo\n", "1,2\tfoo bar\n2\tbar\n1\tfoo\n"},
+    {"-c --set", "foo)bar", "foo bar\nbar\nnone\nfoo\n", "3\n"},
+    {"-o -u", ".", "\xc3\xa9\nab\n", "\xc3\xa9\na\nb\n"},
+    // -o prints the leftmost match, then the longest from there
+    {"-o", "b|cba", "cbab\n", "cba\nb\n"},
+    {"-o", "a|ca[^a]", "cab\n", "cab\n"},
+    {"-o", "ab|b|abcd", "xabcdab\n", "abcd\nab\n"},
+    {"-o", "x*", "axxb\n", "xx\n"},
+    {"-o", "a+|b+", "aabbba\n", "aa\nbbb\na\n"},
+    {"-o", "\\bfoo|o+\\b", "foo foo\n", "foo\nfoo\n"},
+    {"-o", "^(b|bca)", "bcabc\n", "bca\n"},
+    {"-o", "(c|bc|abc)$", "bcabc\n", "abc\n"},
+    {"-o -i", "AB|b", "xaBb\n", "aB\nb\n"},
+};
+
+// The engine options each case runs with.
+static const char *const engines[] = {
+    "--engine=auto",
+    "--engine=full",
+    "--engine=lazy",
+    "--engine=literal",
+    "--engine=table",
+    "--engine=shuffle",
+    "--engine=stride2",
+    "--engine=batch",
+};
+
+#define COUNT(a) ((int)(sizeof(a) / sizeof((a)[0])))
+
+// Runs argv and reads its standard output into `out`, at most size - 1 bytes
+// of it; standard error goes to /dev/null. Returns the exit status, or -1 if
+// it could not be run or died.
+static int run_output(char *const argv[], char *out, size_t size)
+{
+    int pipefd[2];
+    if (pipe(pipefd) < 0)
+    {
+        return -1;
+    }
+    pid_t pid = fork();
+    if (pid < 0)
+    {
+        close(pipefd[0]);
+        close(pipefd[1]);
+        return -1;
+    }
+    if (pid == 0)
+    {
+        int null = open("/dev/null", O_WRONLY);
+        dup2(pipefd[1], STDOUT_FILENO);
+        dup2(null, STDERR_FILENO);
+        close(pipefd[0]);
+        execv(argv[0], argv);
+        _exit(127);
+    }
+    close(pipefd[1]);
+    size_t length = 0;
+    ssize_t n;
+    char discard[4096];
+    while ((n = read(pipefd[0], length < size - 1 ? out + length : discard,
+                     length < size - 1 ? size - 1 - length : sizeof(discard))) > 0)
+    {
+        length += length < size - 1 ? (size_t)n : 0;
+    }
+    out[length] = '\0';
+    close(pipefd[0]);
+    int status;
+    waitpid(pid, &status, 0);
+    return WIFEXITED(status) ? WEXITSTATUS(status) : -1;
+}
+
+static bool write_file(const char *path, const char *text)
+{
+    FILE *fp = fopen(path, "w");
+    if (!fp)
+    {
+        fprintf(stderr, "regex-check: %s: %s\n", path, strerror(errno));
+        return false;
+    }
+    fputs(text, fp);
+    return fclose(fp) == 0;
+}
+
+// Prints s with its newlines and tabs escaped, so that a case fits a line.
+static void print_escaped(FILE *fp, const char *s)
+{
+    for (; *s; ++s)
+    {
+        if (*s == '\n')
+        {
+            fputs("\\n", fp);
+        }
+        else if (*s == '\t')
+        {
+            fputs("\\t", fp);
+        }
+        else
+        {
+            fputc(*s, fp);
+        }
+    }
+}
+
+// Runs one case with one engine option. Returns whether it printed what the
+// case expects.
+static bool check_one(const char *program, const char *dir, const check_case_t *c, const char *engine)
+{
+    char path[4096];
+    snprintf(path, sizeof(path), "%s/input.txt", dir);
+    if (!write_file(path, c->input))
+    {
+        return false;
+    }
+    char options[256];
+    snprintf(options, sizeof(options), "%s", c->options);
+    char *argv[MAX_ARGS];
+    int argc = 0;
+    argv[argc++] = (char *)program;
+    for (char *option = strtok(options, " "); option && argc < MAX_ARGS - 4; option = strtok(NULL, " "))
+    {
+        argv[argc++] = option;
+    }
+    argv[argc++] = (char *)engine;
+    argv[argc++] = (char *)c->pattern;
+    argv[argc++] = path;
+    argv[argc] = NULL;
+    static char out[MAX_OUTPUT];
+    int status = run_output(argv, out, sizeof(out));
+    // grep's exit status: 0 for matches, 1 for none, 2 for trouble
+    int expected_status = c->expected[0] ? 0 : 1;
+    if (status == expected_status && strcmp(out, c->expected) == 0)
+    {
+        return true;
+    }
+    printf("FAIL %s %s '%s' on \"", c->options, engine, c->pattern);
+    print_escaped(stdout, c->input);
+    printf("\": expected \"");
+    print_escaped(stdout, c->expected);
+    printf("\", got \"");
+    print_escaped(stdout, out);
+    printf("\" and exit status %d\n", status);
+    return false;
+}
+
+static void usage(FILE *fp)
+{
+    fprintf(fp, "usage: regex-check --plainc=PATH [--dir=DIR]\n"
+                "\n"
+                "Runs every case through regex-plainc with every engine and\n"
+                "compares its output with the expected one.\n"
+                "\n"
+                "      --plainc=PATH\n"
+                "                the program to check\n"
+                "      --dir=DIR where the inputs are written; the current directory\n"
+                "                by default\n");
+}
+
+int main(int argc, char *argv[])
+{
+    const char *plainc = NULL;
+    const char *dir = ".";
+    for (int i = 1; i < argc; ++i)
+    {
+        if (strncmp(argv[i], "--plainc=", 9) == 0)
+        {
+            plainc = argv[i] + 9;
+        }
+        else if (strncmp(argv[i], "--dir=", 6) == 0)
+        {
+            dir = argv[i] + 6;
+        }
+        else if (strcmp(argv[i], "-h") == 0 || strcmp(argv[i], "--help") == 0)
+        {
+            usage(stdout);
+            return 0;
+        }
+        else
+        {
+            fprintf(stderr, "regex-check: unknown option '%s'\n", argv[i]);
+            usage(stderr);
+            return 2;
+        }
+    }
+    if (!plainc)
+    {
+        usage(stderr);
+        return 2;
+    }
+    mkdir(dir, 0777);
+    // an engine this machine has no instructions for fails to compile anything
+    bool supported[COUNT(engines)];
+    for (int e = 0; e < COUNT(engines); ++e)
+    {
+        char out[16];
+        char *argv[] = {(char *)plainc, (char *)engines[e], "a", "/dev/null", NULL};
+        supported[e] = run_output(argv, out, sizeof(out)) != 2;
+        if (!supported[e])
+        {
+            printf("skipping %s, which cannot run here\n", engines[e]);
+        }
+    }
+    int checks = 0;
+    int failures = 0;
+    for (int c = 0; c < COUNT(cases); ++c)
+    {
+        for (int e = 0; e < COUNT(engines); ++e)
+        {
+            if (!supported[e])
+            {
+                continue;
+            }
+            ++checks;
+            failures += !check_one(plainc, dir, &cases[c], engines[e]);
+        }
+    }
+    printf("%d of %d checks passed\n", checks - failures, checks);
+    return failures ? 1 : 0;
+}